@@ -38,9 +38,7 @@
     tabView.target = self;
     tabView.action = @selector(gotClick:);
     
-    while (tabView.count > 0) {  // Remove all existing tabs
-        [tabView removeTabAtIndex:0];
-    }
+    [tabView removeAllTabs];  // Remove all existing tabs
     
      [self.tabView addTabWithLabel:@"+" tag:@"addKey"];  // Make a + tab
 }
@@ -9,6 +9,18 @@
 #import <Cocoa/Cocoa.h>
 
 @class BSTTabView;
+@class BSTTabViewChangeSet;
+
+
+/**
+ * enum identifying the operations timed against the time budget when statistics are enabled
+ */
+
+typedef NS_ENUM(NSInteger, BSTTabViewTimedOperation) {
+    BSTTabViewTimedOperationLayout,                    // A layout pass
+    BSTTabViewTimedOperationDraw                       // A drawRect: call
+};
+
 
 /**
  * The delegate protocol for the BSTTabView custom control. The delegate pattern is the main
@@ -75,13 +87,31 @@
 -(void)tabView:(BSTTabView *)tabView labelDidChangeForTabAtIndex:(NSUInteger)index;
 
 
+/**
+ * Method called once for each batch of labels applied from enqueueLabel:forTabWithTag:, instead of labelDidChangeForTabAtIndex:
+ *
+ * @param indexes The indexes of the tabs that got a new label
+ */
+-(void)tabView:(BSTTabView *)tabView labelsDidChangeForTabsAtIndexes:(NSIndexSet *)indexes;
+
+
 /**
  * Method that is called if there is insufficient space to display even compressed versions of the tabs
  * The BSTTabView control has no further mechanism to deal with this beyond displaying as many tabs as possible
  * and then truncating. There is no guarantee the selected tab vill be visible
+ * Called once when the tabs stop fitting, not again on each layout until they have fitted in between
  *
  */
 -(void)insufficientWidthForTabView:(BSTTabView *)tabView ;
+
+
+/**
+ * Method that is called when the tabs stop or start fitting, or the number of tabs that do not fit changes
+ *
+ * @param insufficient YES if not all tabs fit even compressed
+ * @param hiddenCount The number of tabs that end beyond the strip when scrolled to the start, see hiddenTabCount
+ */
+-(void)tabView:(BSTTabView *)tabView insufficientWidthDidChange:(BOOL)insufficient hiddenTabCount:(NSUInteger)hiddenCount;
  
 
 
@@ -111,7 +141,19 @@
 
 
 /**
- * Method called on the dragging source delegate after dragging of a tab concludes.
+ * Method called on the dragging source delegate when a drag begins to let several tabs travel in the same drag,
+ * e.g. a group of tabs that belong together. The tabs are inserted together in the destination and removed together
+ * from the source. Return nil or a set not containing index to drag only the grabbed tab.
+ *
+ * @param index The index of the tab the user grabbed
+ *
+ * @return The indexes of all the tabs to drag
+ */
+-(NSIndexSet *)tabView:(BSTTabView *)tabView indexesOfTabsToDragWithTabAtIndex:(NSUInteger)index;
+
+
+/**
+ * Method called on the dragging source delegate after dragging of a tab concludes, once for each tab in the drag.
  *
  * @param label The label of the tab that was dragged
  * @param tag The tag of the tab that was dragged
@@ -123,7 +165,8 @@
 
 
 /**
- * Method called before a dragged tab is inserted, return NO to deny the insert
+ * Method called before a dragged tab is inserted, once for each tab in the drag. Return NO to deny the insert
+ * of the whole drag.
  *
  * @param index The index of the tab that will be inserted
  * @param label The label of the dragged tab
@@ -135,6 +178,198 @@
  */
 -(BOOL)tabView:(BSTTabView *)tabView draggedTabWillBeInsertedWithIndex:(NSUInteger)index label:(NSString *)label tag:(NSString *)tag sourceExternal:(BOOL)external;
 
+
+/**
+ * Method called once after the tabs were replaced by restoreTabStateFromData: or restoreTabStateFromFile:.
+ * No other delegate calls are made for the restored tabs, a selectedTab KVO notification is sent first if the index changed.
+ *
+ * @param tabView The tab view that was restored
+ */
+-(void)tabViewDidRestoreTabs:(BSTTabView *)tabView;
+
+
+/**
+ * Method called when statistics are enabled and a layout pass or a drawRect: call took longer than the timeBudget
+ *
+ * @param operation The operation that was slow
+ * @param duration The time the operation took in seconds
+ */
+-(void)tabView:(BSTTabView *)tabView operation:(BSTTabViewTimedOperation)operation exceededTimeBudgetWithDuration:(NSTimeInterval)duration;
+
+
+/**
+ * Method called before a group of tabs is collapsed into its summary tab or expanded again, return NO to deny the change
+ *
+ * @param collapse YES if the group will be collapsed and NO if it will be expanded
+ * @param range The indexes of the tabs in the group
+ *
+ * @return YES if delegte accepts the change and NO if the change should be prevented
+ */
+-(BOOL)tabView:(BSTTabView *)tabView groupShouldCollapse:(BOOL)collapse forTabsInRange:(NSRange)range;
+
+
+/**
+ * Method called after a group of tabs was collapsed or expanded
+ *
+ * @param collapsed YES if the group is now collapsed and NO if it is expanded
+ * @param range The indexes of the tabs in the group
+ */
+-(void)tabView:(BSTTabView *)tabView groupDidCollapse:(BOOL)collapsed forTabsInRange:(NSRange)range;
+
+
+/**
+ * Method called with all changes to the tabs since the last call, once from the outermost endUpdates or else once
+ * per run loop turn, see sendPendingChanges. Inserts, removes and moves from drags, restores and programmatic calls
+ * are all included together with new labels and tags and the selection. Changes are only collected while the
+ * delegate implements this method.
+ *
+ * @param changes The changes to apply to a mirror of the tabs
+ */
+-(void)tabView:(BSTTabView *)tabView didChangeTabs:(BSTTabViewChangeSet *)changes;
+
+@end
+
+
+
+/**
+ * The BSTTabViewStatistics class is an immutable snapshot of the performance counters of a BSTTabView, see
+ * statisticsEnabled. Counters run from the creation of the view or the last resetStatistics. Times are in seconds
+ * and are only measured while statistics are enabled.
+ */
+
+@interface BSTTabViewStatistics : NSObject
+
+@property (readonly, nonatomic) NSUInteger layoutPasses;                     // All layout passes
+@property (readonly, nonatomic) NSUInteger incrementalLayoutPasses;          // Layout passes that only laid out the tabs after a mutation
+@property (readonly, nonatomic) NSUInteger compressedLayoutPasses;           // Full layout passes that had to compress the tabs
+@property (readonly, nonatomic) NSUInteger tabsLaidOut;                      // Tab positions calculated by all layout passes
+@property (readonly, nonatomic) NSTimeInterval layoutTime;                   // Total time spent in layout
+@property (readonly, nonatomic) NSTimeInterval maxLayoutTime;                // The slowest layout pass
+@property (readonly, nonatomic) NSUInteger labelWidthRequests;               // Label widths asked for by the layout
+@property (readonly, nonatomic) NSUInteger labelMeasurements;                // Label widths actually measured by the text system
+@property (readonly, nonatomic) NSUInteger boundaryPathRebuilds;             // Tabs that picked up a new boundary path
+@property (readonly, nonatomic) NSUInteger trackingAreasAdded;               // Tracking areas added to the view
+@property (readonly, nonatomic) NSUInteger trackingAreasRemoved;             // Tracking areas removed from the view
+@property (readonly, nonatomic) NSUInteger drawCalls;                        // drawRect: calls
+@property (readonly, nonatomic) NSUInteger tabsDrawn;                        // Tabs drawn by all drawRect: calls
+@property (readonly, nonatomic) NSTimeInterval drawTime;                     // Total time spent in drawRect:
+@property (readonly, nonatomic) NSTimeInterval maxDrawTime;                  // The slowest drawRect: call
+@property (readonly, nonatomic) NSUInteger delegateCallbacks;                // Messages sent to the delegate
+@property (readonly, nonatomic) NSUInteger dragPayloadDecodes;               // Drag payloads decoded from the pasteboard
+@property (readonly, nonatomic) NSUInteger tabsAllocated;                    // Tab objects created by inserts
+@property (readonly, nonatomic) NSUInteger tabsReused;                       // Inserts that took a tab from the pool
+@property (readonly, nonatomic) NSUInteger trackingAreasReused;              // Tracking areas a reused tab could add again as its rect was unchanged
+@property (readonly, nonatomic) NSUInteger pooledTabs;                       // Tabs in the pool when the snapshot was taken
+
+@end
+
+
+
+
+/**
+ * The BSTTabViewTraceEvent class is one event of a trace replayed by replayTrace:, what was called, when it was
+ * recorded and how long it took on replay.
+ */
+
+@interface BSTTabViewTraceEvent : NSObject
+
+@property (readonly, nonatomic) NSString *name;                              // The recorded method, e.g. "mouseDragged:" or "setLabel:forTabAtIndex:"
+@property (readonly, nonatomic) NSTimeInterval time;                         // Seconds from the start of the recording
+@property (readonly, nonatomic) NSTimeInterval latency;                      // Seconds the replayed call took including the layout and drawing it caused
+
+@end
+
+
+
+
+/**
+ * The BSTTabViewChangeSet class is an immutable description of the changes to the tabs of a BSTTabView sent to
+ * tabView:didChangeTabs:. It is applied to a mirror of the tabs like a table view batch update: take out the tabs at
+ * removedIndexes and movedFromIndexes, counted before the changes, then put the inserted and moved tabs in at
+ * insertedIndexes and movedToIndexes, counted after the changes. The other tabs keep their order.
+ */
+
+@interface BSTTabViewChangeSet : NSObject
+
+@property (readonly, nonatomic) NSIndexSet *removedIndexes;                  // Tabs removed, indexes before the changes
+@property (readonly, nonatomic) NSIndexSet *insertedIndexes;                 // Tabs added, indexes after the changes
+@property (readonly, nonatomic) NSIndexSet *movedFromIndexes;                // Tabs moved, indexes before the changes
+@property (readonly, nonatomic) NSIndexSet *movedToIndexes;                  // The same tabs, indexes after the changes
+@property (readonly, nonatomic) NSIndexSet *relabeledIndexes;                // Tabs not inserted that got a new label, indexes after the changes
+@property (readonly, nonatomic) NSIndexSet *retaggedIndexes;                 // Tabs not inserted that got a new tag, indexes after the changes
+@property (readonly, nonatomic) NSInteger selectedTabBefore;                 // The selected tab before the changes, -1 if none
+@property (readonly, nonatomic) NSInteger selectedTabAfter;                  // The selected tab after the changes, -1 if none
+
+/**
+ * Method to pair the moved tabs
+ *
+ * @param fromIndex An index in movedFromIndexes
+ *
+ * @return The index of the same tab in movedToIndexes, -1 if fromIndex is not a moved tab
+ */
+-(NSInteger)indexAfterMoveOfTabAtIndex:(NSUInteger)fromIndex;
+
+@end
+
+
+
+
+/**
+ * The BSTTabViewTheme class is an immutable bundle of the look of a BSTTabView: colors, font and tab metrics, together
+ * with what is derived from them once for all views using the theme, the text attributes, the drag image and the
+ * measured label widths. Any number of views on the main thread can share one theme by reference. A new theme is made
+ * by changing a mutableCopy of an existing one and assigning it, the view takes an immutable copy.
+ */
+
+@interface BSTTabViewTheme : NSObject <NSCopying, NSMutableCopying>
+
+/**
+ * Method to get the shared theme new views start with, system colors and the small system font
+ *
+ * @return the default theme
+ */
++(BSTTabViewTheme *)defaultTheme;
+
+@property (readonly, nonatomic) NSColor *backgroundColor;                    // Ribbon and non selected tabs, default windowFrameColor
+@property (readonly, nonatomic) NSColor *borderColor;                        // Outline of non selected tabs, default gridColor
+@property (readonly, nonatomic) NSColor *textColor;                          // Label of non selected tabs, default gridColor
+@property (readonly, nonatomic) NSColor *selectedFieldColor;                 // Selected tab, default highlightColor
+@property (readonly, nonatomic) NSColor *selectedBorderColor;                // Outline of the selected tab, default highlightColor
+@property (readonly, nonatomic) NSColor *selectedTextColor;                  // Label of the selected tab, default controlShadowColor
+@property (readonly, nonatomic) NSColor *rolloverFieldColor;                 // Rollover tab, default controlHighlightColor
+@property (readonly, nonatomic) NSColor *rolloverBorderColor;                // Outline of the rollover tab, default controlHighlightColor
+@property (readonly, nonatomic) NSColor *rolloverTextColor;                  // Label of the rollover tab, default controlShadowColor
+@property (readonly, nonatomic) NSColor *editingColor;                       // Label editor text and drag insert marks, default black
+@property (readonly, nonatomic) NSFont *font;                                // Label font, default the small system font
+@property (readonly, nonatomic) CGFloat spacerWidth;                         // Distance between tabs, default 5.0
+@property (readonly, nonatomic) CGFloat tabCornerRadius;                     // Corner rounding, limited to 0.0 ... spacerWidth, default 1.0
+@property (readonly, nonatomic) CGFloat maxTabHeight;                        // Tab height, 0.0 (default) for the view height - 5.0
+
+@end
+
+
+
+/**
+ * The BSTMutableTabViewTheme class is the editable form of BSTTabViewTheme, copy returns the immutable theme
+ */
+
+@interface BSTMutableTabViewTheme : BSTTabViewTheme
+
+@property (readwrite, nonatomic) NSColor *backgroundColor;
+@property (readwrite, nonatomic) NSColor *borderColor;
+@property (readwrite, nonatomic) NSColor *textColor;
+@property (readwrite, nonatomic) NSColor *selectedFieldColor;
+@property (readwrite, nonatomic) NSColor *selectedBorderColor;
+@property (readwrite, nonatomic) NSColor *selectedTextColor;
+@property (readwrite, nonatomic) NSColor *rolloverFieldColor;
+@property (readwrite, nonatomic) NSColor *rolloverBorderColor;
+@property (readwrite, nonatomic) NSColor *rolloverTextColor;
+@property (readwrite, nonatomic) NSColor *editingColor;
+@property (readwrite, nonatomic) NSFont *font;
+@property (readwrite, nonatomic) CGFloat spacerWidth;
+@property (readwrite, nonatomic) CGFloat tabCornerRadius;
+@property (readwrite, nonatomic) CGFloat maxTabHeight;
+
 @end
 
 
@@ -230,6 +465,69 @@ typedef NS_ENUM(NSInteger, BSTTabViewDragOptions) {
 
 @property (nonatomic) BOOL rolloverEnabled;
 
+/**
+ * property singleTrackingAreaEnabled is a boolean that defines if rollover is tracked by one tracking area covering the whole
+ * control and a hit test on each mouse move instead of one tracking area per tab. With many tabs this avoids recreating
+ * tracking areas on every relayout. Default to NO
+ */
+
+@property (nonatomic) BOOL singleTrackingAreaEnabled;
+
+/**
+ * property tabImageCacheEnabled is a boolean that defines if each rendered tab is kept as an image and reused for all tabs
+ * with the same width, label and state, so that redraws are image copies instead of path and text drawing. The cache
+ * is bounded and flushed on any color, text style or geometry change. Default to NO
+ */
+
+@property (nonatomic) BOOL tabImageCacheEnabled;
+
+/**
+ * property typesetLabelCacheEnabled is a boolean that defines if each visible tab keeps its label typeset and middle
+ * truncated to its width, one line for each of the default, selected and rollover text options, so that redraws do
+ * not lay out the text again. A line is only typeset again when the label, the tab width or the text options change. Default to NO
+ */
+
+@property (nonatomic) BOOL typesetLabelCacheEnabled;
+
+/**
+ * property asynchronousLabelMeasurementEnabled is a boolean that defines if new and changed labels are laid out with an
+ * estimated width at once and measured in batches on a background queue, the selected and hovered tabs and then the
+ * visible tabs first. The measured widths are applied in one relayout. Default to NO
+ */
+
+@property (nonatomic) BOOL asynchronousLabelMeasurementEnabled;
+
+/**
+ * property statisticsEnabled is a boolean that defines if the control counts and times its work, read with
+ * statisticsSnapshot. When NO nothing is timed and only the label measurement, layout and draw tab counts are kept. Default to NO
+ */
+
+@property (nonatomic) BOOL statisticsEnabled;
+
+/**
+ * property timeBudget is the time in seconds a layout pass or drawRect: may take before the delegate is told with
+ * tabView:operation:exceededTimeBudgetWithDuration:. Only checked when statisticsEnabled is YES, 0.0 (default) disables the check
+ */
+
+@property (nonatomic) NSTimeInterval timeBudget;
+
+/**
+ * property traceRecordingEnabled is a boolean that defines if the control records a trace of the public mutations,
+ * the mouse and tracking events, the dragging destination callbacks and the resizes it gets, read with recordedTrace
+ * and replayed with replayTrace:. Setting it to YES starts a new trace from the current frame, options and saved tab state,
+ * see tabStateData, which includes tabs without a label and the tab groups. Default to NO
+ */
+
+@property (nonatomic) BOOL traceRecordingEnabled;
+
+/**
+ * property tabPoolLimit is the high-water mark of the pool of removed tabs kept for reuse by later inserts, so that tabs
+ * opened and closed many times per second do not allocate. A reused tab is reset completely and keeps its tracking
+ * area for when it is laid out in the same place again. Lowering the limit releases the excess tabs. Default to 0, no pool
+ */
+
+@property (nonatomic) NSUInteger tabPoolLimit;
+
 /**
  * property doubleClickEditEnabled is a boolean that defines if the double click to edit label feature is enabled, default to NO
  */
@@ -249,6 +547,14 @@ typedef NS_ENUM(NSInteger, BSTTabViewDragOptions) {
 
 
 
+/**
+ * The theme property is the shared look of the control, see BSTTabViewTheme. Assigning a theme is one invalidation of
+ * what changed, a relayout only if the font or spacer width differ. The spacer, height, corner and color properties below
+ * read the theme, setting one of them gives the control its own copy of the theme with the change. nil is ignored.
+ * Default is defaultTheme
+ */
+@property (copy, nonatomic) BSTTabViewTheme *theme;
+
 /**
  * The spacerWidth property defines the distance between each tab in the band. The spacer is filled by a sloping
  * edges of the tabs partially overlapping. Defaults to 5.0 on initialisation if not set explictly.
@@ -257,7 +563,7 @@ typedef NS_ENUM(NSInteger, BSTTabViewDragOptions) {
 
 /**
  * The maxTabHeight property defines the max height of each tab in the band. Deafult is control height - 5.0. When space is 
- * insufficuent tabs become control height
+ * insufficuent tabs become control height. Setting 0.0 returns to the default
  */
 @property (nonatomic) CGFloat maxTabHeight;
 
@@ -268,6 +574,27 @@ typedef NS_ENUM(NSInteger, BSTTabViewDragOptions) {
 @property (nonatomic) CGFloat tabCornerRadius;
 
 
+/**
+ * The scrollingEnabled property defines if the tab band scrolls horizontally when the tabs do not fit even at the 
+ * minimum tab width. Scrolling is done by scroll wheel, by the arrow buttons shown at the edges when there are hidden 
+ * tabs, or by auto scroll when a dragged tab is held near an edge. The selected tab is scrolled into view when selected.
+ * Default is NO, then the band is truncated as before.
+ */
+@property (nonatomic) BOOL scrollingEnabled;
+
+/**
+ * The scrollOffset property is the horizontal scroll position of the tab band. Always 0.0 when scrollingEnabled is NO.
+ * Setting it is clamped to the scrollable range
+ */
+@property (nonatomic) CGFloat scrollOffset;
+
+/**
+ * The hiddenTabCount property is the number of tabs that did not fit in the last layout and are truncated, or
+ * reached by scrolling when scrollingEnabled. 0 when all tabs fit
+ */
+@property (readonly, nonatomic) NSUInteger hiddenTabCount;
+
+
 /**
  * The backgroundColor property defines the background color of the tab ribbon and the non-selected tabs, default is windowFrameColor
  */
@@ -361,6 +688,111 @@ typedef NS_ENUM(NSInteger, BSTTabViewDragOptions) {
 -(BOOL)removeTabAtIndex:(NSUInteger)index;
 
 
+/**
+ * Method to add several tabs at a specific index in the tab list in one operation. Tabs after the insertion point
+ * will have their index increased by the number of added tabs. If index is beyond the end then the tabs will be added last
+ *
+ * @param labels The text labels of the new tabs, NSNull for no label
+ * @param tags The tag strings of the new tabs, nil for no tags, otherwise same count as labels with NSNull for no tag
+ * @param requestedIndex The desired index of the first new tab
+ *
+ * @return the indexes allocated to the new tabs or nil if failed
+ */
+-(NSIndexSet *)addTabsWithLabels:(NSArray *)labels tags:(NSArray *)tags atIndex:(NSUInteger)requestedIndex;
+
+
+/**
+ * Method to remove several tabs in one operation. If any index does not exist then no tab will be removed. 
+ * If the selected tab is removed then no tab is selected.
+ *
+ * @param indexes The indexes of the tabs to be removed
+ *
+ * @return YES if the removal succeded.
+ */
+-(BOOL)removeTabsAtIndexes:(NSIndexSet *)indexes;
+
+
+/**
+ * Method to remove all tabs in one operation. No tab is selected afterwards.
+ *
+ * @return YES if the removal succeded.
+ */
+-(BOOL)removeAllTabs;
+
+
+/**
+ * Method to move several tabs in one operation. The tabs are taken out and inserted in their original 
+ * order starting at toIndex, where toIndex is counted without the moved tabs. 
+ *
+ * @param indexes The indexes of the tabs to be moved
+ * @param toIndex The index the first moved tab gets, clamped to the end
+ *
+ * @return the new index of the first moved tab or -1 if any index did not exist
+ */
+-(NSInteger)moveTabsAtIndexes:(NSIndexSet *)indexes toIndex:(NSUInteger)toIndex;
+
+
+/**
+ * Methods to group several changes in a transaction. Between beginUpdates and endUpdates the selectedTab KVO 
+ * notification and the tabView:selectedTabChangedIndexTo: delegate call are held back and sent at most once from
+ * endUpdates, and the display is requested once. Editing is ended at beginUpdates. Transactions can be nested,
+ * the outermost endUpdates sends the notifications. Selection changes through the selectedTab setter are still
+ * notified directly as they can be denied by the delegate.
+ */
+-(void)beginUpdates;
+-(void)endUpdates;
+
+
+/**
+ * Method to send the changes collected for tabView:didChangeTabs: now instead of on the next run loop turn, e.g.
+ * before a controller reads the tabs. Does nothing inside a transaction, the outermost endUpdates sends them.
+ */
+-(void)sendPendingChanges;
+
+
+
+/**
+ * Method to save the labels, tags and order of all tabs, the selected index, the tab groups and the measured label
+ * widths as a compact versioned binary blob. The widths are only reused on restore if the text font is the same.
+ *
+ * @return the saved tab state
+ */
+-(NSData *)tabStateData;
+
+
+/**
+ * Method to replace all tabs with a saved tab state in one pass. No delegate is asked, editing is ended and the
+ * delegate gets a single tabViewDidRestoreTabs: call, also for the groups restored collapsed. Labels without a saved
+ * width are measured on the first layout. A state saved before groups were saved restores without groups.
+ *
+ * @param data Data from tabStateData
+ *
+ * @return YES if restored, NO if the data is not a valid tab state of a known version or editing could not be ended, the tabs are then unchanged
+ */
+-(BOOL)restoreTabStateFromData:(NSData *)data;
+
+
+/**
+ * Method to save the tab state to a file, see tabStateData
+ *
+ * @param path The file to write, replaced atomically
+ *
+ * @return YES if the file was written
+ */
+-(BOOL)writeTabStateToFile:(NSString *)path;
+
+
+/**
+ * Method to restore the tab state from a file written by writeTabStateToFile:, the file is memory mapped when it is safe
+ *
+ * @param path The file to read
+ *
+ * @return YES if restored, see restoreTabStateFromData:
+ */
+-(BOOL)restoreTabStateFromFile:(NSString *)path;
+
+
+
 /**
  * Method to move a tab at a specific index in the tab list one step to right or left. 
  * Tabs after and before the tab will have their index adjusted accordingly. 
@@ -397,6 +829,19 @@ typedef NS_ENUM(NSInteger, BSTTabViewDragOptions) {
 -(BOOL)setLabel:(NSString *)label forTabAtIndex:(NSUInteger)index;
 
 
+/**
+ * Method to queue a new label for the tabs with a tag, e.g. from a price feed. It can be called from any thread at a
+ * high rate. Only the latest label for each tag is kept and the queued labels are applied together on the main thread
+ * at most once per display frame, with one tabView:labelsDidChangeForTabsAtIndexes: delegate call and one relayout and
+ * display. The delegate is asked with tabView:labelShouldChangeTo:forTabAtIndex: for each tab when the batch is applied,
+ * unknown tags are ignored and a tab being edited keeps its text.
+ *
+ * @param label The new text label, nil is ignored
+ * @param tag The tag of the tabs to relabel
+ */
+-(void)enqueueLabel:(NSString *)label forTabWithTag:(NSString *)tag;
+
+
 
 
 /**
@@ -409,6 +854,36 @@ typedef NS_ENUM(NSInteger, BSTTabViewDragOptions) {
 -(NSInteger)indexForTabWithLabel:(NSString *)label;
 
 
+/**
+ * Method to return the index of the first tab with given tag. If tag does not exist then then -1 will be returned
+ 
+ * @param tag The tag of the tab to be found
+ *
+ * @return the index of the tab or -1 if tag do not exist.
+ */
+-(NSInteger)indexForTabWithTag:(NSString *)tag;
+
+
+/**
+ * Method to select the first tab with given tag. Same as setting selectedTab to its index.
+ 
+ * @param tag The tag of the tab to be selected
+ *
+ * @return YES if the tab was selected, NO if tag do not exist or the delegate denied the change.
+ */
+-(BOOL)selectTabWithTag:(NSString *)tag;
+
+
+/**
+ * Method to remove the first tab with given tag. Same as removeTabAtIndex: with its index.
+ 
+ * @param tag The tag of the tab to be removed
+ *
+ * @return YES if the removal succeded.
+ */
+-(BOOL)removeTabWithTag:(NSString *)tag;
+
+
 /**
  * Method to return the tag string associated with the tab at index. If index does not exist then the nil will be returned
  
@@ -431,6 +906,85 @@ typedef NS_ENUM(NSInteger, BSTTabViewDragOptions) {
 
 
 
+/**
+ * Method to make a group of the tabs in range. A group is drawn as its tabs when expanded and as one summary tab with
+ * the group label and tab count when collapsed, the collapsed tabs are then not laid out, drawn or tracked but keep
+ * their indexes, labels and tags. Tabs inserted or moved between two tabs of the same group join it, a tab moved
+ * away from its group leaves it. The tabs in range leave the groups they were in, a group split in two keeps its
+ * longer part. Groups are saved with the tab state. A new group is expanded
+ *
+ * @param range The indexes of the tabs to group
+ * @param label The label of the group
+ *
+ * @return YES if the group was made or NO if range is empty or beyond the last tab
+ */
+-(BOOL)groupTabsInRange:(NSRange)range withLabel:(NSString *)label;
+
+
+/**
+ * Method to dissolve the group of the tab at index, its tabs are drawn as before they were grouped
+ *
+ * @param index The index of any tab in the group
+ *
+ * @return YES if the group was dissolved or NO if the tab is not in a group
+ */
+-(BOOL)ungroupTabsOfGroupAtIndex:(NSUInteger)index;
+
+
+/**
+ * Method to return the tabs in the same group as the tab at index
+ *
+ * @param index The index of the tab to be queried
+ *
+ * @return the indexes of the tabs of the group, location NSNotFound if the tab is not in a group
+ */
+-(NSRange)groupRangeForTabAtIndex:(NSUInteger)index;
+
+
+/**
+ * Method to return the label of the group of the tab at index
+ *
+ * @param index The index of the tab to be queried
+ *
+ * @return the group label or nil if the tab is not in a group
+ */
+-(NSString *)groupLabelForTabAtIndex:(NSUInteger)index;
+
+
+/**
+ * Method to return if the tab at index is in a collapsed group
+ *
+ * @param index The index of the tab to be queried
+ *
+ * @return YES if the group of the tab is collapsed, NO if it is expanded or the tab is not in a group
+ */
+-(BOOL)isGroupCollapsedForTabAtIndex:(NSUInteger)index;
+
+
+/**
+ * Methods to collapse the group of the tab at index into one summary tab or expand it again. The summary is hit tested,
+ * selected and dragged as the first tab of the group and is drawn selected while any tab of the group is selected.
+ * Dragging the summary drags all tabs of the group and a drag is never inserted inside a collapsed group.
+ *
+ * @param index The index of any tab in the group
+ *
+ * @return YES if the group is in the requested state, NO if the tab is not in a group or the delegate denied the change
+ */
+-(BOOL)collapseGroupOfTabAtIndex:(NSUInteger)index;
+-(BOOL)expandGroupOfTabAtIndex:(NSUInteger)index;
+
+
+
+/**
+ * Method to scroll the tab band the minimum distance needed to show the tab at index. Does nothing if 
+ * scrollingEnabled is NO or the index does not exist
+ *
+ * @param index The index of the tab to be shown
+ */
+-(void)scrollTabToVisible:(NSUInteger)index;
+
+
+
 /**
  * Method to return the index of the tab the mouse pointer is currently hovering over. If none then -1 will be returned
  *
@@ -439,4 +993,61 @@ typedef NS_ENUM(NSInteger, BSTTabViewDragOptions) {
 -(NSInteger)indexForRolloverTab;
 
 
+
+/**
+ * Method to read the performance counters, see statisticsEnabled
+ *
+ * @return A snapshot of the counters that does not change with further work
+ */
+-(BSTTabViewStatistics *)statisticsSnapshot;
+
+
+/**
+ * Method to set all performance counters to zero
+ */
+-(void)resetStatistics;
+
+
+
+/**
+ * Method to render the tab strip into a bitmap without a window, through the same drawRect: as on screen. The strip is
+ * laid out at size in the given state and the alignment of topEdgeAligned, then the size, selection, rollover and drag
+ * state of the view are restored. The delegate is not told about insufficient width at the temporary size and the view
+ * keeps its hiddenTabCount.
+ *
+ * @param size The size of the strip in points
+ * @param scale The pixels per point, 2.0 for a retina rendering
+ * @param selectedIndex The tab drawn as selected or -1 for none
+ * @param rolloverIndex The tab drawn as rolled over or -1 for none
+ * @param insertPoint The tab after which a drag insert mark is drawn, -1 for before the first tab or NSNotFound for no mark
+ *
+ * @return the rendered bitmap of size times scale pixels or nil if size, scale or an index is not valid
+ */
+-(NSBitmapImageRep *)bitmapImageRepWithSize:(NSSize)size scale:(CGFloat)scale selectedTab:(NSInteger)selectedIndex rolloverTab:(NSInteger)rolloverIndex dragInsertPoint:(NSInteger)insertPoint;
+
+
+
+/**
+ * Method to read the trace recorded since traceRecordingEnabled was last set to YES, see replayTrace:
+ *
+ * @return The compact binary trace, nil if nothing was recorded
+ */
+-(NSData *)recordedTrace;
+
+
+/**
+ * Method to replay a recorded trace into this view, which should be new and not in a window. The view gets the frame,
+ * options and tabs the recording started with, then every event is fed to it in order, without waiting between events,
+ * and rendered offscreen when it needs display. Drag sessions the recorded view started are not started again, their
+ * payload reaches the replayed drag destination calls as it did when recorded. The theme, delegate and target are not
+ * part of the trace, so the replay runs with the default theme and without them. The groups the recording started with
+ * are part of the saved tab state it starts from.
+ *
+ * @param trace The data from recordedTrace
+ *
+ * @return The BSTTabViewTraceEvent of each replayed event in trace order, nil if the trace is not valid
+ */
+-(NSArray *)replayTrace:(NSData *)trace;
+
+
 @end
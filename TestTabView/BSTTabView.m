@@ -7,49 +7,200 @@
 //
 
 #import          "BSTTabView.h"
+#import          <pthread.h>
 
 @class           BSTTabViewTab;
-
-static NSString const * const BSTDragStringHeader         = @"bst.tabview.1.0";  //If updated length must not change, some methods have the length of this string hard coded
+@class           BSTTabViewDragPayload;
+@class           BSTTabViewTraceDraggingInfo;
+@class           BSTTabViewPendingChanges;
+@class           BSTTabViewGroup;
+
+static NSString * const       BSTDragPasteboardType       = @"bst.tabview.tabs";  // Pasteboard type of the binary drag payload
+static uint16_t const         BSTDragPayloadVersion       = 2;     // Version of the binary drag payload, 1 was the old drag string
+static uint16_t const         BSTTabStateVersion          = 2;     // Version of the binary saved tab state, 1 had no groups
+static uint16_t const         BSTTraceVersion             = 1;     // Version of the binary event trace
 static CGFloat  const         BSTminTabWidth              = 15.0;
 static CGFloat const          BSTstdYTextOffset           = 2.0;
 static CGFloat const          BSTstdTextPadding           = 2.0;
 static CGFloat const          BSTeditorExtraPadding       = 2.0;
 static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
-
-
-
-@interface BSTTabView ()<NSTextViewDelegate,NSDraggingSource,NSDraggingDestination> {
+static NSUInteger const       BSTlabelWidthCacheLimit     = 4096;  // Max number of labels in the shared width cache before it is flushed
+static CGFloat const          BSTvisibleTabMargin         = 100.0; // Tabs this far outside the visible band still get paths and tracking areas
+static CGFloat const          BSTscrollButtonWidth        = 12.0;  // Width of the scroll arrow buttons
+static CGFloat const          BSTscrollLineStep           = 10.0;  // Scroll distance per line for non precise scroll wheels
+static CGFloat const          BSTautoScrollZone           = 20.0;  // Distance from the edge where a drag auto scrolls
+static CGFloat const          BSTautoScrollStep           = 8.0;   // Auto scroll distance per dragging update
+static NSUInteger const       BSTpathTemplateLimit        = 256;   // Max number of shared tab paths before they are flushed
+static NSUInteger const       BSTtabImageCacheLimit       = 512;   // Max number of cached tab images before they are flushed
+static NSUInteger const       BSTlabelMeasurementBatch    = 256;   // Labels measured per background block with asynchronousLabelMeasurementEnabled
+static NSTimeInterval const   BSTlabelFeedInterval        = 1.0 / 60.0;  // Queued labels are applied at most this often, one display frame
+
+
+// Performance counters updated while statisticsEnabled, see BSTTabViewStatistics
+typedef struct {
+    NSUInteger                        layoutPasses;
+    NSUInteger                        incrementalLayoutPasses;
+    NSUInteger                        compressedLayoutPasses;
+    NSUInteger                        boundaryPathRebuilds;
+    NSUInteger                        trackingAreasAdded;
+    NSUInteger                        trackingAreasRemoved;
+    NSUInteger                        drawCalls;
+    NSUInteger                        delegateCallbacks;
+    NSUInteger                        dragPayloadDecodes;
+    NSUInteger                        tabsAllocated;
+    NSUInteger                        tabsReused;
+    NSUInteger                        trackingAreasReused;
+    NSTimeInterval                    layoutTime;
+    NSTimeInterval                    maxLayoutTime;
+    NSTimeInterval                    drawTime;
+    NSTimeInterval                    maxDrawTime;
+} BSTTabViewCounters;
+
+
+// Events of a recorded trace and their fields, the values are part of the trace format, see recordedTrace
+typedef NS_ENUM(uint8_t, BSTTraceEventKind) {
+    BSTTraceMouseDown = 1,                               // point, uint32 modifier flags, uint8 click count
+    BSTTraceMouseUp,                                     // as mouse down
+    BSTTraceMouseDragged,                                // as mouse down
+    BSTTraceMouseMoved,                                  // as mouse down with click count 0
+    BSTTraceMouseEntered,                                // uint32 tab index
+    BSTTraceMouseExited,                                 // uint32 tab index, 0xFFFFFFFF when the single tracking area was left
+    BSTTraceResize,                                      // float32 width, float32 height
+    BSTTraceDraggingEntered,                             // point, uint32 source operation mask, uint32 sequence number, uint8 BSTTraceDragSource, uint32 source userTabDraggingEnabled, data payload
+    BSTTraceDraggingUpdated,                             // point
+    BSTTraceDraggingExited,                              // point
+    BSTTracePrepareForDragOperation,                     // point
+    BSTTracePerformDragOperation,                        // point
+    BSTTraceDraggingEnded,                               // uint32 operation, the end of a drag session the view was source of
+    BSTTraceAddTab,                                      // uint32 index, string label, string tag
+    BSTTraceAddTabs,                                     // uint32 index, uint32 count, string label and string tag of each
+    BSTTraceRemoveTab,                                   // uint32 index
+    BSTTraceRemoveTabs,                                  // index set
+    BSTTraceMoveTabs,                                    // index set, uint32 to index
+    BSTTraceMoveTabOneStep,                              // uint32 index, uint8 1 for right
+    BSTTraceSetLabel,                                    // uint32 index, string label
+    BSTTraceSetTag,                                      // uint32 index, string tag
+    BSTTraceSelectTab,                                   // uint32 index, 0xFFFFFFFF for none
+    BSTTraceScrollOffset,                                // float64 offset
+    BSTTraceBeginUpdates,                                // no fields
+    BSTTraceEndUpdates,                                  // no fields
+    BSTTraceRestoreTabState,                             // data saved tab state
+    BSTTraceApplyQueuedLabels,                           // uint32 count, string tag and string label of each
+    BSTTraceGroupTabs,                                   // uint32 location, uint32 length, string label
+    BSTTraceUngroupTabs,                                 // uint32 index
+    BSTTraceCollapseGroup                                // uint32 index, uint8 1 for collapse
+};
+
+
+
+@interface BSTTabView ()<NSTextViewDelegate,NSDraggingSource,NSDraggingDestination,NSPasteboardItemDataProvider> {
     
     
 @private
     
-    NSMutableParagraphStyle*             style;                    // fixed text style
-    
     CGFloat                              currentWidth;             // The overall view width last used when rendering it
     CGFloat                              currentHeight;            // The overall view height last used when rendering it
     NSTextView*                          labelEditor;              // Reference to the label editor when in use
     BSTTabViewTab*                       editedTab;                // reference to the tab beeing edited
-    NSImage*                             dragImage;                // Constant image for drag pointer
     
     // State managing variables for drag source
     NSEvent*                             dragStartMouseEvent;      // The start mouse event
     BOOL                                 deleteTabOnSuccessfulDrag;// flag in source to say if tab is to be deleted on successful drag
-    BSTTabViewTab*                       dragSourceTab;            // The tab in source beeing dragged, nil if no drag in progress
+    NSArray*                             dragSourceTabs;           // The tabs in source beeing dragged, nil if no drag in progress
+    BSTTabViewDragPayload*               dragSourcePayload;        // The labels and tags of dragSourceTabs, handed directly to destinations in the same application
     
     // State managing variables for drag destination
     BOOL                                 validDragInDest;          // flag in destination, YES if a valid drag is inside control
     NSDragOperation                      destinationDragOperation; // Current allowed drag insert operation, determined on entry and maintained while drag is inside control
     NSInteger                            dragInsertPoint;          // Position of visal cue for drag insert (after tab with number dragInsertPoint or before first if -1, any other value means invalid/no insert point)
+    BSTTabViewDragPayload*               dragPayload;              // The payload of the current drag, decoded once per dragging session
+    NSInteger                            dragPayloadSequence;      // The draggingSequenceNumber dragPayload belongs to
+    
+    // Asynchronous label measurement
+    NSMutableOrderedSet*                 labelsToMeasure;          // Labels laid out with an estimated width since the last dispatch
+    NSMutableSet*                        pendingLabelMeasurements; // Labels queued or being measured, not queued again
+    NSMutableDictionary*                 measuredLabelWidths;      // Background measured widths waiting for the next full layout pass to reach the tabs
+    
+    // Hit testing
+    NSTrackingArea*                      viewTrackingArea;         // The single tracking area for the whole control when singleTrackingAreaEnabled
+    CGFloat*                             tabStartTable;            // startX of each tab from the last layout, sorted as tabs are laid out left to right
+    CGFloat*                             tabWidthTable;            // coreWidth of each tab from the last layout
+    CGFloat*                             tabPrefixTable;           // Unrounded x where each tab starts, one entry more than tabs where the last is the content width
+    NSUInteger                           tabTableCount;            // Number of tabs in the tables
+    NSUInteger                           tabTableCapacity;         // Allocated size of the tables
+    BOOL                                 layoutIsCompressed;       // YES if any tab got less than its requested width in the last layout, selection change then needs relayout
+    CGFloat                              stableCappedWidth;        // In a compressed layout a tab requesting at least this keeps its capped width, see invalidateTab:atIndex:relabeledFromWidth:
+    CGFloat                              longestRequestedWidth;    // The longest width requested in the last full layout pass
+    NSUInteger                           longestRequestedCount;    // The number of tabs requesting longestRequestedWidth
+    BOOL                                 layoutNeedsFullPass;      // Set by any invalidation that may change the width of all tabs
+    BOOL                                 geometryIsInvalid;        // Tab shapes changed but not their widths, the visible tabs need new paths and tracking areas
+    BOOL                                 insufficientWidth;        // The tabs did not fit in the last layout, notified on change only
+    NSUInteger                           layoutDirtyFrom;          // The first tab that was inserted, removed, moved or renamed since the last layout
+    
+    // Virtualisation and scrolling
+    CGFloat                              contentWidth;             // The total width of all tabs from the last layout
+    NSRange                              materializedRange;        // The tabs that currently have geometry, paths and tracking areas
+    NSMutableSet*                        materializedTabs;         // The same tabs as a set, as indexes shift on insert and remove
+    BOOL                                 scrollToSelectedPending;  // The selected tab shall be scrolled into view on next layout
+    BOOL                                 scrollButtonClick;        // The current mouse down was on a scroll button
+    
+    // Label feed, the only state touched by other threads
+    pthread_mutex_t                      labelFeedLock;            // Guards queuedLabels and labelFeedScheduled, held only to swap a value in or the dictionary out
+    NSMutableDictionary*                 queuedLabels;             // tag -> latest label from enqueueLabel:forTabWithTag: not applied yet
+    BOOL                                 labelFeedScheduled;       // An apply is scheduled on the main thread
+    
+    // Trace recording and replay
+    NSMutableData*                       traceData;                // The trace recorded since traceRecordingEnabled was last set
+    NSTimeInterval                       traceLastEventTime;       // Uptime of the last recorded event, events store the time since the previous
+    NSUInteger                           traceSuppression;         // > 0 while the control calls its own traced methods, only the outer call is recorded
+    BOOL                                 replayingTrace;           // replayTrace: is running, drag sessions are not started and invalidated areas are collected
+    NSRect                               replayDirtyRect;          // The area invalidated by the replayed event, drawn to time it
+    
+    // Update transactions
+    NSUInteger                           updateDepth;              // Nesting level of beginUpdates, notifications are held back while > 0
+    BOOL                                 renderingOffscreen;       // A temporary state is rendered by bitmapImageRepWithSize:, its layout is not notified
+    NSInteger                            updatesNotifiedSelection; // The selected tab index last notified to observers before or during the transaction
+    BSTTabViewPendingChanges*            pendingChanges;           // Changes not yet sent to tabView:didChangeTabs:, nil if none
+    NSMutableArray*                      tabPool;                  // Removed tabs reset for reuse, at most tabPoolLimit
+    
+    // Tab groups
+    NSMutableArray*                      tabGroups;                // The groups with tabs, ordered as their tabs after updateTabGroupsIfNeeded
+    NSUInteger                           groupsDirtyFrom;          // The first tab inserted, removed or moved since the group ranges were found, NSNotFound if none
+    
+    // Lookup maps
+    NSMutableDictionary*                 tabsByTag;                // tag -> the tab with that tag, or an array if several tabs share it. The keys are the interned tag strings
+    NSMutableDictionary*                 tabsByLabel;              // label -> the tab with that label, or an array if several tabs share it. The keys are the interned label strings
+    NSUInteger                           validCachedIndexCount;    // The tabs before this index have a correct cachedIndex
+    
+    // Drawing caches
+    NSMutableDictionary*                 pathTemplates;            // coreWidth -> boundary path at x = 0, valid for the current tab height, spacer width and corner radius
+    NSMutableDictionary*                 tabImageCache;            // "state width label" -> rendered tab, valid for the current geometry, colors and text options
+    NSMapTable*                          typesetLabels;            // tab (not retained) -> BSTTabViewTypesetLabel, only for tabs drawn with typesetLabelCacheEnabled
+    NSUInteger                           typesetGeneration;        // Stepped when any of the text options change, invalidates all typeset lines
+    
+    // Statistics
+    BSTTabViewCounters                   counters;                 // Performance counters, only updated when statisticsEnabled
 }
 
-// private properties called on by the helper class BSTTabViewTab
-@property (nonatomic) NSDictionary *defaultTextOptions;
-@property (nonatomic) NSDictionary *selectedTextOptions;
-@property (nonatomic) NSDictionary *rolloverTextOptions;
-@property (nonatomic) CGFloat preferredTextHeight;
+// private properties called on by the helper class BSTTabViewTab, all from the theme
+@property (readonly, nonatomic) NSDictionary *defaultTextOptions;
+@property (readonly, nonatomic) NSDictionary *selectedTextOptions;
+@property (readonly, nonatomic) NSDictionary *rolloverTextOptions;
+@property (readonly, nonatomic) CGFloat preferredTextHeight;
 @property (readonly, nonatomic) NSFont *textFont;
 @property (nonatomic) CGFloat tabHeight;
+@property (readonly, nonatomic) NSUInteger labelWidthGeneration;                // Stepped when font or paragraph style change, invalidates widths cached in the tabs
+
+// Label measurement counters
+@property (nonatomic) NSUInteger labelWidthCacheHits;                           // Label widths served from the tab or shared cache
+@property (nonatomic) NSUInteger labelWidthCacheMisses;                         // Label widths actually measured by the text system
+@property (nonatomic) NSUInteger tabsDrawnCount;                                // Number of drawSelf: calls made by drawRect:
+@property (nonatomic) NSUInteger tabsLaidOutCount;                              // Number of tab positions calculated by layout passes
+@property (nonatomic) NSUInteger tabImageCacheHits;                             // Tabs drawn from a cached image
+@property (nonatomic) NSUInteger tabImageCacheMisses;                           // Tab images rendered
+@property (nonatomic) NSUInteger typesetLineHits;                               // Labels drawn from a cached typeset line
+@property (nonatomic) NSUInteger typesetLineMisses;                             // Label lines typeset
+@property (readonly, nonatomic) NSUInteger pathTemplateGeneration;              // Stepped when the shared paths are flushed, tabs then pick up new ones
 
 // State tracking properties
 @property (nonatomic, weak) BSTTabViewTab *currentRollover;                     // Reference to currently hovered over tab
@@ -62,15 +213,403 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 // Private methods used internally
 -(NSInteger)moveTabAtIndex:(NSUInteger)fromIndex toIndex: (NSUInteger)toIndex;  // Move a tab - could be consdered to be made public
 -(void)reassignTabPositionAndTrackingArea;                                      // Reallocate width, start coordinates and tracking areas for all tabs
+-(BOOL)relayoutTabsFromIndex:(NSUInteger)index;                                 // Lay out only the tabs from index on when nothing is compressed, NO if a full pass is needed
+-(void)completeLayout;                                                          // Scroll and give geometry to the visible tabs once the layout tables are up to date
 -(CGFloat)widthForLabelOrEditorForTab:(BSTTabViewTab *)tab;                     // The preferred width that is suffient for both label and field editor
+-(CGFloat)measuredWidthForLabel:(NSString *)label estimated:(BOOL *)estimated;  // The text width of a label in the default text style, uses the shared cache, an estimate while measured in the background
+-(void)scheduleLabelMeasurements;                                               // Dispatch the labels that got an estimated width in batches, most important first
+-(void)applyMeasuredWidths:(NSArray *)widths forLabels:(NSArray *)labels generation:(NSUInteger)generation;  // Take background results on the main thread, stale ones are dropped
+-(NSInteger)indexOfTabAtPoint:(NSPoint)point;                                   // Binary search hit test of the tab core areas, -1 if none
+-(NSInteger)insertPointForXLocation:(CGFloat)xLoc;                              // The tab after which a drag would be inserted, -1 for before first
+-(void)updateRolloverForPoint:(NSPoint)point event:(NSEvent *)theEvent;        // Move the rollover to the tab at point, used with singleTrackingAreaEnabled
+-(void)setNeedsDisplayForTab:(BSTTabViewTab *)tab;                              // Invalidate only the area covered by a tab
+-(NSBezierPath *)boundaryPathForCoreWidth:(CGFloat)coreWidth;                   // The shared boundary path for a tab width, core starting at x = 0
+-(NSImage *)tabImageForKey:(NSString *)key;                                     // A cached tab rendering, nil if none
+-(void)setTabImage:(NSImage *)image forKey:(NSString *)key;                     // Cache a tab rendering
+-(void)invalidateTabShapes;                                                     // Flush paths and images after a change of tab height, spacer width or corner radius
+-(void)invalidateTabImages;                                                     // Flush images after a change of colors, text options or backing scale
+-(id)typesetLineForTab:(BSTTabViewTab *)tab state:(NSUInteger)state attributes:(NSDictionary *)attributes width:(CGFloat)width;  // The cached typeset label line of a tab in a state, typeset if label, width or text options changed
+-(void)discardTypesetLabelForTab:(BSTTabViewTab *)tab;                          // Drop the typeset lines of a tab leaving the visible band or going away
+-(BSTTabViewCounters *)activeCounters;                                          // The counters for the helper class to update, NULL when statistics are disabled
+-(void)recordTimedOperation:(BSTTabViewTimedOperation)operation since:(NSTimeInterval)start;  // Add up the time of a layout or draw and check it against the budget
+-(NSRange)rangeOfTabsInRect:(NSRect)rect;                                       // The tabs that need to be drawn to cover rect
+-(CGFloat)xLocationForInsertPoint:(NSInteger)insertPoint;                       // x coordinate of the drag insert mark
+-(NSRect)rectForInsertPoint:(NSInteger)insertPoint;                             // The area covered by the drag insert mark
+-(void)materializeVisibleTabs;                                                  // Give geometry to the tabs in the visible band and drop it from the others
+-(NSRange)rangeOfTabsFromX:(CGFloat)minX toX:(CGFloat)maxX;                     // The tabs reaching into the content coordinate interval
+-(CGFloat)clampedScrollOffset:(CGFloat)offset;                                  // Limit a scroll offset to the scrollable range
+-(NSInteger)scrollButtonAtPoint:(NSPoint)point;                                 // -1 for left button, 1 for right button, 0 if none
+-(void)drawScrollButtons;                                                       // Draw the scroll arrows when there are hidden tabs
+-(void)shiftSelectedTabIndexTo:(NSInteger)newSelected;                          // Change selected index when the selected tab moves, notifies unless in a transaction
+-(void)invalidateLayoutAndDisplayFromIndex:(NSUInteger)index;                   // Flag relayout from a mutated tab and request display, display is deferred in a transaction
+-(void)invalidateTab:(BSTTabViewTab *)tab atIndex:(NSUInteger)index relabeledFromWidth:(CGFloat)oldWidth;  // Repaint only a relabeled tab if the layout stays the same, else relayout from it
+-(void)invalidateLayout;                                                        // The width of any tab may change, full layout pass on the next display
+-(void)invalidateGeometry;                                                      // Tab shapes change but not their widths, new paths and tracking areas without a layout pass
+-(void)invalidatePaint;                                                         // Only the appearance changes, repaint without layout
+-(void)updateLayoutIfNeeded;                                                    // Run the pending layout or geometry update, layout is only run from here
+-(void)updateInsufficientWidth:(BOOL)insufficient;                             // Count the hidden tabs and notify the delegate if the state changed
+-(NSInteger)indexOfTab:(BSTTabViewTab *)tab;                                    // Index of a tab from its cached index, -1 if not in this view
+-(void)invalidateCachedIndexesFrom:(NSUInteger)index;                           // Tabs at and after index have moved
+-(NSString *)addTab:(BSTTabViewTab *)tab toMap:(NSMutableDictionary *)map forKey:(NSString *)key;  // Register tab in a lookup map, returns the interned key for the tab to store
+-(void)removeTab:(BSTTabViewTab *)tab fromMap:(NSMutableDictionary *)map forKey:(NSString *)key;  // Unregister tab from a lookup map
+-(NSInteger)firstIndexOfTabs:(id)bucket;                                        // Lowest index of the tab or tabs in a map bucket, -1 if none
 -(BOOL)beginEditLabelInteractiveForTab:(NSInteger)index;                        // Edit the label interactively using the window field editor
 
--(NSImage *)createDragImage;                                                    // Method to generate a suitable image for dragging
--(NSString *)dragStringForTabWithIndex:(NSInteger)index;                        // Create the string for pasteboard placement used in dragging
--(BOOL)validateDragString:(NSString *)dragString;                               // Validate dragString is a valid drag string
--(NSInteger)indexFromDragString:(NSString *)dragString;                         // Extract the encoded index from a  drag string
--(NSString*)labelFromDragString:(NSString *)dragString;                         // Extract the encoded label from a drag string
--(NSString*)tagFromDragString:(NSString *)dragString;                           // extract the encoded tag from a drag string
+-(void)changeTheme:(void (^)(BSTMutableTabViewTheme *theme))change;            // Give the view its own theme with a change made by the block
+-(BSTTabViewDragPayload *)outgoingDragPayload;                                  // The payload of the drag this control is source of, nil if none
+-(NSMutableData *)traceEvent:(BSTTraceEventKind)kind;                           // Start recording an event, returns the trace to append its fields to or nil if not recorded
+-(void)traceMouseEvent:(NSEvent *)theEvent kind:(BSTTraceEventKind)kind;       // Record a mouse event at its location in the view
+-(void)traceTab:(BSTTabViewTab *)tab entered:(BOOL)entered event:(NSEvent *)theEvent;  // Record a tab tracking area event, not the rollover changes made by the control itself
+-(void)traceDraggingInfo:(id<NSDraggingInfo>)sender kind:(BSTTraceEventKind)kind;  // Record a dragging destination call, with the source and payload on entry
+-(void (^)(void))replayActionForEvent:(BSTTraceEventKind)kind bytes:(const uint8_t *)bytes length:(NSUInteger)length position:(NSUInteger *)pos name:(NSString **)name dragInfo:(BSTTabViewTraceDraggingInfo *)dragInfo;  // Decode one event, nil if not valid
+-(BSTTabViewDragPayload *)payloadForDraggingInfo:(id<NSDraggingInfo>)sender;    // The payload of a drag, taken from the source or decoded from the pasteboard once
+-(NSIndexSet *)indexesOfDragSourceTabs;                                         // The current indexes of the tabs being dragged
+-(NSString *)labelWidthStyleStamp;                                              // Identifies the text style label widths are measured in, saved with the tab state
+-(void)applyQueuedLabels;                                                       // Take the labels queued by enqueueLabel:forTabWithTag: and apply them in one batch
+-(BSTTabViewPendingChanges *)pendingChangesBeforeMovingTabs:(BOOL)moving;        // The changes to add to, nil if the delegate does not take them. Call before the tabs array changes
+-(BSTTabViewTab *)dequeueTab;                                                   // A tab from the pool, or a new one
+-(void)recycleTab:(BSTTabViewTab *)tab;                                         // Return a removed tab to the pool if below tabPoolLimit
+-(void)updateTabGroupsIfNeeded;                                                 // Find the group ranges again after the tabs changed, tabs split from their group leave it
+-(BSTTabViewGroup *)groupOfTabAtIndex:(NSUInteger)index;                        // The up to date group of a tab, nil if none or index does not exist
+-(NSRange)itemRangeForTabAtIndex:(NSUInteger)index;                             // The tabs laid out and drawn as one with the tab at index, the group if collapsed
+-(CGFloat)widthForSummaryOfGroup:(BSTTabViewGroup *)group;                      // The preferred width of the summary tab of a collapsed group
+-(void)joinGroupAroundTabsInRange:(NSRange)range;                               // Inserted or moved tabs between two tabs of the same group join it
+-(BOOL)setGroupOfTabAtIndex:(NSUInteger)index collapsed:(BOOL)collapsed;        // Collapse or expand a group after asking the delegate
+
+@end
+
+
+
+#pragma mark - <<<<<<<<<< LAYOUT CORE  >>>>>>>>>>>>>>
+
+/*
+ * The layout core is plain C without any AppKit dependency. It takes the requested widths of all tabs and
+ * calculates the cap (longest allowed width) for the non selected tabs. The result is identical to the
+ * original approach of lowering the cap 1.0 at a time from the longest requested width until the tabs fit
+ * or the cap reaches BSTminTabWidth, but instead of walking all tabs for every step the non selected widths
+ * are sorted once and the cap is found in closed form (water filling) in O(N log N).
+ */
+
+static int BSTCompareWidths(const void *a, const void *b) {
+
+    CGFloat wa = *(const CGFloat *)a;
+    CGFloat wb = *(const CGFloat *)b;
+    return ((wa < wb) ? -1 : ((wa > wb) ? 1 : 0));
+}
+
+
+// The total strip width needed if all non selected tabs are capped at cap, summed in tab order to get exactly the same rounding as the step by step approach
+static CGFloat BSTTotalWidthForCap(CGFloat cap, const CGFloat *widths, NSUInteger count, NSInteger selectedIndex, CGFloat spacerWidth) {
+
+    CGFloat total = spacerWidth;
+    for (NSUInteger i = 0; i < count; i++) {
+        if ((selectedIndex >= 0) && ((NSUInteger)selectedIndex == i)) {
+            total = total + widths[i] + spacerWidth;  // The selected tab gets its full width
+        } else {
+            total = total + (widths[i] > cap ? cap : widths[i]) + spacerWidth;
+        }
+    }
+    return total;
+}
+
+
+/**
+ * Calculates the width cap for the non selected tabs
+ *
+ * @param widths The requested width of each tab
+ * @param count The number of tabs
+ * @param selectedIndex The index of the selected tab, that always gets its full width, or -1 if none
+ * @param spacerWidth The width of each spacer, there is one spacer more than tabs
+ * @param availableWidth The width of the tab strip
+ * @param insufficient Set to YES if the tabs do not fit even at BSTminTabWidth, may be NULL
+ *
+ * @return The cap, tabs get min(requested, cap) except the selected tab
+ */
+CGFloat BSTCompressionCapForWidths(const CGFloat *widths, NSUInteger count, NSInteger selectedIndex, CGFloat spacerWidth, CGFloat availableWidth, BOOL *insufficient) {
+
+    CGFloat totalRequested = spacerWidth;
+    CGFloat longestRequested = BSTminTabWidth + 1.0;  // Start value > min width, in case all tabs are shorter than min to prevent warning for insufficient size
+
+    for (NSUInteger i = 0; i < count; i++) {  // Add up ideal width, same order as the tabs to get the same rounding
+        if (widths[i] > longestRequested) {
+            longestRequested = widths[i];
+        }
+        totalRequested = totalRequested + widths[i] + spacerWidth;
+    }
+
+    if (insufficient) {
+        *insufficient = NO;
+    }
+    if (totalRequested <= availableWidth) {  // Everything fits, no compression
+        return longestRequested;
+    }
+
+    // Split in the fixed part (spacers and selected tab) and the sorted compressible part
+    BOOL hasSelected = ((selectedIndex >= 0) && ((NSUInteger)selectedIndex < count));
+    NSUInteger compressible = (hasSelected ? count - 1 : count);
+    CGFloat fixed = spacerWidth * (CGFloat)(count + 1);
+    CGFloat *sorted = malloc((compressible + 1) * sizeof(CGFloat));
+    CGFloat *prefix = malloc((compressible + 1) * sizeof(CGFloat));
+
+    NSUInteger j = 0;
+    for (NSUInteger i = 0; i < count; i++) {
+        if (hasSelected && (i == (NSUInteger)selectedIndex)) {
+            fixed = fixed + widths[i];
+        } else {
+            sorted[j++] = widths[i];
+        }
+    }
+    qsort(sorted, compressible, sizeof(CGFloat), BSTCompareWidths);
+
+    prefix[0] = 0.0;
+    for (j = 0; j < compressible; j++) {
+        prefix[j + 1] = prefix[j] + sorted[j];
+    }
+
+    // Water fill - find the exact cap where the capped total equals the available width
+    CGFloat budget = availableWidth - fixed;
+    CGFloat cap = ((compressible > 0) ? sorted[compressible - 1] : -1.0);  // Nothing to compress means no cap will do
+    for (j = 0; j < compressible; j++) {
+        CGFloat candidate = (budget - prefix[j]) / (CGFloat)(compressible - j);
+        if (candidate <= sorted[j]) {
+            cap = candidate;
+            break;
+        }
+    }
+
+    free(sorted);
+    free(prefix);
+
+    // Snap to the 1.0 steps counted from the longest requested width, stop at min width
+    CGFloat maxSteps = ceil(longestRequested - BSTminTabWidth);
+    CGFloat steps = ((cap < 0.0) ? maxSteps : ceil(longestRequested - cap));
+    if (steps < 1.0) {
+        steps = 1.0;
+    }
+    if (steps > maxSteps) {
+        steps = maxSteps;
+    }
+
+    // Correct for floating point rounding at the step boundaries
+    while ((steps > 1.0) && (BSTTotalWidthForCap(longestRequested - (steps - 1.0), widths, count, selectedIndex, spacerWidth) <= availableWidth)) {
+        steps = steps - 1.0;
+    }
+    while ((steps < maxSteps) && (BSTTotalWidthForCap(longestRequested - steps, widths, count, selectedIndex, spacerWidth) > availableWidth)) {
+        steps = steps + 1.0;
+    }
+
+    longestRequested = longestRequested - steps;
+    if (insufficient) {
+        *insufficient = (longestRequested <= BSTminTabWidth);  // Not all will fit even with compression
+    }
+    return longestRequested;
+}
+
+
+
+// The largest index with table[index] <= x, or -1 if none
+static NSInteger BSTLastIndexAtOrBefore(const CGFloat *table, NSUInteger count, CGFloat x) {
+    
+    NSUInteger lo = 0;
+    NSUInteger hi = count;
+    while (lo < hi) {
+        NSUInteger mid = lo + ((hi - lo) / 2);
+        if (table[mid] <= x) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return ((NSInteger)lo - 1);
+}
+
+
+
+// The tabs after first up to end are in a collapsed group, they sit where the first tab ends with no width so the start table stays sorted and no hit test lands on them
+static void BSTPlaceCollapsedTabs(CGFloat *startTable, CGFloat *widthTable, CGFloat *prefixTable, NSUInteger first, NSUInteger end) {
+    
+    for (NSUInteger i = first + 1; i < end; i++) {
+        startTable[i] = startTable[first] + widthTable[first];
+        widthTable[i] = 0.0;
+        prefixTable[i] = prefixTable[first];
+    }
+}
+
+
+
+#pragma mark - <<<<<<<<<< TYPESET LABELS  >>>>>>>>>>>>>>
+
+/*
+ * With typesetLabelCacheEnabled the label of a visible tab is typeset once per text state into a Core Text line,
+ * centered and truncated in the middle like the paragraph style does for drawInRect:withAttributes:, and kept in
+ * the owner next to the tab until the label, the width of the text rect or the text options change. The lines are
+ * kept in the owner instead of the tab so the tab stays small when the cache is not used.
+ */
+
+@interface BSTTabViewTypesetLabel : NSObject {
+    
+@private
+    id lines[3];                                                 // CTLineRef for each tab state, NSNull if nothing fits, nil if not typeset yet
+}
+
+@property (readonly, nonatomic) NSString *label;                // The label the lines were typeset from, compared by identity as labels are interned
+@property (readonly, nonatomic) CGFloat width;                  // The text rect width the lines were truncated to
+@property (readonly, nonatomic) NSUInteger generation;          // The owner typesetGeneration the lines were typeset in
+
+-(instancetype)initWithLabel:(NSString *)label width:(CGFloat)width generation:(NSUInteger)generation;
+-(BOOL)matchesLabel:(NSString *)label width:(CGFloat)width generation:(NSUInteger)generation;
+-(id)lineForState:(NSUInteger)state;                            // The line typeset for state 0 (default), 1 (rollover) or 2 (selected), nil if none yet
+-(void)setLine:(id)line forState:(NSUInteger)state;
+
+@end
+
+
+
+@implementation BSTTabViewTypesetLabel
+
+-(instancetype)initWithLabel:(NSString *)label width:(CGFloat)width generation:(NSUInteger)generation {
+    
+    self = [super init];
+    if (self) {
+        _label = label;
+        _width = width;
+        _generation = generation;
+    }
+    return self;
+}
+
+
+-(BOOL)matchesLabel:(NSString *)label width:(CGFloat)width generation:(NSUInteger)generation {
+    
+    return ((label == _label) && (width == _width) && (generation == _generation));
+}
+
+
+-(id)lineForState:(NSUInteger)state {
+    
+    return lines[state];
+}
+
+
+-(void)setLine:(id)line forState:(NSUInteger)state {
+    
+    lines[state] = line;
+}
+
+@end
+
+
+
+// Typeset label in the font and color of attributes, truncated in the middle to width. NSNull if not even the ellipsis fits
+static id BSTTypesetLine(NSString *label, NSDictionary *attributes, CGFloat width) {
+    
+    NSFont *font = [attributes valueForKey:NSFontAttributeName];
+    NSColor *color = [attributes valueForKey:NSForegroundColorAttributeName];
+    NSMutableDictionary *ctAttributes = [[NSMutableDictionary alloc] initWithCapacity:2];
+    if (font) {
+        [ctAttributes setObject:font forKey:(__bridge NSString *)kCTFontAttributeName];  // NSFont is toll free bridged to CTFontRef
+    }
+    if (color) {
+        [ctAttributes setObject:(__bridge id)[color CGColor] forKey:(__bridge NSString *)kCTForegroundColorAttributeName];
+    }
+    
+    NSAttributedString *string = [[NSAttributedString alloc] initWithString:label attributes:ctAttributes];
+    CTLineRef line = CTLineCreateWithAttributedString((__bridge CFAttributedStringRef)string);
+    if (CTLineGetTypographicBounds(line, NULL, NULL, NULL) <= width) {
+        return CFBridgingRelease(line);
+    }
+    
+    NSAttributedString *ellipsis = [[NSAttributedString alloc] initWithString:@"…" attributes:ctAttributes];
+    CTLineRef token = CTLineCreateWithAttributedString((__bridge CFAttributedStringRef)ellipsis);
+    CTLineRef truncated = CTLineCreateTruncatedLine(line, width, kCTLineTruncationMiddle, token);
+    CFRelease(token);
+    CFRelease(line);
+    return (truncated ? CFBridgingRelease(truncated) : [NSNull null]);
+}
+
+
+
+// Draw a typeset line centered in rect, starting at the top of rect as drawInRect:withAttributes: does
+static void BSTDrawTypesetLine(id line, NSRect rect) {
+    
+    CTLineRef ctLine = (__bridge CTLineRef)line;
+    CGFloat ascent = 0.0;
+    CGFloat lineWidth = CTLineGetTypographicBounds(ctLine, &ascent, NULL, NULL);
+    CGFloat x = NSMinX(rect) + floor((NSWidth(rect) - lineWidth) / 2.0);
+    
+    NSGraphicsContext *graphicsContext = [NSGraphicsContext currentContext];
+    CGContextRef context = [graphicsContext CGContext];
+    CGContextSaveGState(context);
+    CGContextClipToRect(context, NSRectToCGRect(rect));
+    if ([graphicsContext isFlipped]) {
+        CGContextSetTextMatrix(context, CGAffineTransformMakeScale(1.0, -1.0));
+        CGContextSetTextPosition(context, x, NSMinY(rect) + ascent);
+    } else {
+        CGContextSetTextMatrix(context, CGAffineTransformIdentity);
+        CGContextSetTextPosition(context, x, NSMaxY(rect) - ascent);
+    }
+    CTLineDraw(ctLine, context);
+    CGContextRestoreGState(context);
+}
+
+
+
+#pragma mark - <<<<<<<<<< TAB GROUPS  >>>>>>>>>>>>>>
+
+/*
+ * A group is the run of tabs pointing to it, its range is found again by the owner after the tabs changed, see
+ * updateTabGroupsIfNeeded. A collapsed group is laid out and drawn as its first tab showing the summary label.
+ */
+
+@interface BSTTabViewGroup : NSObject {
+    
+@private
+    NSString *summaryLabel;                                      // The label and tab count drawn by the collapsed group, nil until asked for
+    NSUInteger summaryCount;                                     // The tab count in summaryLabel
+}
+
+@property (copy, nonatomic) NSString *label;                     // The group label
+@property (nonatomic) BOOL collapsed;                            // Drawn as one summary tab
+@property (nonatomic) NSRange range;                             // The tabs of the group, only trusted by the owner after updateTabGroupsIfNeeded
+@property (unsafe_unretained, nonatomic) id summaryTab;          // The first tab of the group, it draws the summary when collapsed. Only compared, never messaged
+@property (nonatomic) CGFloat summaryWidth;                      // The preferred width of summaryLabel, -1 if not measured
+@property (nonatomic) NSUInteger summaryWidthGeneration;         // The owner labelWidthGeneration summaryWidth was measured in
+
+-(NSString *)summaryLabel;                                      // The label drawn when collapsed, made again when label or tab count change
+
+@end
+
+
+
+@implementation BSTTabViewGroup
+
+-(instancetype)init {
+    
+    self = [super init];
+    if (self) {
+        _range = NSMakeRange(NSNotFound, 0);
+        _summaryWidth = -1.0;
+    }
+    return self;
+}
+
+
+-(void)setLabel:(NSString *)label {
+    
+    _label = [label copy];
+    summaryLabel = nil;
+}
+
+
+-(NSString *)summaryLabel {
+    
+    if (!summaryLabel || (summaryCount != self.range.length)) {
+        summaryCount = self.range.length;
+        summaryLabel = [NSString stringWithFormat:@"%@ (%lu)", (self.label ? self.label : @""), (unsigned long)summaryCount];
+        _summaryWidth = -1.0;  // Measured again
+    }
+    return summaryLabel;
+}
 
 @end
 
@@ -88,18 +627,35 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 @interface BSTTabViewTab : NSObject {
     
 @private
-    NSBezierPath *boundaryCurve;                                 // The precalualeted boundary shape of the tab
+    // There is one of these for every tab, all ivars including the property ones are declared here ordered by size so the instance packs into 104 bytes
+    __unsafe_unretained BSTTabView *_owner;
+    NSString *_tag;
+    NSString *_label;
+    BSTTabViewGroup *_group;
+    NSBezierPath *boundaryCurve;                                 // The shared boundary shape for the tab width, drawn translated to startX
     NSTrackingArea *trackingArea;                                // The currently assigned tracking area
-    BOOL rollover;                                               // flag indicating if the assigned tracvking area is currently rolled over (contains the mouse cursor)
+    CGFloat _coreWidth;
+    CGFloat _startX;
     CGFloat currentTabHt;                                        // The height the tab is currently drawn to
+    CGFloat labelWidth;                                          // The cached result of widthForLabelString, -1 if not measured
+    uint32_t _cachedIndex;
+    uint32_t pathGeneration;                                     // The owner pathTemplateGeneration boundaryCurve was taken in (truncated)
+    uint32_t labelWidthGeneration;                               // The owner labelWidthGeneration the cached labelWidth was measured in (truncated)
+    BOOL rollover;                                               // flag indicating if the assigned tracvking area is currently rolled over (contains the mouse cursor)
+    BOOL hasTypesetLabel;                                        // The owner may keep typeset label lines for this tab
+    BOOL trackingAreaAdded;                                      // trackingArea is added to the owner, a pooled tab keeps it aside for reuse
 }
 
 // Referencing properties
-@property (weak, nonatomic, readwrite) BSTTabView *owner;        // The referencing tabView
+@property (unsafe_unretained, nonatomic, readwrite) BSTTabView *owner;  // The referencing tabView, not weak as a weak reference costs a side table entry per tab. The owner clears it in its dealloc for tabs that outlive it
 
-// Data properties
+// Data properties, the owner hands in strings interned in its lookup maps so that tabs with equal labels or tags share one string
 @property (copy, nonatomic) NSString *tag;                       // The attached tag
 @property (copy,nonatomic) NSString *label;                      // The text label
+@property (nonatomic) BSTTabViewGroup *group;                    // The group the tab is in, nil if none
+
+// Position property
+@property (nonatomic) uint32_t cachedIndex;                      // Index in the owner tabs array, only trusted by the owner as far as it knows it is valid
 
 // Graphical properties
 @property (readonly, nonatomic) CGFloat coreWidth;             // The allocated width of the core part of the tab (between spacers)
@@ -109,18 +665,43 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 -(id)initWithOwner:(BSTTabView *)owner;                         // Initialiser
 
 -(CGFloat)widthForLabelString;                                  // The preferred width for the current label string rendered in the current text style
+-(NSString *)displayedLabel;                                    // The label drawn, the group summary if this is the first tab of a collapsed group
+-(CGFloat)cachedLabelWidth;                                     // The width widthForLabelString has cached for the current text style, -1 if none
+-(void)setCachedLabelWidth:(CGFloat)width;                      // Seed the cached width with a width measured earlier in the current text style
 
 -(void)setStartX:(CGFloat)startX width:(CGFloat)width;          // Method to set the geometric shape of the tab and recalulate the curve if needed
 
 // Drawing methods
 -(void)drawSelf:(BOOL)selected;                                 // Draw self - as selected if paramerter is YES
--(void)recreateBoundaryCurve;                                   // Recalualte the bezier path
+-(void)recreateBoundaryCurve;                                   // Pick up the shared bezier path and reset the tracking area
+-(NSRect)textRect;                                              // The label area relative to startX
 -(BOOL)xLocIsBeforeFirstHalfOfTab:(CGFloat)xLoc;                // Returns YES if the passed in location is before halfway (including all preceeding tabs) of this tab and NO if not - used for drag insert
+-(NSRect)boundingRect;                                          // The area drawn by the tab including the sloping edges in the spacers
+-(void)discardGeometry;                                         // Release path and tracking area when the tab is outside the visible band
+-(void)prepareForReuse;                                         // Reset to a new tab when going into the owner pool, the tracking area is only removed from the owner
 
 @end
 
 
 
+// Fill the boundary, draw the label and stroke the boundary, in tab coordinates where the core starts at x = 0. A typeset line is drawn instead of the label when given
+static void BSTDrawTab(NSBezierPath *path, NSString *label, id line, NSRect textRect, NSColor *fillColor, NSColor *borderColor, NSDictionary *txtAttr) {
+    
+    [fillColor set];
+    [path fill];
+    
+    if (!line) {
+        [label drawInRect:textRect withAttributes:txtAttr];
+    } else if (line != [NSNull null]) {  // NSNull when not even the ellipsis fits
+        BSTDrawTypesetLine(line, textRect);
+    }
+    
+    [borderColor set];
+    [path stroke];
+}
+
+
+
 @implementation BSTTabViewTab
 
 #pragma mark - lifetime methods
@@ -131,6 +712,7 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
     if (self) {
         _owner = owner;
         currentTabHt = -1;
+        labelWidth = -1.0;
     }
     return self;
 }
@@ -138,11 +720,18 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 
 -(void)dealloc {
     
-    if (trackingArea) {
+    if (trackingAreaAdded) {
+        BSTTabViewCounters *stats = [self.owner activeCounters];
+        if (stats) {
+            stats->trackingAreasRemoved++;
+        }
         [self.owner removeTrackingArea:trackingArea];
         rollover = NO;
         trackingArea = nil;
     }
+    if (hasTypesetLabel) {
+        [self.owner discardTypesetLabelForTab:self];
+    }
     // release iVars
     boundaryCurve = nil;
 }
@@ -150,26 +739,71 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 #pragma mark - custom accessors
 
 
+-(void)setLabel:(NSString *)label {
+    
+    if (label == _label) {  // The interned copy of the current label
+        return;
+    }
+    _label = [label copy];
+    labelWidth = -1.0;  // New label needs to be measured
+}
+
+
 
 #pragma mark - methods
 
-/// The width for the current label string rendered in the current font
+/// The width for the current label string rendered in the current font, measured once and then cached until label or text style change
 -(CGFloat)widthForLabelString{
     
+    if ((labelWidth >= 0.0) && (labelWidthGeneration == (uint32_t)self.owner.labelWidthGeneration)) {
+        self.owner.labelWidthCacheHits++;
+        return labelWidth;
+    }
+    
     CGFloat w = 0.0;
+    BOOL estimated = NO;
     if (self.label) {
-        NSSize size = [self.label sizeWithAttributes:self.owner.defaultTextOptions];
-        w = size.width + (BSTstdTextPadding * 2);
+        w = [self.owner measuredWidthForLabel:self.label estimated:&estimated] + (BSTstdTextPadding * 2);
+    }
+    if (estimated) {  // Not cached, asked again once the measured width has arrived
+        return (w < BSTminTabWidth ? BSTminTabWidth : w);
+    }
+    
+    labelWidth = (w < BSTminTabWidth ? BSTminTabWidth : w); // never less than min
+    labelWidthGeneration = (uint32_t)self.owner.labelWidthGeneration;
+    return labelWidth;
+}
+
+
+
+-(NSString *)displayedLabel {
+    
+    if (_group.collapsed && (_group.summaryTab == self)) {
+        return [_group summaryLabel];
     }
+    return _label;
+}
+
+
+
+-(CGFloat)cachedLabelWidth {
+    
+    return (((labelWidth >= 0.0) && (labelWidthGeneration == (uint32_t)self.owner.labelWidthGeneration)) ? labelWidth : -1.0);
+}
+
+
+
+-(void)setCachedLabelWidth:(CGFloat)width {
     
-    return (w < BSTminTabWidth ? BSTminTabWidth : w); // never less than min
+    labelWidth = width;
+    labelWidthGeneration = (uint32_t)self.owner.labelWidthGeneration;
 }
 
 
 
 -(void)setStartX:(CGFloat)startX width:(CGFloat)coreWidth {
     
-    if ((coreWidth == _coreWidth) && (startX == _startX) && (currentTabHt == self.owner.tabHeight)) {
+    if ((coreWidth == _coreWidth) && (startX == _startX) && (currentTabHt == self.owner.tabHeight) && (pathGeneration == (uint32_t)self.owner.pathTemplateGeneration)) {
         return;
     }
     
@@ -181,114 +815,201 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 
 
 
-/// Recreate the boundary path and set the tracking area
+/// Pick up the shared boundary path for the width and set the tracking area
 -(void)recreateBoundaryCurve {
     
-    NSBezierPath *path = [[NSBezierPath alloc] init];
-    [path setLineWidth:1.0];
-    NSPoint pt;
-    NSPoint cp1;
+    BSTTabViewCounters *stats = [self.owner activeCounters];
+    if (stats) {
+        stats->boundaryPathRebuilds++;
+    }
     
     currentTabHt = self.owner.tabHeight;
-    
-    pt.x = self.startX - self.owner.spacerWidth;
-    pt.y = 0.0;
-    [path moveToPoint:pt];
-    
-    pt.x = self.startX - self.owner.tabCornerRadius;
-    pt.y = 0.0 + currentTabHt - self.owner.tabCornerRadius;
-    [path lineToPoint:pt];
-    
-    pt.x = self.startX + self.owner.tabCornerRadius;
-    pt.y = 0.0 + currentTabHt;
-    
-    cp1.x = self.startX;
-    cp1.y = 0.0 + currentTabHt;
-    [path curveToPoint:pt controlPoint1:cp1 controlPoint2:cp1];
-    
-    pt.x = self.startX + self.coreWidth - self.owner.tabCornerRadius;
-    pt.y = 0.0 + currentTabHt;
-    [path lineToPoint:pt];
-    
-    pt.x = self.startX + self.coreWidth  + self.owner.tabCornerRadius;
-    pt.y = 0.0 + currentTabHt - self.owner.tabCornerRadius;
-    cp1.x = self.startX + self.coreWidth;
-    cp1.y = 0.0 + currentTabHt;
-    [path curveToPoint:pt controlPoint1:cp1 controlPoint2:cp1];
-    
-    pt.x = self.startX + self.coreWidth + self.owner.spacerWidth;
-    pt.y = 0.0;
-    [path lineToPoint:pt];
-    
-    boundaryCurve = path;
+    boundaryCurve = [self.owner boundaryPathForCoreWidth:self.coreWidth];
+    pathGeneration = (uint32_t)self.owner.pathTemplateGeneration;
     
     
    /* Set the tracking area */
-    if (trackingArea) {
+    if (trackingAreaAdded) {
         [self.owner removeTrackingArea:trackingArea];
+        trackingArea = nil;
+        trackingAreaAdded = NO;
         rollover = NO; // Remove rollover if TA changed
+        if (stats) {
+            stats->trackingAreasRemoved++;
+        }
+    }
+    if (!self.owner.singleTrackingAreaEnabled) {  // With a single tracking area the owner hit tests instead
+        NSRect rect = NSMakeRect(self.startX, 0.0, self.coreWidth, currentTabHt);
+        if (trackingArea && NSEqualRects([trackingArea rect], rect)) {  // Kept from before the tab was pooled, laid out in the same place
+            if (stats) {
+                stats->trackingAreasReused++;
+            }
+        } else {
+            trackingArea = [[NSTrackingArea alloc] initWithRect:rect options:(NSTrackingMouseEnteredAndExited | NSTrackingActiveInActiveApp)  owner:self userInfo:nil];
+        }
+        [self.owner addTrackingArea:trackingArea];
+        trackingAreaAdded = YES;
+        if (stats) {
+            stats->trackingAreasAdded++;
+        }
+    } else {
+        trackingArea = nil;
     }
-    NSRect rect = NSMakeRect(self.startX, 0.0, self.coreWidth, currentTabHt);
-    trackingArea = [[NSTrackingArea alloc] initWithRect:rect options:(NSTrackingMouseEnteredAndExited | NSTrackingActiveInActiveApp)  owner:self userInfo:nil];
-    [self.owner addTrackingArea:trackingArea];
 }
 
 
 -(void)drawSelf:(BOOL)selected {
     
+    NSUInteger state;
     NSColor *fillColor;
     NSColor *borderColor;
     NSDictionary *txtAttr;
     
     if (selected) {
+        state = 2;
         fillColor = self.owner.selectedFieldColor;
         borderColor = self.owner.selectedBorderColor;
         txtAttr = self.owner.selectedTextOptions;
         
     }
     else if (rollover && self.owner.rolloverEnabled)  {  // Rollover enabled, rollover actually always active just not shown by color change
+        state = 1;
         fillColor = self.owner.rolloverFieldColor;
         borderColor = self.owner.rolloverBorderColor;
         txtAttr = self.owner.rolloverTextOptions;
         
     }
     else {
+        state = 0;
         fillColor = self.owner.backgroundColor;
         borderColor = self.owner.borderColor;
         txtAttr = self.owner.defaultTextOptions;
     }
     
-    [fillColor set];
-    [boundaryCurve fill];
+    NSString *label = [self displayedLabel];
+    NSRect textRect = [self textRect];
+    id line = nil;
+    if (self.owner.typesetLabelCacheEnabled && label) {
+        line = [self.owner typesetLineForTab:self state:state attributes:txtAttr width:textRect.size.width];
+        hasTypesetLabel = YES;
+    }
     
-    // Make a rect for text, height as required for font if possible but never more than height of tab - 4 (2 top + 2 bottom margin)
-    NSRect textRect = NSMakeRect(self.startX + BSTstdTextPadding, BSTstdYTextOffset, self.coreWidth - BSTstdTextPadding, ((currentTabHt < (self.owner.preferredTextHeight-(2 * BSTstdYTextOffset))) ? (currentTabHt-(2 * BSTstdYTextOffset)) : self.owner.preferredTextHeight));
-    [self.label drawInRect:textRect withAttributes:txtAttr];
+    if (self.owner.tabImageCacheEnabled) {  // Blit a rendering of the tab, shared by all tabs with the same width, label and state
+        NSString *key = [NSString stringWithFormat:@"%lu %.2f %@", (unsigned long)state, self.coreWidth, label];
+        NSImage *image = [self.owner tabImageForKey:key];
+        if (!image) {
+            NSBezierPath *path = boundaryCurve;
+            CGFloat inset = self.owner.spacerWidth + 1.0;  // The image starts where boundingRect does
+            NSSize size = NSMakeSize(self.coreWidth + (2 * inset), currentTabHt + 1.0);
+            image = [NSImage imageWithSize:size flipped:[self.owner isFlipped] drawingHandler:^BOOL(NSRect dstRect) {
+                NSAffineTransform *shift = [NSAffineTransform transform];
+                [shift translateXBy:inset yBy:0.0];
+                [shift concat];
+                BSTDrawTab(path, label, line, textRect, fillColor, borderColor, txtAttr);
+                return YES;
+            }];
+            [self.owner setTabImage:image forKey:key];
+        }
+        [image drawInRect:[self boundingRect] fromRect:NSZeroRect operation:NSCompositeSourceOver fraction:1.0 respectFlipped:YES hints:nil];
+        return;
+    }
     
-    [borderColor set];
-    [boundaryCurve stroke];
+    // The path is shared between tabs of the same width so it is drawn translated to the tab position
+    NSAffineTransform *shift = [NSAffineTransform transform];
+    [shift translateXBy:self.startX yBy:0.0];
+    [NSGraphicsContext saveGraphicsState];
+    [shift concat];
+    BSTDrawTab(boundaryCurve, label, line, textRect, fillColor, borderColor, txtAttr);
+    [NSGraphicsContext restoreGraphicsState];
 }
 
-/*
- * This method is used by the dragging system to determine the current insert point.
- * It returns YES if the passed in xLoc is in front of the halfpoint of this tab.
- * half point is chosen because any point aft of teh half point goes behind this tab.
- */
--(BOOL)xLocIsBeforeFirstHalfOfTab:(CGFloat)xLoc{
+
+/// Make a rect for text, height as required for font if possible but never more than height of tab - 4 (2 top + 2 bottom margin)
+-(NSRect)textRect {
     
+    return NSMakeRect(BSTstdTextPadding, BSTstdYTextOffset, self.coreWidth - BSTstdTextPadding, ((currentTabHt < (self.owner.preferredTextHeight-(2 * BSTstdYTextOffset))) ? (currentTabHt-(2 * BSTstdYTextOffset)) : self.owner.preferredTextHeight));
+}
+
+/// Release path, tracking area and typeset label, the next setStartX:width: and drawSelf: recreate them
+-(void)discardGeometry {
     
-    if (xLoc > (self.startX + (self.coreWidth / 2)) ) {
-        return NO;
-    } else {
-        return YES;
+    if (trackingAreaAdded) {
+        BSTTabViewCounters *stats = [self.owner activeCounters];
+        if (stats) {
+            stats->trackingAreasRemoved++;
+        }
+        [self.owner removeTrackingArea:trackingArea];
+        trackingAreaAdded = NO;
+    }
+    trackingArea = nil;
+    rollover = NO;
+    boundaryCurve = nil;
+    currentTabHt = -1;
+    if (hasTypesetLabel) {
+        [self.owner discardTypesetLabelForTab:self];
+        hasTypesetLabel = NO;
     }
 }
 
 
-#pragma mark - Mouse Tracking methods (rollover)
+/// Forget label, tag, measurement and geometry so the tab is as new, the tracking area object is kept until the next layout
+-(void)prepareForReuse {
+    
+    if (trackingAreaAdded) {
+        BSTTabViewCounters *stats = [self.owner activeCounters];
+        if (stats) {
+            stats->trackingAreasRemoved++;
+        }
+        [self.owner removeTrackingArea:trackingArea];  // A pooled tab must not get mouse events
+        trackingAreaAdded = NO;
+    }
+    if (hasTypesetLabel) {
+        [self.owner discardTypesetLabelForTab:self];
+        hasTypesetLabel = NO;
+    }
+    _tag = nil;
+    _label = nil;
+    _group = nil;
+    boundaryCurve = nil;
+    _coreWidth = 0.0;
+    _startX = 0.0;
+    currentTabHt = -1;  // setStartX:width: lays it out even in the same place
+    labelWidth = -1.0;
+    _cachedIndex = 0;
+    pathGeneration = 0;
+    labelWidthGeneration = 0;
+    rollover = NO;
+}
+
+
+/// The area drawn by the tab, the sloping edges reach into the spacers on both sides and the stroke adds a little
+-(NSRect)boundingRect {
+    
+    CGFloat ht = ((currentTabHt < 0.0) ? self.owner.tabHeight : currentTabHt);
+    return NSMakeRect(self.startX - self.owner.spacerWidth - 1.0, 0.0, self.coreWidth + (2 * self.owner.spacerWidth) + 2.0, ht + 1.0);
+}
+
+/*
+ * This method is used by the dragging system to determine the current insert point.
+ * It returns YES if the passed in xLoc is in front of the halfpoint of this tab.
+ * half point is chosen because any point aft of teh half point goes behind this tab.
+ */
+-(BOOL)xLocIsBeforeFirstHalfOfTab:(CGFloat)xLoc{
+    
+    
+    if (xLoc > (self.startX + (self.coreWidth / 2)) ) {
+        return NO;
+    } else {
+        return YES;
+    }
+}
+
+
+#pragma mark - Mouse Tracking methods (rollover)
 
 -(void)mouseEntered:(NSEvent *)theEvent {
     
+    [self.owner traceTab:self entered:YES event:theEvent];
     rollover = YES;
     self.owner.currentRollover = self;
 }
@@ -297,6 +1018,7 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 
 -(void)mouseExited:(NSEvent *)theEvent {
 // unset if this is the currently set rollover, else ignore (somthing jumped)
+    [self.owner traceTab:self entered:NO event:theEvent];
     rollover = NO;
     if (self.owner.currentRollover == self) {
         self.owner.currentRollover = nil;
@@ -309,1349 +1031,4950 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 
 
 
-#pragma mark - <<<<<<<<<<<<<< MAIN CLASS >>>>>>>>>>>>>>>>>
+#pragma mark - <<<<<<<<<< DRAG PAYLOAD  >>>>>>>>>>>>>>
+
+/**
+ * The BSTTabViewDragPayload helper class carries the labels and tags of the tabs in one drag. Inside the application
+ * the destination takes it directly from the source control, only drags to other applications encode it on the pasteboard.
+ *
+ * The pasteboard data is little endian binary with no limits on index or label length:
+ * "BSTT", uint16 version, uint16 reserved (0), uint32 tab count, and then for each tab
+ * uint32 source index, uint32 label length, label UTF-8, uint32 tag length (0xFFFFFFFF for no tag), tag UTF-8
+ */
+@interface BSTTabViewDragPayload : NSObject
 
+@property (readonly, nonatomic) NSArray *labels;                 // The labels of the dragged tabs in tab order, NSNull for no label
+@property (readonly, nonatomic) NSArray *tags;                   // The tags of the dragged tabs, NSNull for no tag
+@property (readonly, nonatomic) NSIndexSet *sourceIndexes;       // The indexes of the dragged tabs in the source control
 
-@implementation BSTTabView
+-(instancetype)initWithLabels:(NSArray *)labels tags:(NSArray *)tags sourceIndexes:(NSIndexSet *)indexes;
+-(instancetype)initWithData:(NSData *)data;                      // Decode pasteboard data, nil if not a valid payload of a known version
+-(NSData *)data;                                                 // Encode for the pasteboard
 
-#pragma mark - lifetime methods
+@end
 
 
 
+static uint32_t const BSTDragPayloadNoTag = 0xFFFFFFFF;
 
--(id)initWithFrame:(NSRect)frameRect{
-    
-    self = [super initWithFrame:frameRect];
+static void BSTAppendUInt32(NSMutableData *data, uint32_t value) {
     
-    if (self) {
-        [self setupDefaults];
-    }
-    return self;
+    uint32_t le = NSSwapHostIntToLittle(value);
+    [data appendBytes:&le length:sizeof(le)];
 }
 
-
-
--(void)setupDefaults {
+static void BSTAppendString(NSMutableData *data, NSString *string) {
     
-    if (_tabs) {  // already initailised
+    if (!string) {
+        BSTAppendUInt32(data, BSTDragPayloadNoTag);
         return;
     }
-    
-    _tabs = [[NSMutableArray alloc]initWithCapacity:5];   // Create the property
-    _selectedTab = -1;  // No selected tab
-    labelEditor = nil; // No editor active
-    
-    _lastClickedTab = -1;
-    _clickCount = 1;
-
-    
-    _delegate =nil;
-    
-    _topEdgeAligned = YES;
-    _rolloverEnabled = YES;
-    _doubleClickEditEnabled = NO;
-    _userTabDraggingEnabled = BSTTabViewDragNone;
-    
-    _spacerWidth = 5.0;
-    _tabHeight = ((self.bounds.size.height > BSTsmallTabHeightThreshold) ? (self.bounds.size.height -5.0) : self.bounds.size.height-2.0);
-    _tabCornerRadius = 1.0;
-
-    style = [[NSParagraphStyle defaultParagraphStyle] mutableCopy];
-    [style setLineBreakMode:NSLineBreakByTruncatingMiddle];
-    [style setAlignment:NSCenterTextAlignment];
-    
-    _textFont = [NSFont systemFontOfSize:[NSFont smallSystemFontSize]];
-    
-    _backgroundColor = [NSColor windowFrameColor];
-    _borderColor = [NSColor gridColor];
-    _defaultTextOptions = @{NSFontAttributeName            : _textFont ,
-                            NSForegroundColorAttributeName : _borderColor ,
-                            NSParagraphStyleAttributeName  : style};
-    
-    _selectedFieldColor = [NSColor highlightColor];
-    _selectedBorderColor = _selectedFieldColor;
-    _selectedTextOptions = @{NSFontAttributeName            : _textFont  ,
-                             NSForegroundColorAttributeName : [NSColor controlShadowColor],
-                             NSParagraphStyleAttributeName  : style};
+    NSData *utf8 = [string dataUsingEncoding:NSUTF8StringEncoding];
+    BSTAppendUInt32(data, (uint32_t)utf8.length);
+    [data appendData:utf8];
+}
 
+static BOOL BSTReadUInt32(const uint8_t *bytes, NSUInteger length, NSUInteger *pos, uint32_t *value) {
     
-    _rolloverFieldColor = [NSColor controlHighlightColor];
-    _rolloverBorderColor = _rolloverFieldColor;
-    _rolloverTextOptions = @{NSFontAttributeName            : _textFont ,
-                             NSForegroundColorAttributeName : [NSColor controlShadowColor] ,
-                             NSParagraphStyleAttributeName  : style};
+    if (length - *pos < sizeof(uint32_t)) {
+        return NO;
+    }
+    uint32_t le;
+    memcpy(&le, bytes + *pos, sizeof(le));
+    *value = NSSwapLittleIntToHost(le);
+    *pos += sizeof(le);
+    return YES;
+}
 
+// Reads a length prefixed string, *string is set to nil for the no tag marker
+static BOOL BSTReadString(const uint8_t *bytes, NSUInteger length, NSUInteger *pos, NSString **string) {
     
-    _editingColor = [NSColor blackColor];
-    
-    NSSize size = [@"Dummy|" sizeWithAttributes:_defaultTextOptions];
-    _preferredTextHeight = size.height;
-    
-    currentWidth = self.bounds.size.width;
-    currentHeight = self.bounds.size.height;
-    
-    dragImage = [self createDragImage];
-    dragSourceTab = nil;
-    validDragInDest = NO;
-    [self registerForDraggedTypes:[NSArray arrayWithObject:NSStringPboardType]];
-
-    _LayoutIsInvalid = YES;
+    uint32_t len;
+    if (!BSTReadUInt32(bytes, length, pos, &len)) {
+        return NO;
+    }
+    if (len == BSTDragPayloadNoTag) {
+        *string = nil;
+        return YES;
+    }
+    if (length - *pos < len) {
+        return NO;
+    }
+    *string = [[NSString alloc] initWithBytes:(bytes + *pos) length:len encoding:NSUTF8StringEncoding];
+    *pos += len;
+    return (*string != nil);
 }
 
-
-
-
--(void)dealloc {
+static void BSTAppendFloat64(NSMutableData *data, double value) {
     
-    [self.tabs removeAllObjects];
+    NSSwappedDouble le = NSSwapHostDoubleToLittle(value);
+    [data appendBytes:&le length:sizeof(le)];
 }
 
-
-
-
-#pragma mark - setters and getters
-
-
-
--(NSUInteger)count {
-    return self.tabs.count;
+static BOOL BSTReadFloat64(const uint8_t *bytes, NSUInteger length, NSUInteger *pos, double *value) {
+    
+    if (length - *pos < sizeof(NSSwappedDouble)) {
+        return NO;
+    }
+    NSSwappedDouble le;
+    memcpy(&le, bytes + *pos, sizeof(le));
+    *value = NSSwapLittleDoubleToHost(le);
+    *pos += sizeof(le);
+    return YES;
 }
 
 
 
+@implementation BSTTabViewDragPayload
 
--(void)setTopEdgeAligned:(BOOL)topEdgeAligned {
-
+-(instancetype)initWithLabels:(NSArray *)labels tags:(NSArray *)tags sourceIndexes:(NSIndexSet *)indexes {
     
-    if (topEdgeAligned == _topEdgeAligned) {
-        return;  // No change
+    self = [super init];
+    if (self) {
+        _labels = [labels copy];
+        _tags = [tags copy];
+        _sourceIndexes = [indexes copy];
     }
-    
-    _topEdgeAligned = topEdgeAligned;
-
-    [self setNeedsDisplay:YES];
+    return self;
 }
 
 
-
--(void)setSpacerWidth:(CGFloat)spacerWidth {
+-(instancetype)initWithData:(NSData *)data {
     
-    if (spacerWidth == _spacerWidth) {
-        return;  // No change
+    const uint8_t *bytes = data.bytes;
+    NSUInteger length = data.length;
+    NSUInteger pos = 8;
+    
+    if ((length < 12) || (memcmp(bytes, "BSTT", 4) != 0)) {
+        return nil;
+    }
+    uint16_t version;
+    memcpy(&version, bytes + 4, sizeof(version));
+    if (NSSwapLittleShortToHost(version) != BSTDragPayloadVersion) {  // Unknown version, could be a newer format
+        return nil;
     }
     
-    if (self.tabCornerRadius > spacerWidth) {  // Reset corener radius if too big
-        _tabCornerRadius = spacerWidth;
+    uint32_t count;
+    if (!BSTReadUInt32(bytes, length, &pos, &count) || (count > (length - pos) / 12)) {  // Each tab needs at least 12 bytes
+        return nil;
     }
     
-    _spacerWidth = spacerWidth;
+    NSMutableArray *labels = [[NSMutableArray alloc] initWithCapacity:count];
+    NSMutableArray *tags = [[NSMutableArray alloc] initWithCapacity:count];
+    NSMutableIndexSet *indexes = [[NSMutableIndexSet alloc] init];
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index;
+        NSString *label;
+        NSString *tag;
+        if (!BSTReadUInt32(bytes, length, &pos, &index) || !BSTReadString(bytes, length, &pos, &label) || !BSTReadString(bytes, length, &pos, &tag)) {
+            return nil;
+        }
+        if ((indexes.count > 0) && (index <= indexes.lastIndex)) {  // Tabs are stored in source order
+            return nil;
+        }
+        [indexes addIndex:index];
+        [labels addObject:(label ? label : [NSNull null])];
+        [tags addObject:(tag ? tag : [NSNull null])];
+    }
     
-    [self setNeedsDisplay:YES];
+    return [self initWithLabels:labels tags:tags sourceIndexes:indexes];
 }
 
 
--(void)setMaxTabHeight:(CGFloat)tabHeight {
+-(NSData *)data {
     
-    if (tabHeight == _maxTabHeight) {
-        return;  // No change
-    }
-    _maxTabHeight = tabHeight;
-    self.tabHeight = tabHeight;  // Set the actual tab height
+    NSMutableData *data = [[NSMutableData alloc] init];
+    uint16_t header[2] = { NSSwapHostShortToLittle(BSTDragPayloadVersion), 0 };
+    [data appendBytes:"BSTT" length:4];
+    [data appendBytes:header length:sizeof(header)];
+    BSTAppendUInt32(data, (uint32_t)self.labels.count);
     
-    [self setNeedsDisplay:YES];
+    __block NSUInteger i = 0;
+    [self.sourceIndexes enumerateIndexesUsingBlock:^(NSUInteger index, BOOL *stop) {
+        id label = [self.labels objectAtIndex:i];
+        id tag = [self.tags objectAtIndex:i];
+        BSTAppendUInt32(data, (uint32_t)index);
+        BSTAppendString(data, (label == [NSNull null] ? nil : label));  // No label is written as the no tag length
+        BSTAppendString(data, (tag == [NSNull null] ? nil : tag));
+        i++;
+    }];
+    
+    return data;
 }
 
+@end
 
 
--(void)setTabHeight:(CGFloat)tabHeight {
-    
-    // Called from the draw routine so must not do setNeedsDisplay:YES here. All other callers to this method should do so.
-    // Not the user facing method is setMaxtabHeight:
-    
-    CGFloat newHt = (tabHeight > self.bounds.size.height ? self.bounds.size.height : tabHeight);
-    if (newHt == _tabHeight) {  // no change
-        return;
-    }
-    _tabHeight = newHt;
-    
-    self.LayoutIsInvalid = YES;
-}
 
 
 
--(void)setTabCornerRadius:(CGFloat)tabCornerRadius {
-    
-    if (tabCornerRadius == _tabCornerRadius) {
-        return;  // No change
-    }
-    
-    CGFloat r = (tabCornerRadius < 0.0 ? 0.0 : tabCornerRadius);
-    if (r > self.spacerWidth) {
-        r = self.spacerWidth;
-    }
-    _tabCornerRadius = r;
-    
-    self.LayoutIsInvalid = YES;
-    [self setNeedsDisplay:YES];
-}
+#pragma mark - <<<<<<<<<< STATISTICS  >>>>>>>>>>>>>>
 
+@interface BSTTabViewStatistics ()
 
--(void)setBackgroundColor:(NSColor *)backgroundColor {
-    
-    if ([backgroundColor isEqual: _backgroundColor]) {
-        return;  // No change
-    }
-    
-    _backgroundColor = backgroundColor;
-    
-    [self setNeedsDisplay:YES];
-}
+-(instancetype)initWithCounters:(const BSTTabViewCounters *)counters labelWidthRequests:(NSUInteger)requests labelMeasurements:(NSUInteger)measurements tabsLaidOut:(NSUInteger)laidOut tabsDrawn:(NSUInteger)drawn pooledTabs:(NSUInteger)pooled;
 
+@end
 
--(void)setBorderColor:(NSColor *)borderColor {
+
+
+@implementation BSTTabViewStatistics
+
+-(instancetype)initWithCounters:(const BSTTabViewCounters *)counters labelWidthRequests:(NSUInteger)requests labelMeasurements:(NSUInteger)measurements tabsLaidOut:(NSUInteger)laidOut tabsDrawn:(NSUInteger)drawn pooledTabs:(NSUInteger)pooled {
     
-    if ([borderColor isEqual: _borderColor]) {
-        return;  // No change
+    self = [super init];
+    if (self) {
+        _layoutPasses = counters->layoutPasses;
+        _incrementalLayoutPasses = counters->incrementalLayoutPasses;
+        _compressedLayoutPasses = counters->compressedLayoutPasses;
+        _tabsLaidOut = laidOut;
+        _layoutTime = counters->layoutTime;
+        _maxLayoutTime = counters->maxLayoutTime;
+        _labelWidthRequests = requests;
+        _labelMeasurements = measurements;
+        _boundaryPathRebuilds = counters->boundaryPathRebuilds;
+        _trackingAreasAdded = counters->trackingAreasAdded;
+        _trackingAreasRemoved = counters->trackingAreasRemoved;
+        _drawCalls = counters->drawCalls;
+        _tabsDrawn = drawn;
+        _drawTime = counters->drawTime;
+        _maxDrawTime = counters->maxDrawTime;
+        _delegateCallbacks = counters->delegateCallbacks;
+        _dragPayloadDecodes = counters->dragPayloadDecodes;
+        _tabsAllocated = counters->tabsAllocated;
+        _tabsReused = counters->tabsReused;
+        _trackingAreasReused = counters->trackingAreasReused;
+        _pooledTabs = pooled;
     }
-    
-    _borderColor = borderColor;
-    
-    [self setNeedsDisplay:YES];
+    return self;
 }
 
 
--(NSColor *)textColor{
+-(NSString *)description {
     
-    return [self.defaultTextOptions valueForKey:NSForegroundColorAttributeName];
+    return [NSString stringWithFormat:@"<%@ layout %lu (%lu incremental, %lu compressed) %.3f ms max %.3f ms, %lu tabs laid out, labels %lu/%lu measured, paths %lu, tracking areas +%lu -%lu, draw %lu (%lu tabs) %.3f ms max %.3f ms, delegate %lu, payload decodes %lu, tabs %lu allocated %lu reused %lu pooled, tracking areas %lu reused>",
+            [self class],
+            (unsigned long)self.layoutPasses, (unsigned long)self.incrementalLayoutPasses, (unsigned long)self.compressedLayoutPasses,
+            self.layoutTime * 1000.0, self.maxLayoutTime * 1000.0, (unsigned long)self.tabsLaidOut,
+            (unsigned long)self.labelMeasurements, (unsigned long)self.labelWidthRequests, (unsigned long)self.boundaryPathRebuilds,
+            (unsigned long)self.trackingAreasAdded, (unsigned long)self.trackingAreasRemoved,
+            (unsigned long)self.drawCalls, (unsigned long)self.tabsDrawn, self.drawTime * 1000.0, self.maxDrawTime * 1000.0,
+            (unsigned long)self.delegateCallbacks, (unsigned long)self.dragPayloadDecodes,
+            (unsigned long)self.tabsAllocated, (unsigned long)self.tabsReused, (unsigned long)self.pooledTabs, (unsigned long)self.trackingAreasReused];
 }
 
+@end
 
--(void)setTextColor:(NSColor *)textColor {
-    
-    if ([textColor isEqual: self.textColor]) {
-        return;  // No change
-    }
-    
-    NSDictionary *dict = @{NSFontAttributeName             :[self.defaultTextOptions valueForKey:NSFontAttributeName],
-                           NSForegroundColorAttributeName  :textColor,
-                           NSParagraphStyleAttributeName   :[self.defaultTextOptions valueForKey:NSParagraphStyleAttributeName]
-                           };
-    self.defaultTextOptions = dict;
-    [self setNeedsDisplay:YES];
-}
 
 
 
--(void)setSelectedFieldColor:(NSColor *)selectedFieldColor {
-    
-    if ([selectedFieldColor isEqual: _selectedFieldColor]) {
-        return;  // No change
-    }
-    
-    _selectedFieldColor = selectedFieldColor;
-    dragImage = [self createDragImage];  // Recreate the drag image in new color scheme
 
-    
-    [self setNeedsDisplay:YES];
-}
+#pragma mark - <<<<<<<<<< THEME  >>>>>>>>>>>>>>
 
+/*
+ * A theme is built once and then only read, except for the caches that fill up on first use: the drag image, the
+ * estimated character width and the label widths measured in the theme font. Those are only touched on the main
+ * thread like the views that share the theme.
+ */
 
--(void)setSelectedBorderColor:(NSColor *)selectedBorderColor {
-    
-    if ([selectedBorderColor isEqual: _selectedBorderColor]) {
-        return;  // No change
-    }
+@interface BSTTabViewTheme () {
     
-    _selectedBorderColor = selectedBorderColor;
-    dragImage = [self createDragImage]; // Recreate the drag image in new color scheme
-    
-    [self setNeedsDisplay:YES];
+@private
+    NSImage*                             dragImage;                // Created on first drag
 }
 
+// Writable here so the mutable subclass can use the same storage
+@property (readwrite, nonatomic) NSColor *backgroundColor;
+@property (readwrite, nonatomic) NSColor *borderColor;
+@property (readwrite, nonatomic) NSColor *textColor;
+@property (readwrite, nonatomic) NSColor *selectedFieldColor;
+@property (readwrite, nonatomic) NSColor *selectedBorderColor;
+@property (readwrite, nonatomic) NSColor *selectedTextColor;
+@property (readwrite, nonatomic) NSColor *rolloverFieldColor;
+@property (readwrite, nonatomic) NSColor *rolloverBorderColor;
+@property (readwrite, nonatomic) NSColor *rolloverTextColor;
+@property (readwrite, nonatomic) NSColor *editingColor;
+@property (readwrite, nonatomic) NSFont *font;
+@property (readwrite, nonatomic) CGFloat spacerWidth;
+@property (readwrite, nonatomic) CGFloat tabCornerRadius;
+@property (readwrite, nonatomic) CGFloat maxTabHeight;
+
+// Derived once in the immutable theme, nil or 0 in a mutable one
+@property (readonly, nonatomic) NSDictionary *defaultTextOptions;              // Text attributes of non selected tabs
+@property (readonly, nonatomic) NSDictionary *selectedTextOptions;             // Text attributes of the selected tab
+@property (readonly, nonatomic) NSDictionary *rolloverTextOptions;             // Text attributes of the rollover tab
+@property (readonly, nonatomic) CGFloat preferredTextHeight;                   // Line height of the font
+@property (readonly, nonatomic) NSMutableDictionary *labelWidthCache;          // Label widths measured in the font, shared by all views using the theme
+@property (nonatomic) CGFloat estimatedCharacterWidth;                         // Average character width of the font, 0 if not calculated
+
+-(instancetype)initWithTheme:(BSTTabViewTheme *)theme;                          // A theme with the same colors, font and metrics
+-(void)prepareDerivedValues;                                                    // Limit the metrics and build the text attributes
+-(NSImage *)dragImage;                                                          // The drag pointer image in the selected colors
+
+@end
 
 
--(NSColor *)selectedTextColor{
+
+@implementation BSTTabViewTheme
+
++(BSTTabViewTheme *)defaultTheme {
     
-    return [self.selectedTextOptions valueForKey:NSForegroundColorAttributeName];
+    static BSTTabViewTheme *theme;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        theme = [[BSTTabViewTheme alloc] init];
+    });
+    return theme;
 }
 
 
--(void)setSelectedTextColor:(NSColor *)selectedTextColor {
+
+-(instancetype)init {
     
-    if ([selectedTextColor isEqual: self.selectedTextColor]) {
-        return;  // No change
+    self = [super init];
+    if (self) {
+        _backgroundColor = [NSColor windowFrameColor];
+        _borderColor = [NSColor gridColor];
+        _textColor = _borderColor;
+        _selectedFieldColor = [NSColor highlightColor];
+        _selectedBorderColor = _selectedFieldColor;
+        _selectedTextColor = [NSColor controlShadowColor];
+        _rolloverFieldColor = [NSColor controlHighlightColor];
+        _rolloverBorderColor = _rolloverFieldColor;
+        _rolloverTextColor = [NSColor controlShadowColor];
+        _editingColor = [NSColor blackColor];
+        _font = [NSFont systemFontOfSize:[NSFont smallSystemFontSize]];
+        _spacerWidth = 5.0;
+        _tabCornerRadius = 1.0;
+        _maxTabHeight = 0.0;
+        [self prepareDerivedValues];
     }
-    
-    NSDictionary *dict = @{NSFontAttributeName             :[self.selectedTextOptions valueForKey:NSFontAttributeName],
-                           NSForegroundColorAttributeName  :selectedTextColor ,
-                           NSParagraphStyleAttributeName   :[self.selectedTextOptions valueForKey:NSParagraphStyleAttributeName]
-                           };
-    self.selectedTextOptions = dict;
-    [self setNeedsDisplay:YES];
+    return self;
 }
 
 
 
--(void)setRolloverFieldColor:(NSColor *)rolloverFieldColor {
+-(instancetype)initWithTheme:(BSTTabViewTheme *)theme {
     
-    if ([rolloverFieldColor  isEqual: _rolloverFieldColor ]) {
-        return;  // No change
+    self = [super init];
+    if (self) {
+        _backgroundColor = theme.backgroundColor;
+        _borderColor = theme.borderColor;
+        _textColor = theme.textColor;
+        _selectedFieldColor = theme.selectedFieldColor;
+        _selectedBorderColor = theme.selectedBorderColor;
+        _selectedTextColor = theme.selectedTextColor;
+        _rolloverFieldColor = theme.rolloverFieldColor;
+        _rolloverBorderColor = theme.rolloverBorderColor;
+        _rolloverTextColor = theme.rolloverTextColor;
+        _editingColor = theme.editingColor;
+        _font = theme.font;
+        _spacerWidth = theme.spacerWidth;
+        _tabCornerRadius = theme.tabCornerRadius;
+        _maxTabHeight = theme.maxTabHeight;
+        [self prepareDerivedValues];
     }
-    
-    _rolloverFieldColor  = rolloverFieldColor;
-    
-    [self setNeedsDisplay:YES];
+    return self;
 }
 
 
--(void)setRolloverBorderColor:(NSColor *)rolloverBorderColor{
+
+-(void)prepareDerivedValues {
     
-    if ([rolloverBorderColor isEqual: _rolloverBorderColor]) {
-        return;  // No change
+    if (!_font) {
+        _font = [NSFont systemFontOfSize:[NSFont smallSystemFontSize]];
+    }
+    if (_tabCornerRadius > _spacerWidth) {  // Never rounder than the spacer
+        _tabCornerRadius = _spacerWidth;
+    }
+    if (_tabCornerRadius < 0.0) {
+        _tabCornerRadius = 0.0;
     }
     
-    _rolloverBorderColor = rolloverBorderColor;
+    NSMutableParagraphStyle *style = [[NSParagraphStyle defaultParagraphStyle] mutableCopy];
+    [style setLineBreakMode:NSLineBreakByTruncatingMiddle];
+    [style setAlignment:NSCenterTextAlignment];
     
-    [self setNeedsDisplay:YES];
+    _defaultTextOptions = @{NSFontAttributeName            : _font ,
+                            NSForegroundColorAttributeName : _textColor ,
+                            NSParagraphStyleAttributeName  : style};
+    _selectedTextOptions = @{NSFontAttributeName            : _font ,
+                             NSForegroundColorAttributeName : _selectedTextColor ,
+                             NSParagraphStyleAttributeName  : style};
+    _rolloverTextOptions = @{NSFontAttributeName            : _font ,
+                             NSForegroundColorAttributeName : _rolloverTextColor ,
+                             NSParagraphStyleAttributeName  : style};
+    
+    _preferredTextHeight = [@"Dummy|" sizeWithAttributes:_defaultTextOptions].height;
+    _labelWidthCache = [[NSMutableDictionary alloc] init];
+    _estimatedCharacterWidth = 0.0;
 }
 
--(NSColor *)rolloverTextColor{
+
+
+-(id)copyWithZone:(NSZone *)zone {
     
-    return [self.rolloverTextOptions valueForKey:NSForegroundColorAttributeName];
+    return self;  // Immutable
 }
 
 
--(void)setRolloverTextColor:(NSColor *)rolloverTextColor {
-    
-    if ([rolloverTextColor isEqual: self.rolloverTextColor]) {
-        return;  // No change
-    }
+
+-(id)mutableCopyWithZone:(NSZone *)zone {
     
-    NSDictionary *dict = @{NSFontAttributeName             :[self.rolloverTextOptions valueForKey:NSFontAttributeName],
-                           NSForegroundColorAttributeName  :rolloverTextColor ,
-                           NSParagraphStyleAttributeName   :[self.rolloverTextOptions valueForKey:NSParagraphStyleAttributeName]
-                        };
-    self.rolloverTextOptions = dict;
-    [self setNeedsDisplay:YES];
+    return [[BSTMutableTabViewTheme alloc] initWithTheme:self];
 }
 
 
 
-
--(void)setSelectedTab:(NSInteger)selectedTab {
+-(NSImage *)dragImage {
     
-    if ((selectedTab > ((NSInteger)self.tabs.count -1)) || (selectedTab < -1)) {
-        return;  // Abort on illegal input
+    if (dragImage) {
+        return dragImage;
     }
-
+    
+    NSSize siz = NSMakeSize(20, 7);
+    NSImage *img = [[NSImage alloc]initWithSize:siz];
+    
+    
+    NSBezierPath *path = [[NSBezierPath alloc] init];
+    [path setLineWidth:1.0];
+    NSPoint pt;
+    
+    CGFloat spcr = 3.0;
+    
+    pt.x = 0.0;
+    pt.y = 0.0;
+    [path moveToPoint:pt];
+    
+    pt.x = spcr;
+    pt.y = siz.height;
+    [path lineToPoint:pt];
+    
+    pt.x = siz.width - spcr;
+    pt.y = siz.height;
+    [path lineToPoint:pt];
+    
+    pt.x = siz.width;
+    pt.y = 0.0;
+    [path lineToPoint:pt];
+    
+    // drawing code
+    [img lockFocus];
+    [self.selectedFieldColor set];
+    [path fill];
+    
+    [self.selectedBorderColor set];
+    [path stroke];
+    [img unlockFocus];
+    
+    dragImage = img;
+    return dragImage;
+}
+
+@end
+
+
+
+@implementation BSTMutableTabViewTheme
+
+@dynamic backgroundColor, borderColor, textColor, selectedFieldColor, selectedBorderColor, selectedTextColor;
+@dynamic rolloverFieldColor, rolloverBorderColor, rolloverTextColor, editingColor, font, spacerWidth, tabCornerRadius, maxTabHeight;
+
+
+-(void)prepareDerivedValues {
+    
+    // Derived when copied to an immutable theme
+}
+
+
+
+-(id)copyWithZone:(NSZone *)zone {
+    
+    return [[BSTTabViewTheme alloc] initWithTheme:self];
+}
+
+@end
+
+
+
+
+
+#pragma mark - <<<<<<<<<< TRACE  >>>>>>>>>>>>>>
+
+/*
+ * The recorded trace is little endian binary, reusing the drag payload encoding of numbers and strings:
+ * "BSTR", uint16 version, uint16 reserved (0), float64 width, float64 height, uint32 option bits (BSTTraceOption),
+ * uint32 userTabDraggingEnabled, float64 scroll offset, data saved tab state (see tabStateData), and then each event as
+ * uint8 event kind, uint32 microseconds since the previous event and the fields of the kind (see BSTTraceEventKind).
+ * Points are float32 view coordinates, data is uint32 length (0xFFFFFFFF for none) and bytes, an index set is
+ * uint32 range count and uint32 location, uint32 length of each range.
+ */
+typedef NS_OPTIONS(uint32_t, BSTTraceOption) {
+    BSTTraceOptionTopEdgeAligned        = 1 << 0,
+    BSTTraceOptionRollover              = 1 << 1,
+    BSTTraceOptionSingleTrackingArea    = 1 << 2,
+    BSTTraceOptionTabImageCache         = 1 << 3,
+    BSTTraceOptionTypesetLabelCache     = 1 << 4,
+    BSTTraceOptionScrolling             = 1 << 5,
+    BSTTraceOptionDoubleClickEdit       = 1 << 6
+};
+
+// The sources of a recorded drag
+typedef NS_ENUM(uint8_t, BSTTraceDragSource) {
+    BSTTraceDragSourceOtherApplication,                  // No source object, the payload is recorded from the pasteboard
+    BSTTraceDragSourceSelf,                              // The recorded view
+    BSTTraceDragSourceOtherTabView,                      // Another BSTTabView, its payload and userTabDraggingEnabled are recorded
+    BSTTraceDragSourceOther                              // Any other object, never accepted
+};
+
+
+static void BSTAppendUInt8(NSMutableData *data, uint8_t value) {
+    
+    [data appendBytes:&value length:sizeof(value)];
+}
+
+static BOOL BSTReadUInt8(const uint8_t *bytes, NSUInteger length, NSUInteger *pos, uint8_t *value) {
+    
+    if (length - *pos < sizeof(uint8_t)) {
+        return NO;
+    }
+    *value = bytes[*pos];
+    *pos += sizeof(uint8_t);
+    return YES;
+}
+
+static void BSTAppendPoint(NSMutableData *data, NSPoint point) {
+    
+    NSSwappedFloat le[2] = { NSSwapHostFloatToLittle((float)point.x), NSSwapHostFloatToLittle((float)point.y) };
+    [data appendBytes:le length:sizeof(le)];
+}
+
+static BOOL BSTReadPoint(const uint8_t *bytes, NSUInteger length, NSUInteger *pos, NSPoint *point) {
+    
+    NSSwappedFloat le[2];
+    if (length - *pos < sizeof(le)) {
+        return NO;
+    }
+    memcpy(le, bytes + *pos, sizeof(le));
+    *point = NSMakePoint(NSSwapLittleFloatToHost(le[0]), NSSwapLittleFloatToHost(le[1]));
+    *pos += sizeof(le);
+    return YES;
+}
+
+static void BSTAppendData(NSMutableData *data, NSData *value) {
+    
+    if (!value) {
+        BSTAppendUInt32(data, BSTDragPayloadNoTag);
+        return;
+    }
+    BSTAppendUInt32(data, (uint32_t)value.length);
+    [data appendData:value];
+}
+
+// Reads length prefixed data, *value is set to nil for the none marker
+static BOOL BSTReadData(const uint8_t *bytes, NSUInteger length, NSUInteger *pos, NSData **value) {
+    
+    uint32_t len;
+    if (!BSTReadUInt32(bytes, length, pos, &len)) {
+        return NO;
+    }
+    if (len == BSTDragPayloadNoTag) {
+        *value = nil;
+        return YES;
+    }
+    if (length - *pos < len) {
+        return NO;
+    }
+    *value = [NSData dataWithBytes:(bytes + *pos) length:len];
+    *pos += len;
+    return YES;
+}
+
+static void BSTAppendIndexSet(NSMutableData *data, NSIndexSet *indexes) {
+    
+    __block uint32_t ranges = 0;
+    [indexes enumerateRangesUsingBlock:^(NSRange range, BOOL *stop) {
+        ranges++;
+    }];
+    BSTAppendUInt32(data, ranges);
+    [indexes enumerateRangesUsingBlock:^(NSRange range, BOOL *stop) {
+        BSTAppendUInt32(data, (uint32_t)range.location);
+        BSTAppendUInt32(data, (uint32_t)range.length);
+    }];
+}
+
+static BOOL BSTReadIndexSet(const uint8_t *bytes, NSUInteger length, NSUInteger *pos, NSIndexSet **indexes) {
+    
+    uint32_t ranges;
+    if (!BSTReadUInt32(bytes, length, pos, &ranges) || (ranges > (length - *pos) / 8)) {  // Each range needs 8 bytes
+        return NO;
+    }
+    NSMutableIndexSet *result = [[NSMutableIndexSet alloc] init];
+    for (uint32_t i = 0; i < ranges; i++) {
+        uint32_t location;
+        uint32_t rangeLength;
+        if (!BSTReadUInt32(bytes, length, pos, &location) || !BSTReadUInt32(bytes, length, pos, &rangeLength)) {
+            return NO;
+        }
+        [result addIndexesInRange:NSMakeRange(location, rangeLength)];
+    }
+    *indexes = result;
+    return YES;
+}
+
+// Indexes past the end of the tabs mean the end, which the clamped value still does
+static uint32_t BSTTraceIndex(NSUInteger index) {
+    
+    return ((index > UINT32_MAX) ? UINT32_MAX : (uint32_t)index);
+}
+
+
+
+@interface BSTTabViewTraceEvent ()
+
+-(instancetype)initWithName:(NSString *)name time:(NSTimeInterval)time latency:(NSTimeInterval)latency;
+
+@end
+
+
+
+@implementation BSTTabViewTraceEvent
+
+-(instancetype)initWithName:(NSString *)name time:(NSTimeInterval)time latency:(NSTimeInterval)latency {
+    
+    self = [super init];
+    if (self) {
+        _name = name;
+        _time = time;
+        _latency = latency;
+    }
+    return self;
+}
+
+
+-(NSString *)description {
+    
+    return [NSString stringWithFormat:@"<%@ %@ at %.6f s, %.3f ms>", [self class], self.name, self.time, self.latency * 1000.0];
+}
+
+@end
+
+
+
+/**
+ * The BSTTabViewTraceDraggingInfo helper class stands in for the NSDraggingInfo of a recorded drag on replay. It only
+ * answers what the dragging destination methods of BSTTabView ask for, and is its own pasteboard for a payload
+ * recorded from another application.
+ */
+@interface BSTTabViewTraceDraggingInfo : NSObject
+
+@property (weak, nonatomic) NSView *view;                        // The replaying view, locations are converted from it
+@property (nonatomic) NSPoint location;                          // The dragging location in view coordinates
+@property (strong, nonatomic) id source;                         // The dragging source, nil for another application
+@property (nonatomic) NSDragOperation sourceOperationMask;       // The operations the source allows
+@property (nonatomic) NSInteger sequenceNumber;                  // The recorded dragging sequence number
+@property (strong, nonatomic) NSData *payloadData;               // The recorded pasteboard payload, nil if none
+
+-(NSPoint)draggingLocation;
+-(id)draggingSource;
+-(NSDragOperation)draggingSourceOperationMask;
+-(NSInteger)draggingSequenceNumber;
+-(id)draggingPasteboard;
+-(NSData *)dataForType:(NSString *)type;
+
+@end
+
+
+
+@implementation BSTTabViewTraceDraggingInfo
+
+-(NSPoint)draggingLocation {
+    
+    return [self.view convertPoint:self.location toView:nil];  // In window coordinates as AppKit gives it
+}
+
+
+-(id)draggingSource {
+    
+    return self.source;
+}
+
+
+-(NSDragOperation)draggingSourceOperationMask {
+    
+    return self.sourceOperationMask;
+}
+
+
+-(NSInteger)draggingSequenceNumber {
+    
+    return self.sequenceNumber;
+}
+
+
+-(id)draggingPasteboard {
+    
+    return self;  // Answers dataForType: like the pasteboard would, without the pasteboard server
+}
+
+
+-(NSData *)dataForType:(NSString *)type {
+    
+    return ([type isEqualToString:BSTDragPasteboardType] ? self.payloadData : nil);
+}
+
+@end
+
+
+
+
+
+#pragma mark - <<<<<<<<<< CHANGE FEED  >>>>>>>>>>>>>>
+
+@interface BSTTabViewChangeSet () {
+    NSDictionary*                        moves;                    // old index -> new index of each moved tab
+}
+
+-(instancetype)initWithRemoved:(NSIndexSet *)removed inserted:(NSIndexSet *)inserted moves:(NSDictionary *)moves relabeled:(NSIndexSet *)relabeled retagged:(NSIndexSet *)retagged selectedBefore:(NSInteger)before after:(NSInteger)after;
+
+@end
+
+
+
+@implementation BSTTabViewChangeSet
+
+-(instancetype)initWithRemoved:(NSIndexSet *)removed inserted:(NSIndexSet *)inserted moves:(NSDictionary *)movedTabs relabeled:(NSIndexSet *)relabeled retagged:(NSIndexSet *)retagged selectedBefore:(NSInteger)before after:(NSInteger)after {
+    
+    self = [super init];
+    if (self) {
+        NSMutableIndexSet *from = [[NSMutableIndexSet alloc] init];
+        NSMutableIndexSet *to = [[NSMutableIndexSet alloc] init];
+        for (NSNumber *index in movedTabs) {
+            [from addIndex:[index unsignedIntegerValue]];
+            [to addIndex:[[movedTabs objectForKey:index] unsignedIntegerValue]];
+        }
+        _removedIndexes = [removed copy];
+        _insertedIndexes = [inserted copy];
+        _movedFromIndexes = from;
+        _movedToIndexes = to;
+        _relabeledIndexes = [relabeled copy];
+        _retaggedIndexes = [retagged copy];
+        _selectedTabBefore = before;
+        _selectedTabAfter = after;
+        moves = [movedTabs copy];
+    }
+    return self;
+}
+
+
+-(NSInteger)indexAfterMoveOfTabAtIndex:(NSUInteger)fromIndex {
+    
+    NSNumber *index = [moves objectForKey:[NSNumber numberWithUnsignedInteger:fromIndex]];
+    return (index ? [index integerValue] : -1);
+}
+
+
+-(NSString *)description {
+    
+    return [NSString stringWithFormat:@"<%@ removed %lu, inserted %lu, moved %lu, relabeled %lu, retagged %lu, selected %ld -> %ld>",
+            [self class], (unsigned long)self.removedIndexes.count, (unsigned long)self.insertedIndexes.count,
+            (unsigned long)self.movedFromIndexes.count, (unsigned long)self.relabeledIndexes.count,
+            (unsigned long)self.retaggedIndexes.count, (long)self.selectedTabBefore, (long)self.selectedTabAfter];
+}
+
+@end
+
+
+
+/**
+ * The BSTTabViewPendingChanges helper class collects the changes to the tabs of a view until they are sent. Tabs are
+ * kept by identity as their indexes shift with every change, and are turned into indexes once when the change set is
+ * made. The tabs array is copied before the first insert, remove or move so that the old indexes can be found.
+ */
+@interface BSTTabViewPendingChanges : NSObject
+
+@property (nonatomic) NSArray *oldTabs;                              // The tabs before the first insert, remove or move, nil until then
+@property (nonatomic) NSInteger oldSelectedTab;                      // The selected tab when the first change was made
+@property (nonatomic) BOOL tabsReplaced;                             // All tabs were replaced by a restore, every tab is then inserted
+@property (readonly, nonatomic) NSHashTable *insertedTabs;           // Tabs added
+@property (readonly, nonatomic) NSHashTable *movedTabs;              // Tabs moved
+@property (readonly, nonatomic) NSHashTable *relabeledTabs;          // Tabs given a new label
+@property (readonly, nonatomic) NSHashTable *retaggedTabs;           // Tabs given a new tag
+@property (readonly, nonatomic) NSMutableArray *retiredTabs;         // Removed tabs going to the pool once the change set is made
+
+@end
+
+
+
+@implementation BSTTabViewPendingChanges
+
+-(instancetype)init {
+    
+    self = [super init];
+    if (self) {
+        NSPointerFunctionsOptions options = (NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality);
+        _insertedTabs = [[NSHashTable alloc] initWithOptions:options capacity:0];
+        _movedTabs = [[NSHashTable alloc] initWithOptions:options capacity:0];
+        _relabeledTabs = [[NSHashTable alloc] initWithOptions:options capacity:0];
+        _retaggedTabs = [[NSHashTable alloc] initWithOptions:options capacity:0];
+        _retiredTabs = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+@end
+
+
+
+
+
+#pragma mark - <<<<<<<<<<<<<< MAIN CLASS >>>>>>>>>>>>>>>>>
+
+
+@implementation BSTTabView
+
+#pragma mark - lifetime methods
+
+
+
+
+-(id)initWithFrame:(NSRect)frameRect{
+    
+    self = [super initWithFrame:frameRect];
+    
+    if (self) {
+        [self setupDefaults];
+    }
+    return self;
+}
+
+
+
+-(void)setupDefaults {
+    
+    if (_tabs) {  // already initailised
+        return;
+    }
+    
+    _tabs = [[NSMutableArray alloc]initWithCapacity:5];   // Create the property
+    _selectedTab = -1;  // No selected tab
+    labelEditor = nil; // No editor active
+    
+    _lastClickedTab = -1;
+    _clickCount = 1;
+
+    
+    _delegate =nil;
+    
+    _topEdgeAligned = YES;
+    _rolloverEnabled = YES;
+    _doubleClickEditEnabled = NO;
+    _userTabDraggingEnabled = BSTTabViewDragNone;
+    
+    _theme = [BSTTabViewTheme defaultTheme];  // Colors, font, text attributes and drag image are shared
+    _tabHeight = self.maxTabHeight;
+    
+    _labelWidthGeneration = 0;
+    labelsToMeasure = [[NSMutableOrderedSet alloc] init];
+    pendingLabelMeasurements = [[NSMutableSet alloc] init];
+    measuredLabelWidths = [[NSMutableDictionary alloc] init];
+    
+    pathTemplates = [[NSMutableDictionary alloc] init];
+    tabImageCache = [[NSMutableDictionary alloc] init];
+    _pathTemplateGeneration = 0;
+    typesetLabels = [NSMapTable mapTableWithKeyOptions:(NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality) valueOptions:NSPointerFunctionsStrongMemory];
+    typesetGeneration = 0;
+    
+    tabsByTag = [[NSMutableDictionary alloc] init];
+    tabsByLabel = [[NSMutableDictionary alloc] init];
+    pthread_mutex_init(&labelFeedLock, NULL);
+    queuedLabels = [[NSMutableDictionary alloc] init];
+    labelFeedScheduled = NO;
+    validCachedIndexCount = 0;
+    
+    materializedTabs = [[NSMutableSet alloc] init];
+    tabPool = [[NSMutableArray alloc] init];
+    tabGroups = [[NSMutableArray alloc] init];
+    groupsDirtyFrom = NSNotFound;
+    materializedRange = NSMakeRange(0, 0);
+    _scrollOffset = 0.0;
+    
+    currentWidth = self.bounds.size.width;
+    currentHeight = self.bounds.size.height;
+    
+    dragSourceTabs = nil;
+    validDragInDest = NO;
+    [self registerForDraggedTypes:[NSArray arrayWithObject:BSTDragPasteboardType]];
+
+    _LayoutIsInvalid = YES;
+    layoutNeedsFullPass = YES;
+    layoutDirtyFrom = NSNotFound;
+}
+
+
+
+
+-(void)dealloc {
+    
+    // Tabs kept alive past this body by the lookup maps, the collected changes or a drag must not reach the view when they go
+    NSMutableArray *holders = [[NSMutableArray alloc] initWithObjects:self.tabs, tabPool, materializedTabs, nil];
+    if (dragSourceTabs) {
+        [holders addObject:dragSourceTabs];
+    }
+    if (pendingChanges) {
+        [holders addObjectsFromArray:@[pendingChanges.insertedTabs, pendingChanges.movedTabs, pendingChanges.relabeledTabs, pendingChanges.retaggedTabs, pendingChanges.retiredTabs]];
+        if (pendingChanges.oldTabs) {
+            [holders addObject:pendingChanges.oldTabs];
+        }
+    }
+    for (id<NSFastEnumeration> tabs in holders) {
+        for (BSTTabViewTab *tab in tabs) {
+            tab.owner = nil;
+        }
+    }
+    editedTab.owner = nil;
+    pendingChanges = nil;
+    dragSourceTabs = nil;
+    
+    [self.tabs removeAllObjects];
+    [tabPool removeAllObjects];
+    typesetLabels = nil;  // Tabs still held elsewhere must not reach the map when they go
+    pthread_mutex_destroy(&labelFeedLock);  // A scheduled apply finds the view gone
+    free(tabStartTable);
+    free(tabWidthTable);
+    free(tabPrefixTable);
+}
+
+
+
+
+#pragma mark - setters and getters
+
+
+
+-(NSUInteger)count {
+    return self.tabs.count;
+}
+
+
+
+
+-(void)setTopEdgeAligned:(BOOL)topEdgeAligned {
+
+    
+    if (topEdgeAligned == _topEdgeAligned) {
+        return;  // No change
+    }
+    
+    _topEdgeAligned = topEdgeAligned;
+    [self invalidateTabImages];  // Rendered for the old flipped state
+
+    [self invalidatePaint];
+}
+
+
+
+-(void)setSingleTrackingAreaEnabled:(BOOL)singleTrackingAreaEnabled {
+    
+    if (singleTrackingAreaEnabled == _singleTrackingAreaEnabled) {
+        return;  // No change
+    }
+    
+    _singleTrackingAreaEnabled = singleTrackingAreaEnabled;
+    
+    if (viewTrackingArea) {
+        [self removeTrackingArea:viewTrackingArea];
+        viewTrackingArea = nil;
+        if (_statisticsEnabled) {
+            counters.trackingAreasRemoved++;
+        }
+    }
+    [self.currentRollover mouseExited:nil];
+    
+    [self invalidateTabShapes];  // The visible tabs pick up new paths and add or remove their tracking areas
+    [self invalidateGeometry];
+    [self updateTrackingAreas];
+}
+
+
+
+-(void)setTabImageCacheEnabled:(BOOL)tabImageCacheEnabled {
+    
+    if (tabImageCacheEnabled == _tabImageCacheEnabled) {
+        return;  // No change
+    }
+    
+    _tabImageCacheEnabled = tabImageCacheEnabled;
+    [self invalidateTabImages];
+    
+    [self invalidatePaint];
+}
+
+
+
+-(void)setTypesetLabelCacheEnabled:(BOOL)typesetLabelCacheEnabled {
+    
+    if (typesetLabelCacheEnabled == _typesetLabelCacheEnabled) {
+        return;  // No change
+    }
+    
+    _typesetLabelCacheEnabled = typesetLabelCacheEnabled;
+    [typesetLabels removeAllObjects];
+    [self invalidateTabImages];
+    
+    [self invalidatePaint];
+}
+
+
+
+-(void)setAsynchronousLabelMeasurementEnabled:(BOOL)asynchronousLabelMeasurementEnabled {
+    
+    if (asynchronousLabelMeasurementEnabled == _asynchronousLabelMeasurementEnabled) {
+        return;  // No change
+    }
+    
+    _asynchronousLabelMeasurementEnabled = asynchronousLabelMeasurementEnabled;
+    if (!asynchronousLabelMeasurementEnabled) {  // Tabs with estimated widths are measured on the next layout
+        [labelsToMeasure removeAllObjects];
+        [self invalidateLayout];
+    }
+}
+
+
+
+-(void)setScrollingEnabled:(BOOL)scrollingEnabled {
+    
+    if (scrollingEnabled == _scrollingEnabled) {
+        return;  // No change
+    }
+    
+    _scrollingEnabled = scrollingEnabled;
+    _scrollOffset = 0.0;
+    scrollToSelectedPending = YES;
+    
+    [self invalidateLayout];
+}
+
+
+
+-(void)setScrollOffset:(CGFloat)scrollOffset {
+    
+    NSMutableData *trace = [self traceEvent:BSTTraceScrollOffset];
+    if (trace) {
+        BSTAppendFloat64(trace, scrollOffset);
+    }
+    CGFloat offset = [self clampedScrollOffset:scrollOffset];
+    if (offset == _scrollOffset) {
+        return;  // No change
+    }
+    
+    _scrollOffset = offset;
+    
+    if (!self.LayoutIsInvalid) {  // Otherwise done by the layout
+        [self materializeVisibleTabs];
+    }
+    [self setNeedsDisplay:YES];
+}
+
+
+
+-(void)setTheme:(BSTTabViewTheme *)theme {
+    
+    BSTTabViewTheme *old = _theme;
+    BSTTabViewTheme *new = [theme copy];  // The theme itself unless it is mutable
+    if (!new || (new == old)) {
+        return;  // No change
+    }
+    _theme = new;
+    
+    BOOL sameFont = [new.font isEqual:old.font];
+    BOOL sameText = (sameFont && [new.textColor isEqual:old.textColor] && [new.selectedTextColor isEqual:old.selectedTextColor] && [new.rolloverTextColor isEqual:old.rolloverTextColor]);
+    BOOL sameSpacer = (new.spacerWidth == old.spacerWidth);
+    BOOL sameShape = (sameSpacer && (new.tabCornerRadius == old.tabCornerRadius));
+    
+    if (!sameFont) {  // Widths measured in the old font are not valid, results on the way are dropped by their generation
+        [labelsToMeasure removeAllObjects];
+        [pendingLabelMeasurements removeAllObjects];
+        [measuredLabelWidths removeAllObjects];
+        _labelWidthGeneration++;
+    }
+    if (!sameText) {
+        typesetGeneration++;
+    }
+    if (!sameShape) {
+        [self invalidateTabShapes];
+    } else {
+        [self invalidateTabImages];  // Any change shows in the rendered tabs
+    }
+    if (new.maxTabHeight != old.maxTabHeight) {
+        self.tabHeight = self.maxTabHeight;  // Flags the geometry if the height changes
+    }
+    
+    // One invalidation of the widest kind needed
+    if (!sameFont || !sameSpacer) {
+        [self invalidateLayout];  // The tabs move
+    } else if (!sameShape || geometryIsInvalid) {
+        [self invalidateGeometry];
+    } else {
+        [self invalidatePaint];
+    }
+}
+
+
+
+-(void)changeTheme:(void (^)(BSTMutableTabViewTheme *theme))change {
+    
+    BSTMutableTabViewTheme *theme = [self.theme mutableCopy];
+    change(theme);
+    self.theme = theme;
+}
+
+
+
+-(CGFloat)spacerWidth {
+    
+    return self.theme.spacerWidth;
+}
+
+
+-(void)setSpacerWidth:(CGFloat)spacerWidth {
+    
+    if (spacerWidth == self.spacerWidth) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.spacerWidth = spacerWidth;  // The corner radius is limited to the new width
+    }];
+}
+
+
+
+-(CGFloat)maxTabHeight {
+    
+    if (self.theme.maxTabHeight > 0.0) {
+        return self.theme.maxTabHeight;
+    }
+    return ((self.bounds.size.height > BSTsmallTabHeightThreshold) ? (self.bounds.size.height -5.0) : self.bounds.size.height-2.0);
+}
+
+
+-(void)setMaxTabHeight:(CGFloat)tabHeight {
+    
+    if (tabHeight == self.theme.maxTabHeight) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.maxTabHeight = tabHeight;
+    }];
+}
+
+
+
+-(void)setTabHeight:(CGFloat)tabHeight {
+    
+    // Called from the draw routine so must not do setNeedsDisplay:YES here. All other callers to this method should do so.
+    // Not the user facing method is setMaxtabHeight:
+    
+    CGFloat newHt = (tabHeight > self.bounds.size.height ? self.bounds.size.height : tabHeight);
+    if (newHt == _tabHeight) {  // no change
+        return;
+    }
+    _tabHeight = newHt;
+    [self invalidateTabShapes];
+    
+    geometryIsInvalid = YES;  // Widths are unchanged
+}
+
+
+
+-(CGFloat)tabCornerRadius {
+    
+    return self.theme.tabCornerRadius;
+}
+
+
+-(void)setTabCornerRadius:(CGFloat)tabCornerRadius {
+    
+    if (tabCornerRadius == self.tabCornerRadius) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.tabCornerRadius = tabCornerRadius;  // Limited to 0.0 ... spacerWidth by the copy
+    }];
+}
+
+
+
+-(NSDictionary *)defaultTextOptions {
+    
+    return self.theme.defaultTextOptions;
+}
+
+
+-(NSDictionary *)selectedTextOptions {
+    
+    return self.theme.selectedTextOptions;
+}
+
+
+-(NSDictionary *)rolloverTextOptions {
+    
+    return self.theme.rolloverTextOptions;
+}
+
+
+-(CGFloat)preferredTextHeight {
+    
+    return self.theme.preferredTextHeight;
+}
+
+
+-(NSFont *)textFont {
+    
+    return self.theme.font;
+}
+
+
+
+-(NSColor *)backgroundColor {
+    
+    return self.theme.backgroundColor;
+}
+
+
+-(void)setBackgroundColor:(NSColor *)backgroundColor {
+    
+    if ([backgroundColor isEqual: self.backgroundColor]) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.backgroundColor = backgroundColor;
+    }];
+}
+
+
+-(NSColor *)borderColor {
+    
+    return self.theme.borderColor;
+}
+
+
+-(void)setBorderColor:(NSColor *)borderColor {
+    
+    if ([borderColor isEqual: self.borderColor]) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.borderColor = borderColor;
+    }];
+}
+
+
+
+-(NSColor *)textColor{
+    
+    return self.theme.textColor;
+}
+
+
+-(void)setTextColor:(NSColor *)textColor {
+    
+    if ([textColor isEqual: self.textColor]) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.textColor = textColor;
+    }];
+}
+
+
+
+-(NSColor *)selectedFieldColor {
+    
+    return self.theme.selectedFieldColor;
+}
+
+
+-(void)setSelectedFieldColor:(NSColor *)selectedFieldColor {
+    
+    if ([selectedFieldColor isEqual: self.selectedFieldColor]) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.selectedFieldColor = selectedFieldColor;  // The drag image follows with the new theme
+    }];
+}
+
+
+-(NSColor *)selectedBorderColor {
+    
+    return self.theme.selectedBorderColor;
+}
+
+
+-(void)setSelectedBorderColor:(NSColor *)selectedBorderColor {
+    
+    if ([selectedBorderColor isEqual: self.selectedBorderColor]) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.selectedBorderColor = selectedBorderColor;
+    }];
+}
+
+
+
+-(NSColor *)selectedTextColor{
+    
+    return self.theme.selectedTextColor;
+}
+
+
+-(void)setSelectedTextColor:(NSColor *)selectedTextColor {
+    
+    if ([selectedTextColor isEqual: self.selectedTextColor]) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.selectedTextColor = selectedTextColor;
+    }];
+}
+
+
+
+-(NSColor *)rolloverFieldColor {
+    
+    return self.theme.rolloverFieldColor;
+}
+
+
+-(void)setRolloverFieldColor:(NSColor *)rolloverFieldColor {
+    
+    if ([rolloverFieldColor  isEqual: self.rolloverFieldColor]) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.rolloverFieldColor = rolloverFieldColor;
+    }];
+}
+
+
+-(NSColor *)rolloverBorderColor {
+    
+    return self.theme.rolloverBorderColor;
+}
+
+
+-(void)setRolloverBorderColor:(NSColor *)rolloverBorderColor{
+    
+    if ([rolloverBorderColor isEqual: self.rolloverBorderColor]) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.rolloverBorderColor = rolloverBorderColor;
+    }];
+}
+
+
+
+-(NSColor *)rolloverTextColor{
+    
+    return self.theme.rolloverTextColor;
+}
+
+
+-(void)setRolloverTextColor:(NSColor *)rolloverTextColor {
+    
+    if ([rolloverTextColor isEqual: self.rolloverTextColor]) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.rolloverTextColor = rolloverTextColor;
+    }];
+}
+
+
+
+-(NSColor *)editingColor {
+    
+    return self.theme.editingColor;
+}
+
+
+-(void)setEditingColor:(NSColor *)editingColor {
+    
+    if ([editingColor isEqual: self.editingColor]) {
+        return;  // No change
+    }
+    
+    [self changeTheme:^(BSTMutableTabViewTheme *theme) {
+        theme.editingColor = editingColor;
+    }];
+}
+
+
+
+-(void)setSelectedTab:(NSInteger)selectedTab {
+    
+    NSMutableData *trace = [self traceEvent:BSTTraceSelectTab];
+    if (trace) {
+        BSTAppendUInt32(trace, ((selectedTab < 0) ? BSTDragPayloadNoTag : BSTTraceIndex(selectedTab)));
+    }
+    if ((selectedTab > ((NSInteger)self.tabs.count -1)) || (selectedTab < -1)) {
+        return;  // Abort on illegal input
+    }
+
     if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:tabWithIndexShouldBecomeSelected:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
+        }
         if (![self.delegate tabView:self tabWithIndexShouldBecomeSelected:selectedTab]) {
             return;  // Abort if delegate denies change
         }
     }
     
-    if (labelEditor && ![self.window makeFirstResponder:self.window]) {  // Editing in progress ensure it is concluded or abort
-        return;
+    if (labelEditor && ![self.window makeFirstResponder:self.window]) {  // Editing in progress ensure it is concluded or abort
+        return;
+    }
+    
+    NSInteger oldSelected = _selectedTab;
+    [self pendingChangesBeforeMovingTabs:NO];
+    _selectedTab = selectedTab;
+    updatesNotifiedSelection = selectedTab;  // KVO notifies this change directly, also inside a transaction
+    scrollToSelectedPending = self.scrollingEnabled;
+    
+    if (layoutIsCompressed) {  // The selected tab gets its full width so the other tabs will move
+        [self invalidateLayout];
+    } else {  // Only the two tabs change appearance, the summary for a collapsed tab
+        if (oldSelected >= 0) {
+            [self setNeedsDisplayForTab:[self.tabs objectAtIndex:[self itemRangeForTabAtIndex:oldSelected].location]];
+        }
+        if (selectedTab >= 0) {
+            [self setNeedsDisplayForTab:[self.tabs objectAtIndex:[self itemRangeForTabAtIndex:selectedTab].location]];
+        }
+        if (scrollToSelectedPending && (selectedTab >= 0)) {  // Layout is still valid, scroll now
+            scrollToSelectedPending = NO;
+            traceSuppression++;
+            [self scrollTabToVisible:selectedTab];
+            traceSuppression--;
+        }
+    }
+    
+    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:tabWithIndexDidBecomeSelected:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
+        }
+        [self.delegate tabView:self tabWithIndexDidBecomeSelected:selectedTab];
+    }
+}
+
+
+
+-(void)setCurrentRollover:(BSTTabViewTab *)currentRollover {
+    
+    if (currentRollover) {
+        
+        if ([_currentRollover isEqual:currentRollover]) { // No change
+            return;
+        }
+        [self setNeedsDisplayForTab:_currentRollover];  // Repaint the old and new rollover only
+        _currentRollover = currentRollover;
+        [self setNeedsDisplayForTab:currentRollover];
+        
+    }
+    else {  // set to nil
+        
+        if (!_currentRollover) {
+            return;
+        }
+        [self setNeedsDisplayForTab:_currentRollover];
+        _currentRollover = nil;
+    }
+}
+
+
+#pragma mark - drawing
+
+-(BOOL)isFlipped{
+ 
+    return !self.topEdgeAligned;    // Flip all drawing coordinates if bottom edge
+}
+
+
+-(BOOL)isOpaque{  // used to prevent mouse drag events beeing sent on to superview
+    return YES;
+}
+
+
+-(BOOL)mouseDownCanMoveWindow{ // used to prevent mouse drag events beeing sent on to superview
+    
+    return NO;
+}
+
+
+
+- (void)drawRect:(NSRect)dirtyRect {
+    
+    // Only tabs touching the dirty rect are drawn, drawing is clipped to the dirty rect so the result is the same as a full draw
+
+    NSTimeInterval start = (_statisticsEnabled ? [[NSProcessInfo processInfo] systemUptime] : 0.0);
+    [super drawRect:dirtyRect];
+    
+    NSRect bounds = [self bounds];
+
+    if (bounds.size.width != currentWidth) {
+        currentWidth = bounds.size.width;
+        self.LayoutIsInvalid = YES;
+        scrollToSelectedPending = self.scrollingEnabled;
+    }
+    
+    if (bounds.size.height != currentHeight) {
+        currentHeight = bounds.size.height;
+        self.tabHeight = self.maxTabHeight;  // reset the tab height - possibly
+    }
+    
+    [self.backgroundColor set];
+    [NSBezierPath fillRect:dirtyRect];     // Draw background
+    
+    [self updateLayoutIfNeeded];
+    
+    // Draw tabs, a collapsed group is drawn by its first tab and is selected if any of its tabs is
+    NSInteger selected = ((self.selectedTab >= 0) ? (NSInteger)[self itemRangeForTabAtIndex:self.selectedTab].location : -1);
+    NSRange range = [self rangeOfTabsInRect:dirtyRect];
+    for (NSUInteger i = range.location; i < NSMaxRange(range); ) {   // For each tab in the dirty rect call draw
+        NSRange item = [self itemRangeForTabAtIndex:i];
+        if ((item.location == i) && (i != selected)) {     //Delay selected - Draw selected last to be on top
+            [(BSTTabViewTab *)[self.tabs objectAtIndex:i] drawSelf:NO];
+            self.tabsDrawnCount++;
+        }
+        i = NSMaxRange(item);
+    }
+    if ((selected >= 0) && NSLocationInRange(selected, materializedRange) && NSIntersectsRect(dirtyRect, [(BSTTabViewTab *)[self.tabs objectAtIndex:selected] boundingRect])) {
+        [(BSTTabViewTab *)[self.tabs objectAtIndex:selected] drawSelf:YES];  // Finally draw selected tab
+        self.tabsDrawnCount++;
+    }
+    
+    [self drawScrollButtons];
+    
+    // Draw insert point
+    if (validDragInDest) {
+        NSBezierPath* bp = [[NSBezierPath alloc] init];;
+        NSPoint pt;
+        CGFloat baseX = [self xLocationForInsertPoint:dragInsertPoint];
+        
+        if (currentHeight < BSTsmallTabHeightThreshold) {  // The small insert
+            
+            pt.x = baseX;
+            pt.y = 0;
+            [bp moveToPoint:pt];
+            
+            pt.x = baseX;
+            pt.y = currentHeight;
+            [bp lineToPoint:pt];
+            
+        } else {  // The bigger insert
+            CGFloat ht = ((self.maxTabHeight + 2) > currentHeight ? currentHeight : self.maxTabHeight + 2);
+            pt.x = baseX;
+            pt.y = ht - 8;
+            [bp moveToPoint:pt];
+            
+            pt.x = baseX;
+            pt.y = ht-5;
+            [bp lineToPoint:pt];
+            
+            pt.x = baseX - 2;
+            pt.y = ht;
+            [bp lineToPoint:pt];
+
+            pt.x = baseX + 2;
+            pt.y = ht;
+            [bp lineToPoint:pt];
+
+            pt.x = baseX;
+            pt.y = ht-5;
+            [bp lineToPoint:pt];
+
+        } // end big mark
+        
+        [self.editingColor set];
+        [bp stroke];
+        
+    }  // end draw mark code
+    
+    if (_statisticsEnabled) {
+        [self recordTimedOperation:BSTTabViewTimedOperationDraw since:start];
+    }
+}
+
+
+
+-(void)setNeedsDisplayForTab:(BSTTabViewTab *)tab {
+    
+    if (!tab) {
+        return;
+    }
+    if (self.LayoutIsInvalid) {  // Tab geometry is not known until the next layout
+        [self setNeedsDisplay:YES];
+        return;
+    }
+    [self setNeedsDisplayInRect:[tab boundingRect]];
+}
+
+
+
+/*
+ * Tabs of the same width share one path. In a compressed strip most tabs are capped to the same width so a handful
+ * of paths cover all of them. The path has the core starting at x = 0 and tabs draw it translated to their startX.
+ */
+-(NSBezierPath *)boundaryPathForCoreWidth:(CGFloat)coreWidth {
+    
+    NSNumber *key = [NSNumber numberWithDouble:coreWidth];
+    NSBezierPath *path = [pathTemplates objectForKey:key];
+    if (path) {
+        return path;
+    }
+    
+    path = [[NSBezierPath alloc] init];
+    [path setLineWidth:1.0];
+    NSPoint pt;
+    NSPoint cp1;
+    
+    CGFloat ht = self.tabHeight;
+    
+    pt.x = 0.0 - self.spacerWidth;
+    pt.y = 0.0;
+    [path moveToPoint:pt];
+    
+    pt.x = 0.0 - self.tabCornerRadius;
+    pt.y = 0.0 + ht - self.tabCornerRadius;
+    [path lineToPoint:pt];
+    
+    pt.x = 0.0 + self.tabCornerRadius;
+    pt.y = 0.0 + ht;
+    
+    cp1.x = 0.0;
+    cp1.y = 0.0 + ht;
+    [path curveToPoint:pt controlPoint1:cp1 controlPoint2:cp1];
+    
+    pt.x = coreWidth - self.tabCornerRadius;
+    pt.y = 0.0 + ht;
+    [path lineToPoint:pt];
+    
+    pt.x = coreWidth + self.tabCornerRadius;
+    pt.y = 0.0 + ht - self.tabCornerRadius;
+    cp1.x = coreWidth;
+    cp1.y = 0.0 + ht;
+    [path curveToPoint:pt controlPoint1:cp1 controlPoint2:cp1];
+    
+    pt.x = coreWidth + self.spacerWidth;
+    pt.y = 0.0;
+    [path lineToPoint:pt];
+    
+    if (pathTemplates.count >= BSTpathTemplateLimit) {  // Tabs keep their paths, only sharing is lost until they are relaid
+        [pathTemplates removeAllObjects];
+    }
+    [pathTemplates setObject:path forKey:key];
+    return path;
+}
+
+
+
+-(NSImage *)tabImageForKey:(NSString *)key {
+    
+    NSImage *image = [tabImageCache objectForKey:key];
+    if (image) {
+        self.tabImageCacheHits++;
+    } else {
+        self.tabImageCacheMisses++;
+    }
+    return image;
+}
+
+
+
+-(void)setTabImage:(NSImage *)image forKey:(NSString *)key {
+    
+    if (tabImageCache.count >= BSTtabImageCacheLimit) {  // Keep the memory bounded, start over
+        [tabImageCache removeAllObjects];
+    }
+    [tabImageCache setObject:image forKey:key];
+}
+
+
+
+-(void)invalidateTabShapes {
+    
+    [pathTemplates removeAllObjects];
+    _pathTemplateGeneration++;
+    [self invalidateTabImages];
+}
+
+
+
+-(void)invalidateTabImages {
+    
+    [tabImageCache removeAllObjects];
+}
+
+
+
+-(id)typesetLineForTab:(BSTTabViewTab *)tab state:(NSUInteger)state attributes:(NSDictionary *)attributes width:(CGFloat)width {
+    
+    NSString *label = [tab displayedLabel];
+    BSTTabViewTypesetLabel *entry = [typesetLabels objectForKey:tab];
+    if (![entry matchesLabel:label width:width generation:typesetGeneration]) {  // New label, width or text options, all states typeset again
+        entry = [[BSTTabViewTypesetLabel alloc] initWithLabel:label width:width generation:typesetGeneration];
+        [typesetLabels setObject:entry forKey:tab];
+    }
+    
+    id line = [entry lineForState:state];
+    if (line) {
+        self.typesetLineHits++;
+    } else {
+        self.typesetLineMisses++;
+        line = BSTTypesetLine(label, attributes, width);
+        [entry setLine:line forState:state];
+    }
+    return line;
+}
+
+
+
+-(void)discardTypesetLabelForTab:(BSTTabViewTab *)tab {
+    
+    [typesetLabels removeObjectForKey:tab];
+}
+
+
+
+-(void)viewDidChangeBackingProperties {
+    
+    [super viewDidChangeBackingProperties];
+    [self invalidateTabImages];  // Rendered for the old scale
+}
+
+
+
+/*
+ * The range of tabs reaching into the content (unscrolled) interval minX to maxX. Tabs are laid out left to right 
+ * so both ends are found by a binary search in the layout tables. A tab reaches spacerWidth + 1 outside its core on either side.
+ */
+-(NSRange)rangeOfTabsFromX:(CGFloat)minX toX:(CGFloat)maxX {
+    
+    CGFloat margin = self.spacerWidth + 1.0;
+    
+    NSUInteger lo = 0;
+    NSUInteger hi = tabTableCount;
+    while (lo < hi) {  // first tab whose right edge reaches the interval
+        NSUInteger mid = lo + ((hi - lo) / 2);
+        if ((tabStartTable[mid] + tabWidthTable[mid] + margin) < minX) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    NSInteger last = BSTLastIndexAtOrBefore(tabStartTable, tabTableCount, maxX + margin);  // last tab whose left edge reaches the interval
+    
+    if (last < (NSInteger)lo) {
+        return NSMakeRange(lo, 0);
+    }
+    return NSMakeRange(lo, (NSUInteger)last - lo + 1);
+}
+
+
+
+// The tabs that need to be drawn to cover rect, only tabs with geometry can be drawn
+-(NSRange)rangeOfTabsInRect:(NSRect)rect {
+    
+    if (tabTableCount != self.tabs.count) {  // Tables are stale, draw what has geometry
+        return NSIntersectionRange(materializedRange, NSMakeRange(0, self.tabs.count));
+    }
+    
+    NSRange range = [self rangeOfTabsFromX:(NSMinX(rect) + self.scrollOffset) toX:(NSMaxX(rect) + self.scrollOffset)];
+    return NSIntersectionRange(range, materializedRange);
+}
+
+
+
+-(CGFloat)xLocationForInsertPoint:(NSInteger)insertPoint {
+    
+    if ((insertPoint < 0) || (insertPoint >= self.tabs.count)) {  // Insert first
+        return (self.spacerWidth / 2) - self.scrollOffset;
+    }
+    // Insert after tab nr insertPoint
+    if (tabTableCount == self.tabs.count) {
+        return tabStartTable[insertPoint] + tabWidthTable[insertPoint] + (self.spacerWidth / 2) - self.scrollOffset;
+    }
+    BSTTabViewTab *tab = [self.tabs objectAtIndex:insertPoint];
+    return tab.startX + tab.coreWidth + (self.spacerWidth / 2);
+}
+
+
+
+-(NSRect)rectForInsertPoint:(NSInteger)insertPoint {
+    
+    return NSMakeRect([self xLocationForInsertPoint:insertPoint] - 4.0, 0.0, 8.0, currentHeight);  // Mark is 2 wide each side plus stroke
+}
+
+
+
+
+/* 
+ * This method allocates location and widths to tabs and sets the tracking areas
+ * It works in this way
+ * Step 1 it measures the width each tab wants, once per tab
+ * Step 2 if that does not fit because the tab row space is to small the layout core
+ * calculates the cap for longer tabs except the current tab so the space is sufficient 
+ * or the min tab width is reached (see BSTCompressionCapForWidths)
+ * If min width is reached it renders as many tabs as it can in that space and sends a delegate
+ * message that space is insufficient.
+ * Step 3 it records the allocated positions in the layout tables, clamps the scroll position and
+ * assigns the positions and tracking areas to the visible tabs (see materializeVisibleTabs)
+ * The method also aligns the editor with it's tab if the editor is visible
+ */
+
+-(void)reassignTabPositionAndTrackingArea{
+    
+    NSTimeInterval start = (_statisticsEnabled ? [[NSProcessInfo processInfo] systemUptime] : 0.0);
+    
+    [self updateTabGroupsIfNeeded];  // May ask for the full pass
+    if (!layoutNeedsFullPass && !layoutIsCompressed && [self relayoutTabsFromIndex:layoutDirtyFrom]) {  // Only tabs were mutated and they still fit
+        [self completeLayout];
+        [self updateInsufficientWidth:NO];
+        if (_statisticsEnabled) {
+            counters.incrementalLayoutPasses++;
+            [self recordTimedOperation:BSTTabViewTimedOperationLayout since:start];
+        }
+        return;
+    }
+    
+    NSUInteger count = self.tabs.count;
+    CGFloat *requested = malloc((count + 1) * sizeof(CGFloat));  // One per item, +1 to never malloc 0
+    NSUInteger *itemStart = malloc((count + 1) * sizeof(NSUInteger));  // The first tab of each item
+    NSUInteger items = 0;
+    NSInteger selectedItem = -1;
+    CGFloat tabWidth;
+    
+    // Measure ideal width, an item is a tab or a collapsed group whose tabs are not measured
+    longestRequestedWidth = 0.0;
+    longestRequestedCount = 0;
+    for (NSUInteger i = 0; i < count; items++) {
+        BSTTabViewTab *tab = [self.tabs objectAtIndex:i];
+        itemStart[items] = i;
+        if (tab.group.collapsed) {  // The first tab of the group, ranges are up to date
+            requested[items] = [self widthForSummaryOfGroup:tab.group];
+            i = NSMaxRange(tab.group.range);
+        } else {
+            requested[items] = [self widthForLabelOrEditorForTab:tab];
+            i++;
+        }
+        if ((self.selectedTab >= (NSInteger)itemStart[items]) && (self.selectedTab < (NSInteger)i)) {
+            selectedItem = items;
+        }
+        if (requested[items] > longestRequestedWidth) {
+            longestRequestedWidth = requested[items];
+            longestRequestedCount = 1;
+        } else if (requested[items] == longestRequestedWidth) {
+            longestRequestedCount++;
+        }
+    }
+    [measuredLabelWidths removeAllObjects];  // All tabs have picked up their background measured width
+    
+    // Calculate the compression cap
+    BOOL insufficient = NO;
+    CGFloat longestRequested = BSTCompressionCapForWidths(requested, items, selectedItem, self.spacerWidth, currentWidth, &insufficient);
+    stableCappedWidth = longestRequested + 1.0;  // The cap only depends on how much of each width is below the next step
+    
+    if (insufficient && self.scrollingEnabled && (longestRequested < BSTminTabWidth)) {  // Not all will fit even with compression, scroll instead of shrinking below min
+        longestRequested = BSTminTabWidth;
+    }
+    if (stableCappedWidth < longestRequested) {
+        stableCappedWidth = longestRequested;
+    }
+    
+    // allocate actual width to tabs - all get their requested but not more than longestRequested
+    CGFloat accumulatedX = self.spacerWidth;
+    
+    if (tabTableCapacity < (count + 1)) {  // Grow the hit test tables, also for an empty view as tabPrefixTable[count] is always written
+        tabTableCapacity = count + 16;
+        tabStartTable = realloc(tabStartTable, tabTableCapacity * sizeof(CGFloat));
+        tabWidthTable = realloc(tabWidthTable, tabTableCapacity * sizeof(CGFloat));
+        tabPrefixTable = realloc(tabPrefixTable, (tabTableCapacity + 1) * sizeof(CGFloat));
+    }
+    
+    layoutIsCompressed = NO;
+    for (NSUInteger k = 0; k < items; k++) {
+        if (selectedItem == (NSInteger)k) {
+            tabWidth = requested[k];  // The seletced tab gets its full width
+        }
+        else {
+            tabWidth = (requested[k] > longestRequested ? longestRequested : requested[k]);
+            if (tabWidth < requested[k]) {
+                layoutIsCompressed = YES;
+            }
+        }
+        
+        NSUInteger i = itemStart[k];
+        tabPrefixTable[i] = accumulatedX;
+        tabStartTable[i] = roundf(accumulatedX);
+        tabWidthTable[i] = roundf(tabWidth);
+        BSTPlaceCollapsedTabs(tabStartTable, tabWidthTable, tabPrefixTable, i, ((k + 1 < items) ? itemStart[k + 1] : count));
+        accumulatedX = accumulatedX + tabWidth + self.spacerWidth;
+    }
+    tabPrefixTable[count] = accumulatedX;
+    tabTableCount = count;
+    contentWidth = accumulatedX;
+    self.tabsLaidOutCount = self.tabsLaidOutCount + items;
+    free(requested);
+    free(itemStart);
+    
+    [self completeLayout];
+    [self updateInsufficientWidth:insufficient];  // Display will be truncated or scrolled
+    if (_statisticsEnabled) {
+        if (layoutIsCompressed || insufficient) {
+            counters.compressedLayoutPasses++;
+        }
+        [self recordTimedOperation:BSTTabViewTimedOperationLayout since:start];
+    }
+}
+
+
+
+/*
+ * When the last layout was not compressed every tab has its requested width, so a mutation leaves the tabs before
+ * the first mutated one in place. Those after it are laid out again from the prefix table, continuing the sum in
+ * the same order as the full pass, so the result is identical. Appending or renaming the last tab is then O(1).
+ * Returns NO if the tabs no longer fit, the full pass then takes care of the compression.
+ */
+-(BOOL)relayoutTabsFromIndex:(NSUInteger)index {
+    
+    NSUInteger count = self.tabs.count;
+    if ((index > tabTableCount) || (index > count)) {  // Tables do not cover the tabs before index
+        return NO;
+    }
+    if (index < count) {  // Start from the first tab of a collapsed group
+        index = [self itemRangeForTabAtIndex:index].location;
+    }
+    
+    if (tabTableCapacity < (count + 1)) {  // Grow the hit test tables, also for an empty view as tabPrefixTable[count] is always written
+        tabTableCapacity = count + 16;
+        tabStartTable = realloc(tabStartTable, tabTableCapacity * sizeof(CGFloat));
+        tabWidthTable = realloc(tabWidthTable, tabTableCapacity * sizeof(CGFloat));
+        tabPrefixTable = realloc(tabPrefixTable, (tabTableCapacity + 1) * sizeof(CGFloat));
+    }
+    
+    CGFloat accumulatedX = ((index == 0) ? self.spacerWidth : tabPrefixTable[index]);
+    NSUInteger items = 0;
+    for (NSUInteger i = index; i < count; items++) {
+        BSTTabViewTab *tab = [self.tabs objectAtIndex:i];
+        CGFloat tabWidth;
+        NSUInteger end;
+        if (tab.group.collapsed) {  // One item for the group, as in the full pass
+            tabWidth = [self widthForSummaryOfGroup:tab.group];
+            end = NSMaxRange(tab.group.range);
+        } else {
+            tabWidth = [self widthForLabelOrEditorForTab:tab];
+            end = i + 1;
+        }
+        
+        tabPrefixTable[i] = accumulatedX;
+        tabStartTable[i] = roundf(accumulatedX);
+        tabWidthTable[i] = roundf(tabWidth);
+        BSTPlaceCollapsedTabs(tabStartTable, tabWidthTable, tabPrefixTable, i, end);
+        accumulatedX = accumulatedX + tabWidth + self.spacerWidth;
+        
+        if (accumulatedX > currentWidth) {  // Compression needed
+            return NO;
+        }
+        i = end;
+    }
+    tabPrefixTable[count] = accumulatedX;
+    tabTableCount = count;
+    contentWidth = accumulatedX;
+    self.tabsLaidOutCount = self.tabsLaidOutCount + items;
+    
+    return YES;
+}
+
+
+
+-(void)completeLayout {
+    
+    // Keep the scroll position valid and the selected tab in view
+    _scrollOffset = [self clampedScrollOffset:_scrollOffset];
+    if (scrollToSelectedPending && (self.selectedTab >= 0)) {
+        NSUInteger selected = [self itemRangeForTabAtIndex:self.selectedTab].location;  // The summary if the selected tab is collapsed
+        CGFloat left = tabStartTable[selected] - self.spacerWidth - BSTscrollButtonWidth;
+        CGFloat right = tabStartTable[selected] + tabWidthTable[selected] + self.spacerWidth + BSTscrollButtonWidth;
+        if (left < _scrollOffset) {
+            _scrollOffset = [self clampedScrollOffset:left];
+        } else if (right > (_scrollOffset + currentWidth)) {
+            _scrollOffset = [self clampedScrollOffset:(right - currentWidth)];
+        }
+    }
+    scrollToSelectedPending = NO;
+    
+    [self materializeVisibleTabs];
+    self.LayoutIsInvalid = NO;
+    layoutDirtyFrom = NSNotFound;
+    
+    if (labelsToMeasure.count > 0) {
+        [self scheduleLabelMeasurements];
+    }
+}
+
+
+
+/// Notify only when the strip goes from fitting to not fitting or back, or the number of tabs that do not fit changes
+-(void)updateInsufficientWidth:(BOOL)insufficient {
+    
+    if (renderingOffscreen) {  // Not the size the view is shown in
+        return;
+    }
+    
+    NSUInteger hidden = 0;
+    if (insufficient) {  // The tabs that end beyond the strip when scrolled to the start
+        NSInteger last = BSTLastIndexAtOrBefore(tabStartTable, tabTableCount, currentWidth);
+        while ((last >= 0) && ((tabStartTable[last] + tabWidthTable[last]) > currentWidth)) {
+            last--;
+        }
+        hidden = tabTableCount - (NSUInteger)(last + 1);
+    }
+    
+    if ((insufficient == insufficientWidth) && (hidden == _hiddenTabCount)) {  // No change
+        return;
+    }
+    BOOL becameInsufficient = (insufficient && !insufficientWidth);
+    insufficientWidth = insufficient;
+    _hiddenTabCount = hidden;
+    
+    if (becameInsufficient && self.delegate && [self.delegate respondsToSelector:@selector(insufficientWidthForTabView:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
+        }
+        [self.delegate insufficientWidthForTabView:self];
+    }
+    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:insufficientWidthDidChange:hiddenTabCount:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
+        }
+        [self.delegate tabView:self insufficientWidthDidChange:insufficient hiddenTabCount:hidden];
+    }
+}
+
+
+
+-(void)setLayoutIsInvalid:(BOOL)LayoutIsInvalid {
+    
+    _LayoutIsInvalid = LayoutIsInvalid;
+    layoutNeedsFullPass = LayoutIsInvalid;  // Anything but a tab mutation may change the width of all tabs
+}
+
+
+
+/*
+ * Assigns the geometry from the layout tables to the tabs in the visible band plus a margin, this is where
+ * paths and tracking areas are created. Tabs that left the band release theirs. The cost therefore depends
+ * on the number of visible tabs and not on the total number of tabs.
+ */
+-(void)materializeVisibleTabs {
+    
+    NSRange range = [self rangeOfTabsFromX:(self.scrollOffset - BSTvisibleTabMargin) toX:(self.scrollOffset + currentWidth + BSTvisibleTabMargin)];
+    NSMutableSet *visible = [[NSMutableSet alloc] initWithCapacity:range.length];
+    BSTTabViewTab *tab;
+    
+    for (NSUInteger i = range.location; i < NSMaxRange(range); ) {
+        NSRange item = [self itemRangeForTabAtIndex:i];
+        if (item.location == i) {  // The tabs of a collapsed group after the first get no geometry
+            tab = [self.tabs objectAtIndex:i];
+            
+            if (tab == editedTab) {  // Editing is ongoing, align the editor start
+                [labelEditor setFrameOrigin:NSMakePoint(tabStartTable[i] - self.scrollOffset + BSTstdTextPadding,BSTstdYTextOffset)];
+            }
+            
+            [tab setStartX:(tabStartTable[i] - self.scrollOffset) width:tabWidthTable[i]];
+            [visible addObject:tab];
+        }
+        i = NSMaxRange(item);
+    }
+    
+    [materializedTabs minusSet:visible];  // Those left are no longer visible
+    for (tab in materializedTabs) {
+        [tab discardGeometry];
+    }
+    materializedTabs = visible;
+    materializedRange = range;
+    
+    if (self.singleTrackingAreaEnabled && self.window) {  // Tabs may have moved under a still cursor
+        [self updateRolloverForPoint:[self convertPoint:[self.window mouseLocationOutsideOfEventStream] fromView:nil] event:nil];
+    }
+}
+
+
+
+-(CGFloat)clampedScrollOffset:(CGFloat)offset {
+    
+    CGFloat maxOffset = contentWidth - currentWidth;
+    if (!self.scrollingEnabled || (maxOffset <= 0.0) || (offset <= 0.0)) {
+        return 0.0;
+    }
+    return roundf(offset > maxOffset ? maxOffset : offset);
+}
+
+
+
+-(void)scrollTabToVisible:(NSUInteger)index {
+    
+    if (!self.scrollingEnabled || (index >= self.tabs.count)) {
+        return;
+    }
+    [self updateLayoutIfNeeded];  // Need the positions
+    index = [self itemRangeForTabAtIndex:index].location;  // A collapsed tab is shown by its summary
+    
+    CGFloat left = tabStartTable[index] - self.spacerWidth - BSTscrollButtonWidth;
+    CGFloat right = tabStartTable[index] + tabWidthTable[index] + self.spacerWidth + BSTscrollButtonWidth;
+    if (left < self.scrollOffset) {
+        self.scrollOffset = left;
+    } else if (right > (self.scrollOffset + currentWidth)) {
+        self.scrollOffset = right - currentWidth;
+    }
+}
+
+
+
+-(NSInteger)scrollButtonAtPoint:(NSPoint)point {
+    
+    if (!self.scrollingEnabled || (contentWidth <= currentWidth)) {
+        return 0;
+    }
+    if ((point.x < BSTscrollButtonWidth) && (self.scrollOffset > 0.0)) {
+        return -1;
+    }
+    if ((point.x >= (currentWidth - BSTscrollButtonWidth)) && (self.scrollOffset < (contentWidth - currentWidth))) {
+        return 1;
+    }
+    return 0;
+}
+
+
+
+-(void)drawScrollButtons {
+    
+    if (!self.scrollingEnabled || (contentWidth <= currentWidth)) {
+        return;
+    }
+    
+    CGFloat ht = (self.tabHeight < currentHeight ? self.tabHeight : currentHeight);
+    CGFloat mid = ht / 2;
+    
+    for (NSInteger side = -1; side <= 1; side += 2) {
+        CGFloat x = ((side < 0) ? 0.0 : (currentWidth - BSTscrollButtonWidth));
+        NSPoint pt = NSMakePoint(x + 1.0, 1.0);
+        if ([self scrollButtonAtPoint:pt] != side) {  // No hidden tabs on this side
+            continue;
+        }
+        [self.backgroundColor set];
+        [NSBezierPath fillRect:NSMakeRect(x, 0.0, BSTscrollButtonWidth, currentHeight)];
+        
+        NSBezierPath *arrow = [[NSBezierPath alloc] init];
+        CGFloat tip = ((side < 0) ? (x + 3.0) : (x + BSTscrollButtonWidth - 3.0));
+        CGFloat back = ((side < 0) ? (x + BSTscrollButtonWidth - 3.0) : (x + 3.0));
+        [arrow moveToPoint:NSMakePoint(back, mid - 4.0)];
+        [arrow lineToPoint:NSMakePoint(tip, mid)];
+        [arrow lineToPoint:NSMakePoint(back, mid + 4.0)];
+        [arrow closePath];
+        [self.textColor set];
+        [arrow fill];
+    }
+}
+
+
+
+
+-(CGFloat)measuredWidthForLabel:(NSString *)label estimated:(BOOL *)estimated {
+    
+    NSMutableDictionary *labelWidthCache = self.theme.labelWidthCache;  // Shared by all views with the theme
+    NSNumber *cached = [labelWidthCache objectForKey:label];
+    if (!cached) {
+        cached = [measuredLabelWidths objectForKey:label];
+        if (cached && (labelWidthCache.count < BSTlabelWidthCacheLimit)) {  // Keep it for tabs added later with the same label
+            [labelWidthCache setObject:cached forKey:label];
+        }
+    }
+    if (cached) {
+        self.labelWidthCacheHits++;
+        return [cached doubleValue];
+    }
+    
+    if (self.asynchronousLabelMeasurementEnabled) {  // Estimate from the average character width and measure in the background
+        if (![pendingLabelMeasurements containsObject:label]) {
+            [pendingLabelMeasurements addObject:label];
+            [labelsToMeasure addObject:label];
+        }
+        if (self.theme.estimatedCharacterWidth <= 0.0) {
+            NSString *sample = @"abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789";
+            self.theme.estimatedCharacterWidth = [sample sizeWithAttributes:self.defaultTextOptions].width / sample.length;
+        }
+        *estimated = YES;
+        return (self.theme.estimatedCharacterWidth * label.length);
+    }
+    
+    self.labelWidthCacheMisses++;
+    CGFloat w = [label sizeWithAttributes:self.defaultTextOptions].width;
+    
+    if (labelWidthCache.count >= BSTlabelWidthCacheLimit) {  // Keep the cache bounded, tabs still hold their own width
+        [labelWidthCache removeAllObjects];
+    }
+    [labelWidthCache setObject:@(w) forKey:label];
+    return w;
+}
+
+
+
+// Core Text measurement, safe on any thread
+static CGFloat BSTMeasureLabel(NSString *label, CTFontRef font) {
+    
+    NSAttributedString *string = [[NSAttributedString alloc] initWithString:label attributes:@{(__bridge NSString *)kCTFontAttributeName : (__bridge id)font}];
+    CTLineRef line = CTLineCreateWithAttributedString((__bridge CFAttributedStringRef)string);
+    CGFloat width = CTLineGetTypographicBounds(line, NULL, NULL, NULL);
+    CFRelease(line);
+    return width;
+}
+
+
+
+-(void)scheduleLabelMeasurements {
+    
+    static dispatch_queue_t queue;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        queue = dispatch_queue_create("bst.tabview.labelmeasurement", dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_USER_INITIATED, 0));
+    });
+    
+    // The selected tab, the tab under the cursor and the visible tabs first, tabs without a label are not measured
+    NSMutableOrderedSet *ordered = [[NSMutableOrderedSet alloc] initWithCapacity:labelsToMeasure.count];
+    NSString *tabLabel = ((self.selectedTab >= 0) ? [(BSTTabViewTab *)[self.tabs objectAtIndex:self.selectedTab] label] : nil);
+    if (tabLabel) {
+        [ordered addObject:tabLabel];
+    }
+    if (self.currentRollover.label) {
+        [ordered addObject:self.currentRollover.label];
+    }
+    for (NSUInteger i = materializedRange.location; (i < NSMaxRange(materializedRange)) && (i < self.tabs.count); i++) {
+        tabLabel = [(BSTTabViewTab *)[self.tabs objectAtIndex:i] label];
+        if (tabLabel) {
+            [ordered addObject:tabLabel];
+        }
+    }
+    [ordered intersectOrderedSet:labelsToMeasure];
+    [ordered unionOrderedSet:labelsToMeasure];
+    [labelsToMeasure removeAllObjects];
+    
+    NSFont *font = [self.defaultTextOptions valueForKey:NSFontAttributeName];
+    id ctFont = CFBridgingRelease(CTFontCreateWithName((__bridge CFStringRef)font.fontName, font.pointSize, NULL));  // Not the NSFont, it stays on the main thread
+    NSUInteger generation = self.labelWidthGeneration;
+    __weak BSTTabView *weakSelf = self;
+    
+    for (NSUInteger start = 0; start < ordered.count; start += BSTlabelMeasurementBatch) {
+        NSUInteger length = ((ordered.count - start) < BSTlabelMeasurementBatch ? (ordered.count - start) : BSTlabelMeasurementBatch);
+        NSArray *batch = [ordered.array subarrayWithRange:NSMakeRange(start, length)];
+        dispatch_async(queue, ^{
+            NSMutableArray *widths = [[NSMutableArray alloc] initWithCapacity:batch.count];
+            for (NSString *label in batch) {
+                [widths addObject:@(BSTMeasureLabel(label, (__bridge CTFontRef)ctFont))];
+            }
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [weakSelf applyMeasuredWidths:widths forLabels:batch generation:generation];
+            });
+        });
+    }
+}
+
+
+
+-(void)applyMeasuredWidths:(NSArray *)widths forLabels:(NSArray *)labels generation:(NSUInteger)generation {
+    
+    if (generation != self.labelWidthGeneration) {  // Measured in an old font
+        return;
+    }
+    
+    NSUInteger applied = 0;
+    for (NSUInteger i = 0; i < labels.count; i++) {
+        NSString *label = [labels objectAtIndex:i];
+        [pendingLabelMeasurements removeObject:label];
+        if (![tabsByLabel objectForKey:label]) {  // Renamed or removed while measured
+            continue;
+        }
+        [measuredLabelWidths setObject:[widths objectAtIndex:i] forKey:label];
+        applied++;
+    }
+    self.labelWidthCacheMisses = self.labelWidthCacheMisses + labels.count;
+    
+    if (applied > 0) {  // Every batch arriving before the next display shares one relayout
+        [self invalidateLayout];
+    }
+}
+
+
+
+-(CGFloat)widthForLabelOrEditorForTab:(BSTTabViewTab *)tab {
+    
+    CGFloat wlabel = [tab widthForLabelString];
+    
+    CGFloat weditor;
+    if (editedTab != tab) { // This is not the edited tab
+        weditor = -1.0;
+    } else {
+    // Edit in progress for the requested tab
+      NSRect rect = labelEditor.frame;
+      weditor = rect.size.width + BSTeditorExtraPadding;
+    }
+    
+    return (weditor > wlabel ? weditor : wlabel);  // take the max
+}
+
+
+#pragma mark - hit testing
+
+
+-(NSInteger)indexOfTabAtPoint:(NSPoint)point {
+    
+    if ((tabTableCount != self.tabs.count) || (point.y < 0.0) || (point.y >= self.tabHeight)) {  // Tables are stale or outside tab height
+        return -1;
+    }
+    
+    if ([self scrollButtonAtPoint:point] != 0) {  // Scroll buttons cover the tabs below
+        return -1;
+    }
+    
+    CGFloat x = point.x + self.scrollOffset;  // Tables are in unscrolled coordinates
+    NSInteger index = BSTLastIndexAtOrBefore(tabStartTable, tabTableCount, x);
+    if ((index >= 0) && (x < (tabStartTable[index] + tabWidthTable[index]))) {  // Inside the core area, not in the spacer after
+        return index;
+    }
+    return -1;
+}
+
+
+
+/*
+ * Returns the tab after which a dropped tab would be inserted (-1 == before first). The insert point is before the first
+ * tab whose first half is at or after xLoc, see xLocIsBeforeFirstHalfOfTab:. The tab mid points are increasing so
+ * this is a binary search, unless the tables are stale in which case all tabs are asked.
+ */
+-(NSInteger)insertPointForXLocation:(CGFloat)xLoc {
+    
+    NSUInteger count = self.tabs.count;
+    
+    if (tabTableCount != count) {
+        for (NSUInteger i = 0; i < count; i++) {
+            if ([(BSTTabViewTab*)[self.tabs objectAtIndex:i] xLocIsBeforeFirstHalfOfTab:xLoc]) {
+                return ((NSInteger)i - 1);
+            }
+        }
+        return ((NSInteger)count - 1);
+    }
+    
+    xLoc = xLoc + self.scrollOffset;  // Tables are in unscrolled coordinates
+    NSUInteger lo = 0;
+    NSUInteger hi = count;
+    while (lo < hi) {  // find first tab with xLoc <= its mid point
+        NSUInteger mid = lo + ((hi - lo) / 2);
+        if (xLoc > (tabStartTable[mid] + (tabWidthTable[mid] / 2))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) {  // Past the middle of a collapsed group inserts after all its tabs, never inside it
+        return ((NSInteger)NSMaxRange([self itemRangeForTabAtIndex:(lo - 1)]) - 1);
+    }
+    return ((NSInteger)lo - 1);
+}
+
+
+
+-(void)updateRolloverForPoint:(NSPoint)point event:(NSEvent *)theEvent {
+    
+    NSInteger index = [self indexOfTabAtPoint:point];
+    BSTTabViewTab *tab = ((index >= 0) ? [self.tabs objectAtIndex:index] : nil);
+    
+    if (tab == self.currentRollover) {  // No change
+        return;
+    }
+    [self.currentRollover mouseExited:theEvent];
+    [tab mouseEntered:theEvent];
+}
+
+
+
+-(void)updateTrackingAreas {
+    
+    [super updateTrackingAreas];
+    
+    if (self.singleTrackingAreaEnabled && !viewTrackingArea) {  // Visible rect tracking follows the view so it never needs to be recreated
+        viewTrackingArea = [[NSTrackingArea alloc] initWithRect:NSZeroRect options:(NSTrackingMouseEnteredAndExited | NSTrackingMouseMoved | NSTrackingActiveInActiveApp | NSTrackingInVisibleRect) owner:self userInfo:nil];
+        [self addTrackingArea:viewTrackingArea];
+        if (_statisticsEnabled) {
+            counters.trackingAreasAdded++;
+        }
+    }
+}
+
+
+
+#pragma mark - event handlers
+
+-(void)mouseMoved:(NSEvent *)theEvent {
+    
+    if (!self.singleTrackingAreaEnabled) {
+        [super mouseMoved:theEvent];
+        return;
+    }
+    [self traceMouseEvent:theEvent kind:BSTTraceMouseMoved];
+    [self updateRolloverForPoint:[self convertPoint:[theEvent locationInWindow] fromView:nil] event:theEvent];
+}
+
+
+
+-(void)mouseExited:(NSEvent *)theEvent {
+    
+    if (!self.singleTrackingAreaEnabled) {
+        [super mouseExited:theEvent];
+        return;
+    }
+    NSMutableData *trace = [self traceEvent:BSTTraceMouseExited];
+    if (trace) {
+        BSTAppendUInt32(trace, BSTDragPayloadNoTag);
+    }
+    [self.currentRollover mouseExited:theEvent];
+}
+
+
+
+-(void)scrollWheel:(NSEvent *)theEvent {
+    
+    if (!self.scrollingEnabled || (contentWidth <= currentWidth)) {
+        [super scrollWheel:theEvent];
+        return;
+    }
+    
+    CGFloat delta = (([theEvent scrollingDeltaX] != 0.0) ? [theEvent scrollingDeltaX] : [theEvent scrollingDeltaY]);
+    if (![theEvent hasPreciseScrollingDeltas]) {
+        delta = delta * BSTscrollLineStep;
+    }
+    self.scrollOffset = self.scrollOffset - delta;
+}
+
+
+
+-(void)mouseDown:(NSEvent *)theEvent {
+    BOOL displayDirty = NO;
+    
+    [self traceMouseEvent:theEvent kind:BSTTraceMouseDown];
+    NSInteger button = [self scrollButtonAtPoint:[self convertPoint:[theEvent locationInWindow] fromView:nil]];
+    scrollButtonClick = (button != 0);
+    if (scrollButtonClick) {  // Scroll half a band, the click is not passed on
+        traceSuppression++;
+        self.scrollOffset = self.scrollOffset + (button * (currentWidth / 2));
+        traceSuppression--;
+        return;
+    }
+    
+    dragStartMouseEvent = theEvent; // Keep this event for dragging purposes - initiated from mouseDragged: message
+    
+    NSInteger cnt = [theEvent clickCount];
+    NSInteger rolloverIndex = [self indexForRolloverTab];  // Get the index of current rollover if any, else -1
+    
+    // If doubleclick edit is enabled and this is a double click then launch interactive edit
+    if (self.doubleClickEditEnabled && (cnt > 1) && self.currentRollover) {
+        
+        BOOL allowed = YES;
+        if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:editingShouldBeginForTabAtIndex:)]) {  // delegate check
+            if (_statisticsEnabled) {
+                counters.delegateCallbacks++;
+            }
+            allowed = [self.delegate tabView:self editingShouldBeginForTabAtIndex:rolloverIndex];
+        }
+        
+        if (allowed) {
+            if ([self beginEditLabelInteractiveForTab:rolloverIndex]) {   // call edit on active tab
+                displayDirty = YES;
+            }
+        }
+    }
+
+    // Postprocess - the editor may widen the tab
+    if (displayDirty) {
+        [self invalidateLayoutAndDisplayFromIndex:rolloverIndex];
+    }
+}
+
+
+
+-(void)mouseUp:(NSEvent *)theEvent {
+
+    [self traceMouseEvent:theEvent kind:BSTTraceMouseUp];
+    if (scrollButtonClick) {  // Consumed by the scroll button
+        scrollButtonClick = NO;
+        return;
+    }
+
+    NSInteger clickedIndex = [self indexOfTabAtPoint:[self convertPoint:[theEvent locationInWindow] fromView:nil]];  // Get the index of the clicked tab if any, else -1
+
+    // If this is a single click on a tab that is not same as selected then change selection
+    if (([theEvent clickCount] == 1) && (clickedIndex >= 0) && (clickedIndex != self.selectedTab)) {
+        traceSuppression++;
+        self.selectedTab = clickedIndex;  // Invalidates what the selection change needs
+        traceSuppression--;
+    }
+    
+    // Set the click related properties
+    _lastClickedTab = clickedIndex;
+    _clickCount = [theEvent clickCount];
+    
+    // Send the target action message
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Warc-performSelector-leaks"
+     
+     if (_target && _action) {
+     [_target performSelector:_action withObject:self afterDelay:0.0];
+     }
+    
+#pragma clang diagnostic pop
+}
+
+
+
+-(void)mouseDragged:(NSEvent *)theEvent {
+    
+    [self traceMouseEvent:theEvent kind:BSTTraceMouseDragged];
+    
+    // Used for initiating dragging after some distance (2)
+    if ((!dragSourceTabs) && (self.userTabDraggingEnabled > BSTTabViewDragNone) && self.currentRollover) {   // Investiage if a drag should start
+        
+        CGFloat deltX = [dragStartMouseEvent locationInWindow].x - [theEvent locationInWindow].x;
+        CGFloat deltY = [dragStartMouseEvent locationInWindow].y - [theEvent locationInWindow].y;
+        CGFloat draggedDist = (deltX * deltX) + (deltY * deltY);
+        if (draggedDist >= 4) {  // begin drag after sqrt(4) distance
+            
+            NSInteger grabbed = [self indexForRolloverTab];
+            
+            // Check with delegate
+            if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:draggingShouldBeginForTabWithIndex:)]) {
+                if (_statisticsEnabled) {
+                    counters.delegateCallbacks++;
+                }
+                if (![self.delegate tabView:self draggingShouldBeginForTabWithIndex:grabbed]) {
+                    return;
+                }
+            }
+            
+            NSIndexSet *indexes = [NSIndexSet indexSetWithIndexesInRange:[self itemRangeForTabAtIndex:grabbed]];  // All tabs of a collapsed group
+            if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:indexesOfTabsToDragWithTabAtIndex:)]) {  // Delegate may add more tabs to the drag
+                if (_statisticsEnabled) {
+                    counters.delegateCallbacks++;
+                }
+                NSIndexSet *requested = [self.delegate tabView:self indexesOfTabsToDragWithTabAtIndex:grabbed];
+                if ([requested containsIndex:grabbed] && (requested.lastIndex < self.tabs.count)) {
+                    indexes = requested;
+                }
+            }
+            
+            // Set up the drag, the payload is only encoded if the pasteboard is read by another application
+            dragSourceTabs = [self.tabs objectsAtIndexes:indexes];
+            NSMutableArray *labels = [[NSMutableArray alloc] initWithCapacity:dragSourceTabs.count];
+            NSMutableArray *tags = [[NSMutableArray alloc] initWithCapacity:dragSourceTabs.count];
+            for (BSTTabViewTab *tab in dragSourceTabs) {
+                [labels addObject:(tab.label ? tab.label : [NSNull null])];
+                [tags addObject:(tab.tag ? tab.tag : [NSNull null])];
+            }
+            dragSourcePayload = [[BSTTabViewDragPayload alloc] initWithLabels:labels tags:tags sourceIndexes:indexes];
+            deleteTabOnSuccessfulDrag = YES;
+            if (replayingTrace) {  // No drag session without a window, the recorded dragging calls follow
+                return;
+            }
+            
+            NSPasteboardItem *item = [[NSPasteboardItem alloc] init];
+            [item setDataProvider:self forTypes:[NSArray arrayWithObject:BSTDragPasteboardType]];
+            
+            NSDraggingItem *di = [[NSDraggingItem alloc] initWithPasteboardWriter:item];
+            NSPoint stPt = [self convertPoint:[dragStartMouseEvent locationInWindow] fromView:nil];
+            NSImage *dragImage = [self.theme dragImage];
+            NSRect r = NSMakeRect(stPt.x + 2, stPt.y + 2, dragImage.size.width, dragImage.size.height);
+            [di setDraggingFrame:r contents:dragImage];
+
+            [self beginDraggingSessionWithItems:[NSArray arrayWithObject:di] event:dragStartMouseEvent source:self];
+        }
+    }
+}
+
+
+-(void)cancelOperation:(id)sender {
+    
+    [labelEditor setString:editedTab.label];
+    [self.window makeFirstResponder:self.window];  // Ending the edit invalidates the tab
+}
+
+
+#pragma mark - Editing and NSTextViewDelegate methods
+
+-(BOOL)beginEditLabelInteractiveForTab:(NSInteger)index {
+    
+    if ([self isGroupCollapsedForTabAtIndex:index]) {  // The summary shows the group label, not the label of the tab
+        return NO;
+    }
+    if (![self.window makeFirstResponder:self.window]) {  // Try to make window first responder to ensure the shared field editor is available.
+        return NO;
+    };
+    
+    NSTextView *tv = (NSTextView *)[self.window fieldEditor:YES forObject:nil]; // take the shared field editor and configure it
+    if (!tv) {  // Did not get the field editor
+        return NO;
+    }
+    
+    // Set font and location
+    [tv setVerticallyResizable:NO];
+    [tv setFont:self.textFont];
+    [tv setBackgroundColor:self.selectedFieldColor];
+    [tv setTextColor:self.editingColor];
+    [tv setEditable:YES];
+
+    editedTab = [self.tabs objectAtIndex:index];
+    tv.string = editedTab.label;         // Set text
+    
+    CGFloat w = editedTab.coreWidth + BSTeditorExtraPadding; // Slightly larger to fit the cursor
+    CGFloat h = (self.tabHeight < (self.preferredTextHeight-(2 * BSTstdYTextOffset))) ? (self.tabHeight-(2 * BSTstdYTextOffset)) : self.preferredTextHeight; // Text height or tab ht - 4 whichever is less
+    [tv setFrameSize:NSMakeSize(w,h)];
+    // x poistion is set in owner draw method to match location of tab
+    
+    tv.textContainer.lineFragmentPadding = 0; // remove padding for alignment with text below
+    
+    // Set delegate
+    tv.delegate = self;
+    // Insert into view hierarchy
+    [self addSubview:tv];
+    [self.window makeFirstResponder:tv];
+    
+    labelEditor = tv;  // Store a reference also used as a flag
+    return YES;
+}
+
+
+-(void)textDidEndEditing:(NSNotification *)notification {
+    
+    
+    // textview editing did end
+    NSTextView *tv = [notification object];
+    
+    [self setLabel:tv.string forTabAtIndex:[self indexOfTab:editedTab]];
+//    [self setLabel:[NSString stringWithString:tv.string] forTabAtIndex:[self.tabs indexOfObject:editedTab]];
+    
+    // Remove the field editor
+    [tv removeFromSuperview];
+    tv.delegate = nil;
+    labelEditor = nil;
+    editedTab = nil;
+}
+
+
+-(void)textDidChange:(NSNotification *)notification {
+    
+    NSTextView *tv = [notification object];
+    CGFloat w = [tv.string sizeWithAttributes:self.selectedTextOptions].width + 2.0;  // Increase the length to follow added text
+    CGFloat h = tv.frame.size.height; // Reuse the old height, will not change
+    CGFloat wlabel = [editedTab widthForLabelString];  // The label itself is unchanged until editing ends so this is a cache hit
+    NSSize siz = NSMakeSize( (w < wlabel ? wlabel : w) , h);  // Set a new size (width) but never less than original (otherwise text below is exposed)
+    [tv setFrameSize:siz];
+    [self invalidateLayoutAndDisplayFromIndex:[self indexOfTab:editedTab]];  // Only the edited tab changes width
+}
+
+#pragma mark - Drag and Drop methods
+
+
+-(BSTTabViewDragPayload *)outgoingDragPayload {
+    
+    return dragSourcePayload;
+}
+
+
+
+-(BSTTabViewDragPayload *)payloadForDraggingInfo:(id<NSDraggingInfo>)sender {
+    
+    if (dragPayload && (dragPayloadSequence == [sender draggingSequenceNumber])) {  // Already have it for this drag
+        return dragPayload;
+    }
+    
+    id src = [sender draggingSource];
+    if ([src isKindOfClass:[BSTTabView class]]) {  // Same application, take it straight from the source without encoding
+        dragPayload = [(BSTTabView *)src outgoingDragPayload];
+    } else {
+        NSData *data = [sender.draggingPasteboard dataForType:BSTDragPasteboardType];
+        dragPayload = (data ? [[BSTTabViewDragPayload alloc] initWithData:data] : nil);
+        if (_statisticsEnabled && data) {
+            counters.dragPayloadDecodes++;
+        }
+    }
+    dragPayloadSequence = [sender draggingSequenceNumber];
+    
+    return dragPayload;
+}
+
+
+
+-(NSIndexSet *)indexesOfDragSourceTabs {
+    
+    NSMutableIndexSet *indexes = [[NSMutableIndexSet alloc] init];
+    for (BSTTabViewTab *tab in dragSourceTabs) {
+        NSInteger index = [self indexOfTab:tab];
+        if (index >= 0) {  // Could have been removed during the drag
+            [indexes addIndex:index];
+        }
+    }
+    return indexes;
+}
+
+
+
+// NSPasteboardItemDataProvider method, called only when the pasteboard is read
+
+-(void)pasteboard:(NSPasteboard *)pasteboard item:(NSPasteboardItem *)item provideDataForType:(NSString *)type {
+    
+    if (dragSourcePayload && [type isEqualToString:BSTDragPasteboardType]) {
+        [item setData:[dragSourcePayload data] forType:type];
+    }
+}
+
+
+// DarggingSource methods
+
+-(NSDragOperation)draggingSession:(NSDraggingSession *)session sourceOperationMaskForDraggingContext:(NSDraggingContext)context {
+    
+    switch(context) {
+        case NSDraggingContextOutsideApplication:
+            if (self.userTabDraggingEnabled >= BSTTabViewDragGlobal) {
+                return NSDragOperationMove;
+            } else {
+                return NSDragOperationNone;
+            }
+            break;
+            
+        case NSDraggingContextWithinApplication:
+        default:
+            if (self.userTabDraggingEnabled >= BSTTabViewDragInternal) {
+                return NSDragOperationMove;
+            } else {
+                return NSDragOperationNone;
+            }
+            break;
+    }
+}
+
+
+
+
+-(BOOL)ignoreModifierKeysForDraggingSession:(NSDraggingSession *)session {
+    return YES;
+}
+
+
+
+-(void)draggingSession:(NSDraggingSession *)session endedAtPoint:(NSPoint)screenPoint operation:(NSDragOperation)operation {
+    
+    NSMutableData *trace = [self traceEvent:BSTTraceDraggingEnded];
+    if (trace) {
+        BSTAppendUInt32(trace, (uint32_t)operation);
+    }
+    BOOL success = (operation == NSDragOperationMove ? YES : NO);
+
+    if (success && deleteTabOnSuccessfulDrag) {  // The move eas successful and the insert and remove operation is not in same control
+
+        traceSuppression++;
+        [self removeTabsAtIndexes:[self indexesOfDragSourceTabs]];  // One remove for all the dragged tabs
+        traceSuppression--;
+    }
+    
+    // Inform delegate
+    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:draggingDidFinishForTabWithLabel:tag:success:)]) {
+        for (BSTTabViewTab *tab in dragSourceTabs) {
+            if (_statisticsEnabled) {
+                counters.delegateCallbacks++;
+            }
+            [self.delegate tabView:self draggingDidFinishForTabWithLabel:tab.label tag:tab.tag success:success];
+        }
+    }
+
+    dragSourceTabs = nil;
+    dragSourcePayload = nil;
+    dragStartMouseEvent = nil;
+    [self invalidatePaint];  // Removing the dragged tabs has invalidated the layout
+}
+
+
+
+// DraggingDestination metthods
+
+-(NSDragOperation)draggingEntered:(id<NSDraggingInfo>)sender {
+    
+    /*
+     * This method determines the response for dragging inside the control and stores that in the state managing variables
+     * the state managing varaibles are used to indicate that a inswrt opoint is to be drawn 
+     * and whre a tab should be inserted on a successful conclude operation.
+     * The state managing variables are unset on a successful conclusion or on exit
+     */
+    
+    [self traceDraggingInfo:sender kind:BSTTraceDraggingEntered];
+    if (self.userTabDraggingEnabled == BSTTabViewDragNone) {  // No dragging allowed return early
+      destinationDragOperation = NSDragOperationNone;
+        return destinationDragOperation;
+    }
+    
+    id src = [sender draggingSource]; // Find the source of the drag and compare to the settings flag
+    if (!src) {  // This is coming from other application
+        
+        if (self.userTabDraggingEnabled >= BSTTabViewDragGlobal) {  // Corss app dragging is permitted, check if we have a payload
+            if ([self payloadForDraggingInfo:sender]) {  // The pasteboard has a valid payload, decoded once here and reused for the rest of the drag
+                destinationDragOperation = NSDragOperationMove & [sender draggingSourceOperationMask];
+            } else {  // Not a tab payload
+                destinationDragOperation = NSDragOperationNone;
+            }
+        } else { // Cross app drag not allowed
+            destinationDragOperation = NSDragOperationNone;
+        }
+        
+    } else {  // there is a source object means source is in same application
+        
+        if ([src isKindOfClass:[BSTTabView class]]) {  // sender is a BSTTabView - required
+            if ((self.userTabDraggingEnabled >= BSTTabViewDragLocal) && ([(BSTTabView *)src userTabDraggingEnabled] >= BSTTabViewDragLocal) ) { // any sender in same app is ok, but we need to check the sender allows cross control drags also
+                destinationDragOperation = NSDragOperationMove & [sender draggingSourceOperationMask];
+            } else { // == BSTTabViewDragInternal
+                if (src == self) {  // must be same sender
+                    destinationDragOperation = NSDragOperationMove & [sender draggingSourceOperationMask];
+                } else {
+                    destinationDragOperation = NSDragOperationNone;
+                }
+            }
+        } else {
+            destinationDragOperation = NSDragOperationNone; // Sender is some other class - not valid
+        };
+    }
+    if (destinationDragOperation == NSDragOperationMove) {
+        validDragInDest = YES; // Set the other state managing variables
+        dragInsertPoint = -1; // Placeholder to before first tab - will change on first draggging Updated message.
+        [self setNeedsDisplayInRect:[self rectForInsertPoint:dragInsertPoint]];
+    }
+    
+    return destinationDragOperation;
+}
+
+
+
+-(BOOL)wantsPeriodicDraggingUpdates {
+    
+    return self.scrollingEnabled; // Only get updates on move, unless auto scroll needs them while the drag rests at an edge
+}
+
+
+
+
+-(NSDragOperation)draggingUpdated:(id<NSDraggingInfo>)sender {
+    
+    /*
+     * This method is used to determine the insert point in case the drag operation were to conclude next
+     * it is recalculating every time and storing the reult in a state varaible.  A short circuit could 
+     * be considered to check if the previous value is valid before going into the full calculation
+     * but given the rarity of drags this is felt unneeded until a performace issue is seen
+     */
+
+    [self traceDraggingInfo:sender kind:BSTTraceDraggingUpdated];
+    
+    if (validDragInDest) {   // Calculate the point of the visual feedback if the drag is valid
+        NSPoint drPt = [self convertPoint:[sender draggingLocation] fromView:nil];
+        
+        if (self.scrollingEnabled) {  // Auto scroll near the edges
+            traceSuppression++;
+            if (drPt.x < BSTautoScrollZone) {
+                self.scrollOffset = self.scrollOffset - BSTautoScrollStep;
+            } else if (drPt.x > (currentWidth - BSTautoScrollZone)) {
+                self.scrollOffset = self.scrollOffset + BSTautoScrollStep;
+            }
+            traceSuppression--;
+        }
+        
+        NSInteger insPoint = [self insertPointForXLocation:drPt.x];  // insPoint is defined as tab before insert point (-1 == before first)
+        
+        if (dragInsertPoint != insPoint) {   // if point changed, update state variable and request redraw of old and new mark
+            [self setNeedsDisplayInRect:[self rectForInsertPoint:dragInsertPoint]];
+            dragInsertPoint = insPoint;
+            [self setNeedsDisplayInRect:[self rectForInsertPoint:dragInsertPoint]];
+        }
+
+    }
+    
+    return destinationDragOperation;
+}
+
+
+
+
+-(void)draggingExited:(id<NSDraggingInfo>)sender {
+    
+    [self traceDraggingInfo:sender kind:BSTTraceDraggingExited];
+    
+    // Unset the state managing variables
+    validDragInDest = NO;
+    [self setNeedsDisplayInRect:[self rectForInsertPoint:dragInsertPoint]];
+    dragInsertPoint = -1;
+}
+
+
+
+
+-(BOOL)prepareForDragOperation:(id<NSDraggingInfo>)sender {
+    
+    [self traceDraggingInfo:sender kind:BSTTracePrepareForDragOperation];
+    BSTTabViewDragPayload *payload = [self payloadForDraggingInfo:sender];
+
+    if (payload.labels.count == 0) {  // Something is wrong, there should be at least one tab in the payload
+        validDragInDest = NO;  // unset the state variable if we are going to deny drag
+        [self setNeedsDisplay:YES];
+
+        return NO;
+    }
+    
+    // There is a valid payload - Ask delegate if ok to insert each tab
+    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:draggedTabWillBeInsertedWithIndex:label:tag:sourceExternal:)]) {
+        for (NSUInteger i = 0; i < payload.labels.count; i++) {
+            id label = [payload.labels objectAtIndex:i];
+            id tag = [payload.tags objectAtIndex:i];
+            if (_statisticsEnabled) {
+                counters.delegateCallbacks++;
+            }
+            if (![self.delegate tabView:self draggedTabWillBeInsertedWithIndex:(dragInsertPoint + 1 + i) label:(label == [NSNull null] ? nil : label) tag:(tag == [NSNull null] ? nil : tag) sourceExternal:([sender draggingSource] ? NO : YES)]) {
+                validDragInDest = NO;  // unset the state variable if we are going to deny drag
+                [self setNeedsDisplay:YES];
+
+                return NO;
+            };
+        }
+    }
+    
+    return YES;  // Default return if no delegate method
+}
+
+
+
+
+-(BOOL)performDragOperation:(id<NSDraggingInfo>)sender {
+    
+    // if we get here we are good to go, validation done in prepareForDragOperation
+    
+    [self traceDraggingInfo:sender kind:BSTTracePerformDragOperation];
+    BOOL success = YES;
+    traceSuppression++;  // The insert or move is part of the recorded drag
+
+    if ([sender draggingSource] == self ) {  // This drag can be short-circuited by using the moveTabs method
+        
+        NSIndexSet *frm = [self indexesOfDragSourceTabs];
+        NSUInteger to = (dragInsertPoint + 1);
+        
+        to = to - [frm countOfIndexesInRange:NSMakeRange(0, to)];  // moveTabsAtIndexes counts without the moved tabs
+        if ([self moveTabsAtIndexes:frm toIndex:to] == -1) {
+            success = NO;
+        }
+        deleteTabOnSuccessfulDrag = NO; // Flag the sender (== self) that no delete is needed
+        
+    }
+    else { // Do a proper new insert and assume the sender will do a delete
+
+        BSTTabViewDragPayload *payload = [self payloadForDraggingInfo:sender];
+        
+        if (![self addTabsWithLabels:payload.labels tags:payload.tags atIndex:(dragInsertPoint + 1)]) {  // Try insert, all tabs in one go
+            success = NO;
+        }
+    }
+    
+    traceSuppression--;
+    
+    // Done - unset the state managing variables
+    validDragInDest = NO;
+    dragPayload = nil;
+    [self invalidatePaint];  // Remove the insert mark, inserting or moving has invalidated the layout
+    
+    return success;
+}
+
+
+
+-(void)concludeDragOperation:(id<NSDraggingInfo>)sender {
+    
+    // Do nothing here
+}
+
+
+
+#pragma mark - Action methods
+
+
+-(NSInteger)addTabWithLabel:(NSString *)label tag:(NSString *)tag {
+    
+    return [self addTabWithLabel:label tag: tag atIndex:self.tabs.count];
+}
+
+
+-(NSInteger)addTabWithLabel:(NSString *)label tag:(NSString *)tag atIndex:(NSUInteger)requestedIndex{
+    
+    NSMutableData *trace = [self traceEvent:BSTTraceAddTab];
+    if (trace) {
+        BSTAppendUInt32(trace, BSTTraceIndex(requestedIndex));
+        BSTAppendString(trace, label);
+        BSTAppendString(trace, tag);
+    }
+    NSInteger newIndex = ((requestedIndex > self.tabs.count) ? self.tabs.count : requestedIndex); // Set to end if higher then end
+    
+    // End editing and if not abort
+    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
+        return -1;
+    }
+
+    BSTTabViewTab *tab = [self dequeueTab];
+    tab.tag = [self addTab:tab toMap:tabsByTag forKey:tag];
+    tab.label = [self addTab:tab toMap:tabsByLabel forKey:label];
+    [[self pendingChangesBeforeMovingTabs:YES].insertedTabs addObject:tab];
+    [self.tabs insertObject:tab atIndex:newIndex];
+    [self invalidateCachedIndexesFrom:newIndex];
+    [self joinGroupAroundTabsInRange:NSMakeRange(newIndex, 1)];
+    
+    // Check if selected tab index change and notify
+    if (self.selectedTab >= newIndex) {  // At or after insertion point will increase by one
+        [self shiftSelectedTabIndexTo:(_selectedTab + 1)];
+    }
+    
+    [self invalidateLayoutAndDisplayFromIndex:newIndex];
+    return (newIndex);
+}
+
+
+
+
+-(BOOL)removeTabAtIndex:(NSUInteger)index {
+    
+    NSMutableData *trace = [self traceEvent:BSTTraceRemoveTab];
+    if (trace) {
+        BSTAppendUInt32(trace, BSTTraceIndex(index));
+    }
+    if (index >= self.tabs.count) {
+        return NO;  // Invalid index
+    }
+    
+    // End editing and if not abort
+    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
+        return NO;
+    }
+
+    // Check selected tab status and notify
+    if (self.selectedTab == index) {  // Removing selected tab
+        traceSuppression++;
+        self.selectedTab = -1;  // Try to change to selection - triggers delegate notification methods
+        traceSuppression--;
+        if (self.selectedTab != -1) {  // Change was denied by deleagte - abort
+            return NO;
+        }
+    }
+    
+    // Remove it
+    BSTTabViewTab *tab = [self.tabs objectAtIndex:index];
+    [self removeTab:tab fromMap:tabsByTag forKey:tab.tag];
+    [self removeTab:tab fromMap:tabsByLabel forKey:tab.label];
+    [self pendingChangesBeforeMovingTabs:YES];
+    [self.tabs removeObjectAtIndex:index];
+    [self invalidateCachedIndexesFrom:index];
+    [self recycleTab:tab];
+    
+    // Check if selected tab index change and notify
+    if (self.selectedTab > (NSInteger)index) {  // After removal point will reduce by one
+        [self shiftSelectedTabIndexTo:(_selectedTab - 1)];
+    }
+    
+    [self invalidateLayoutAndDisplayFromIndex:index];
+    return YES;
+}
+
+
+
+-(NSInteger)moveTabAtIndex:(NSUInteger)fromIndex toIndex:(NSUInteger)toIndex {
+    
+    // Validate intended indexes
+    if ((fromIndex >= self.tabs.count) || (toIndex >= self.tabs.count)) {
+        return -1;  // Invalid index
+    }
+    
+    if (fromIndex == toIndex) {  // No move - abort
+        return (NSInteger)fromIndex;
+    }
+    
+    // End editing and if not abort
+    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
+        return -1;
+    }
+
+    // Do the move
+    BSTTabViewTab *tab = [self.tabs objectAtIndex:fromIndex];
+    [[self pendingChangesBeforeMovingTabs:YES].movedTabs addObject:tab];
+    [self.tabs removeObjectAtIndex:fromIndex];
+    [self.tabs insertObject:tab atIndex:toIndex];
+    [self invalidateCachedIndexesFrom:(fromIndex < toIndex ? fromIndex : toIndex)];
+    [self joinGroupAroundTabsInRange:NSMakeRange(toIndex, 1)];
+    
+    // Calculate if the selected tab index will change - change and delegate notify
+    NSInteger newSelected = self.selectedTab;
+    
+    if (fromIndex == self.selectedTab) {   // The selected tab is moving
+        
+        newSelected = toIndex;
+        
+    } else {  // The selected tab is not moving
+        
+        if (self.selectedTab > fromIndex  ) {  // Selected tab is after removal point will step one down
+            newSelected = newSelected - 1;
+        }
+        
+        if (newSelected >= toIndex) {  // Selected tab is at or after insertion point will step one up
+            newSelected = newSelected + 1;
+        }
+    }
+    
+    if (newSelected != self.selectedTab) {  // Selected tab is moving
+        [self shiftSelectedTabIndexTo:newSelected];
     }
     
-    _selectedTab = selectedTab;
-    [self setNeedsDisplay:YES];
+    [self invalidateLayoutAndDisplayFromIndex:(fromIndex < toIndex ? fromIndex : toIndex)];
+
+    return toIndex;
+}
+
+
+
+-(NSIndexSet *)addTabsWithLabels:(NSArray *)labels tags:(NSArray *)tags atIndex:(NSUInteger)requestedIndex {
     
-    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:tabWithIndexDidBecomeSelected:)]) {
-        [self.delegate tabView:self tabWithIndexDidBecomeSelected:selectedTab];
+    if (!labels || (tags && (tags.count != labels.count))) {
+        return nil;
     }
+    NSMutableData *trace = [self traceEvent:BSTTraceAddTabs];
+    if (trace) {
+        BSTAppendUInt32(trace, BSTTraceIndex(requestedIndex));
+        BSTAppendUInt32(trace, (uint32_t)labels.count);
+        for (NSUInteger i = 0; i < labels.count; i++) {
+            id label = [labels objectAtIndex:i];
+            id tag = [tags objectAtIndex:i];
+            BSTAppendString(trace, ((label == [NSNull null]) ? nil : label));
+            BSTAppendString(trace, ((tag == [NSNull null]) ? nil : tag));
+        }
+    }
+    
+    NSUInteger newIndex = ((requestedIndex > self.tabs.count) ? self.tabs.count : requestedIndex); // Set to end if higher then end
+    
+    // End editing and if not abort
+    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
+        return nil;
+    }
+    
+    NSMutableArray *newTabs = [[NSMutableArray alloc] initWithCapacity:labels.count];
+    for (NSUInteger i = 0; i < labels.count; i++) {
+        BSTTabViewTab *tab = [self dequeueTab];
+        id label = [labels objectAtIndex:i];
+        id tag = [tags objectAtIndex:i];
+        tab.tag = [self addTab:tab toMap:tabsByTag forKey:((tag == [NSNull null]) ? nil : tag)];
+        tab.label = [self addTab:tab toMap:tabsByLabel forKey:((label == [NSNull null]) ? nil : label)];
+        [newTabs addObject:tab];
+    }
+    
+    NSIndexSet *indexes = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(newIndex, newTabs.count)];
+    BSTTabViewPendingChanges *changes = [self pendingChangesBeforeMovingTabs:YES];
+    for (BSTTabViewTab *tab in newTabs) {
+        [changes.insertedTabs addObject:tab];
+    }
+    [self.tabs insertObjects:newTabs atIndexes:indexes];  // One shift of the tail
+    [self invalidateCachedIndexesFrom:newIndex];
+    [self joinGroupAroundTabsInRange:NSMakeRange(newIndex, newTabs.count)];
+    
+    // Check if selected tab index change and notify
+    if ((self.selectedTab >= (NSInteger)newIndex) && (newTabs.count > 0)) {
+        [self shiftSelectedTabIndexTo:(_selectedTab + newTabs.count)];
+    }
+    
+    [self invalidateLayoutAndDisplayFromIndex:newIndex];
+    return indexes;
 }
 
 
 
--(void)setCurrentRollover:(BSTTabViewTab *)currentRollover {
+-(BOOL)removeTabsAtIndexes:(NSIndexSet *)indexes {
     
-    if (currentRollover) {
-        
-        if ([_currentRollover isEqual:currentRollover]) { // No change
-            return;
+    NSMutableData *trace = [self traceEvent:BSTTraceRemoveTabs];
+    if (trace) {
+        BSTAppendIndexSet(trace, indexes);
+    }
+    if (!indexes || (indexes.count == 0)) {
+        return YES;  // Nothing to do
+    }
+    if (indexes.lastIndex >= self.tabs.count) {
+        return NO;  // Invalid index
+    }
+    
+    // End editing and if not abort
+    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
+        return NO;
+    }
+    
+    // Check selected tab status and notify
+    if ((self.selectedTab >= 0) && [indexes containsIndex:self.selectedTab]) {  // Removing selected tab
+        traceSuppression++;
+        self.selectedTab = -1;  // Try to change to selection - triggers delegate notification methods
+        traceSuppression--;
+        if (self.selectedTab != -1) {  // Change was denied by deleagte - abort
+            return NO;
         }
-        _currentRollover = currentRollover;
-        [self setNeedsDisplay:YES];
-        
     }
-    else {  // set to nil
-        
-        if (!_currentRollover) {
-            return;
+    
+    // Remove them in one pass
+    if (indexes.count == self.tabs.count) {  // All go, no need to unregister one by one
+        [tabsByTag removeAllObjects];
+        [tabsByLabel removeAllObjects];
+    } else {
+        for (BSTTabViewTab *tab in [self.tabs objectsAtIndexes:indexes]) {
+            [self removeTab:tab fromMap:tabsByTag forKey:tab.tag];
+            [self removeTab:tab fromMap:tabsByLabel forKey:tab.label];
+        }
+    }
+    NSArray *removed = ((self.tabPoolLimit > 0) ? [self.tabs objectsAtIndexes:indexes] : nil);
+    [self pendingChangesBeforeMovingTabs:YES];
+    [self.tabs removeObjectsAtIndexes:indexes];
+    [self invalidateCachedIndexesFrom:indexes.firstIndex];
+    for (BSTTabViewTab *tab in removed) {
+        [self recycleTab:tab];
+    }
+    
+    // Check if selected tab index change and notify
+    if (self.selectedTab > 0) {
+        NSUInteger before = [indexes countOfIndexesInRange:NSMakeRange(0, self.selectedTab)];
+        if (before > 0) {
+            [self shiftSelectedTabIndexTo:(_selectedTab - before)];
         }
-        _currentRollover = nil;
-        [self setNeedsDisplay:YES];
     }
+    
+    [self invalidateLayoutAndDisplayFromIndex:indexes.firstIndex];
+    return YES;
 }
 
 
-#pragma mark - drawing
 
--(BOOL)isFlipped{
- 
-    return !self.topEdgeAligned;    // Flip all drawing coordinates if bottom edge
+-(BOOL)removeAllTabs {
+    
+    return [self removeTabsAtIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, self.tabs.count)]];
 }
 
 
--(BOOL)isOpaque{  // used to prevent mouse drag events beeing sent on to superview
-    return YES;
+
+-(NSInteger)moveTabsAtIndexes:(NSIndexSet *)indexes toIndex:(NSUInteger)toIndex {
+    
+    NSMutableData *trace = [self traceEvent:BSTTraceMoveTabs];
+    if (trace) {
+        BSTAppendIndexSet(trace, indexes);
+        BSTAppendUInt32(trace, BSTTraceIndex(toIndex));
+    }
+    if (!indexes || (indexes.count == 0) || (indexes.lastIndex >= self.tabs.count)) {
+        return -1;  // Invalid index
+    }
+    
+    NSUInteger remaining = self.tabs.count - indexes.count;
+    NSUInteger newIndex = ((toIndex > remaining) ? remaining : toIndex);  // Index in the array after the moved tabs are taken out
+    
+    // End editing and if not abort
+    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
+        return -1;
+    }
+    
+    // Calculate the new selected index before the move
+    NSInteger newSelected = self.selectedTab;
+    if (self.selectedTab >= 0) {
+        NSUInteger before = [indexes countOfIndexesInRange:NSMakeRange(0, self.selectedTab)];  // Moved tabs before the selected
+        if ([indexes containsIndex:self.selectedTab]) {  // The selected tab is moving with the others
+            newSelected = newIndex + before;
+        } else {
+            newSelected = self.selectedTab - before;
+            if (newSelected >= (NSInteger)newIndex) {  // At or after insertion point will step up
+                newSelected = newSelected + indexes.count;
+            }
+        }
+    }
+    
+    // Do the move - one removal and one insertion
+    NSArray *moved = [self.tabs objectsAtIndexes:indexes];
+    BSTTabViewPendingChanges *changes = [self pendingChangesBeforeMovingTabs:YES];
+    for (BSTTabViewTab *tab in moved) {
+        [changes.movedTabs addObject:tab];
+    }
+    [self.tabs removeObjectsAtIndexes:indexes];
+    [self.tabs insertObjects:moved atIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(newIndex, moved.count)]];
+    [self invalidateCachedIndexesFrom:(indexes.firstIndex < newIndex ? indexes.firstIndex : newIndex)];
+    [self joinGroupAroundTabsInRange:NSMakeRange(newIndex, moved.count)];
+    
+    if (newSelected != self.selectedTab) {  // Selected tab is moving
+        [self shiftSelectedTabIndexTo:newSelected];
+    }
+    
+    [self invalidateLayoutAndDisplayFromIndex:(indexes.firstIndex < newIndex ? indexes.firstIndex : newIndex)];
+    return newIndex;
 }
 
 
--(BOOL)mouseDownCanMoveWindow{ // used to prevent mouse drag events beeing sent on to superview
+
+-(void)beginUpdates {
     
-    return NO;
+    [self traceEvent:BSTTraceBeginUpdates];
+    if (updateDepth == 0) {
+        if (labelEditor) {  // End editing once for the whole transaction
+            [self.window makeFirstResponder:self.window];
+        }
+        updatesNotifiedSelection = self.selectedTab;
+    }
+    updateDepth++;
 }
 
 
 
-- (void)drawRect:(NSRect)dirtyRect {
+-(void)endUpdates {
+    
+    [self traceEvent:BSTTraceEndUpdates];
+    if (updateDepth == 0) {  // Unbalanced
+        return;
+    }
+    updateDepth--;
+    if (updateDepth > 0) {
+        return;
+    }
+    
+    if (self.selectedTab != updatesNotifiedSelection) {  // The selected tab changed index during the transaction - notify once
+        NSInteger newSelected = _selectedTab;
+        _selectedTab = updatesNotifiedSelection;  // Restore the notified value so KVO observers see the correct old value
+        [self shiftSelectedTabIndexTo:newSelected];
+    }
     
-    // Ignore the dirty rect and draw full control allways
+    if (self.LayoutIsInvalid || geometryIsInvalid) {
+        [self setNeedsDisplay:YES];
+    }
+    [self sendPendingChanges];
+}
 
-    [super drawRect:dirtyRect];
+
+
+-(void)shiftSelectedTabIndexTo:(NSInteger)newSelected {
     
-    NSRect bounds = [self bounds];
+    if (updateDepth > 0) {  // Notified once in endUpdates
+        _selectedTab = newSelected;
+        return;
+    }
+    
+    [self willChangeValueForKey:@"selectedTab"];  // Do key value calls without the setter to prevent delegate calls
+    _selectedTab = newSelected;
+    [self didChangeValueForKey:@"selectedTab"];
+    
+    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:selectedTabChangedIndexTo:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
+        }
+        [self.delegate tabView:self selectedTabChangedIndexTo:newSelected];
+    }
+}
 
-    if (bounds.size.width != currentWidth) {
-        currentWidth = bounds.size.width;
-        self.LayoutIsInvalid = YES;
+
+
+/*
+ * The changes are collected by identity in pendingChanges and turned into indexes here, once per change set. The old
+ * tabs are only walked when tabs were inserted, removed or moved, their copy was taken before the first such change.
+ */
+-(BSTTabViewPendingChanges *)pendingChangesBeforeMovingTabs:(BOOL)moving {
+    
+    if (!pendingChanges) {
+        if (renderingOffscreen || !self.delegate || ![self.delegate respondsToSelector:@selector(tabView:didChangeTabs:)]) {
+            return nil;
+        }
+        pendingChanges = [[BSTTabViewPendingChanges alloc] init];
+        pendingChanges.oldSelectedTab = _selectedTab;
+        if (updateDepth == 0) {  // Else sent from the outermost endUpdates
+            __weak BSTTabView *weakSelf = self;
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [weakSelf sendPendingChanges];
+            });
+        }
     }
+    if (moving && !pendingChanges.oldTabs) {
+        pendingChanges.oldTabs = [self.tabs copy];
+    }
+    return pendingChanges;
+}
+
+
+
+-(void)sendPendingChanges {
     
-    if (bounds.size.height != currentHeight) {
-        currentHeight = bounds.size.height;
-        self.tabHeight = self.maxTabHeight;  // reset the tab height - possibly
+    if (!pendingChanges || (updateDepth > 0)) {
+        return;
+    }
+    BSTTabViewPendingChanges *changes = pendingChanges;
+    pendingChanges = nil;  // Changes made by the delegate go in the next change set
+    
+    NSMutableIndexSet *removed = [[NSMutableIndexSet alloc] init];
+    NSMutableIndexSet *inserted = [[NSMutableIndexSet alloc] init];
+    NSMutableIndexSet *relabeled = [[NSMutableIndexSet alloc] init];
+    NSMutableIndexSet *retagged = [[NSMutableIndexSet alloc] init];
+    NSMutableDictionary *moves = [[NSMutableDictionary alloc] init];
+    
+    NSUInteger oldIndex = 0;
+    for (BSTTabViewTab *tab in changes.oldTabs) {
+        NSInteger index = [self indexOfTab:tab];
+        if (index < 0) {
+            [removed addIndex:oldIndex];
+        } else if ([changes.movedTabs containsObject:tab]) {
+            [moves setObject:[NSNumber numberWithInteger:index] forKey:[NSNumber numberWithUnsignedInteger:oldIndex]];
+        }
+        oldIndex++;
     }
     
-    [self.backgroundColor set];
-    [NSBezierPath fillRect:bounds];     // Draw background
+    if (changes.tabsReplaced) {  // No tab is kept
+        [inserted addIndexesInRange:NSMakeRange(0, self.tabs.count)];
+    } else {
+        for (BSTTabViewTab *tab in changes.insertedTabs) {
+            NSInteger index = [self indexOfTab:tab];
+            if (index >= 0) {  // Not removed again
+                [inserted addIndex:index];
+            }
+        }
+        for (BSTTabViewTab *tab in changes.relabeledTabs) {
+            NSInteger index = [self indexOfTab:tab];
+            if ((index >= 0) && ![changes.insertedTabs containsObject:tab]) {
+                [relabeled addIndex:index];
+            }
+        }
+        for (BSTTabViewTab *tab in changes.retaggedTabs) {
+            NSInteger index = [self indexOfTab:tab];
+            if ((index >= 0) && ![changes.insertedTabs containsObject:tab]) {
+                [retagged addIndex:index];
+            }
+        }
+    }
     
-    if (self.LayoutIsInvalid) {  // Recalc layout if needed
-        [self reassignTabPositionAndTrackingArea];
+    for (BSTTabViewTab *tab in changes.retiredTabs) {  // No longer needed by identity
+        [self recycleTab:tab];
     }
     
-    // Draw tabs
-    for (NSUInteger i = 0; i < self.tabs.count; i++) {   // For each tab call draw
-        if (i != self.selectedTab) {     //Delay selected - Draw selected last to be on top
-            [(BSTTabViewTab *)[self.tabs objectAtIndex:i] drawSelf:NO];
+    if ((removed.count == 0) && (inserted.count == 0) && (moves.count == 0) && (relabeled.count == 0) && (retagged.count == 0) &&
+        (changes.oldSelectedTab == _selectedTab)) {  // Changed back, or a denied selection
+        return;
+    }
+    
+    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:didChangeTabs:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
         }
+        [self.delegate tabView:self didChangeTabs:[[BSTTabViewChangeSet alloc] initWithRemoved:removed inserted:inserted moves:moves relabeled:relabeled retagged:retagged selectedBefore:changes.oldSelectedTab after:_selectedTab]];
     }
-    if (self.selectedTab >= 0) {
-        [(BSTTabViewTab *)[self.tabs objectAtIndex:self.selectedTab] drawSelf:YES];  // Finally draw selected tab
+}
+
+
+
+-(void)invalidateLayoutAndDisplayFromIndex:(NSUInteger)index {
+    
+    _LayoutIsInvalid = YES;  // Not through the setter, only the tabs from index on need a new layout
+    if (index < layoutDirtyFrom) {
+        layoutDirtyFrom = index;
+    }
+    if (updateDepth == 0) {  // Display requested once in endUpdates
+        [self setNeedsDisplay:YES];
+    }
+}
+
+
+
+/*
+ * A relabeled tab keeps the layout when it was uncompressed and the tab requests exactly the width it had, as with
+ * counters, times and prices in digits of equal width. In a compressed layout it keeps the layout when it is not the
+ * selected tab, both widths are at least stableCappedWidth and the longest requested width stays the same: the tab
+ * is capped before and after and the cap steps of BSTCompressionCapForWidths see the same totals, so the cap comes
+ * out the same. Only the area of the tab is then repainted, in constant time.
+ */
+-(void)invalidateTab:(BSTTabViewTab *)tab atIndex:(NSUInteger)index relabeledFromWidth:(CGFloat)oldWidth {
+    
+    if (self.LayoutIsInvalid || (tab == editedTab) || (oldWidth < 0.0) || (index >= tabTableCount)) {  // Relayout pending or the old width is not known
+        [self invalidateLayoutAndDisplayFromIndex:index];
+        return;
+    }
+    if (tab.group.collapsed) {  // The label is not drawn or laid out while collapsed
+        return;
     }
     
-    // Draw insert point
-    if (validDragInDest) {
-        NSBezierPath* bp = [[NSBezierPath alloc] init];;
-        NSPoint pt;
-        CGFloat baseX;
-        
-        if (dragInsertPoint == -1) {  // Insert first
-            baseX = (self.spacerWidth / 2);
-        } else {  // Insert after tab nr dragInsertPoint
-            BSTTabViewTab *tab = [self.tabs objectAtIndex:dragInsertPoint];
-            baseX = tab.startX + tab.coreWidth + (self.spacerWidth / 2);
+    CGFloat newWidth = [tab widthForLabelString];
+    BOOL stable;
+    if ([tab cachedLabelWidth] < 0.0) {  // An estimate, measured in the background and laid out when it arrives
+        stable = NO;
+    } else if (!layoutIsCompressed) {
+        stable = (newWidth == oldWidth);
+    } else {
+        BOOL longestKept = ((newWidth <= longestRequestedWidth) && ((oldWidth < longestRequestedWidth) || (newWidth == oldWidth) || (longestRequestedCount > 1)));
+        stable = (longestKept && ((NSInteger)index != self.selectedTab) && (oldWidth >= stableCappedWidth) && (newWidth >= stableCappedWidth));
+        if (stable && (newWidth != oldWidth)) {  // Keep the count of tabs at the longest width
+            if (oldWidth == longestRequestedWidth) {
+                longestRequestedCount--;
+            } else if (newWidth == longestRequestedWidth) {
+                longestRequestedCount++;
+            }
         }
-        
-        if (currentHeight < BSTsmallTabHeightThreshold) {  // The small insert
-            
-            pt.x = baseX;
-            pt.y = 0;
-            [bp moveToPoint:pt];
-            
-            pt.x = baseX;
-            pt.y = currentHeight;
-            [bp lineToPoint:pt];
-            
-        } else {  // The bigger insert
-            CGFloat ht = ((self.maxTabHeight + 2) > currentHeight ? currentHeight : self.maxTabHeight + 2);
-            pt.x = baseX;
-            pt.y = ht - 8;
-            [bp moveToPoint:pt];
-            
-            pt.x = baseX;
-            pt.y = ht-5;
-            [bp lineToPoint:pt];
-            
-            pt.x = baseX - 2;
-            pt.y = ht;
-            [bp lineToPoint:pt];
+    }
+    
+    if (!stable) {
+        [self invalidateLayoutAndDisplayFromIndex:index];
+        return;
+    }
+    if ([materializedTabs containsObject:tab]) {  // Tabs outside the visible band are drawn when scrolled to
+        [self setNeedsDisplayForTab:tab];
+    }
+}
 
-            pt.x = baseX + 2;
-            pt.y = ht;
-            [bp lineToPoint:pt];
 
-            pt.x = baseX;
-            pt.y = ht-5;
-            [bp lineToPoint:pt];
 
-        } // end big mark
-        
-        [self.editingColor set];
-        [bp stroke];
-        
-    }  // end draw mark code
+/*
+ * The invalidation kinds from widest to narrowest are layout (any width may change), tab mutation from an index
+ * (invalidateLayoutAndDisplayFromIndex:), geometry (shapes but not widths), paint (appearance only) and a single
+ * tab (setNeedsDisplayForTab:). Only the two layout kinds make the next display run a layout pass, and the layout
+ * runs at most once however many invalidations came before it.
+ */
+-(void)invalidateLayout {
+    
+    self.LayoutIsInvalid = YES;  // The setter flags the full pass
+    if (updateDepth == 0) {  // Display requested once in endUpdates
+        [self setNeedsDisplay:YES];
+    }
+}
+
+
+
+-(void)invalidateGeometry {
+    
+    geometryIsInvalid = YES;
+    if (updateDepth == 0) {  // Display requested once in endUpdates
+        [self setNeedsDisplay:YES];
+    }
+}
+
+
+
+-(void)invalidatePaint {
+    
+    [self setNeedsDisplay:YES];
+}
+
+
+
+-(void)updateLayoutIfNeeded {
+    
+    if (self.LayoutIsInvalid) {  // Also gives the visible tabs their geometry
+        [self reassignTabPositionAndTrackingArea];
+    } else if (geometryIsInvalid) {  // Same positions, new shapes
+        [self materializeVisibleTabs];
+    }
+    geometryIsInvalid = NO;
 }
 
 
 
+#pragma mark - Tab groups
 
-/* 
- * This method allocates location and widths to tabs and sets the tracking areas
- * It works in this way
- * Step 1 it tries to give all tabs all the sapece they want
- * Step 2 if that does not work because the tab row space is to small 
- * it gradually decreases the length of longer tabs except the current tab
- * until space is sufficient or the min tab width is rached
- * If min width is reached it renders as many tabs as it can in that space and sends a delegate
- * message that space is insufficient.
- * Step 3 it actually assigns the allocated poitions and tracking areas to each tab
- * The method also aligns the editor with it's tab if the editor is visible
+/*
+ * A tab is in the group its group property points to. Tabs inserted or moved between two tabs of the same group join
+ * it, see joinGroupAroundTabsInRange:, so a group only comes apart when some of its tabs are moved away or grouped
+ * again. The groups ending before groupsDirtyFrom keep their ranges, the tabs from the first of the other groups on
+ * are walked once to find their ranges again. The longest run of a split group keeps it and the other tabs leave it.
+ * A collapsed group is one item in the layout tables, its first tab is laid out, drawn and tracked with the summary
+ * label and the other tabs are placed where it ends with no width, see BSTPlaceCollapsedTabs, so the index based
+ * lookups keep working without measuring, drawing or tracking them.
  */
-
--(void)reassignTabPositionAndTrackingArea{
+-(void)updateTabGroupsIfNeeded {
     
-    CGFloat totalRequested = self.spacerWidth;      // Start with one spacer width to the left side
-    CGFloat longestRequested = BSTminTabWidth + 1.0;   // Start value > min width, in case all tabs are shorter than min to prevent warning for insufficinet size
-    CGFloat tabWidth;
-    CGFloat w;
-    BSTTabViewTab *tab;
+    NSUInteger from = groupsDirtyFrom;
+    if (from == NSNotFound) {
+        return;
+    }
+    groupsDirtyFrom = NSNotFound;
+    if (tabGroups.count == 0) {
+        return;
+    }
     
-    // Add up ideal width
-    for (NSUInteger i = 0; i < self.tabs.count; i++) {
-        tab = [self.tabs objectAtIndex:i];
-        tabWidth = [self widthForLabelOrEditorForTab:tab];
-        
-        if (tabWidth > longestRequested) {
-            longestRequested = tabWidth;
+    // Only the groups reaching the first changed tab are found again, starting from the first of them
+    NSUInteger count = self.tabs.count;
+    NSUInteger scanStart = from;
+    NSMutableArray *changed = [[NSMutableArray alloc] init];
+    NSUInteger *oldLengths = malloc(tabGroups.count * sizeof(NSUInteger));
+    for (BSTTabViewGroup *group in tabGroups) {
+        if (NSMaxRange(group.range) <= from) {
+            continue;
         }
-        totalRequested = totalRequested + tabWidth + self.spacerWidth;
+        if (group.range.location < scanStart) {
+            scanStart = group.range.location;
+        }
+        oldLengths[changed.count] = group.range.length;
+        [changed addObject:group];
+    }
+    NSHashTable *scanned = [NSHashTable hashTableWithOptions:NSPointerFunctionsObjectPointerPersonality];
+    for (BSTTabViewGroup *group in changed) {
+        group.range = NSMakeRange(NSNotFound, 0);
+        [scanned addObject:group];
     }
     
-    // Compress space if required (until it fits or all tabs are smaller or equal to min)
-    while ((totalRequested > currentWidth) && (longestRequested > BSTminTabWidth)) {
-        
-        longestRequested = longestRequested - 1.0;
-        totalRequested = self.spacerWidth;
-        
-        for (NSUInteger i = 0; i < self.tabs.count; i++) {
-            tab = [self.tabs objectAtIndex:i];
-            if ((self.selectedTab >= 0) && (self.selectedTab == i) ) {
-                tabWidth = [self widthForLabelOrEditorForTab:tab];  // The seletced tab gets its full width
+    // Find the longest run of each group, the first of equally long
+    BSTTabViewGroup *runGroup = nil;
+    NSUInteger runStart = scanStart;
+    BOOL split = NO;
+    for (NSUInteger i = scanStart; i <= count; i++) {
+        BSTTabViewGroup *group = ((i < count) ? [(BSTTabViewTab *)[self.tabs objectAtIndex:i] group] : nil);
+        if (group == runGroup) {
+            continue;
+        }
+        if (runGroup) {
+            if (![scanned containsObject:runGroup] || (runGroup.range.location != NSNotFound)) {  // Apart from its kept tabs
+                split = YES;
             }
-            else {
-                w = [self widthForLabelOrEditorForTab:tab];
-                tabWidth = (w > longestRequested ? longestRequested : w);
+            if ([scanned containsObject:runGroup] && ((i - runStart) > runGroup.range.length)) {
+                runGroup.range = NSMakeRange(runStart, i - runStart);
             }
-            totalRequested = totalRequested + tabWidth + self.spacerWidth;
-        } // end for
-    }  // end while - max allowed longestRequested has now been calculated
-    
-    if (longestRequested <= BSTminTabWidth) {  // Not all will fit even with compression display will be truncated - notify delegate
-       if (self.delegate && [self.delegate respondsToSelector:@selector(insufficientWidthForTabView:)]) {
-            [self.delegate insufficientWidthForTabView:self];
         }
-
+        runGroup = group;
+        runStart = i;
     }
     
-    // allocate actual width to tabs - all get their requested but not more than longestRequested
-    CGFloat accumulatedX = self.spacerWidth;
-    
-    for (NSUInteger i = 0; i < self.tabs.count; i++) {
-        tab = [self.tabs objectAtIndex:i];
-        if ((self.selectedTab >= 0) && (self.selectedTab == i) ) {
-            tabWidth = [self widthForLabelOrEditorForTab:tab];  // The seletced tab gets its full width
+    if (split) {  // The tabs outside the kept run leave the group
+        BOOL collapsedSplit = NO;
+        for (NSUInteger i = scanStart; i < count; i++) {
+            BSTTabViewTab *tab = [self.tabs objectAtIndex:i];
+            if (tab.group && !NSLocationInRange(i, tab.group.range)) {
+                collapsedSplit = collapsedSplit || tab.group.collapsed;
+                tab.group = nil;
+            }
         }
-        else {
-            w = [self widthForLabelOrEditorForTab:tab];
-            tabWidth = (w > longestRequested ? longestRequested : w);
+        if (collapsedSplit && (scanStart < layoutDirtyFrom)) {  // The tabs that left come back in the layout
+            layoutDirtyFrom = scanStart;
         }
-        
-        if (tab == editedTab) {  // Editing is ongoing, align the editor start
-            [labelEditor setFrameOrigin:NSMakePoint(accumulatedX + BSTstdTextPadding,BSTstdYTextOffset)];
+    }
+    
+    NSMutableIndexSet *emptied = [[NSMutableIndexSet alloc] init];
+    for (NSUInteger g = 0; g < changed.count; g++) {
+        BSTTabViewGroup *group = [changed objectAtIndex:g];
+        if (group.range.location == NSNotFound) {  // All its tabs are gone
+            [emptied addIndex:[tabGroups indexOfObjectIdenticalTo:group]];
+            continue;
+        }
+        group.summaryTab = [self.tabs objectAtIndex:group.range.location];
+        if (group.collapsed && (group.range.length != oldLengths[g]) && (group.range.location < layoutDirtyFrom)) {  // The summary count changed
+            layoutDirtyFrom = group.range.location;
         }
-        
-        [tab setStartX:roundf(accumulatedX) width:roundf(tabWidth)];
-        accumulatedX = accumulatedX + tabWidth + self.spacerWidth;
     }
-    self.LayoutIsInvalid = NO;
-    return;
+    free(oldLengths);
+    [tabGroups removeObjectsAtIndexes:emptied];
+    [tabGroups sortUsingComparator:^NSComparisonResult(BSTTabViewGroup *a, BSTTabViewGroup *b) {
+        return ((a.range.location < b.range.location) ? NSOrderedAscending : ((a.range.location > b.range.location) ? NSOrderedDescending : NSOrderedSame));
+    }];
 }
 
 
 
-
--(CGFloat)widthForLabelOrEditorForTab:(BSTTabViewTab *)tab {
-    
-    CGFloat wlabel = [tab widthForLabelString];
+-(BSTTabViewGroup *)groupOfTabAtIndex:(NSUInteger)index {
     
-    CGFloat weditor;
-    if (editedTab != tab) { // This is not the edited tab
-        weditor = -1.0;
-    } else {
-    // Edit in progress for the requested tab
-      NSRect rect = labelEditor.frame;
-      weditor = rect.size.width + BSTeditorExtraPadding;
+    if ((index >= self.tabs.count) || (tabGroups.count == 0)) {
+        return nil;
     }
-    
-    return (weditor > wlabel ? weditor : wlabel);  // take the max
+    [self updateTabGroupsIfNeeded];
+    return [(BSTTabViewTab *)[self.tabs objectAtIndex:index] group];
 }
 
 
-#pragma mark - event handlers
 
--(void)mouseDown:(NSEvent *)theEvent {
-    BOOL displayDirty = NO;
-    
-    dragStartMouseEvent = theEvent; // Keep this event for dragging purposes - initiated from mouseDragged: message
-    
-    NSInteger cnt = [theEvent clickCount];
-    NSInteger rolloverIndex = [self indexForRolloverTab];  // Get the index of current rollover if any, else -1
+-(NSRange)itemRangeForTabAtIndex:(NSUInteger)index {
     
-    // If doubleclick edit is enabled and this is a double click then launch interactive edit
-    if (self.doubleClickEditEnabled && (cnt > 1) && self.currentRollover) {
-        
-        BOOL allowed = YES;
-        if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:editingShouldBeginForTabAtIndex:)]) {  // delegate check
-            allowed = [self.delegate tabView:self editingShouldBeginForTabAtIndex:rolloverIndex];
-        }
-        
-        if (allowed) {
-            if ([self beginEditLabelInteractiveForTab:rolloverIndex]) {   // call edit on active tab
-                displayDirty = YES;
-            }
-        }
-    }
+    BSTTabViewGroup *group = [self groupOfTabAtIndex:index];
+    return (group.collapsed ? group.range : NSMakeRange(index, 1));
+}
 
-    // Postprocess - redraw as needed
-    if (displayDirty) {
-        [self reassignTabPositionAndTrackingArea];
+
+
+-(CGFloat)widthForSummaryOfGroup:(BSTTabViewGroup *)group {
+    
+    NSString *label = [group summaryLabel];  // Resets the width if the tab count changed
+    if ((group.summaryWidth < 0.0) || (group.summaryWidthGeneration != self.labelWidthGeneration)) {
+        self.labelWidthCacheMisses++;
+        CGFloat w = [label sizeWithAttributes:self.defaultTextOptions].width + (BSTstdTextPadding * 2);
+        group.summaryWidth = (w < BSTminTabWidth ? BSTminTabWidth : w);  // never less than min
+        group.summaryWidthGeneration = self.labelWidthGeneration;
     }
+    return group.summaryWidth;
 }
 
 
 
--(void)mouseUp:(NSEvent *)theEvent {
+-(void)joinGroupAroundTabsInRange:(NSRange)range {
+    
+    if ((tabGroups.count == 0) || (range.location == 0) || (NSMaxRange(range) >= self.tabs.count)) {  // Not between two tabs
+        return;
+    }
+    BSTTabViewGroup *group = [(BSTTabViewTab *)[self.tabs objectAtIndex:(range.location - 1)] group];
+    if (!group || (group != [(BSTTabViewTab *)[self.tabs objectAtIndex:NSMaxRange(range)] group])) {
+        return;
+    }
+    for (NSUInteger i = range.location; i < NSMaxRange(range); i++) {
+        [(BSTTabViewTab *)[self.tabs objectAtIndex:i] setGroup:group];
+    }
+}
 
-    BOOL displayDirty = NO;
 
-    NSInteger rolloverIndex = [self indexForRolloverTab];  // Get the index of current rollover if any, else -1
 
-    // If this is a single click and there is a current rollover that is not same as selected then change selection
-    if (([theEvent clickCount] == 1) && (self.currentRollover) && (rolloverIndex != self.selectedTab)) {
-        self.selectedTab = rolloverIndex;
-        displayDirty = YES;
-    }
-    
-    // Set the click related properties
-    _lastClickedTab = rolloverIndex;
-    _clickCount = [theEvent clickCount];
+-(BOOL)groupTabsInRange:(NSRange)range withLabel:(NSString *)label {
     
-    // Send the target action message
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Warc-performSelector-leaks"
-     
-     if (_target && _action) {
-     [_target performSelector:_action withObject:self afterDelay:0.0];
-     }
+    NSMutableData *trace = [self traceEvent:BSTTraceGroupTabs];
+    if (trace) {
+        BSTAppendUInt32(trace, BSTTraceIndex(range.location));
+        BSTAppendUInt32(trace, BSTTraceIndex(range.length));
+        BSTAppendString(trace, label);
+    }
+    if ((range.length == 0) || (range.location >= self.tabs.count) || (range.length > (self.tabs.count - range.location))) {
+        return NO;
+    }
     
-#pragma clang diagnostic pop
+    [self updateTabGroupsIfNeeded];
+    BSTTabViewGroup *group = [[BSTTabViewGroup alloc] init];
+    group.label = label;
+    group.range = range;  // Found again from range.location on
+    BOOL relayout = NO;
+    for (NSUInteger i = range.location; i < NSMaxRange(range); i++) {
+        BSTTabViewTab *tab = [self.tabs objectAtIndex:i];
+        relayout = relayout || tab.group.collapsed;  // Taken out of a collapsed group
+        tab.group = group;
+    }
+    [tabGroups addObject:group];
+    if (range.location < groupsDirtyFrom) {
+        groupsDirtyFrom = range.location;
+    }
     
-    // Postprocess - redraw as needed
-    if (displayDirty) {
-        [self reassignTabPositionAndTrackingArea];
+    if (relayout) {
+        [self invalidateLayout];
     }
+    return YES;
 }
 
 
 
--(void)mouseDragged:(NSEvent *)theEvent {
+-(BOOL)ungroupTabsOfGroupAtIndex:(NSUInteger)index {
     
-    // Used for initiating dragging after some distance (2)
-    if ((!dragSourceTab) && (self.userTabDraggingEnabled > BSTTabViewDragNone) && self.currentRollover) {   // Investiage if a drag should start
-        
-        CGFloat deltX = [dragStartMouseEvent locationInWindow].x - [theEvent locationInWindow].x;
-        CGFloat deltY = [dragStartMouseEvent locationInWindow].y - [theEvent locationInWindow].y;
-        CGFloat draggedDist = (deltX * deltX) + (deltY * deltY);
-        if (draggedDist >= 4) {  // begin drag after sqrt(4) distance
-            
-            // Check with delegate
-            if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:draggingShouldBeginForTabWithIndex:)]) {
-                if (![self.delegate tabView:self draggingShouldBeginForTabWithIndex:[self indexForRolloverTab]]) {
-                    return;
-                }
-            }
-            
-            // Set up the drag
-            NSString *dragString =[self dragStringForTabWithIndex:[self indexForRolloverTab]];
-            
-            NSDraggingItem *di = [[NSDraggingItem alloc] initWithPasteboardWriter:dragString];
-            NSPoint stPt = [self convertPoint:[dragStartMouseEvent locationInWindow] fromView:nil];
-            NSRect r = NSMakeRect(stPt.x + 2, stPt.y + 2, dragImage.size.width, dragImage.size.height);
-            [di setDraggingFrame:r contents:dragImage];
-
-            dragSourceTab = self.currentRollover;
-            deleteTabOnSuccessfulDrag = YES;
-            [self beginDraggingSessionWithItems:[NSArray arrayWithObject:di] event:dragStartMouseEvent source:self];
-        }
+    NSMutableData *trace = [self traceEvent:BSTTraceUngroupTabs];
+    if (trace) {
+        BSTAppendUInt32(trace, BSTTraceIndex(index));
+    }
+    BSTTabViewGroup *group = [self groupOfTabAtIndex:index];
+    if (!group) {
+        return NO;
+    }
+    
+    for (NSUInteger i = group.range.location; i < NSMaxRange(group.range); i++) {
+        [(BSTTabViewTab *)[self.tabs objectAtIndex:i] setGroup:nil];
+    }
+    [tabGroups removeObjectIdenticalTo:group];  // The others keep their ranges
+    
+    if (group.collapsed) {  // The tabs come back
+        [self invalidateLayout];
     }
+    return YES;
 }
 
 
--(void)cancelOperation:(id)sender {
+
+-(NSRange)groupRangeForTabAtIndex:(NSUInteger)index {
     
-    [labelEditor setString:editedTab.label];
-    [self.window makeFirstResponder:self.window];
-    [self reassignTabPositionAndTrackingArea];
-    [self setNeedsDisplay:YES];
+    BSTTabViewGroup *group = [self groupOfTabAtIndex:index];
+    return (group ? group.range : NSMakeRange(NSNotFound, 0));
 }
 
 
-#pragma mark - Editing and NSTextViewDelegate methods
 
--(BOOL)beginEditLabelInteractiveForTab:(NSInteger)index {
-    
-    if (![self.window makeFirstResponder:self.window]) {  // Try to make window first responder to ensure the shared field editor is available.
-        return NO;
-    };
-    
-    NSTextView *tv = (NSTextView *)[self.window fieldEditor:YES forObject:nil]; // take the shared field editor and configure it
-    if (!tv) {  // Did not get the field editor
-        return NO;
-    }
+-(NSString *)groupLabelForTabAtIndex:(NSUInteger)index {
     
-    // Set font and location
-    [tv setVerticallyResizable:NO];
-    [tv setFont:self.textFont];
-    [tv setBackgroundColor:self.selectedFieldColor];
-    [tv setTextColor:self.editingColor];
-    [tv setEditable:YES];
+    return [[self groupOfTabAtIndex:index] label];
+}
 
-    editedTab = [self.tabs objectAtIndex:index];
-    tv.string = editedTab.label;         // Set text
-    
-    CGFloat w = editedTab.coreWidth + BSTeditorExtraPadding; // Slightly larger to fit the cursor
-    CGFloat h = (self.tabHeight < (self.preferredTextHeight-(2 * BSTstdYTextOffset))) ? (self.tabHeight-(2 * BSTstdYTextOffset)) : self.preferredTextHeight; // Text height or tab ht - 4 whichever is less
-    [tv setFrameSize:NSMakeSize(w,h)];
-    // x poistion is set in owner draw method to match location of tab
-    
-    tv.textContainer.lineFragmentPadding = 0; // remove padding for alignment with text below
-    
-    // Set delegate
-    tv.delegate = self;
-    // Insert into view hierarchy
-    [self addSubview:tv];
-    [self.window makeFirstResponder:tv];
+
+
+-(BOOL)isGroupCollapsedForTabAtIndex:(NSUInteger)index {
     
-    labelEditor = tv;  // Store a reference also used as a flag
-    return YES;
+    return [[self groupOfTabAtIndex:index] collapsed];
 }
 
 
--(void)textDidEndEditing:(NSNotification *)notification {
-    
-    
-    // textview editing did end
-    NSTextView *tv = [notification object];
-    
-    [self setLabel:tv.string forTabAtIndex:[self.tabs indexOfObject:editedTab]];
-//    [self setLabel:[NSString stringWithString:tv.string] forTabAtIndex:[self.tabs indexOfObject:editedTab]];
+
+-(BOOL)collapseGroupOfTabAtIndex:(NSUInteger)index {
     
-    // Remove the field editor
-    [tv removeFromSuperview];
-    tv.delegate = nil;
-    labelEditor = nil;
-    editedTab = nil;
+    return [self setGroupOfTabAtIndex:index collapsed:YES];
 }
 
 
--(void)textDidChange:(NSNotification *)notification {
+
+-(BOOL)expandGroupOfTabAtIndex:(NSUInteger)index {
     
-    NSTextView *tv = [notification object];
-    CGFloat w = [tv.string sizeWithAttributes:self.selectedTextOptions].width + 2.0;  // Increase the length to follow added text
-    CGFloat h = tv.frame.size.height; // Reuse the old height, will not change
-    NSSize siz = NSMakeSize( (w < [editedTab widthForLabelString] ? [editedTab widthForLabelString] : w) , h);  // Set a new size (width) but never less than original (otherwise text below is exposed)
-    [tv setFrameSize:siz];
-    self.LayoutIsInvalid = YES;
-    [self setNeedsDisplay:YES];
+    return [self setGroupOfTabAtIndex:index collapsed:NO];
 }
 
-#pragma mark - Drag and Drop methods
 
 
--(NSImage *)createDragImage{
-    
-    NSSize siz = NSMakeSize(20, 7);
-    NSImage *img = [[NSImage alloc]initWithSize:siz];
-    
-    
-    NSBezierPath *path = [[NSBezierPath alloc] init];
-    [path setLineWidth:1.0];
-    NSPoint pt;
-    
-    CGFloat spcr = 3.0;
+-(BOOL)setGroupOfTabAtIndex:(NSUInteger)index collapsed:(BOOL)collapsed {
     
-    pt.x = 0.0;
-    pt.y = 0.0;
-    [path moveToPoint:pt];
+    NSMutableData *trace = [self traceEvent:BSTTraceCollapseGroup];
+    if (trace) {
+        BSTAppendUInt32(trace, BSTTraceIndex(index));
+        BSTAppendUInt8(trace, (collapsed ? 1 : 0));
+    }
+    BSTTabViewGroup *group = [self groupOfTabAtIndex:index];
+    if (!group) {
+        return NO;
+    }
+    if (group.collapsed == collapsed) {  // No change
+        return YES;
+    }
     
-    pt.x = spcr;
-    pt.y = siz.height;
-    [path lineToPoint:pt];
+    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:groupShouldCollapse:forTabsInRange:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
+        }
+        if (![self.delegate tabView:self groupShouldCollapse:collapsed forTabsInRange:group.range]) {
+            return NO;  // Abort if delegate denies change
+        }
+    }
     
-    pt.x = siz.width - spcr;
-    pt.y = siz.height;
-    [path lineToPoint:pt];
+    // End editing and if not abort
+    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
+        return NO;
+    }
     
-    pt.x = siz.width;
-    pt.y = 0.0;
-    [path lineToPoint:pt];
+    group.collapsed = collapsed;
+    [self invalidateLayout];  // The tabs of the group go or come back
     
-    // drawing code
-    [img lockFocus];
-    [self.selectedFieldColor set];
-    [path fill];
+    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:groupDidCollapse:forTabsInRange:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
+        }
+        [self.delegate tabView:self groupDidCollapse:collapsed forTabsInRange:group.range];
+    }
+    return YES;
+}
+
+
+
+
+#pragma mark - Tab pool
+
+/*
+ * Removed tabs go back to tabPool up to tabPoolLimit and inserts take them from there. A tab is only pooled when
+ * nothing else knows it by identity any more: while a drag from this view is going on, or while changes for
+ * tabView:didChangeTabs: are collected, a reused tab would be mistaken for the removed one. Those removed while
+ * changes are collected are pooled once the change set is made, the others are released as before.
+ */
+-(void)setTabPoolLimit:(NSUInteger)tabPoolLimit {
     
-    [self.selectedBorderColor set];
-    [path stroke];
-    [img unlockFocus];
+    _tabPoolLimit = tabPoolLimit;
+    if (tabPool.count > tabPoolLimit) {  // Release the tabs over the new limit
+        [tabPool removeObjectsInRange:NSMakeRange(tabPoolLimit, tabPool.count - tabPoolLimit)];
+    }
+}
+
+
+
+-(BSTTabViewTab *)dequeueTab {
+    
+    BSTTabViewTab *tab = [tabPool lastObject];  // The last removed, most likely laid out where the new one goes
+    if (tab) {
+        [tabPool removeLastObject];
+        if (_statisticsEnabled) {
+            counters.tabsReused++;
+        }
+        return tab;
+    }
     
-    return img;
+    if (_statisticsEnabled) {
+        counters.tabsAllocated++;
+    }
+    return [[BSTTabViewTab alloc] initWithOwner:self];
 }
 
-/** 
- * The dragString is encoded following the following format
- * "H I LL L T", meaning
- * H - Header 15 characters followed by one space - header shall be bst.tabview.1.0 to be valid
- * I - tab index integer 4 digits, with leading zeroes as needed followed by 1 space
- * LL - Label length integer 4 digits, with leading zeroes as needed followed by 1 space
- * L - Label as many characters as given in LL, followed by 1 space
- * T - Tag remainder of string
- * This means tags with index above 9999 or with label length more than 9999 characters cannot be encoded.
- * Method will return nil for these cases
- *
- * @param index The tab to be encoded
- *
- * @return The encoded string
- *
- */
 
--(NSString *)dragStringForTabWithIndex:(NSInteger)index{
+
+-(void)recycleTab:(BSTTabViewTab *)tab {
     
-    if ((index > 9999) || (index < 0) || (index >= self.tabs.count)) {  // invalid index
-        return nil;
+    if ((tabPool.count + pendingChanges.retiredTabs.count >= self.tabPoolLimit) || dragSourceTabs) {  // Released
+        return;
+    }
+    if (pendingChanges) {
+        [pendingChanges.retiredTabs addObject:tab];
+        return;
     }
     
-    NSString  *lab =[self labelForTabAtIndex:index];
-    if (!lab) {
-        lab = @"";
+    if (tab == _currentRollover) {  // Not through the setter, the removal repaints
+        _currentRollover = nil;
     }
-    if ([lab length] > 9999) {
-        return nil;
+    [materializedTabs removeObject:tab];
+    [tab prepareForReuse];
+    [tabPool addObject:tab];
+}
+
+
+
+
+#pragma mark - Saving and restoring
+
+/*
+ * The saved tab state is little endian binary, reusing the drag payload encoding of numbers and strings:
+ * "BSTS", uint16 version, uint16 reserved (0), uint32 tab count, uint32 selected index (0xFFFFFFFF for none),
+ * string label width style stamp, and then for each tab in order
+ * uint32 label length (0xFFFFFFFF for no label), label UTF-8, uint32 tag length (0xFFFFFFFF for no tag), tag UTF-8,
+ * float64 label width (-1 if not measured). Since version 2 followed by uint32 group count and for each group in tab
+ * order uint32 first index, uint32 tab count, string label, uint8 collapsed (0 or 1). Version 1 is read without groups.
+ */
+-(NSData *)tabStateData {
+    
+    [self updateTabGroupsIfNeeded];
+    NSMutableData *data = [[NSMutableData alloc] initWithCapacity:(32 + (self.tabs.count * 32))];
+    uint16_t header[2] = { NSSwapHostShortToLittle(BSTTabStateVersion), 0 };
+    [data appendBytes:"BSTS" length:4];
+    [data appendBytes:header length:sizeof(header)];
+    BSTAppendUInt32(data, (uint32_t)self.tabs.count);
+    BSTAppendUInt32(data, ((self.selectedTab < 0) ? BSTDragPayloadNoTag : (uint32_t)self.selectedTab));
+    BSTAppendString(data, [self labelWidthStyleStamp]);
+    
+    for (BSTTabViewTab *tab in self.tabs) {
+        BSTAppendString(data, tab.label);
+        BSTAppendString(data, tab.tag);
+        BSTAppendFloat64(data, [tab cachedLabelWidth]);
     }
     
-    NSString *tag =[self tagForTabAtIndex:index];
-    if (!tag) {
-        tag = @"";
+    BSTAppendUInt32(data, (uint32_t)tabGroups.count);
+    for (BSTTabViewGroup *group in tabGroups) {
+        BSTAppendUInt32(data, (uint32_t)group.range.location);
+        BSTAppendUInt32(data, (uint32_t)group.range.length);
+        BSTAppendString(data, group.label);
+        BSTAppendUInt8(data, (group.collapsed ? 1 : 0));
     }
-    
-    NSString *s = [NSString stringWithFormat:@"%@ %04ld %04ld %@ %@",BSTDragStringHeader, (long)index,(long)[lab length],lab,tag];
-    return s;
+    return data;
 }
 
 
--(BOOL)validateDragString:(NSString *)dragString{
-    
-    NSInteger dragHeaderLength = BSTDragStringHeader.length;
 
+-(BOOL)restoreTabStateFromData:(NSData *)data {
     
-    if (!dragString || (dragString.length < dragHeaderLength + 12)) {// Check min length headerLength+1+4+1+4+1+1
-        return NO;
+    NSMutableData *trace = [self traceEvent:BSTTraceRestoreTabState];
+    if (trace) {
+        BSTAppendData(trace, data);
     }
-    NSString *s;
-    NSRange r;
+    const uint8_t *bytes = data.bytes;
+    NSUInteger length = data.length;
+    NSUInteger pos = 8;
     
-    // Check header
-    r = NSMakeRange(0, dragHeaderLength);
-    s = [dragString substringWithRange:r];  // Extract header
-    if (![BSTDragStringHeader isEqualToString:s]) {  // invalid dragString
+    if ((length < 16) || (memcmp(bytes, "BSTS", 4) != 0)) {
+        return NO;
+    }
+    uint16_t version;
+    memcpy(&version, bytes + 4, sizeof(version));
+    version = NSSwapLittleShortToHost(version);
+    if ((version != 1) && (version != BSTTabStateVersion)) {  // Unknown version, could be a newer format
         return NO;
     }
     
-    NSCharacterSet *unwantedCharacters = [[NSCharacterSet decimalDigitCharacterSet] invertedSet];
-
-    // Check index
-    r = NSMakeRange(dragHeaderLength + 1, 4);
-    s = [dragString substringWithRange:r];  // Extract index
-    
-    if ([s rangeOfCharacterFromSet:unwantedCharacters].location != NSNotFound) {
+    uint32_t count;
+    uint32_t selected;
+    NSString *stamp;
+    if (!BSTReadUInt32(bytes, length, &pos, &count) || !BSTReadUInt32(bytes, length, &pos, &selected) || !BSTReadString(bytes, length, &pos, &stamp)) {
         return NO;
     }
+    if ((count > (length - pos) / 16) || ((selected != BSTDragPayloadNoTag) && (selected >= count))) {  // Each tab needs at least 16 bytes
+        return NO;
+    }
+    BOOL widthsValid = [stamp isEqualToString:[self labelWidthStyleStamp]];  // Else the widths are measured again on first layout
+    
+    // Build the new tabs aside so that invalid data leaves the view untouched
+    NSMutableDictionary *newTabsByTag = [[NSMutableDictionary alloc] initWithCapacity:count];
+    NSMutableDictionary *newTabsByLabel = [[NSMutableDictionary alloc] initWithCapacity:count];
+    NSMutableArray *newTabs = [[NSMutableArray alloc] initWithCapacity:count];
+    for (uint32_t i = 0; i < count; i++) {
+        NSString *label;
+        NSString *tag;
+        double width;
+        if (!BSTReadString(bytes, length, &pos, &label) || !BSTReadString(bytes, length, &pos, &tag) || !BSTReadFloat64(bytes, length, &pos, &width)) {
+            return NO;
+        }
+        BSTTabViewTab *tab = [[BSTTabViewTab alloc] initWithOwner:self];
+        tab.tag = [self addTab:tab toMap:newTabsByTag forKey:tag];
+        tab.label = [self addTab:tab toMap:newTabsByLabel forKey:label];
+        if (widthsValid && (width >= BSTminTabWidth)) {
+            [tab setCachedLabelWidth:width];
+        }
+        [newTabs addObject:tab];
+    }
     
-    // Check label length
-    r = NSMakeRange(dragHeaderLength + 6, 4);
-    s = [dragString substringWithRange:r];  // Extract label length
+    NSMutableArray *newGroups = [[NSMutableArray alloc] init];
+    uint32_t groupCount = 0;
+    if ((version >= 2) && (!BSTReadUInt32(bytes, length, &pos, &groupCount) || (groupCount > (length - pos) / 13))) {  // Each group needs at least 13 bytes
+        return NO;
+    }
+    NSUInteger groupsEnd = 0;
+    for (uint32_t g = 0; g < groupCount; g++) {
+        uint32_t location;
+        uint32_t groupLength;
+        NSString *label;
+        uint8_t collapsed;
+        if (!BSTReadUInt32(bytes, length, &pos, &location) || !BSTReadUInt32(bytes, length, &pos, &groupLength) || !BSTReadString(bytes, length, &pos, &label) || !BSTReadUInt8(bytes, length, &pos, &collapsed)) {
+            return NO;
+        }
+        if ((groupLength == 0) || (location < groupsEnd) || (location >= count) || (groupLength > (count - location)) || (collapsed > 1)) {  // Groups are in tab order and do not overlap
+            return NO;
+        }
+        BSTTabViewGroup *group = [[BSTTabViewGroup alloc] init];
+        group.label = label;
+        group.collapsed = (collapsed == 1);
+        group.range = NSMakeRange(location, groupLength);
+        group.summaryTab = [newTabs objectAtIndex:location];
+        for (NSUInteger i = location; i < (location + groupLength); i++) {
+            [(BSTTabViewTab *)[newTabs objectAtIndex:i] setGroup:group];
+        }
+        [newGroups addObject:group];
+        groupsEnd = location + groupLength;
+    }
     
-    if ([s rangeOfCharacterFromSet:unwantedCharacters].location != NSNotFound) {
+    // End editing and if not abort
+    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
         return NO;
     }
     
+    self.currentRollover = nil;
+    [self pendingChangesBeforeMovingTabs:YES].tabsReplaced = YES;
+    self.tabs = newTabs;
+    tabsByTag = newTabsByTag;
+    tabsByLabel = newTabsByLabel;
+    validCachedIndexCount = 0;
+    tabGroups = newGroups;  // Ranges found above
+    groupsDirtyFrom = NSNotFound;
+    scrollToSelectedPending = self.scrollingEnabled;
+    
+    NSInteger newSelected = ((selected == BSTDragPayloadNoTag) ? -1 : (NSInteger)selected);
+    if (newSelected != _selectedTab) {
+        if (updateDepth > 0) {  // Notified once in endUpdates
+            _selectedTab = newSelected;
+        } else {
+            [self willChangeValueForKey:@"selectedTab"];  // Do key value calls without the setter to prevent delegate calls
+            _selectedTab = newSelected;
+            [self didChangeValueForKey:@"selectedTab"];
+        }
+    }
+    
+    [self invalidateLayout];  // All widths change
+    
+    if (self.delegate && [self.delegate respondsToSelector:@selector(tabViewDidRestoreTabs:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
+        }
+        [self.delegate tabViewDidRestoreTabs:self];
+    }
     return YES;
 }
 
 
 
--(NSInteger)indexFromDragString:(NSString *)dragString{
-    
-    NSInteger dragHeaderLength = BSTDragStringHeader.length;
+-(BOOL)writeTabStateToFile:(NSString *)path {
     
-    if (![self validateDragString:dragString]) {
-        return -1;
-    }
-    NSRange r = NSMakeRange(dragHeaderLength + 1, 4);
-    NSString *s =[dragString substringWithRange:r];
-
-    return [s integerValue];
+    return [[self tabStateData] writeToFile:path atomically:YES];
 }
 
 
 
--(NSString*)labelFromDragString:(NSString *)dragString{
-
-    NSInteger dragHeaderLength = BSTDragStringHeader.length;
-
-    if (![self validateDragString:dragString]) {
-        return nil;
-    }
-    NSRange r = NSMakeRange(dragHeaderLength + 6, 4);
-    NSString *s =[dragString substringWithRange:r];
-    
-    NSInteger len = [s integerValue];
+-(BOOL)restoreTabStateFromFile:(NSString *)path {
     
-    if (len == 0) {
-        return @"";
-    }
-    
-    if ([dragString length] < (dragHeaderLength + 12 + len)) {  // Something is wrong
-        return nil;
+    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+    if (!data) {
+        return NO;
     }
+    return [self restoreTabStateFromData:data];
+}
+
+
+
+// Widths measured in another font are not reused, the paragraph style only sets alignment and truncation
+-(NSString *)labelWidthStyleStamp {
     
-    r = NSMakeRange(dragHeaderLength + 11, len);
-    return [dragString substringWithRange:r];
+    NSFont *font = [self.defaultTextOptions valueForKey:NSFontAttributeName];
+    return [NSString stringWithFormat:@"%@ %.3f", font.fontName, font.pointSize];
 }
 
 
 
--(NSString*)tagFromDragString:(NSString *)dragString{
+#pragma mark - Statistics
+
+-(BSTTabViewCounters *)activeCounters {
     
-    NSInteger dragHeaderLength = BSTDragStringHeader.length;
+    return (_statisticsEnabled ? &counters : NULL);
+}
 
-    if (![self validateDragString:dragString]) {
-        return nil;
-    }
-    NSRange r = NSMakeRange(dragHeaderLength + 6, 4);
-    NSString *s =[dragString substringWithRange:r];
+
+
+-(void)recordTimedOperation:(BSTTabViewTimedOperation)operation since:(NSTimeInterval)start {
     
-    NSInteger len = [s integerValue];
+    NSTimeInterval duration = [[NSProcessInfo processInfo] systemUptime] - start;
     
-    if ([dragString length] <= (dragHeaderLength + 12 + len)) {  // Something is wrong or there were no tag
-        return nil;
+    if (operation == BSTTabViewTimedOperationLayout) {
+        counters.layoutPasses++;
+        counters.layoutTime = counters.layoutTime + duration;
+        if (duration > counters.maxLayoutTime) {
+            counters.maxLayoutTime = duration;
+        }
+    } else {
+        counters.drawCalls++;
+        counters.drawTime = counters.drawTime + duration;
+        if (duration > counters.maxDrawTime) {
+            counters.maxDrawTime = duration;
+        }
     }
     
-    r = NSMakeRange( dragHeaderLength + 12 +len, ([dragString length] - (dragHeaderLength + 12 +len)) );
-    return [dragString substringWithRange:r];
+    if ((self.timeBudget > 0.0) && (duration > self.timeBudget)) {
+        if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:operation:exceededTimeBudgetWithDuration:)]) {
+            counters.delegateCallbacks++;
+            [self.delegate tabView:self operation:operation exceededTimeBudgetWithDuration:duration];
+        }
+    }
 }
 
 
-// DarggingSource methods
 
--(NSDragOperation)draggingSession:(NSDraggingSession *)session sourceOperationMaskForDraggingContext:(NSDraggingContext)context {
+-(BSTTabViewStatistics *)statisticsSnapshot {
     
-    switch(context) {
-        case NSDraggingContextOutsideApplication:
-            if (self.userTabDraggingEnabled >= BSTTabViewDragGlobal) {
-                return NSDragOperationMove;
-            } else {
-                return NSDragOperationNone;
-            }
-            break;
-            
-        case NSDraggingContextWithinApplication:
-        default:
-            if (self.userTabDraggingEnabled >= BSTTabViewDragInternal) {
-                return NSDragOperationMove;
-            } else {
-                return NSDragOperationNone;
-            }
-            break;
-    }
+    return [[BSTTabViewStatistics alloc] initWithCounters:&counters labelWidthRequests:(self.labelWidthCacheHits + self.labelWidthCacheMisses) labelMeasurements:self.labelWidthCacheMisses tabsLaidOut:self.tabsLaidOutCount tabsDrawn:self.tabsDrawnCount pooledTabs:tabPool.count];
 }
 
 
 
-
--(BOOL)ignoreModifierKeysForDraggingSession:(NSDraggingSession *)session {
-    return YES;
+-(void)resetStatistics {
+    
+    memset(&counters, 0, sizeof(counters));
+    self.labelWidthCacheHits = 0;
+    self.labelWidthCacheMisses = 0;
+    self.tabsLaidOutCount = 0;
+    self.tabsDrawnCount = 0;
 }
 
 
 
--(void)draggingSession:(NSDraggingSession *)session endedAtPoint:(NSPoint)screenPoint operation:(NSDragOperation)operation {
-    
-    BOOL success = (operation == NSDragOperationMove ? YES : NO);
-
-    if (success && deleteTabOnSuccessfulDrag) {  // The move eas successful and the insert and remove operation is not in same control
+#pragma mark - Offscreen rendering
 
-        [self removeTabAtIndex:[self.tabs indexOfObject:dragSourceTab]];
+-(NSBitmapImageRep *)bitmapImageRepWithSize:(NSSize)size scale:(CGFloat)scale selectedTab:(NSInteger)selectedIndex rolloverTab:(NSInteger)rolloverIndex dragInsertPoint:(NSInteger)insertPoint {
+    
+    NSInteger count = (NSInteger)self.tabs.count;
+    if ((size.width <= 0.0) || (size.height <= 0.0) || (scale <= 0.0)) {
+        return nil;
+    }
+    if ((selectedIndex < -1) || (selectedIndex >= count) || (rolloverIndex < -1) || (rolloverIndex >= count)) {
+        return nil;
+    }
+    if ((insertPoint != NSNotFound) && ((insertPoint < -1) || (insertPoint >= count))) {
+        return nil;
     }
     
-    // Inform delegate
-    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:draggingDidFinishForTabWithLabel:tag:success:)]) {
-        [self.delegate tabView:self draggingDidFinishForTabWithLabel:dragSourceTab.label tag:dragSourceTab.tag success:success];
+    // Save the on screen state
+    NSSize oldSize = self.frame.size;
+    NSInteger oldSelected = _selectedTab;
+    BSTTabViewTab *oldRollover = self.currentRollover;
+    BOOL oldValidDrag = validDragInDest;
+    NSInteger oldInsertPoint = dragInsertPoint;
+    CGFloat oldScrollOffset = _scrollOffset;
+    BOOL oldScrollPending = scrollToSelectedPending;
+    
+    // Put the view in the requested state, nothing is notified
+    renderingOffscreen = YES;
+    if (!NSEqualSizes(size, oldSize)) {
+        [self setFrameSize:size];
     }
-
-    dragSourceTab = nil;
-    dragStartMouseEvent = nil;
-    self.LayoutIsInvalid = YES;
-    [self setNeedsDisplay:YES];
+    if (selectedIndex != oldSelected) {
+        _selectedTab = selectedIndex;
+        if (layoutIsCompressed) {  // The selected tab gets its full width
+            [self invalidateLayout];
+        }
+    }
+    BSTTabViewTab *rolloverTab = ((rolloverIndex >= 0) ? [self.tabs objectAtIndex:rolloverIndex] : nil);
+    if (rolloverTab != oldRollover) {
+        [oldRollover mouseExited:nil];
+        [rolloverTab mouseEntered:nil];
+    }
+    validDragInDest = (insertPoint != NSNotFound);
+    dragInsertPoint = insertPoint;
+    
+    // The bitmap is size points of scale pixels each, cacheDisplayInRect: runs drawRect: with the flipping and scaling of the rep
+    NSBitmapImageRep *rep = [[NSBitmapImageRep alloc] initWithBitmapDataPlanes:NULL
+                                                                    pixelsWide:(NSInteger)ceil(size.width * scale)
+                                                                    pixelsHigh:(NSInteger)ceil(size.height * scale)
+                                                                 bitsPerSample:8
+                                                               samplesPerPixel:4
+                                                                      hasAlpha:YES
+                                                                      isPlanar:NO
+                                                                colorSpaceName:NSDeviceRGBColorSpace
+                                                                   bytesPerRow:0
+                                                                  bitsPerPixel:0];
+    [rep setSize:size];
+    [self cacheDisplayInRect:self.bounds toBitmapImageRep:rep];
+    
+    // Restore the on screen state, the layout is redone on the next display if the rendering changed it
+    if (rolloverTab != oldRollover) {
+        [rolloverTab mouseExited:nil];
+        [oldRollover mouseEntered:nil];
+    }
+    validDragInDest = oldValidDrag;
+    dragInsertPoint = oldInsertPoint;
+    if (selectedIndex != oldSelected) {
+        _selectedTab = oldSelected;
+        if (layoutIsCompressed) {
+            [self invalidateLayout];
+        }
+    }
+    if (!NSEqualSizes(size, oldSize)) {
+        [self setFrameSize:oldSize];
+    }
+    _scrollOffset = oldScrollOffset;
+    scrollToSelectedPending = oldScrollPending;
+    renderingOffscreen = NO;
+    [self invalidateGeometry];  // Tabs get back their on screen positions
+    
+    return rep;
 }
 
 
 
-// DraggingDestination metthods
+#pragma mark - Tracing
 
--(NSDragOperation)draggingEntered:(id<NSDraggingInfo>)sender {
-    
-    /*
-     * This method determines the response for dragging inside the control and stores that in the state managing variables
-     * the state managing varaibles are used to indicate that a inswrt opoint is to be drawn 
-     * and whre a tab should be inserted on a successful conclude operation.
-     * The state managing variables are unset on a successful conclusion or on exit
-     */
-    
-    if (self.userTabDraggingEnabled == BSTTabViewDragNone) {  // No dragging allowed return early
-      destinationDragOperation = NSDragOperationNone;
-        return destinationDragOperation;
-    }
+/*
+ * Recording appends to traceData from the traced methods themselves. Only the outermost call is recorded, the calls
+ * the control makes to its own traced methods while handling an event are wrapped in traceSuppression so the replay
+ * does not do them twice. Calls the delegate makes back into the control are recorded as they would otherwise be lost
+ * on a replay without a delegate. asynchronousLabelMeasurementEnabled is not recorded, the replay measures in line so
+ * that it is deterministic.
+ */
+-(void)setTraceRecordingEnabled:(BOOL)traceRecordingEnabled {
     
-    id src = [sender draggingSource]; // Find the source of the drag and compare to the settings flag
-    if (!src) {  // This is coming from other application
-        
-        if (self.userTabDraggingEnabled >= BSTTabViewDragGlobal) {  // Corss app dragging is permitted, check if we have dragString
-            NSArray *ar = [sender.draggingPasteboard readObjectsForClasses:[NSArray arrayWithObject:[NSString class]] options:nil];
-            
-            if ((ar.count == 1) && [self validateDragString:(NSString *)[ar firstObject]]) {  // The pasteboard has a valid dragString
-                destinationDragOperation = NSDragOperationMove & [sender draggingSourceOperationMask];
-            } else {  // Not drag string
-                destinationDragOperation = NSDragOperationNone;
-            }
-        } else { // Cross app drag not allowed
-            destinationDragOperation = NSDragOperationNone;
-        }
-        
-    } else {  // there is a source object means source is in same application
-        
-        if ([src isKindOfClass:[BSTTabView class]]) {  // sender is a BSTTabView - required
-            if ((self.userTabDraggingEnabled >= BSTTabViewDragLocal) && ([(BSTTabView *)src userTabDraggingEnabled] >= BSTTabViewDragLocal) ) { // any sender in same app is ok, but we need to check the sender allows cross control drags also
-                destinationDragOperation = NSDragOperationMove & [sender draggingSourceOperationMask];
-            } else { // == BSTTabViewDragInternal
-                if (src == self) {  // must be same sender
-                    destinationDragOperation = NSDragOperationMove & [sender draggingSourceOperationMask];
-                } else {
-                    destinationDragOperation = NSDragOperationNone;
-                }
-            }
-        } else {
-            destinationDragOperation = NSDragOperationNone; // Sender is some other class - not valid
-        };
+    if (traceRecordingEnabled == _traceRecordingEnabled) {
+        return;
     }
-    if (destinationDragOperation == NSDragOperationMove) {
-        validDragInDest = YES; // Set the other state managing variables
-        dragInsertPoint = -1; // Placeholder to before first tab - will change on first draggging Updated message.
-        [self setNeedsDisplay:YES];
+    _traceRecordingEnabled = traceRecordingEnabled;
+    if (!traceRecordingEnabled) {  // Keep the trace for recordedTrace
+        return;
     }
     
-    return destinationDragOperation;
+    BSTTraceOption options = ((self.topEdgeAligned ? BSTTraceOptionTopEdgeAligned : 0) |
+                              (self.rolloverEnabled ? BSTTraceOptionRollover : 0) |
+                              (self.singleTrackingAreaEnabled ? BSTTraceOptionSingleTrackingArea : 0) |
+                              (self.tabImageCacheEnabled ? BSTTraceOptionTabImageCache : 0) |
+                              (self.typesetLabelCacheEnabled ? BSTTraceOptionTypesetLabelCache : 0) |
+                              (self.scrollingEnabled ? BSTTraceOptionScrolling : 0) |
+                              (self.doubleClickEditEnabled ? BSTTraceOptionDoubleClickEdit : 0));
+    
+    NSData *state = [self tabStateData];
+    traceData = [[NSMutableData alloc] initWithCapacity:(64 + state.length + 4096)];
+    uint16_t header[2] = { NSSwapHostShortToLittle(BSTTraceVersion), 0 };
+    [traceData appendBytes:"BSTR" length:4];
+    [traceData appendBytes:header length:sizeof(header)];
+    BSTAppendFloat64(traceData, self.frame.size.width);
+    BSTAppendFloat64(traceData, self.frame.size.height);
+    BSTAppendUInt32(traceData, options);
+    BSTAppendUInt32(traceData, (uint32_t)self.userTabDraggingEnabled);
+    BSTAppendFloat64(traceData, self.scrollOffset);
+    BSTAppendData(traceData, state);
+    traceLastEventTime = [[NSProcessInfo processInfo] systemUptime];
 }
 
 
 
--(BOOL)wantsPeriodicDraggingUpdates {
+-(NSData *)recordedTrace {
     
-    return NO; // Only get updates on move
+    return [traceData copy];
 }
 
 
 
-
--(NSDragOperation)draggingUpdated:(id<NSDraggingInfo>)sender {
-    
-    /*
-     * This method is used to determine the insert point in case the drag operation were to conclude next
-     * it is recalculating every time and storing the reult in a state varaible.  A short circuit could 
-     * be considered to check if the previous value is valid before going into the full calculation
-     * but given the rarity of drags this is felt unneeded until a performace issue is seen
-     */
-
+-(NSMutableData *)traceEvent:(BSTTraceEventKind)kind {
     
-    if (validDragInDest) {   // Calculate the point of the visual feedback if the drag is valid
-        NSPoint drPt = [self convertPoint:[sender draggingLocation] fromView:nil];
-        NSInteger insPoint;
-        
-        // Find location
-        insPoint = self.tabs.count - 1;  // Start by assuming after last tab
-        NSInteger i = 0;
-        while (i<self.tabs.count) {  // Search all tabs
-            if ([(BSTTabViewTab*)[self.tabs objectAtIndex:i] xLocIsBeforeFirstHalfOfTab:drPt.x]) {
-                insPoint = i - 1;  // insPoint is defined as tab before insert point (-1 == before first)
-                i = self.tabs.count; // Found the point, break out of while loop
-            }
-            i++;
-        }
-        if (dragInsertPoint != insPoint) {   // if point changed, update state variable and request redraw
-            dragInsertPoint = insPoint;
-            [self setNeedsDisplay:YES];
-        }
-
+    if (!_traceRecordingEnabled || (traceSuppression > 0)) {
+        return nil;
     }
+    NSTimeInterval now = [[NSProcessInfo processInfo] systemUptime];
+    double micros = (now - traceLastEventTime) * 1000000.0;
+    traceLastEventTime = now;
     
-    return destinationDragOperation;
+    BSTAppendUInt8(traceData, kind);
+    BSTAppendUInt32(traceData, ((micros > (double)UINT32_MAX) ? UINT32_MAX : (uint32_t)micros));  // Pauses over an hour are shortened
+    return traceData;
 }
 
 
 
-
--(void)draggingExited:(id<NSDraggingInfo>)sender {
+-(void)traceMouseEvent:(NSEvent *)theEvent kind:(BSTTraceEventKind)kind {
     
-    // Unset the state managing variables
-    validDragInDest = NO;
-    dragInsertPoint = -1;
-    [self setNeedsDisplay:YES];
+    NSMutableData *trace = [self traceEvent:kind];
+    if (!trace) {
+        return;
+    }
+    BSTAppendPoint(trace, [self convertPoint:[theEvent locationInWindow] fromView:nil]);
+    BSTAppendUInt32(trace, (uint32_t)[theEvent modifierFlags]);
+    BSTAppendUInt8(trace, ((kind == BSTTraceMouseMoved) ? 0 : (uint8_t)MIN([theEvent clickCount], 255)));  // Moves have no click count
 }
 
 
 
-
--(BOOL)prepareForDragOperation:(id<NSDraggingInfo>)sender {
-    
+-(void)traceTab:(BSTTabViewTab *)tab entered:(BOOL)entered event:(NSEvent *)theEvent {
     
-    NSArray *ar = [sender.draggingPasteboard readObjectsForClasses:[NSArray arrayWithObject:[NSString class]] options:nil];
+    if (!theEvent || self.singleTrackingAreaEnabled) {  // The control moved the rollover itself, its cause is recorded
+        return;
+    }
+    NSInteger index = [self indexOfTab:tab];
+    NSMutableData *trace = ((index >= 0) ? [self traceEvent:(entered ? BSTTraceMouseEntered : BSTTraceMouseExited)] : nil);
+    if (trace) {
+        BSTAppendUInt32(trace, (uint32_t)index);
+    }
+}
 
-    if (( ar.count != 1 ) || (![self validateDragString:(NSString *)[ar firstObject]])) {  // Something is wrong, there should be one and only one valid string on the pasteboard
-        validDragInDest = NO;  // unset the state variable if we are going to deny drag
-        [self setNeedsDisplay:YES];
 
-        return NO;
-    }
-    
-    // There is a valid dragString - Ask delegate if ok to insert
-    NSString *ds =[ar firstObject];
-    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:draggedTabWillBeInsertedWithIndex:label:tag:sourceExternal:)]) {
-        if (![self.delegate tabView:self draggedTabWillBeInsertedWithIndex:(dragInsertPoint+1) label:[self labelFromDragString:ds] tag:[self tagFromDragString:ds] sourceExternal:([sender draggingSource] ? NO : YES)]) {
-            validDragInDest = NO;  // unset the state variable if we are going to deny drag
-            [self setNeedsDisplay:YES];
 
-            return NO;
-        };
+-(void)traceDraggingInfo:(id<NSDraggingInfo>)sender kind:(BSTTraceEventKind)kind {
+    
+    NSMutableData *trace = [self traceEvent:kind];
+    if (!trace) {
+        return;
+    }
+    BSTAppendPoint(trace, [self convertPoint:[sender draggingLocation] fromView:nil]);
+    if (kind != BSTTraceDraggingEntered) {
+        return;
     }
     
-    return YES;  // Default return if no delegate method
+    id src = [sender draggingSource];
+    BSTTraceDragSource source = BSTTraceDragSourceOther;
+    NSData *payload = nil;
+    uint32_t sourceDragging = 0;
+    if (!src) {
+        source = BSTTraceDragSourceOtherApplication;
+        payload = [sender.draggingPasteboard dataForType:BSTDragPasteboardType];
+    } else if (src == self) {
+        source = BSTTraceDragSourceSelf;
+    } else if ([src isKindOfClass:[BSTTabView class]]) {
+        source = BSTTraceDragSourceOtherTabView;
+        payload = [[(BSTTabView *)src outgoingDragPayload] data];
+        sourceDragging = (uint32_t)[(BSTTabView *)src userTabDraggingEnabled];
+    }
+    BSTAppendUInt32(trace, (uint32_t)[sender draggingSourceOperationMask]);
+    BSTAppendUInt32(trace, (uint32_t)[sender draggingSequenceNumber]);
+    BSTAppendUInt8(trace, source);
+    BSTAppendUInt32(trace, sourceDragging);
+    BSTAppendData(trace, payload);
 }
 
 
 
-
--(BOOL)performDragOperation:(id<NSDraggingInfo>)sender {
-    
-    // if we get here we are good to go, validation done in prepareForDragOperation
+-(void)setFrameSize:(NSSize)newSize {
     
-    BOOL success = YES;
-
-    if ([sender draggingSource] == self ) {  // This drag can be short-circuited by using the moveTab method
-        
-        NSInteger frm =[self.tabs indexOfObject:dragSourceTab];
-        NSInteger to =(dragInsertPoint+1);
-        
-        [self moveTabAtIndex:frm toIndex:(to > frm ? (to - 1) : to)]; 
-        deleteTabOnSuccessfulDrag = NO; // Flag the sender (== self) that no delete is needed
-        
+    [super setFrameSize:newSize];
+    if (renderingOffscreen) {  // A temporary size
+        return;
     }
-    else { // Do a proper new insert and assume the sender will do a delete
-
-        NSString *ds = [[sender.draggingPasteboard readObjectsForClasses:[NSArray arrayWithObject:[NSString class]] options:nil] firstObject];
-        
-        if ([self addTabWithLabel:[self labelFromDragString:ds] tag: nil atIndex:(dragInsertPoint + 1)] == -1) {  // Try insert
-            success = NO;
-        }
-        
-        NSString *tg = [self tagFromDragString:ds];
-        if (tg && success) {
-            success = [self setTag:tg ForTabAtIndex:(dragInsertPoint + 1)];
-        }
+    NSMutableData *trace = [self traceEvent:BSTTraceResize];
+    if (trace) {
+        BSTAppendPoint(trace, NSMakePoint(newSize.width, newSize.height));
     }
-    
-    // Done - unset the state managing variables
-    validDragInDest = NO;
-    self.LayoutIsInvalid = YES;
-    [self setNeedsDisplay:YES];
-    
-    return success;
 }
 
 
 
--(void)concludeDragOperation:(id<NSDraggingInfo>)sender {
+-(void)setNeedsDisplayInRect:(NSRect)invalidRect {
     
-    // Do nothing here
+    if (replayingTrace) {
+        replayDirtyRect = NSUnionRect(replayDirtyRect, invalidRect);
+    }
+    [super setNeedsDisplayInRect:invalidRect];
 }
 
 
 
-#pragma mark - Action methods
-
-
--(NSInteger)addTabWithLabel:(NSString *)label tag:(NSString *)tag {
+-(void)setNeedsDisplay:(BOOL)needsDisplay {
     
-    return [self addTabWithLabel:label tag: tag atIndex:self.tabs.count];
+    if (replayingTrace && needsDisplay) {
+        replayDirtyRect = self.bounds;
+    }
+    [super setNeedsDisplay:needsDisplay];
 }
 
 
--(NSInteger)addTabWithLabel:(NSString *)label tag:(NSString *)tag atIndex:(NSUInteger)requestedIndex{
+
+/*
+ * The whole trace is decoded into one action per event before the view is touched, so a damaged trace is rejected
+ * without replaying part of it. Each action is then timed together with drawing the area it invalidated, which is
+ * where the layout it caused runs.
+ */
+-(NSArray *)replayTrace:(NSData *)trace {
     
-    NSInteger newIndex = ((requestedIndex > self.tabs.count) ? self.tabs.count : requestedIndex); // Set to end if higher then end
+    const uint8_t *bytes = trace.bytes;
+    NSUInteger length = trace.length;
+    NSUInteger pos = 8;
     
-    // End editing and if not abort
-    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
-        return -1;
+    if ((length < 8) || (memcmp(bytes, "BSTR", 4) != 0)) {
+        return nil;
+    }
+    uint16_t version;
+    memcpy(&version, bytes + 4, sizeof(version));
+    if (NSSwapLittleShortToHost(version) != BSTTraceVersion) {  // Unknown version, could be a newer format
+        return nil;
     }
-
-    BSTTabViewTab *tab = [[BSTTabViewTab alloc] initWithOwner:self];
-    tab.label = label;
-    tab.tag = tag;
-    [self.tabs insertObject:tab atIndex:newIndex];
     
-    // Check if selected tab index change and notify
-    if (self.selectedTab >= newIndex) {  // At or after insertion point will increase by one
-        
-        [self willChangeValueForKey:@"selectedTab"];  // Do key value calls without the setter to prevent delegate calls
-        _selectedTab = _selectedTab + 1;
-        [self didChangeValueForKey:@"selectedTab"];
+    double width;
+    double height;
+    uint32_t options;
+    uint32_t dragging;
+    double offset;
+    NSData *state;
+    if (!BSTReadFloat64(bytes, length, &pos, &width) || !BSTReadFloat64(bytes, length, &pos, &height) ||
+        !BSTReadUInt32(bytes, length, &pos, &options) || !BSTReadUInt32(bytes, length, &pos, &dragging) ||
+        !BSTReadFloat64(bytes, length, &pos, &offset) || !BSTReadData(bytes, length, &pos, &state) || !state) {
+        return nil;
+    }
+    
+    // Decode the events
+    BSTTabViewTraceDraggingInfo *dragInfo = [[BSTTabViewTraceDraggingInfo alloc] init];
+    dragInfo.view = self;
+    NSMutableArray *names = [[NSMutableArray alloc] init];
+    NSMutableArray *times = [[NSMutableArray alloc] init];
+    NSMutableArray *actions = [[NSMutableArray alloc] init];
+    NSTimeInterval time = 0.0;
+    while (pos < length) {
+        uint8_t kind;
+        uint32_t micros;
+        NSString *name = nil;
+        if (!BSTReadUInt8(bytes, length, &pos, &kind) || !BSTReadUInt32(bytes, length, &pos, &micros)) {
+            return nil;
+        }
+        time = time + (micros / 1000000.0);
+        void (^action)(void) = [self replayActionForEvent:kind bytes:bytes length:length position:&pos name:&name dragInfo:dragInfo];
+        if (!action) {
+            return nil;
+        }
+        [names addObject:name];
+        [times addObject:[NSNumber numberWithDouble:time]];
+        [actions addObject:action];
+    }
+    
+    // Start from the recorded view
+    [self setFrameSize:NSMakeSize(width, height)];
+    self.topEdgeAligned = ((options & BSTTraceOptionTopEdgeAligned) != 0);
+    self.rolloverEnabled = ((options & BSTTraceOptionRollover) != 0);
+    self.singleTrackingAreaEnabled = ((options & BSTTraceOptionSingleTrackingArea) != 0);
+    self.tabImageCacheEnabled = ((options & BSTTraceOptionTabImageCache) != 0);
+    self.typesetLabelCacheEnabled = ((options & BSTTraceOptionTypesetLabelCache) != 0);
+    self.scrollingEnabled = ((options & BSTTraceOptionScrolling) != 0);
+    self.doubleClickEditEnabled = ((options & BSTTraceOptionDoubleClickEdit) != 0);
+    self.asynchronousLabelMeasurementEnabled = NO;
+    self.userTabDraggingEnabled = (BSTTabViewDragOptions)dragging;
+    if (![self restoreTabStateFromData:state]) {
+        return nil;
+    }
+    [self updateLayoutIfNeeded];  // The scroll offset is clamped to the laid out tabs
+    self.scrollOffset = offset;
+    
+    NSBitmapImageRep *rep = nil;
+    NSMutableArray *events = [[NSMutableArray alloc] initWithCapacity:actions.count];
+    replayingTrace = YES;
+    replayDirtyRect = self.bounds;  // The first event draws the whole strip
+    for (NSUInteger i = 0; i < actions.count; i++) {
+        NSTimeInterval start = [[NSProcessInfo processInfo] systemUptime];
+        void (^action)(void) = [actions objectAtIndex:i];
+        action();
         
-        if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:selectedTabChangedIndexTo:)]) {
-            [self.delegate tabView:self selectedTabChangedIndexTo:self.selectedTab];
+        NSRect dirty = NSIntersectionRect(replayDirtyRect, self.bounds);
+        if (!NSIsEmptyRect(dirty)) {
+            if (!rep || !NSEqualSizes(rep.size, self.bounds.size)) {  // Reused until the view is resized
+                rep = [self bitmapImageRepForCachingDisplayInRect:self.bounds];
+            }
+            [self cacheDisplayInRect:dirty toBitmapImageRep:rep];
         }
+        replayDirtyRect = NSZeroRect;
+        
+        NSTimeInterval latency = [[NSProcessInfo processInfo] systemUptime] - start;
+        [events addObject:[[BSTTabViewTraceEvent alloc] initWithName:[names objectAtIndex:i] time:[[times objectAtIndex:i] doubleValue] latency:latency]];
     }
+    replayingTrace = NO;
     
-    self.LayoutIsInvalid = YES;
-    [self setNeedsDisplay:YES];
-    return (newIndex);
+    return events;
 }
 
 
 
-
--(BOOL)removeTabAtIndex:(NSUInteger)index {
+-(void (^)(void))replayActionForEvent:(BSTTraceEventKind)kind bytes:(const uint8_t *)bytes length:(NSUInteger)length position:(NSUInteger *)pos name:(NSString **)name dragInfo:(BSTTabViewTraceDraggingInfo *)dragInfo {
     
-    if (index >= self.tabs.count) {
-        return NO;  // Invalid index
-    }
+    __weak BSTTabView *weakSelf = self;
+    NSPoint point;
+    uint32_t value;
+    uint32_t index;
+    uint8_t flag;
+    NSString *label;
+    NSString *tag;
+    NSIndexSet *indexes;
+    NSData *data;
+    double number;
     
-    // End editing and if not abort
-    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
-        return NO;
+    switch (kind) {
+        case BSTTraceMouseDown:
+        case BSTTraceMouseUp:
+        case BSTTraceMouseDragged:
+        case BSTTraceMouseMoved: {
+            if (!BSTReadPoint(bytes, length, pos, &point) || !BSTReadUInt32(bytes, length, pos, &value) || !BSTReadUInt8(bytes, length, pos, &flag)) {
+                return nil;
+            }
+            NSEventType type = ((kind == BSTTraceMouseDown) ? NSLeftMouseDown : ((kind == BSTTraceMouseUp) ? NSLeftMouseUp : ((kind == BSTTraceMouseDragged) ? NSLeftMouseDragged : NSMouseMoved)));
+            NSString *names[] = { @"mouseDown:", @"mouseUp:", @"mouseDragged:", @"mouseMoved:" };
+            *name = names[kind - BSTTraceMouseDown];
+            return ^{
+                NSEvent *theEvent = [NSEvent mouseEventWithType:type location:[weakSelf convertPoint:point toView:nil] modifierFlags:value timestamp:0.0 windowNumber:0 context:nil eventNumber:0 clickCount:flag pressure:1.0];
+                switch (kind) {
+                    case BSTTraceMouseDown:
+                        [weakSelf mouseDown:theEvent];
+                        break;
+                    case BSTTraceMouseUp:
+                        [weakSelf mouseUp:theEvent];
+                        break;
+                    case BSTTraceMouseDragged:
+                        [weakSelf mouseDragged:theEvent];
+                        break;
+                    default:
+                        [weakSelf mouseMoved:theEvent];
+                        break;
+                }
+            };
+        }
+            
+        case BSTTraceMouseEntered:
+        case BSTTraceMouseExited: {
+            if (!BSTReadUInt32(bytes, length, pos, &index)) {
+                return nil;
+            }
+            BOOL entered = (kind == BSTTraceMouseEntered);
+            *name = (entered ? @"mouseEntered:" : @"mouseExited:");
+            return ^{
+                if (index == BSTDragPayloadNoTag) {  // The single tracking area
+                    [weakSelf mouseExited:nil];
+                } else if (index < weakSelf.tabs.count) {
+                    BSTTabViewTab *tab = [weakSelf.tabs objectAtIndex:index];
+                    if (entered) {
+                        [tab mouseEntered:nil];
+                    } else {
+                        [tab mouseExited:nil];
+                    }
+                }
+            };
+        }
+            
+        case BSTTraceResize:
+            if (!BSTReadPoint(bytes, length, pos, &point)) {
+                return nil;
+            }
+            *name = @"setFrameSize:";
+            return ^{
+                [weakSelf setFrameSize:NSMakeSize(point.x, point.y)];
+            };
+            
+        case BSTTraceDraggingEntered: {
+            uint32_t mask;
+            uint32_t sequence;
+            uint32_t sourceDragging;
+            if (!BSTReadPoint(bytes, length, pos, &point) || !BSTReadUInt32(bytes, length, pos, &mask) || !BSTReadUInt32(bytes, length, pos, &sequence) ||
+                !BSTReadUInt8(bytes, length, pos, &flag) || !BSTReadUInt32(bytes, length, pos, &sourceDragging) || !BSTReadData(bytes, length, pos, &data)) {
+                return nil;
+            }
+            *name = @"draggingEntered:";
+            return ^{
+                BSTTabView *strongSelf = weakSelf;
+                id source = nil;
+                if (flag == BSTTraceDragSourceSelf) {
+                    source = strongSelf;
+                } else if (flag == BSTTraceDragSourceOtherTabView) {  // A stand in for the other strip, with its payload
+                    BSTTabView *other = [[BSTTabView alloc] initWithFrame:NSZeroRect];
+                    other.userTabDraggingEnabled = (BSTTabViewDragOptions)sourceDragging;
+                    other->dragSourcePayload = (data ? [[BSTTabViewDragPayload alloc] initWithData:data] : nil);
+                    source = other;
+                } else if (flag != BSTTraceDragSourceOtherApplication) {
+                    source = [[NSObject alloc] init];
+                }
+                dragInfo.source = source;
+                dragInfo.payloadData = data;
+                dragInfo.sourceOperationMask = mask;
+                dragInfo.sequenceNumber = sequence;
+                dragInfo.location = point;
+                [strongSelf draggingEntered:(id<NSDraggingInfo>)dragInfo];
+            };
+        }
+            
+        case BSTTraceDraggingUpdated:
+        case BSTTraceDraggingExited:
+        case BSTTracePrepareForDragOperation:
+        case BSTTracePerformDragOperation: {
+            if (!BSTReadPoint(bytes, length, pos, &point)) {
+                return nil;
+            }
+            NSString *names[] = { @"draggingUpdated:", @"draggingExited:", @"prepareForDragOperation:", @"performDragOperation:" };
+            *name = names[kind - BSTTraceDraggingUpdated];
+            return ^{
+                dragInfo.location = point;
+                id<NSDraggingInfo> sender = (id<NSDraggingInfo>)dragInfo;
+                switch (kind) {
+                    case BSTTraceDraggingUpdated:
+                        [weakSelf draggingUpdated:sender];
+                        break;
+                    case BSTTraceDraggingExited:
+                        [weakSelf draggingExited:sender];
+                        break;
+                    case BSTTracePrepareForDragOperation:
+                        [weakSelf prepareForDragOperation:sender];
+                        break;
+                    default:
+                        [weakSelf performDragOperation:sender];
+                        [weakSelf concludeDragOperation:sender];
+                        break;
+                }
+            };
+        }
+            
+        case BSTTraceDraggingEnded:
+            if (!BSTReadUInt32(bytes, length, pos, &value)) {
+                return nil;
+            }
+            *name = @"draggingSession:endedAtPoint:operation:";
+            return ^{
+                [weakSelf draggingSession:nil endedAtPoint:NSZeroPoint operation:value];
+            };
+            
+        case BSTTraceAddTab:
+            if (!BSTReadUInt32(bytes, length, pos, &index) || !BSTReadString(bytes, length, pos, &label) || !BSTReadString(bytes, length, pos, &tag)) {
+                return nil;
+            }
+            *name = @"addTabWithLabel:tag:atIndex:";
+            return ^{
+                [weakSelf addTabWithLabel:label tag:tag atIndex:index];
+            };
+            
+        case BSTTraceAddTabs: {
+            if (!BSTReadUInt32(bytes, length, pos, &index) || !BSTReadUInt32(bytes, length, pos, &value) || (value > (length - *pos) / 8)) {  // Each tab needs at least 8 bytes
+                return nil;
+            }
+            NSMutableArray *labels = [[NSMutableArray alloc] initWithCapacity:value];
+            NSMutableArray *tags = [[NSMutableArray alloc] initWithCapacity:value];
+            for (uint32_t i = 0; i < value; i++) {
+                if (!BSTReadString(bytes, length, pos, &label) || !BSTReadString(bytes, length, pos, &tag)) {
+                    return nil;
+                }
+                [labels addObject:(label ? label : [NSNull null])];
+                [tags addObject:(tag ? tag : [NSNull null])];
+            }
+            *name = @"addTabsWithLabels:tags:atIndex:";
+            return ^{
+                [weakSelf addTabsWithLabels:labels tags:tags atIndex:index];
+            };
+        }
+            
+        case BSTTraceRemoveTab:
+            if (!BSTReadUInt32(bytes, length, pos, &index)) {
+                return nil;
+            }
+            *name = @"removeTabAtIndex:";
+            return ^{
+                [weakSelf removeTabAtIndex:index];
+            };
+            
+        case BSTTraceRemoveTabs:
+            if (!BSTReadIndexSet(bytes, length, pos, &indexes)) {
+                return nil;
+            }
+            *name = @"removeTabsAtIndexes:";
+            return ^{
+                [weakSelf removeTabsAtIndexes:indexes];
+            };
+            
+        case BSTTraceMoveTabs:
+            if (!BSTReadIndexSet(bytes, length, pos, &indexes) || !BSTReadUInt32(bytes, length, pos, &index)) {
+                return nil;
+            }
+            *name = @"moveTabsAtIndexes:toIndex:";
+            return ^{
+                [weakSelf moveTabsAtIndexes:indexes toIndex:index];
+            };
+            
+        case BSTTraceMoveTabOneStep:
+            if (!BSTReadUInt32(bytes, length, pos, &index) || !BSTReadUInt8(bytes, length, pos, &flag)) {
+                return nil;
+            }
+            *name = @"moveTabAtIndex:oneStepRight:";
+            return ^{
+                [weakSelf moveTabAtIndex:index oneStepRight:(flag != 0)];
+            };
+            
+        case BSTTraceSetLabel:
+            if (!BSTReadUInt32(bytes, length, pos, &index) || !BSTReadString(bytes, length, pos, &label)) {
+                return nil;
+            }
+            *name = @"setLabel:forTabAtIndex:";
+            return ^{
+                [weakSelf setLabel:label forTabAtIndex:index];
+            };
+            
+        case BSTTraceSetTag:
+            if (!BSTReadUInt32(bytes, length, pos, &index) || !BSTReadString(bytes, length, pos, &tag)) {
+                return nil;
+            }
+            *name = @"setTag:ForTabAtIndex:";
+            return ^{
+                [weakSelf setTag:tag ForTabAtIndex:index];
+            };
+            
+        case BSTTraceSelectTab:
+            if (!BSTReadUInt32(bytes, length, pos, &index)) {
+                return nil;
+            }
+            *name = @"setSelectedTab:";
+            return ^{
+                weakSelf.selectedTab = ((index == BSTDragPayloadNoTag) ? -1 : (NSInteger)index);
+            };
+            
+        case BSTTraceScrollOffset:
+            if (!BSTReadFloat64(bytes, length, pos, &number)) {
+                return nil;
+            }
+            *name = @"setScrollOffset:";
+            return ^{
+                weakSelf.scrollOffset = number;
+            };
+            
+        case BSTTraceBeginUpdates:
+            *name = @"beginUpdates";
+            return ^{
+                [weakSelf beginUpdates];
+            };
+            
+        case BSTTraceEndUpdates:
+            *name = @"endUpdates";
+            return ^{
+                [weakSelf endUpdates];
+            };
+            
+        case BSTTraceRestoreTabState:
+            if (!BSTReadData(bytes, length, pos, &data)) {
+                return nil;
+            }
+            *name = @"restoreTabStateFromData:";
+            return ^{
+                [weakSelf restoreTabStateFromData:data];
+            };
+            
+        case BSTTraceApplyQueuedLabels: {
+            if (!BSTReadUInt32(bytes, length, pos, &value) || (value > (length - *pos) / 8)) {  // Each label needs at least 8 bytes
+                return nil;
+            }
+            NSMutableArray *tags = [[NSMutableArray alloc] initWithCapacity:value];
+            NSMutableArray *labels = [[NSMutableArray alloc] initWithCapacity:value];
+            for (uint32_t i = 0; i < value; i++) {
+                if (!BSTReadString(bytes, length, pos, &tag) || !tag || !BSTReadString(bytes, length, pos, &label) || !label) {
+                    return nil;
+                }
+                [tags addObject:tag];
+                [labels addObject:label];
+            }
+            *name = @"applyQueuedLabels";
+            return ^{
+                for (NSUInteger i = 0; i < tags.count; i++) {
+                    [weakSelf enqueueLabel:[labels objectAtIndex:i] forTabWithTag:[tags objectAtIndex:i]];
+                }
+                [weakSelf applyQueuedLabels];  // The scheduled apply finds the queue empty
+            };
+        }
+            
+        case BSTTraceGroupTabs:
+            if (!BSTReadUInt32(bytes, length, pos, &index) || !BSTReadUInt32(bytes, length, pos, &value) || !BSTReadString(bytes, length, pos, &label)) {
+                return nil;
+            }
+            *name = @"groupTabsInRange:withLabel:";
+            return ^{
+                [weakSelf groupTabsInRange:NSMakeRange(index, value) withLabel:label];
+            };
+            
+        case BSTTraceUngroupTabs:
+            if (!BSTReadUInt32(bytes, length, pos, &index)) {
+                return nil;
+            }
+            *name = @"ungroupTabsOfGroupAtIndex:";
+            return ^{
+                [weakSelf ungroupTabsOfGroupAtIndex:index];
+            };
+            
+        case BSTTraceCollapseGroup:
+            if (!BSTReadUInt32(bytes, length, pos, &index) || !BSTReadUInt8(bytes, length, pos, &flag)) {
+                return nil;
+            }
+            *name = ((flag != 0) ? @"collapseGroupOfTabAtIndex:" : @"expandGroupOfTabAtIndex:");
+            return ^{
+                if (flag != 0) {
+                    [weakSelf collapseGroupOfTabAtIndex:index];
+                } else {
+                    [weakSelf expandGroupOfTabAtIndex:index];
+                }
+            };
+            
+        default:  // Unknown event, could be from a newer version
+            return nil;
     }
+}
 
-    // Check selected tab status and notify
-    if (self.selectedTab == index) {  // Removing selected tab
-        self.selectedTab = -1;  // Try to change to selection - triggers delegate notification methods
-        if (self.selectedTab != -1) {  // Change was denied by deleagte - abort
-            return NO;
-        }
+
+
+#pragma mark - Lookup maps
+
+/*
+ * Each tab caches its own index. A mutation only lowers validCachedIndexCount, the stale tail is renumbered
+ * once on the next lookup that needs it, so a series of mutations followed by lookups costs O(N) in total
+ * and lookups between mutations are O(1).
+ */
+-(NSInteger)indexOfTab:(BSTTabViewTab *)tab {
+    
+    if (!tab) {
+        return -1;
     }
     
-    // Remove it
-    [self.tabs removeObjectAtIndex:index];
+    NSUInteger count = self.tabs.count;
+    NSUInteger index = tab.cachedIndex;
+    if ((index < validCachedIndexCount) && (index < count) && ([self.tabs objectAtIndex:index] == tab)) {
+        return index;
+    }
     
-    // Check if selected tab index change and notify
-    if (self.selectedTab > (NSInteger)index) {  // After removal point will reduce by one
-        
-        [self willChangeValueForKey:@"selectedTab"];  // Do key value calls without the setter to prevent delegate calls
-        _selectedTab = _selectedTab - 1;
-        [self didChangeValueForKey:@"selectedTab"];
-        
-        if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:selectedTabChangedIndexTo:)]) {
-            [self.delegate tabView: self selectedTabChangedIndexTo:self.selectedTab];
-        }
+    for (NSUInteger i = validCachedIndexCount; i < count; i++) {  // Renumber the stale tail
+        [(BSTTabViewTab *)[self.tabs objectAtIndex:i] setCachedIndex:(uint32_t)i];
     }
+    validCachedIndexCount = count;
     
-    self.LayoutIsInvalid = YES;
-    [self setNeedsDisplay:YES];
-    return YES;
+    index = tab.cachedIndex;
+    if ((index < count) && ([self.tabs objectAtIndex:index] == tab)) {
+        return index;
+    }
+    return -1;  // Not in this view
 }
 
 
 
--(NSInteger)moveTabAtIndex:(NSUInteger)fromIndex toIndex:(NSUInteger)toIndex {
+-(void)invalidateCachedIndexesFrom:(NSUInteger)index {
     
-    // Validate intended indexes
-    if ((fromIndex >= self.tabs.count) || (toIndex >= self.tabs.count)) {
-        return -1;  // Invalid index
+    if (index < validCachedIndexCount) {
+        validCachedIndexCount = index;
     }
+    if (index < groupsDirtyFrom) {  // Called on every insert, remove and move
+        groupsDirtyFrom = index;
+    }
+}
+
+
+
+/*
+ * Most labels and tags belong to a single tab, that tab is then stored directly in the map and an array is only
+ * created for keys shared by several tabs. The map keys double as the intern table for the label and tag strings,
+ * a tab stores the key object so all tabs with equal labels share one string, and the string is released with
+ * the last tab using it.
+ */
+-(NSString *)addTab:(BSTTabViewTab *)tab toMap:(NSMutableDictionary *)map forKey:(NSString *)key {
     
-    if (fromIndex == toIndex) {  // No move - abort
-        return (NSInteger)fromIndex;
+    if (!key) {
+        return nil;
+    }
+    id bucket = [map objectForKey:key];
+    if (!bucket) {
+        [map setObject:tab forKey:key];
+    } else if ([bucket isKindOfClass:[BSTTabViewTab class]]) {
+        [map setObject:[[NSMutableArray alloc] initWithObjects:bucket, tab, nil] forKey:key];
+    } else {
+        [(NSMutableArray *)bucket addObject:tab];
     }
     
-    // End editing and if not abort
-    if (labelEditor && ![self.window makeFirstResponder:self.window]) {
-        return -1;
+    const void *interned = NULL;
+    if (!CFDictionaryGetKeyIfPresent((__bridge CFDictionaryRef)map, (__bridge const void *)key, &interned)) {
+        return key;
     }
+    return (__bridge NSString *)interned;
+}
 
-    // Do the move
-    BSTTabViewTab *tab = [self.tabs objectAtIndex:fromIndex];
-    [self.tabs removeObjectAtIndex:fromIndex];
-    [self.tabs insertObject:tab atIndex:toIndex];
-    
-    // Calculate if the selected tab index will change - change and delegate notify
-    NSInteger newSelected = self.selectedTab;
+
+
+-(void)removeTab:(BSTTabViewTab *)tab fromMap:(NSMutableDictionary *)map forKey:(NSString *)key {
     
-    if (fromIndex == self.selectedTab) {   // The selected tab is moving
-        
-        newSelected = toIndex;
-        
-    } else {  // The selected tab is not moving
-        
-        if (self.selectedTab > fromIndex  ) {  // Selected tab is after removal point will step one down
-            newSelected = newSelected - 1;
-        }
-        
-        if (newSelected >= toIndex) {  // Selected tab is at or after insertion point will step one up
-            newSelected = newSelected + 1;
+    if (!key) {
+        return;
+    }
+    id bucket = [map objectForKey:key];
+    if (bucket == tab) {
+        [map removeObjectForKey:key];
+    } else if ([bucket isKindOfClass:[NSMutableArray class]]) {
+        [(NSMutableArray *)bucket removeObjectIdenticalTo:tab];
+        if ([(NSMutableArray *)bucket count] == 1) {  // Back to a single tab
+            [map setObject:[(NSMutableArray *)bucket firstObject] forKey:key];
         }
     }
+}
+
+
+
+// Arrays are not kept in index order, they are only used for shared labels and tags
+-(NSInteger)firstIndexOfTabs:(id)bucket {
+    
+    if (!bucket) {
+        return -1;
+    }
+    if ([bucket isKindOfClass:[BSTTabViewTab class]]) {
+        return [self indexOfTab:bucket];
+    }
     
-    if (newSelected != self.selectedTab) {  // Selected tab is moving
-        
-        [self willChangeValueForKey:@"selectedTab"];  // Do key value calls without the setter to prevent delegate calls
-        _selectedTab = newSelected;
-        [self didChangeValueForKey:@"selectedTab"];
-        
-        if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:selectedTabChangedIndexTo:)]) {
-            [self.delegate tabView:self selectedTabChangedIndexTo:newSelected];
+    NSInteger first = -1;
+    for (BSTTabViewTab *tab in (NSArray *)bucket) {
+        NSInteger index = [self indexOfTab:tab];
+        if ((index >= 0) && ((first < 0) || (index < first))) {
+            first = index;
         }
     }
-    
-    self.LayoutIsInvalid = YES;
-    [self setNeedsDisplay:YES];
-
-    return toIndex;
+    return first;
 }
 
 
 
 -(NSInteger)moveTabAtIndex:(NSUInteger)index oneStepRight:(BOOL)right{
     
+    NSMutableData *trace = [self traceEvent:BSTTraceMoveTabOneStep];
+    if (trace) {
+        BSTAppendUInt32(trace, BSTTraceIndex(index));
+        BSTAppendUInt8(trace, (right ? 1 : 0));
+    }
     if (index >= self.tabs.count) {
         return -1;  // Invalid index
     }
@@ -1687,33 +6010,47 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 
 -(BOOL)setLabel:(NSString *)label forTabAtIndex:(NSUInteger)index{
     
+    NSMutableData *trace = [self traceEvent:BSTTraceSetLabel];
+    if (trace) {
+        BSTAppendUInt32(trace, BSTTraceIndex(index));
+        BSTAppendString(trace, label);
+    }
     if ((index >= self.tabs.count) || (!label)) {  // nil values not permitted
         return NO;
     }
     
     BSTTabViewTab *tab = [self.tabs objectAtIndex:index];
 
-    if ([tab.label isEqualToString:label]) {  // No change - most likely an interactive edit cancel
-        self.LayoutIsInvalid = YES;
-        [self setNeedsDisplay:YES];
+    if ([tab.label isEqualToString:label]) {  // No change - most likely an interactive edit cancel, the editor may have widened the tab
+        if (tab == editedTab) {
+            [self invalidateLayoutAndDisplayFromIndex:index];
+        }
         return YES;
     }
 
     if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:labelShouldChangeTo:forTabAtIndex:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
+        }
         if (![self.delegate tabView:self labelShouldChangeTo:label forTabAtIndex:index]) {
             return NO;  // Abort if delegate denies change
         }
     }
     
-    tab.label = label;
+    CGFloat oldWidth = [tab cachedLabelWidth];
+    [[self pendingChangesBeforeMovingTabs:NO].relabeledTabs addObject:tab];
+    [self removeTab:tab fromMap:tabsByLabel forKey:tab.label];
+    tab.label = [self addTab:tab toMap:tabsByLabel forKey:label];
 
     
     if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:labelDidChangeForTabAtIndex:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
+        }
         [self.delegate tabView:self labelDidChangeForTabAtIndex:index];
     }
     
-    self.LayoutIsInvalid = YES;
-    [self setNeedsDisplay:YES];
+    [self invalidateTab:tab atIndex:index relabeledFromWidth:oldWidth];
 
     return YES;
 }
@@ -1721,21 +6058,137 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 
 
 
--(NSInteger)indexForTabWithLabel:(NSString *)label{
+/*
+ * Producers on any thread only swap the latest label into queuedLabels under labelFeedLock, the first one after an
+ * apply also schedules the next apply one frame later. The main thread takes the whole dictionary out under the lock
+ * and does all the work outside it, so a producer never waits for more than a dictionary insert. Tabs keeping their
+ * width are only repainted, the others give one relayout from the first of them.
+ */
+-(void)enqueueLabel:(NSString *)label forTabWithTag:(NSString *)tag {
     
-    BSTTabViewTab *tab;
-    for (NSUInteger i = 0; i < self.tabs.count; i++) {
-        tab = [self.tabs objectAtIndex:i];
-        if ([tab.label isEqualToString:label]) {
-            return i;
+    if (!label || !tag) {
+        return;
+    }
+    NSString *labelCopy = [label copy];
+    NSString *tagCopy = [tag copy];
+    
+    pthread_mutex_lock(&labelFeedLock);
+    [queuedLabels setObject:labelCopy forKey:tagCopy];
+    BOOL schedule = !labelFeedScheduled;
+    labelFeedScheduled = YES;
+    pthread_mutex_unlock(&labelFeedLock);
+    
+    if (schedule) {  // Everything queued until then is applied in the same batch
+        __weak BSTTabView *weakSelf = self;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(BSTlabelFeedInterval * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+            [weakSelf applyQueuedLabels];
+        });
+    }
+}
+
+
+
+-(void)applyQueuedLabels {
+    
+    NSMutableDictionary *empty = [[NSMutableDictionary alloc] init];  // Allocated outside the lock
+    pthread_mutex_lock(&labelFeedLock);
+    NSMutableDictionary *labels = queuedLabels;
+    queuedLabels = empty;
+    labelFeedScheduled = NO;
+    pthread_mutex_unlock(&labelFeedLock);
+    
+    NSMutableData *trace = ((labels.count > 0) ? [self traceEvent:BSTTraceApplyQueuedLabels] : nil);
+    if (trace) {
+        BSTAppendUInt32(trace, (uint32_t)labels.count);
+        for (NSString *tag in labels) {
+            BSTAppendString(trace, tag);
+            BSTAppendString(trace, [labels objectForKey:tag]);
+        }
+    }
+    
+    NSMutableIndexSet *changed = [[NSMutableIndexSet alloc] init];
+    for (NSString *tag in labels) {
+        NSString *label = [labels objectForKey:tag];
+        id bucket = [tabsByTag objectForKey:tag];
+        NSArray *tabs = ([bucket isKindOfClass:[BSTTabViewTab class]] ? @[bucket] : [(NSArray *)bucket copy]);  // nil for an unknown tag
+        for (BSTTabViewTab *tab in tabs) {
+            if ((tab == editedTab) || [tab.label isEqualToString:label]) {  // The user edit wins, or no change
+                continue;
+            }
+            NSUInteger index = (NSUInteger)[self indexOfTab:tab];
+            if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:labelShouldChangeTo:forTabAtIndex:)]) {
+                if (_statisticsEnabled) {
+                    counters.delegateCallbacks++;
+                }
+                if (![self.delegate tabView:self labelShouldChangeTo:label forTabAtIndex:index]) {
+                    continue;  // The delegate denies the change
+                }
+            }
+            CGFloat oldWidth = [tab cachedLabelWidth];
+            [[self pendingChangesBeforeMovingTabs:NO].relabeledTabs addObject:tab];
+            [self removeTab:tab fromMap:tabsByLabel forKey:tab.label];
+            tab.label = [self addTab:tab toMap:tabsByLabel forKey:label];
+            [self invalidateTab:tab atIndex:index relabeledFromWidth:oldWidth];
+            [changed addIndex:index];
+        }
+    }
+    if (changed.count == 0) {
+        return;
+    }
+    
+    if (self.delegate && [self.delegate respondsToSelector:@selector(tabView:labelsDidChangeForTabsAtIndexes:)]) {
+        if (_statisticsEnabled) {
+            counters.delegateCallbacks++;
         }
+        [self.delegate tabView:self labelsDidChangeForTabsAtIndexes:changed];
     }
-    return -1; // Can only get here if not found
 }
 
 
 
 
+-(NSInteger)indexForTabWithLabel:(NSString *)label{
+    
+    if (!label) {
+        return -1;
+    }
+    return [self firstIndexOfTabs:[tabsByLabel objectForKey:label]];  // -1 if label do not exist
+}
+
+
+
+-(NSInteger)indexForTabWithTag:(NSString *)tag{
+    
+    if (!tag) {
+        return -1;
+    }
+    return [self firstIndexOfTabs:[tabsByTag objectForKey:tag]];  // -1 if tag do not exist
+}
+
+
+
+-(BOOL)selectTabWithTag:(NSString *)tag{
+    
+    NSInteger index = [self indexForTabWithTag:tag];
+    if (index < 0) {
+        return NO;
+    }
+    self.selectedTab = index;
+    return (self.selectedTab == index);  // Delegate may deny
+}
+
+
+
+-(BOOL)removeTabWithTag:(NSString *)tag{
+    
+    NSInteger index = [self indexForTabWithTag:tag];
+    if (index < 0) {
+        return NO;
+    }
+    return [self removeTabAtIndex:index];
+}
+
+
 
 -(NSString *)tagForTabAtIndex:(NSUInteger)index{
     
@@ -1750,12 +6203,21 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
 
 -(BOOL)setTag:(NSString *)tag ForTabAtIndex:(NSUInteger)index{
  
+    NSMutableData *trace = [self traceEvent:BSTTraceSetTag];
+    if (trace) {
+        BSTAppendUInt32(trace, BSTTraceIndex(index));
+        BSTAppendString(trace, tag);
+    }
     
     if (index >= self.tabs.count ) {
         return NO;
     }
     BSTTabViewTab *tab = [self.tabs objectAtIndex:index];
-    tab.tag = tag;
+    if ((tab.tag != tag) && ![tab.tag isEqualToString:tag]) {  // Only a new tag is a change
+        [[self pendingChangesBeforeMovingTabs:NO].retaggedTabs addObject:tab];
+    }
+    [self removeTab:tab fromMap:tabsByTag forKey:tab.tag];
+    tab.tag = [self addTab:tab toMap:tabsByTag forKey:tag];
     return YES;
 }
 
@@ -1768,7 +6230,11 @@ static CGFloat const          BSTsmallTabHeightThreshold  = 10.0;
         return -1;
     }
     
-    return [self.tabs indexOfObject:self.currentRollover];
+    NSInteger index = BSTLastIndexAtOrBefore(tabStartTable, tabTableCount, self.currentRollover.startX + self.scrollOffset);
+    if ((index >= 0) && (index < self.tabs.count) && ([self.tabs objectAtIndex:index] == self.currentRollover)) {
+        return index;
+    }
+    return [self indexOfTab:self.currentRollover];  // Tables are stale, layout pending
 }
 
 
@@ -0,0 +1,560 @@
+//
+//  BSTTabViewBenchmarks.m
+//  TestTabViewTests
+//
+
+#import <Cocoa/Cocoa.h>
+#import <XCTest/XCTest.h>
+#import <mach/mach.h>
+#import <mach/mach_time.h>
+#import <malloc/malloc.h>
+#import <stdatomic.h>
+#import "BSTTabView.h"
+
+/*
+ * Benchmarks of the BSTTabView model, layout and drawing operations at 10 to 100k tabs. Every operation is timed
+ * one call at a time and reported as one JSON object per line, prefixed "BSTBENCH " on stdout so it can be picked
+ * out of the xcodebuild log. If the environment variable BST_BENCHMARK_OUTPUT names a file the lines are also
+ * appended there without the prefix, ready to be diffed between releases.
+ *
+ * Run headless with
+ *   xcodebuild test -project TestTabView.xcodeproj -scheme TestTabView -only-testing:TestTabViewTests/BSTTabViewBenchmarks
+ *
+ * Fields: benchmark, tabs, ops, ops_per_sec, p50_us, p99_us, allocs_per_op and alloc_bytes_per_op, the malloc calls
+ * made during an operation, and live_bytes_per_op, the growth of the live heap over the run divided by ops.
+ */
+
+
+// Drag payload helper class in BSTTabView.m
+@interface BSTTabViewDragPayload : NSObject
+-(instancetype)initWithLabels:(NSArray *)labels tags:(NSArray *)tags sourceIndexes:(NSIndexSet *)indexes;
+-(instancetype)initWithData:(NSData *)data;
+-(NSData *)data;
+@end
+
+
+// Rollover hit testing in BSTTabView.m
+@interface BSTTabView (Benchmarks)
+-(void)updateRolloverForPoint:(NSPoint)point event:(NSEvent *)theEvent;
+-(void)applyQueuedLabels;
+@end
+
+
+typedef void (^BSTBenchmarkBlock)(NSUInteger i);
+
+
+static uint64_t BSTNanoseconds(void) {
+
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+
+static int BSTCompareDoubles(const void *a, const void *b) {
+
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return ((da < db) ? -1 : ((da > db) ? 1 : 0));
+}
+
+
+static _Atomic uint64_t BSTAllocationCount;
+static _Atomic uint64_t BSTAllocatedBytes;
+static void *(*BSTZoneMalloc)(malloc_zone_t *zone, size_t size);
+static void *(*BSTZoneCalloc)(malloc_zone_t *zone, size_t count, size_t size);
+static void *(*BSTZoneRealloc)(malloc_zone_t *zone, void *ptr, size_t size);
+
+
+static void BSTCountAllocation(size_t size) {
+
+    atomic_fetch_add_explicit(&BSTAllocationCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&BSTAllocatedBytes, size, memory_order_relaxed);
+}
+
+
+static void *BSTCountingMalloc(malloc_zone_t *zone, size_t size) {
+
+    BSTCountAllocation(size);
+    return BSTZoneMalloc(zone, size);
+}
+
+
+static void *BSTCountingCalloc(malloc_zone_t *zone, size_t count, size_t size) {
+
+    BSTCountAllocation(count * size);
+    return BSTZoneCalloc(zone, count, size);
+}
+
+
+static void *BSTCountingRealloc(malloc_zone_t *zone, void *ptr, size_t size) {
+
+    BSTCountAllocation(size);
+    return BSTZoneRealloc(zone, ptr, size);
+}
+
+
+/// Count every malloc, calloc and realloc of the default zone, which objects and CF storage are allocated from
+static void BSTInstallAllocationCounter(void) {
+
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        malloc_zone_t *zone = malloc_default_zone();
+        vm_address_t start = trunc_page((vm_address_t)zone);
+        vm_size_t size = round_page((vm_address_t)zone + sizeof(malloc_zone_t)) - start;
+        vm_protect(mach_task_self(), start, size, FALSE, VM_PROT_READ | VM_PROT_WRITE);  // Zones are read only
+        BSTZoneMalloc = zone->malloc;
+        BSTZoneCalloc = zone->calloc;
+        BSTZoneRealloc = zone->realloc;
+        zone->malloc = BSTCountingMalloc;
+        zone->calloc = BSTCountingCalloc;
+        zone->realloc = BSTCountingRealloc;
+        vm_protect(mach_task_self(), start, size, FALSE, VM_PROT_READ);
+    });
+}
+
+
+static malloc_statistics_t BSTHeapStatistics(void) {
+
+    malloc_statistics_t stats;
+    malloc_zone_statistics(NULL, &stats);  // All zones
+    return stats;
+}
+
+
+
+@interface BSTTabViewBenchmarks : XCTestCase
+
+@end
+
+@implementation BSTTabViewBenchmarks
+
+
+/// Time ops calls of block one by one, reset runs untimed after each call to keep the tab count constant. Returns p50 in us
+-(double)runBenchmark:(NSString *)name tabs:(NSUInteger)count ops:(NSUInteger)ops block:(BSTBenchmarkBlock)block reset:(BSTBenchmarkBlock)reset {
+
+    double *samples = malloc(ops * sizeof(double));
+    uint64_t total = 0;
+    uint64_t allocations = 0;
+    uint64_t allocatedBytes = 0;
+
+    BSTInstallAllocationCounter();
+    malloc_statistics_t before = BSTHeapStatistics();
+    for (NSUInteger i = 0; i < ops; i++) {
+        @autoreleasepool {
+            uint64_t startAllocations = atomic_load(&BSTAllocationCount);
+            uint64_t startBytes = atomic_load(&BSTAllocatedBytes);
+            uint64_t start = BSTNanoseconds();
+            block(i);
+            uint64_t elapsed = BSTNanoseconds() - start;
+            allocations = allocations + (atomic_load(&BSTAllocationCount) - startAllocations);
+            allocatedBytes = allocatedBytes + (atomic_load(&BSTAllocatedBytes) - startBytes);
+            samples[i] = elapsed / 1000.0;
+            total = total + elapsed;
+            if (reset) {
+                reset(i);
+            }
+        }
+    }
+    malloc_statistics_t after = BSTHeapStatistics();
+
+    qsort(samples, ops, sizeof(double), BSTCompareDoubles);
+    double p50 = samples[(ops - 1) / 2];
+    double p99 = samples[((ops - 1) * 99) / 100];
+    free(samples);
+
+    NSString *line = [NSString stringWithFormat:@"{\"benchmark\":\"%@\",\"tabs\":%lu,\"ops\":%lu,\"ops_per_sec\":%.1f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"allocs_per_op\":%.2f,\"alloc_bytes_per_op\":%.1f,\"live_bytes_per_op\":%.1f}",
+                      name, (unsigned long)count, (unsigned long)ops,
+                      ((total > 0) ? (ops * 1e9 / total) : 0.0), p50, p99,
+                      (double)allocations / ops, (double)allocatedBytes / ops,
+                      ((double)after.size_in_use - (double)before.size_in_use) / ops];
+
+    [self reportLine:line];
+    return p50;
+}
+
+
+
+/// Print a result line and append it to the BST_BENCHMARK_OUTPUT file if set
+-(void)reportLine:(NSString *)line {
+
+    printf("BSTBENCH %s\n", [line UTF8String]);
+
+    NSString *path = [[[NSProcessInfo processInfo] environment] objectForKey:@"BST_BENCHMARK_OUTPUT"];
+    if (path) {
+        NSFileHandle *file = [NSFileHandle fileHandleForWritingAtPath:path];
+        if (!file) {
+            [[NSFileManager defaultManager] createFileAtPath:path contents:nil attributes:nil];
+            file = [NSFileHandle fileHandleForWritingAtPath:path];
+        }
+        [file seekToEndOfFile];
+        [file writeData:[[line stringByAppendingString:@"\n"] dataUsingEncoding:NSUTF8StringEncoding]];
+        [file closeFile];
+    }
+}
+
+
+
+/// A view with count tabs with unique labels and tags, scrolling so that only the visible band is drawn
+-(BSTTabView *)tabViewWithTabs:(NSUInteger)count {
+
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 800, 22)];
+    tv.scrollingEnabled = YES;
+    tv.singleTrackingAreaEnabled = YES;
+
+    NSMutableArray *labels = [[NSMutableArray alloc] initWithCapacity:count];
+    NSMutableArray *tags = [[NSMutableArray alloc] initWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        [labels addObject:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i]];
+        [tags addObject:[NSString stringWithFormat:@"T%lu", (unsigned long)i]];
+    }
+    [tv addTabsWithLabels:labels tags:tags atIndex:0];
+    return tv;
+}
+
+
+
+// Layout runs from drawRect:, a one point render gives the layout with almost no drawing
+static void BSTLayout(BSTTabView *tv) {
+
+    NSRect rect = NSMakeRect(0, 0, 1, 1);
+    NSBitmapImageRep *rep = [tv bitmapImageRepForCachingDisplayInRect:rect];
+    [tv cacheDisplayInRect:rect toBitmapImageRep:rep];
+}
+
+
+static void BSTRender(BSTTabView *tv) {
+
+    NSBitmapImageRep *rep = [tv bitmapImageRepForCachingDisplayInRect:tv.bounds];
+    [tv cacheDisplayInRect:tv.bounds toBitmapImageRep:rep];
+}
+
+
+
+/// Heap held per tab by a laid out view including its label and tag strings, labels repeat every labelPeriod tabs.
+/// Reports blocks_per_tab and bytes_per_tab
+-(void)runMemoryBenchmark:(NSString *)name tabs:(NSUInteger)count labelPeriod:(NSUInteger)period {
+    
+    malloc_statistics_t before;
+    malloc_statistics_t after;
+    @autoreleasepool {
+        before = BSTHeapStatistics();
+        BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 800, 22)];
+        tv.scrollingEnabled = YES;
+        tv.singleTrackingAreaEnabled = YES;
+        @autoreleasepool {  // The strings handed in are released here, only what the view keeps is counted
+            NSMutableArray *labels = [[NSMutableArray alloc] initWithCapacity:count];
+            NSMutableArray *tags = [[NSMutableArray alloc] initWithCapacity:count];
+            for (NSUInteger i = 0; i < count; i++) {
+                [labels addObject:[NSString stringWithFormat:@"Document number %lu", (unsigned long)(i % period)]];
+                [tags addObject:[NSString stringWithFormat:@"com.example.document.%lu", (unsigned long)i]];
+            }
+            [tv addTabsWithLabels:labels tags:tags atIndex:0];
+            BSTLayout(tv);
+        }
+        after = BSTHeapStatistics();
+        [tv removeAllTabs];
+    }
+    
+    NSString *line = [NSString stringWithFormat:@"{\"benchmark\":\"%@\",\"tabs\":%lu,\"blocks_per_tab\":%.2f,\"bytes_per_tab\":%.1f}",
+                      name, (unsigned long)count,
+                      ((double)after.blocks_in_use - (double)before.blocks_in_use) / count,
+                      ((double)after.size_in_use - (double)before.size_in_use) / count];
+    [self reportLine:line];
+}
+
+
+
+/// Frame time while the rollover sweeps across a compressed strip of long labels that all need middle truncation
+-(void)runRolloverSweepBenchmark:(NSString *)name typesetLabelCache:(BOOL)typesetLabelCache {
+    
+    NSUInteger count = 40;  // About 40 points per tab
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 1600, 22)];
+    tv.singleTrackingAreaEnabled = YES;
+    tv.typesetLabelCacheEnabled = typesetLabelCache;
+    
+    NSString *body = [@"" stringByPaddingToLength:400 withString:@"Quarterly report draft " startingAtIndex:0];
+    NSMutableArray *labels = [[NSMutableArray alloc] initWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        [labels addObject:[NSString stringWithFormat:@"%lu %@", (unsigned long)i, body]];
+    }
+    [tv addTabsWithLabels:labels tags:nil atIndex:0];
+    BSTRender(tv);
+    
+    CGFloat step = tv.bounds.size.width / count;
+    [self runBenchmark:name tabs:count ops:1000 block:^(NSUInteger i) {
+        CGFloat x = (step / 2.0) + ((i % count) * step);  // A new tab under the pointer for every frame
+        [tv updateRolloverForPoint:NSMakePoint(x, 5.0) event:nil];
+        BSTRender(tv);
+    } reset:nil];
+}
+
+
+
+/// Frame time of offscreen renderings of a strip with mixed label lengths in changing states
+-(void)runFrameBenchmark:(NSString *)name tabs:(NSUInteger)count size:(NSSize)size scale:(CGFloat)scale {
+    
+    NSArray *words = @[@"Inbox", @"Quarterly report draft", @"Notes", @"Release checklist for version", @"Build log", @"Customer feedback"];
+    NSMutableArray *labels = [[NSMutableArray alloc] initWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        [labels addObject:[NSString stringWithFormat:@"%@ %lu", [words objectAtIndex:(i % words.count)], (unsigned long)i]];
+    }
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, size.width, size.height)];
+    tv.scrollingEnabled = (count > 100);
+    tv.singleTrackingAreaEnabled = YES;
+    [tv addTabsWithLabels:labels tags:nil atIndex:0];
+    BSTRender(tv);
+    
+    NSInteger visible = ((count > 20) ? 20 : (NSInteger)count);
+    [self runBenchmark:name tabs:count ops:200 block:^(NSUInteger i) {
+        NSInteger selected = (NSInteger)((i / 3) % visible);     // Selection changes every third frame
+        NSInteger rollover = (NSInteger)(i % visible);           // Rollover moves every frame
+        NSInteger insert = (((i % 10) == 0) ? (NSInteger)((i / 10) % visible) : NSNotFound);  // A drag passes now and then
+        (void)[tv bitmapImageRepWithSize:size scale:scale selectedTab:selected rolloverTab:rollover dragInsertPoint:insert];
+    } reset:nil];
+}
+
+
+
+-(void)runBenchmarksWithTabs:(NSUInteger)count {
+
+    BSTTabView *tv = [self tabViewWithTabs:count];
+    BSTLayout(tv);
+    NSUInteger ops = ((count < 1000) ? 1000 : count / 10);
+    if (ops > 1000) {
+        ops = 1000;
+    }
+
+    [self runBenchmark:@"add" tabs:count ops:ops block:^(NSUInteger i) {
+        [tv addTabWithLabel:@"Added" tag:nil];
+    } reset:^(NSUInteger i) {
+        [tv removeTabAtIndex:(tv.count - 1)];
+    }];
+
+    [self runBenchmark:@"remove" tabs:count ops:ops block:^(NSUInteger i) {
+        [tv removeTabAtIndex:(tv.count / 2)];
+    } reset:^(NSUInteger i) {
+        [tv addTabWithLabel:@"Added" tag:nil atIndex:(tv.count / 2)];
+    }];
+
+    [self runBenchmark:@"move" tabs:count ops:ops block:^(NSUInteger i) {
+        [tv moveTabsAtIndexes:[NSIndexSet indexSetWithIndex:(tv.count - 1)] toIndex:0];
+    } reset:nil];
+
+    [self runBenchmark:@"setLabel" tabs:count ops:ops block:^(NSUInteger i) {
+        [tv setLabel:[NSString stringWithFormat:@"Renamed %lu", (unsigned long)i] forTabAtIndex:((i * 7919) % count)];
+    } reset:nil];
+
+    // Labels of the same number of digits have the same width in a font with digits of equal width
+    BSTMutableTabViewTheme *digits = [[BSTTabViewTheme defaultTheme] mutableCopy];
+    digits.font = [NSFont monospacedDigitSystemFontOfSize:[NSFont smallSystemFontSize] weight:NSFontWeightRegular];
+    tv.theme = digits;
+    BSTLayout(tv);
+    NSUInteger relabeled = count / 2;
+    NSString *even = [NSString stringWithFormat:@"Tab %lu", (unsigned long)relabeled];
+    NSString *odd = [NSString stringWithFormat:@"Tab %lu", (unsigned long)(relabeled + 1)];
+    XCTAssertEqual([even sizeWithAttributes:@{NSFontAttributeName : digits.font}].width, [odd sizeWithAttributes:@{NSFontAttributeName : digits.font}].width);
+    [self runBenchmark:@"setLabelStableWidth" tabs:count ops:ops block:^(NSUInteger i) {
+        [tv setLabel:((i % 2) ? odd : even) forTabAtIndex:relabeled];
+        BSTLayout(tv);
+    } reset:nil];
+    tv.theme = [BSTTabViewTheme defaultTheme];
+
+    [self runBenchmark:@"indexForTabWithLabel" tabs:count ops:ops block:^(NSUInteger i) {
+        [tv indexForTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)((i * 104729) % count)]];
+    } reset:nil];
+
+    [self runBenchmark:@"dragPayloadRoundTrip" tabs:count ops:ops block:^(NSUInteger i) {
+        NSUInteger index = (i * 7919) % count;
+        NSString *tag = [tv tagForTabAtIndex:index];
+        BSTTabViewDragPayload *payload = [[BSTTabViewDragPayload alloc] initWithLabels:@[[tv labelForTabAtIndex:index]] tags:@[(tag ? tag : [NSNull null])] sourceIndexes:[NSIndexSet indexSetWithIndex:index]];
+        (void)[[BSTTabViewDragPayload alloc] initWithData:[payload data]];
+    } reset:nil];
+
+    [self runBenchmark:@"layout" tabs:count ops:20 block:^(NSUInteger i) {
+        [tv setFrameSize:NSMakeSize(300.0 + (i * 97.0), 22.0)];  // A new width for every layout
+        BSTLayout(tv);
+    } reset:nil];
+
+    [tv setFrameSize:NSMakeSize(800.0, 22.0)];
+    BSTLayout(tv);
+    [self runBenchmark:@"draw" tabs:count ops:100 block:^(NSUInteger i) {
+        tv.scrollOffset = ((i % 2) ? 0.0 : 400.0);
+        BSTRender(tv);
+    } reset:nil];
+}
+
+
+
+- (void)testBenchmark10Tabs {
+    [self runBenchmarksWithTabs:10];
+}
+
+- (void)testBenchmark100Tabs {
+    [self runBenchmarksWithTabs:100];
+}
+
+- (void)testBenchmark1kTabs {
+    [self runBenchmarksWithTabs:1000];
+}
+
+- (void)testBenchmark10kTabs {
+    [self runBenchmarksWithTabs:10000];
+}
+
+- (void)testBenchmark100kTabs {
+    [self runBenchmarksWithTabs:100000];
+}
+
+- (void)testBenchmarkRolloverSweep {
+    [self runRolloverSweepBenchmark:@"rolloverSweep" typesetLabelCache:NO];
+    [self runRolloverSweepBenchmark:@"rolloverSweepTypesetCache" typesetLabelCache:YES];
+}
+
+- (void)testBenchmarkFrames {
+    [self runFrameBenchmark:@"frame1x" tabs:12 size:NSMakeSize(800, 22) scale:1.0];
+    [self runFrameBenchmark:@"frame2x" tabs:12 size:NSMakeSize(800, 22) scale:2.0];
+    [self runFrameBenchmark:@"frameCompressed2x" tabs:60 size:NSMakeSize(800, 22) scale:2.0];
+    [self runFrameBenchmark:@"frameScrolled2x" tabs:10000 size:NSMakeSize(800, 22) scale:2.0];
+}
+
+/// Empty strips that are all kept, live_bytes_per_op is the memory of one strip with the shared default theme
+- (void)testBenchmarkViewSetup {
+    NSMutableArray *views = [[NSMutableArray alloc] initWithCapacity:1000];
+    [self runBenchmark:@"viewSetup" tabs:0 ops:1000 block:^(NSUInteger i) {
+        [views addObject:[[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 400, 22)]];
+    } reset:nil];
+}
+
+/// A burst of 1000 label updates over 100 of 1000 tabs laid out once, set directly and queued with one batch apply
+- (void)testBenchmarkLabelFeed {
+    BSTTabView *tv = [self tabViewWithTabs:1000];
+    BSTLayout(tv);
+    [self runBenchmark:@"labelFeedDirect" tabs:1000 ops:100 block:^(NSUInteger i) {
+        for (NSUInteger j = 0; j < 1000; j++) {
+            [tv setLabel:[NSString stringWithFormat:@"%lu.%lu", (unsigned long)i, (unsigned long)j] forTabAtIndex:((j % 100) * 10)];
+        }
+        BSTLayout(tv);
+    } reset:nil];
+    [self runBenchmark:@"labelFeedQueued" tabs:1000 ops:100 block:^(NSUInteger i) {
+        for (NSUInteger j = 0; j < 1000; j++) {
+            [tv enqueueLabel:[NSString stringWithFormat:@"%lu.%lu", (unsigned long)i, (unsigned long)j] forTabWithTag:[NSString stringWithFormat:@"T%lu", (unsigned long)((j % 100) * 10)]];
+        }
+        [tv applyQueuedLabels];
+        BSTLayout(tv);
+    } reset:nil];
+}
+
+/// Preview tab churn, the tab at index 10 is removed and a new one inserted in its place. Also reports
+/// tab_allocations_per_op and tracking_area_allocations_per_op, 0 in the steady state with the pool
+-(void)runChurnBenchmark:(NSString *)name tabPoolLimit:(NSUInteger)limit {
+    
+    NSUInteger ops = 10000;
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 1600, 22)];
+    tv.tabPoolLimit = limit;
+    for (NSUInteger i = 0; i < 20; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Document %lu", (unsigned long)i] tag:nil];
+    }
+    BSTLayout(tv);
+    [tv removeTabAtIndex:10];  // Warm up, the pool then holds the preview tab
+    [tv addTabWithLabel:@"Preview" tag:nil atIndex:10];
+    BSTLayout(tv);
+    tv.statisticsEnabled = YES;
+    
+    [self runBenchmark:name tabs:20 ops:ops block:^(NSUInteger i) {
+        [tv removeTabAtIndex:10];
+        [tv addTabWithLabel:@"Preview" tag:nil atIndex:10];
+        BSTLayout(tv);
+    } reset:nil];
+    
+    BSTTabViewStatistics *stats = [tv statisticsSnapshot];
+    NSString *line = [NSString stringWithFormat:@"{\"benchmark\":\"%@\",\"tabs\":20,\"ops\":%lu,\"tab_allocations_per_op\":%.3f,\"tracking_area_allocations_per_op\":%.3f}",
+                      name, (unsigned long)ops, (double)stats.tabsAllocated / ops,
+                      ((double)stats.trackingAreasAdded - (double)stats.trackingAreasReused) / ops];
+    [self reportLine:line];
+}
+
+- (void)testBenchmarkTabChurn {
+    [self runChurnBenchmark:@"churn" tabPoolLimit:0];
+    [self runChurnBenchmark:@"churnPooled" tabPoolLimit:8];
+}
+
+/// Layout of a strip whose tabs are in 50 collapsed groups against the same strip without groups. Hidden tabs still
+/// cost a table store per pass, so the collapsed time grows with the tab count, only far slower
+-(void)runCollapsedGroupsBenchmarkWithTabs:(NSUInteger)count {
+    
+    NSUInteger ops = 20;
+    NSUInteger groupLength = count / 50;
+    BSTTabView *baseline = [self tabViewWithTabs:count];
+    BSTTabView *tv = [self tabViewWithTabs:count];
+    for (NSUInteger g = 0; g < 50; g++) {
+        [tv groupTabsInRange:NSMakeRange(g * groupLength, groupLength) withLabel:[NSString stringWithFormat:@"Group %lu", (unsigned long)g]];
+        [tv collapseGroupOfTabAtIndex:(g * groupLength)];
+    }
+    BSTLayout(baseline);
+    BSTLayout(tv);
+    
+    double baselineP50 = [self runBenchmark:@"layoutUngroupedBaseline" tabs:count ops:ops block:^(NSUInteger i) {
+        [baseline setFrameSize:NSMakeSize(300.0 + (i * 97.0), 22.0)];  // A new width for every layout
+        BSTLayout(baseline);
+    } reset:nil];
+    double collapsedP50 = [self runBenchmark:@"layoutCollapsedGroups" tabs:count ops:ops block:^(NSUInteger i) {
+        [tv setFrameSize:NSMakeSize(300.0 + (i * 97.0), 22.0)];
+        BSTLayout(tv);
+    } reset:nil];
+    
+    NSString *line = [NSString stringWithFormat:@"{\"benchmark\":\"collapsedGroupsVsBaseline\",\"tabs\":%lu,\"groups\":50,\"baseline_p50_us\":%.3f,\"collapsed_p50_us\":%.3f,\"speedup\":%.1f}",
+                      (unsigned long)count, baselineP50, collapsedP50, ((collapsedP50 > 0.0) ? (baselineP50 / collapsedP50) : 0.0)];
+    [self reportLine:line];
+}
+
+- (void)testBenchmarkCollapsedGroups {
+    [self runCollapsedGroupsBenchmarkWithTabs:1000];
+    [self runCollapsedGroupsBenchmarkWithTabs:10000];
+    [self runCollapsedGroupsBenchmarkWithTabs:100000];
+}
+
+/// Latencies of every recorded method in the traces in BST_TRACE_DIR, skipped if it is not set
+- (void)testBenchmarkTraceReplay {
+    
+    NSString *dir = [[[NSProcessInfo processInfo] environment] objectForKey:@"BST_TRACE_DIR"];
+    if (!dir) {
+        return;
+    }
+    for (NSString *file in [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:dir error:NULL] sortedArrayUsingSelector:@selector(compare:)]) {
+        NSData *trace = [NSData dataWithContentsOfFile:[dir stringByAppendingPathComponent:file]];
+        BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 800, 22)];
+        NSArray *events = (trace ? [tv replayTrace:trace] : nil);
+        if (!events) {
+            continue;  // Not a trace
+        }
+        
+        NSMutableDictionary *latencies = [[NSMutableDictionary alloc] init];
+        for (BSTTabViewTraceEvent *event in events) {
+            NSMutableArray *samples = [latencies objectForKey:event.name];
+            if (!samples) {
+                samples = [[NSMutableArray alloc] init];
+                [latencies setObject:samples forKey:event.name];
+            }
+            [samples addObject:[NSNumber numberWithDouble:(event.latency * 1e6)]];
+        }
+        for (NSString *name in [[latencies allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+            NSArray *samples = [[latencies objectForKey:name] sortedArrayUsingSelector:@selector(compare:)];
+            NSUInteger ops = samples.count;
+            NSString *line = [NSString stringWithFormat:@"{\"benchmark\":\"replay:%@:%@\",\"tabs\":%lu,\"ops\":%lu,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}",
+                              file, name, (unsigned long)tv.count, (unsigned long)ops,
+                              [[samples objectAtIndex:((ops - 1) / 2)] doubleValue], [[samples objectAtIndex:(((ops - 1) * 99) / 100)] doubleValue],
+                              [[samples lastObject] doubleValue]];
+            [self reportLine:line];
+        }
+    }
+}
+
+- (void)testMemoryPerTab {
+    [self runMemoryBenchmark:@"memory_unique_labels" tabs:100000 labelPeriod:100000];
+    [self runMemoryBenchmark:@"memory_repeated_labels" tabs:100000 labelPeriod:100];
+}
+
+@end
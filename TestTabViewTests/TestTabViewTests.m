@@ -8,6 +8,360 @@
 
 #import <Cocoa/Cocoa.h>
 #import <XCTest/XCTest.h>
+#import "BSTTabView.h"
+
+// Private parts of BSTTabView used by the tests
+@interface BSTTabView (Testing)
+@property (nonatomic) NSUInteger labelWidthCacheHits;
+@property (nonatomic) NSUInteger labelWidthCacheMisses;
+-(NSInteger)indexOfTabAtPoint:(NSPoint)point;
+-(NSInteger)insertPointForXLocation:(CGFloat)xLoc;
+@property (nonatomic) NSUInteger tabsDrawnCount;
+-(void)updateRolloverForPoint:(NSPoint)point event:(NSEvent *)theEvent;
+@property (nonatomic) NSUInteger tabImageCacheHits;
+@property (nonatomic) NSUInteger tabImageCacheMisses;
+-(NSBezierPath *)boundaryPathForCoreWidth:(CGFloat)coreWidth;
+@property (nonatomic) NSUInteger tabsLaidOutCount;
+@property (nonatomic) BOOL LayoutIsInvalid;
+-(void)reassignTabPositionAndTrackingArea;
+@property (readonly, nonatomic) NSUInteger labelWidthGeneration;
+-(void)applyMeasuredWidths:(NSArray *)widths forLabels:(NSArray *)labels generation:(NSUInteger)generation;
+@property (nonatomic) NSUInteger typesetLineHits;
+@property (nonatomic) NSUInteger typesetLineMisses;
+-(void)applyQueuedLabels;
+-(CGFloat)measuredWidthForLabel:(NSString *)label estimated:(BOOL *)estimated;
+@end
+
+// Drag payload helper class in BSTTabView.m
+@interface BSTTabViewDragPayload : NSObject
+@property (readonly, nonatomic) NSArray *labels;
+@property (readonly, nonatomic) NSArray *tags;
+@property (readonly, nonatomic) NSIndexSet *sourceIndexes;
+-(instancetype)initWithLabels:(NSArray *)labels tags:(NSArray *)tags sourceIndexes:(NSIndexSet *)indexes;
+-(instancetype)initWithData:(NSData *)data;
+-(NSData *)data;
+@end
+
+
+// Records the area invalidated by the view
+@interface BSTRecordingTabView : BSTTabView
+@property (nonatomic) NSRect invalidRect;
+@property (nonatomic) BOOL fullInvalidation;
+@end
+
+@implementation BSTRecordingTabView
+
+-(void)setNeedsDisplayInRect:(NSRect)invalidRect {
+    self.invalidRect = NSUnionRect(self.invalidRect, invalidRect);
+    [super setNeedsDisplayInRect:invalidRect];
+}
+
+-(void)setNeedsDisplay:(BOOL)needsDisplay {
+    self.fullInvalidation = self.fullInvalidation || needsDisplay;
+    [super setNeedsDisplay:needsDisplay];
+}
+
+@end
+
+
+// Render the view offscreen, runs the normal drawRect: including layout
+static void BSTRenderOffscreen(NSView *view) {
+    
+    NSBitmapImageRep *rep = [view bitmapImageRepForCachingDisplayInRect:view.bounds];
+    [view cacheDisplayInRect:view.bounds toBitmapImageRep:rep];
+}
+
+// The tab hit at each x along the strip, captures the complete layout
+static NSArray *BSTHitTestSignature(BSTTabView *tv, CGFloat width) {
+    
+    NSMutableArray *signature = [[NSMutableArray alloc] init];
+    for (CGFloat x = 0.0; x < width; x += 1.0) {
+        [signature addObject:[NSNumber numberWithInteger:[tv indexOfTabAtPoint:NSMakePoint(x, 5.0)]]];
+    }
+    return signature;
+}
+
+// A drag from another application, the payload is on a pasteboard of its own
+@interface BSTExternalDraggingInfo : NSObject
+@property (weak, nonatomic) NSView *view;
+@property (nonatomic) NSPoint location;                                       // In view coordinates
+@property (nonatomic) NSPasteboard *draggingPasteboard;
+@end
+
+@implementation BSTExternalDraggingInfo
+
+-(id)draggingSource {
+    return nil;
+}
+
+-(NSPoint)draggingLocation {
+    return [self.view convertPoint:self.location toView:nil];
+}
+
+-(NSDragOperation)draggingSourceOperationMask {
+    return NSDragOperationMove;
+}
+
+-(NSInteger)draggingSequenceNumber {
+    return 7;
+}
+
+@end
+
+// A left mouse event at a point in the view
+static NSEvent *BSTMouseEvent(NSView *view, NSEventType type, NSPoint point) {
+    
+    return [NSEvent mouseEventWithType:type location:[view convertPoint:point toView:nil] modifierFlags:0 timestamp:0.0 windowNumber:0 context:nil eventNumber:0 clickCount:((type == NSMouseMoved) ? 0 : 1) pressure:1.0];
+}
+
+
+// The default theme with digits of equal width, in the small system font they are proportional
+static BSTTabViewTheme *BSTMonospacedDigitTheme(void) {
+    
+    BSTMutableTabViewTheme *theme = [[BSTTabViewTheme defaultTheme] mutableCopy];
+    theme.font = [NSFont monospacedDigitSystemFontOfSize:[NSFont smallSystemFontSize] weight:NSFontWeightRegular];
+    return [theme copy];
+}
+
+// A strip wide enough for its tabs to never be compressed
+static BSTTabView *BSTUncompressedTabView(NSUInteger count) {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 1000000, 22)];
+    for (NSUInteger i = 0; i < count; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i] tag:nil];
+    }
+    [tv reassignTabPositionAndTrackingArea];
+    return tv;
+}
+
+// Layout core in BSTTabView.m
+extern CGFloat BSTCompressionCapForWidths(const CGFloat *widths, NSUInteger count, NSInteger selectedIndex, CGFloat spacerWidth, CGFloat availableWidth, BOOL *insufficient);
+
+
+// Reference - the original layout loop that lowers the cap 1.0 at a time
+static CGFloat BSTStepwiseCompressionCap(const CGFloat *widths, NSUInteger count, NSInteger selectedIndex, CGFloat spacerWidth, CGFloat availableWidth, BOOL *insufficient) {
+    
+    CGFloat totalRequested = spacerWidth;
+    CGFloat longestRequested = 16.0;
+    for (NSUInteger i = 0; i < count; i++) {
+        if (widths[i] > longestRequested) {
+            longestRequested = widths[i];
+        }
+        totalRequested = totalRequested + widths[i] + spacerWidth;
+    }
+    while ((totalRequested > availableWidth) && (longestRequested > 15.0)) {
+        longestRequested = longestRequested - 1.0;
+        totalRequested = spacerWidth;
+        for (NSUInteger i = 0; i < count; i++) {
+            CGFloat w = (((selectedIndex >= 0) && (selectedIndex == i)) ? widths[i] : (widths[i] > longestRequested ? longestRequested : widths[i]));
+            totalRequested = totalRequested + w + spacerWidth;
+        }
+    }
+    *insufficient = (longestRequested <= 15.0);
+    return longestRequested;
+}
+
+
+// Random tab widths as produced by widthForLabelString, never below min width
+static CGFloat *BSTRandomWidths(NSUInteger count) {
+    
+    CGFloat *widths = malloc((count + 1) * sizeof(CGFloat));
+    for (NSUInteger i = 0; i < count; i++) {
+        widths[i] = 15.0 + (arc4random_uniform(3) ? (arc4random_uniform(20000) / 100.0) : 0.0);
+    }
+    return widths;
+}
+
+// Counts the delegate callbacks
+@interface BSTCountingDelegate : NSObject <BSTTabViewDelegate>
+@property (nonatomic) NSUInteger indexChangeCount;
+@property (nonatomic) NSInteger lastIndex;
+@property (nonatomic) NSUInteger budgetExceededCount;
+@property (nonatomic) NSUInteger restoreCount;
+@property (nonatomic) NSUInteger insufficientWidthCount;
+@property (nonatomic) NSUInteger insufficientChangeCount;
+@property (nonatomic) NSUInteger lastHiddenCount;
+@property (nonatomic) NSUInteger labelBatchCount;
+@property (nonatomic) NSIndexSet *lastChangedIndexes;
+@property (nonatomic) NSUInteger groupChangeCount;
+@property (nonatomic) NSRange lastGroupRange;
+@property (nonatomic) BOOL denyGroupChanges;
+@property (nonatomic) NSString *deniedLabel;
+@end
+
+@implementation BSTCountingDelegate
+
+-(void)tabView:(BSTTabView *)tabView selectedTabChangedIndexTo:(NSInteger)index {
+    self.indexChangeCount++;
+    self.lastIndex = index;
+}
+
+-(void)tabView:(BSTTabView *)tabView operation:(BSTTabViewTimedOperation)operation exceededTimeBudgetWithDuration:(NSTimeInterval)duration {
+    self.budgetExceededCount++;
+}
+
+-(void)tabViewDidRestoreTabs:(BSTTabView *)tabView {
+    self.restoreCount++;
+}
+
+-(void)insufficientWidthForTabView:(BSTTabView *)tabView {
+    self.insufficientWidthCount++;
+}
+
+-(void)tabView:(BSTTabView *)tabView insufficientWidthDidChange:(BOOL)insufficient hiddenTabCount:(NSUInteger)hiddenCount {
+    self.insufficientChangeCount++;
+    self.lastHiddenCount = hiddenCount;
+}
+
+-(void)tabView:(BSTTabView *)tabView labelsDidChangeForTabsAtIndexes:(NSIndexSet *)indexes {
+    self.labelBatchCount++;
+    self.lastChangedIndexes = indexes;
+}
+
+-(BOOL)tabView:(BSTTabView *)tabView labelShouldChangeTo:(NSString *)newLabel forTabAtIndex:(NSUInteger)index {
+    return ![newLabel isEqualToString:self.deniedLabel];
+}
+
+-(BOOL)tabView:(BSTTabView *)tabView groupShouldCollapse:(BOOL)collapse forTabsInRange:(NSRange)range {
+    return !self.denyGroupChanges;
+}
+
+-(void)tabView:(BSTTabView *)tabView groupDidCollapse:(BOOL)collapsed forTabsInRange:(NSRange)range {
+    self.groupChangeCount++;
+    self.lastGroupRange = range;
+}
+
+@end
+
+
+// Keeps a mirror of the labels and tags of a view up to date from its change sets alone
+@interface BSTMirroringDelegate : NSObject <BSTTabViewDelegate>
+@property (nonatomic) NSMutableArray *labels;
+@property (nonatomic) NSMutableArray *tags;
+@property (nonatomic) NSInteger selectedTab;
+@property (nonatomic) NSUInteger changeSetCount;
+@property (nonatomic) BSTTabViewChangeSet *lastChanges;
+@end
+
+@implementation BSTMirroringDelegate
+
+-(instancetype)initWithTabView:(BSTTabView *)tv {
+    self = [super init];
+    if (self) {
+        _labels = [[NSMutableArray alloc] init];
+        _tags = [[NSMutableArray alloc] init];
+        for (NSUInteger i = 0; i < tv.count; i++) {
+            [_labels addObject:[tv labelForTabAtIndex:i]];
+            [_tags addObject:([tv tagForTabAtIndex:i] ? [tv tagForTabAtIndex:i] : [NSNull null])];
+        }
+        _selectedTab = tv.selectedTab;
+    }
+    return self;
+}
+
+-(void)tabView:(BSTTabView *)tabView didChangeTabs:(BSTTabViewChangeSet *)changes {
+    self.changeSetCount++;
+    self.lastChanges = changes;
+    
+    NSMutableArray *movedLabels = [[NSMutableArray alloc] init];
+    NSMutableArray *movedTags = [[NSMutableArray alloc] init];
+    [changes.movedFromIndexes enumerateIndexesUsingBlock:^(NSUInteger from, BOOL *stop) {
+        [movedLabels addObject:@[@([changes indexAfterMoveOfTabAtIndex:from]), [self.labels objectAtIndex:from]]];
+        [movedTags addObject:[self.tags objectAtIndex:from]];
+    }];
+    NSMutableIndexSet *taken = [changes.removedIndexes mutableCopy];
+    [taken addIndexes:changes.movedFromIndexes];
+    [self.labels removeObjectsAtIndexes:taken];
+    [self.tags removeObjectsAtIndexes:taken];
+    
+    NSMutableIndexSet *put = [changes.insertedIndexes mutableCopy];
+    [put addIndexes:changes.movedToIndexes];
+    NSMutableArray *newLabels = [[NSMutableArray alloc] init];
+    NSMutableArray *newTags = [[NSMutableArray alloc] init];
+    for (NSUInteger i = 0; i < put.count; i++) {
+        [newLabels addObject:[NSNull null]];
+        [newTags addObject:[NSNull null]];
+    }
+    [self.labels insertObjects:newLabels atIndexes:put];
+    [self.tags insertObjects:newTags atIndexes:put];
+    for (NSUInteger i = 0; i < movedLabels.count; i++) {
+        NSUInteger to = [[[movedLabels objectAtIndex:i] objectAtIndex:0] unsignedIntegerValue];
+        [self.labels replaceObjectAtIndex:to withObject:[[movedLabels objectAtIndex:i] objectAtIndex:1]];
+        [self.tags replaceObjectAtIndex:to withObject:[movedTags objectAtIndex:i]];
+    }
+    
+    NSMutableIndexSet *read = [changes.insertedIndexes mutableCopy];  // Only what changed is read from the view
+    [read addIndexes:changes.relabeledIndexes];
+    [read addIndexes:changes.retaggedIndexes];
+    [read enumerateIndexesUsingBlock:^(NSUInteger i, BOOL *stop) {
+        [self.labels replaceObjectAtIndex:i withObject:[tabView labelForTabAtIndex:i]];
+        [self.tags replaceObjectAtIndex:i withObject:([tabView tagForTabAtIndex:i] ? [tabView tagForTabAtIndex:i] : [NSNull null])];
+    }];
+    
+    NSAssert(changes.selectedTabBefore == self.selectedTab, @"Change sets follow each other");
+    self.selectedTab = changes.selectedTabAfter;
+}
+
+@end
+
+
+/*
+ * Golden images are PNG files named after the rendering in the GoldenImages directory next to this file, or in the
+ * directory named by the environment variable BST_GOLDEN_IMAGE_DIR. The comparison is skipped while the directory does
+ * not exist, as on a checkout without recorded images, and a missing image in an existing directory fails. Set
+ * BST_RECORD_GOLDEN_IMAGES to record them all from the current rendering, the first time or after an intended
+ * rendering change. A failing rendering is written to the temporary directory as <name>-actual.png for comparison.
+ */
+static NSString *BSTGoldenImageDirectory(void) {
+    
+    NSString *dir = [[[NSProcessInfo processInfo] environment] objectForKey:@"BST_GOLDEN_IMAGE_DIR"];
+    if (!dir) {
+        dir = [[[NSString stringWithUTF8String:__FILE__] stringByDeletingLastPathComponent] stringByAppendingPathComponent:@"GoldenImages"];
+    }
+    return dir;
+}
+
+// A strip with fixed colors so the rendering does not follow the system appearance
+static BSTTabView *BSTGoldenTabView(void) {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    tv.backgroundColor = [NSColor colorWithDeviceRed:0.85 green:0.85 blue:0.85 alpha:1.0];
+    tv.borderColor = [NSColor colorWithDeviceRed:0.45 green:0.45 blue:0.45 alpha:1.0];
+    tv.textColor = [NSColor colorWithDeviceRed:0.1 green:0.1 blue:0.1 alpha:1.0];
+    tv.selectedFieldColor = [NSColor colorWithDeviceRed:0.3 green:0.5 blue:0.9 alpha:1.0];
+    tv.selectedBorderColor = [NSColor colorWithDeviceRed:0.2 green:0.3 blue:0.7 alpha:1.0];
+    tv.selectedTextColor = [NSColor colorWithDeviceRed:1.0 green:1.0 blue:1.0 alpha:1.0];
+    tv.rolloverFieldColor = [NSColor colorWithDeviceRed:0.7 green:0.8 blue:0.95 alpha:1.0];
+    tv.rolloverBorderColor = [NSColor colorWithDeviceRed:0.45 green:0.55 blue:0.8 alpha:1.0];
+    tv.rolloverTextColor = [NSColor colorWithDeviceRed:0.0 green:0.0 blue:0.0 alpha:1.0];
+    tv.editingColor = [NSColor colorWithDeviceRed:0.8 green:0.1 blue:0.1 alpha:1.0];
+    
+    NSArray *labels = @[@"Inbox", @"Drafts", @"Quarterly report for the board of directors", @"Notes", @"Build log",
+                        @"A", @"Release checklist", @"Customer feedback summary", @"Todo", @"Archive 2015"];
+    [tv addTabsWithLabels:labels tags:nil atIndex:0];
+    return tv;
+}
+
+// Number of pixels differing by more than tolerance in any channel, NSNotFound if the sizes differ
+static NSUInteger BSTDifferingPixels(NSBitmapImageRep *a, NSBitmapImageRep *b, CGFloat tolerance) {
+    
+    if ((a.pixelsWide != b.pixelsWide) || (a.pixelsHigh != b.pixelsHigh)) {
+        return NSNotFound;
+    }
+    NSUInteger differing = 0;
+    for (NSInteger y = 0; y < a.pixelsHigh; y++) {
+        for (NSInteger x = 0; x < a.pixelsWide; x++) {
+            NSColor *ca = [[a colorAtX:x y:y] colorUsingColorSpaceName:NSDeviceRGBColorSpace];
+            NSColor *cb = [[b colorAtX:x y:y] colorUsingColorSpaceName:NSDeviceRGBColorSpace];
+            if ((fabs(ca.redComponent - cb.redComponent) > tolerance) || (fabs(ca.greenComponent - cb.greenComponent) > tolerance) ||
+                (fabs(ca.blueComponent - cb.blueComponent) > tolerance) || (fabs(ca.alphaComponent - cb.alphaComponent) > tolerance)) {
+                differing++;
+            }
+        }
+    }
+    return differing;
+}
+
 
 @interface TestTabViewTests : XCTestCase
 
@@ -30,6 +384,1130 @@
     XCTAssert(YES, @"Pass");
 }
 
+- (void)testCompressionCapMatchesStepwiseLayout {
+    
+    NSUInteger sizes[] = {10, 1000, 100000};
+    for (NSUInteger s = 0; s < 3; s++) {
+        NSUInteger count = sizes[s];
+        NSUInteger rounds = (count > 1000 ? 1 : 200);
+        for (NSUInteger r = 0; r < rounds; r++) {
+            CGFloat *widths = BSTRandomWidths(count);
+            NSInteger selected = (NSInteger)arc4random_uniform((uint32_t)count + 1) - 1;
+            CGFloat spacer = arc4random_uniform(10);
+            CGFloat available = (count > 1000 ? (count * 60.0) : arc4random_uniform((uint32_t)count * 120));
+            BOOL insufficientOld, insufficientNew;
+            
+            CGFloat capOld = BSTStepwiseCompressionCap(widths, count, selected, spacer, available, &insufficientOld);
+            CGFloat capNew = BSTCompressionCapForWidths(widths, count, selected, spacer, available, &insufficientNew);
+            XCTAssertEqual(capOld, capNew, @"Cap differs for %lu tabs", (unsigned long)count);
+            XCTAssertEqual(insufficientOld, insufficientNew, @"Insufficient flag differs for %lu tabs", (unsigned long)count);
+            free(widths);
+        }
+    }
+}
+
+- (void)testPerformanceCompressionCap100k {
+    
+    CGFloat *widths = BSTRandomWidths(100000);
+    [self measureBlock:^{
+        BOOL insufficient;
+        BSTCompressionCapForWidths(widths, 100000, 50000, 5.0, 100000 * 40.0, &insufficient);
+    }];
+    free(widths);
+}
+
+- (void)testPerformanceStepwiseCompressionCap1k {
+    
+    CGFloat *widths = BSTRandomWidths(1000);
+    [self measureBlock:^{
+        BOOL insufficient;
+        BSTStepwiseCompressionCap(widths, 1000, 500, 5.0, 1000 * 40.0, &insufficient);
+    }];
+    free(widths);
+}
+
+- (void)testSteadyStateRelayoutDoesNoTextMeasurement {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 2000, 22)];
+    tv.theme = [[BSTTabViewTheme alloc] init];  // A label width cache of its own
+    for (NSUInteger i = 0; i < 200; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)(i % 50)] tag:nil];
+    }
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.labelWidthCacheMisses, (NSUInteger)50, @"Each distinct label should be measured once");
+    
+    tv.labelWidthCacheMisses = 0;
+    tv.labelWidthCacheHits = 0;
+    [tv setFrameSize:NSMakeSize(900, 22)];  // Window resize
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.labelWidthCacheMisses, (NSUInteger)0, @"Relayout after resize should not measure text");
+    XCTAssertTrue(tv.labelWidthCacheHits > 0);
+    
+    [tv setLabel:@"Renamed" forTabAtIndex:3];
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.labelWidthCacheMisses, (NSUInteger)1, @"Only the renamed tab should be measured");
+}
+
+- (void)testHitTestingFindsEveryTabInOrder {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 20000, 22)];
+    tv.singleTrackingAreaEnabled = YES;
+    for (NSUInteger i = 0; i < 500; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"%lu", (unsigned long)i] tag:nil];
+    }
+    BSTRenderOffscreen(tv);
+    
+    NSInteger lastHit = -1;
+    NSInteger lastInsert = -1;
+    NSMutableIndexSet *hits = [NSMutableIndexSet indexSet];
+    for (CGFloat x = 0.0; x < 20000.0; x += 0.5) {
+        NSInteger hit = [tv indexOfTabAtPoint:NSMakePoint(x, 1.0)];
+        NSInteger insert = [tv insertPointForXLocation:x];
+        if (hit >= 0) {
+            XCTAssertTrue(hit >= lastHit, @"Hits must follow tab order");
+            lastHit = hit;
+            [hits addIndex:hit];
+        }
+        XCTAssertTrue(insert >= lastInsert, @"Insert points must follow tab order");
+        lastInsert = insert;
+    }
+    XCTAssertEqual(hits.count, (NSUInteger)500, @"Every tab should be hit");
+    XCTAssertEqual(lastInsert, (NSInteger)499, @"Past the end inserts after last tab");
+}
+
+- (void)testRolloverRepaintsOnlyNeighbouringTabs {
+    
+    BSTRecordingTabView *tv = [[BSTRecordingTabView alloc] initWithFrame:NSMakeRect(0, 0, 8000, 22)];
+    tv.singleTrackingAreaEnabled = YES;
+    for (NSUInteger i = 0; i < 200; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i] tag:nil];
+    }
+    tv.tabsDrawnCount = 0;
+    BSTRenderOffscreen(tv);  // Before - every invalidation drew all tabs
+    NSUInteger drawnFull = tv.tabsDrawnCount;
+    
+    NSUInteger events = 0;
+    NSUInteger drawnPartial = 0;
+    for (CGFloat x = 0.0; x < 8000.0; x += 3.0) {  // Rollover sweep
+        tv.invalidRect = NSZeroRect;
+        tv.fullInvalidation = NO;
+        [tv updateRolloverForPoint:NSMakePoint(x, 1.0) event:nil];
+        if (!NSIsEmptyRect(tv.invalidRect)) {
+            XCTAssertFalse(tv.fullInvalidation, @"Rollover must not invalidate the whole view");
+            tv.tabsDrawnCount = 0;
+            [tv cacheDisplayInRect:tv.invalidRect toBitmapImageRep:[tv bitmapImageRepForCachingDisplayInRect:tv.bounds]];
+            drawnPartial = drawnPartial + tv.tabsDrawnCount;
+            events++;
+        }
+    }
+    XCTAssertTrue(events > 0);
+    XCTAssertEqual(drawnFull, (NSUInteger)200, @"A full display draws every tab");
+    XCTAssertTrue((drawnPartial / events) <= 6, @"Rollover should only repaint the tabs around the old and new rollover");
+}
+
+- (void)testScrollingDrawsOnlyVisibleTabs {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    tv.scrollingEnabled = YES;
+    for (NSUInteger i = 0; i < 10000; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)(i % 100)] tag:nil];
+    }
+    tv.tabsDrawnCount = 0;
+    BSTRenderOffscreen(tv);
+    XCTAssertTrue(tv.tabsDrawnCount < 100, @"Only the visible tabs should be drawn");
+    XCTAssertEqual(tv.scrollOffset, 0.0);
+    
+    tv.selectedTab = 9999;  // Selecting scrolls it into view
+    BSTRenderOffscreen(tv);
+    XCTAssertTrue(tv.scrollOffset > 0.0);
+    XCTAssertEqual([tv indexOfTabAtPoint:NSMakePoint(0.0, 1.0)], (NSInteger)-1, @"Left scroll button covers the first tabs");
+    
+    tv.scrollOffset = -100.0;  // Clamped
+    XCTAssertEqual(tv.scrollOffset, 0.0);
+}
+
+- (void)testPerformanceLayout10kTabsScrolled {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    tv.scrollingEnabled = YES;
+    for (NSUInteger i = 0; i < 10000; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)(i % 100)] tag:nil];
+    }
+    BSTRenderOffscreen(tv);
+    [self measureBlock:^{
+        for (NSUInteger i = 0; i < 100; i++) {
+            tv.scrollOffset = tv.scrollOffset + 50.0;
+            BSTRenderOffscreen(tv);
+        }
+    }];
+}
+
+- (void)testUncompressedMutationsRelayoutOnlyTheTail {
+    
+    BSTTabView *tv = BSTUncompressedTabView(1000);
+    
+    NSUInteger before = tv.tabsLaidOutCount;
+    [tv addTabWithLabel:@"Appended" tag:nil];
+    [tv reassignTabPositionAndTrackingArea];
+    XCTAssertEqual(tv.tabsLaidOutCount - before, (NSUInteger)1);
+    
+    before = tv.tabsLaidOutCount;
+    [tv setLabel:@"Renamed to something longer" forTabAtIndex:500];
+    [tv removeTabAtIndex:900];
+    [tv reassignTabPositionAndTrackingArea];
+    XCTAssertEqual(tv.tabsLaidOutCount - before, (NSUInteger)500);
+    
+    // Same layout as a full pass
+    NSArray *incremental = BSTHitTestSignature(tv, 60000.0);
+    tv.LayoutIsInvalid = YES;
+    [tv reassignTabPositionAndTrackingArea];
+    XCTAssertEqualObjects(BSTHitTestSignature(tv, 60000.0), incremental);
+}
+
+- (void)testEmptyViewLayout {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    BSTRenderOffscreen(tv);  // Lays out no tabs
+    XCTAssertEqual([tv indexOfTabAtPoint:NSMakePoint(10.0, 5.0)], (NSInteger)-1);
+    XCTAssertEqual([tv insertPointForXLocation:10.0], (NSInteger)-1);
+    
+    [tv addTabWithLabel:@"First" tag:nil];
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual([tv indexOfTabAtPoint:NSMakePoint(10.0, 5.0)], (NSInteger)0);
+    XCTAssertTrue([tv removeTabAtIndex:0]);
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual([tv indexOfTabAtPoint:NSMakePoint(10.0, 5.0)], (NSInteger)-1);
+}
+
+- (void)testPerformanceAppend1kTabs {
+    
+    BSTTabView *tv = BSTUncompressedTabView(1000);
+    [self measureBlock:^{
+        for (NSUInteger i = 0; i < 100; i++) {
+            [tv addTabWithLabel:@"Appended" tag:nil];
+            [tv reassignTabPositionAndTrackingArea];
+        }
+    }];
+}
+
+- (void)testPerformanceAppend10kTabs {
+    
+    BSTTabView *tv = BSTUncompressedTabView(10000);
+    [self measureBlock:^{
+        for (NSUInteger i = 0; i < 100; i++) {
+            [tv addTabWithLabel:@"Appended" tag:nil];
+            [tv reassignTabPositionAndTrackingArea];
+        }
+    }];
+}
+
+- (void)testPerformanceRenameLast10kTabs {
+    
+    BSTTabView *tv = BSTUncompressedTabView(10000);
+    [self measureBlock:^{
+        for (NSUInteger i = 0; i < 100; i++) {
+            [tv setLabel:[NSString stringWithFormat:@"Renamed %lu", (unsigned long)i] forTabAtIndex:(tv.count - 1)];
+            [tv reassignTabPositionAndTrackingArea];
+        }
+    }];
+}
+
+- (void)testTransactionSendsOneSelectionNotification {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    BSTCountingDelegate *delegate = [[BSTCountingDelegate alloc] init];
+    tv.delegate = delegate;
+    [tv addTabWithLabel:@"Selected" tag:nil];
+    tv.selectedTab = 0;
+    
+    [tv beginUpdates];
+    for (NSUInteger i = 0; i < 100; i++) {
+        [tv addTabWithLabel:@"New" tag:nil atIndex:0];
+    }
+    [tv removeTabAtIndex:0];
+    [tv endUpdates];
+    
+    XCTAssertEqual(delegate.indexChangeCount, (NSUInteger)1);
+    XCTAssertEqual(delegate.lastIndex, (NSInteger)99);
+    XCTAssertEqualObjects([tv labelForTabAtIndex:tv.selectedTab], @"Selected");
+}
+
+- (void)testBulkOperations {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    NSMutableArray *labels = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 10000; i++) {
+        [labels addObject:[NSString stringWithFormat:@"%lu", (unsigned long)i]];
+    }
+    NSIndexSet *added = [tv addTabsWithLabels:labels tags:nil atIndex:0];
+    XCTAssertEqual(added.count, (NSUInteger)10000);
+    XCTAssertEqual(tv.count, (NSUInteger)10000);
+    
+    tv.selectedTab = 5;
+    NSMutableIndexSet *move = [NSMutableIndexSet indexSetWithIndexesInRange:NSMakeRange(0, 3)];
+    [move addIndex:5];
+    XCTAssertEqual([tv moveTabsAtIndexes:move toIndex:10], (NSInteger)10);
+    XCTAssertEqualObjects([tv labelForTabAtIndex:10], @"0");
+    XCTAssertEqualObjects([tv labelForTabAtIndex:13], @"5");
+    XCTAssertEqual(tv.selectedTab, (NSInteger)13);
+    
+    XCTAssertTrue([tv removeTabsAtIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, 10)]]);
+    XCTAssertEqual(tv.selectedTab, (NSInteger)3);
+    XCTAssertTrue([tv removeAllTabs]);
+    XCTAssertEqual(tv.count, (NSUInteger)0);
+    XCTAssertEqual(tv.selectedTab, (NSInteger)-1);
+}
+
+- (void)testLookupByTagAndLabelFollowsMutations {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    for (NSUInteger i = 0; i < 1000; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"L%lu", (unsigned long)(i % 10)] tag:[NSString stringWithFormat:@"T%lu", (unsigned long)i]];
+    }
+    XCTAssertEqual([tv indexForTabWithTag:@"T500"], (NSInteger)500);
+    XCTAssertEqual([tv indexForTabWithLabel:@"L3"], (NSInteger)3);
+    
+    [tv removeTabAtIndex:0];
+    [tv addTabWithLabel:@"L3" tag:@"First" atIndex:0];
+    [tv moveTabsAtIndexes:[NSIndexSet indexSetWithIndex:500] toIndex:0];
+    XCTAssertEqual([tv indexForTabWithTag:@"T500"], (NSInteger)0);
+    XCTAssertEqual([tv indexForTabWithLabel:@"L3"], (NSInteger)1);
+    
+    [tv setTag:@"Renamed" ForTabAtIndex:0];
+    [tv setLabel:@"Unique" forTabAtIndex:0];
+    XCTAssertEqual([tv indexForTabWithTag:@"T500"], (NSInteger)-1);
+    XCTAssertEqual([tv indexForTabWithTag:@"Renamed"], (NSInteger)0);
+    XCTAssertEqual([tv indexForTabWithLabel:@"Unique"], (NSInteger)0);
+    
+    XCTAssertTrue([tv selectTabWithTag:@"T999"]);
+    XCTAssertEqual(tv.selectedTab, (NSInteger)999);
+    XCTAssertTrue([tv removeTabWithTag:@"T999"]);
+    XCTAssertEqual([tv indexForTabWithTag:@"T999"], (NSInteger)-1);
+}
+
+- (void)testDragPayloadRoundTripWithoutLimits {
+    
+    NSString *longLabel = [@"" stringByPaddingToLength:12000 withString:@"\u00e5bc " startingAtIndex:0];
+    NSMutableIndexSet *indexes = [NSMutableIndexSet indexSetWithIndex:3];
+    [indexes addIndex:20000];
+    BSTTabViewDragPayload *payload = [[BSTTabViewDragPayload alloc] initWithLabels:@[longLabel, @""] tags:@[[NSNull null], @"tag \u2603"] sourceIndexes:indexes];
+    
+    NSData *data = [payload data];
+    BSTTabViewDragPayload *decoded = [[BSTTabViewDragPayload alloc] initWithData:data];
+    XCTAssertEqualObjects(decoded.labels, payload.labels);
+    XCTAssertEqualObjects(decoded.tags, payload.tags);
+    XCTAssertEqualObjects(decoded.sourceIndexes, indexes);
+    
+    // A tab without a label is dragged and dropped without one, not with an empty label
+    BSTTabViewDragPayload *unlabeled = [[BSTTabViewDragPayload alloc] initWithLabels:@[[NSNull null], @""] tags:@[[NSNull null], [NSNull null]] sourceIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, 2)]];
+    decoded = [[BSTTabViewDragPayload alloc] initWithData:[unlabeled data]];
+    XCTAssertEqualObjects(decoded.labels, unlabeled.labels);
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    XCTAssertNotNil([tv addTabsWithLabels:decoded.labels tags:decoded.tags atIndex:0]);
+    XCTAssertNil([tv labelForTabAtIndex:0]);
+    XCTAssertEqualObjects([tv labelForTabAtIndex:1], @"");
+    
+    // Truncated, unknown version and foreign data are rejected
+    XCTAssertNil([[BSTTabViewDragPayload alloc] initWithData:[data subdataWithRange:NSMakeRange(0, data.length - 1)]]);
+    NSMutableData *newer = [data mutableCopy];
+    ((uint8_t *)newer.mutableBytes)[4] = 3;
+    XCTAssertNil([[BSTTabViewDragPayload alloc] initWithData:newer]);
+    XCTAssertNil([[BSTTabViewDragPayload alloc] initWithData:[@"bst.tabview.1.0 0001 0001 a " dataUsingEncoding:NSUTF8StringEncoding]]);
+}
+
+- (void)testTabsShareBoundaryPathsAndCachedImages {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    NSBezierPath *path = [tv boundaryPathForCoreWidth:40.0];
+    XCTAssertEqual([tv boundaryPathForCoreWidth:40.0], path);
+    tv.tabCornerRadius = 3.0;
+    XCTAssertNotEqual([tv boundaryPathForCoreWidth:40.0], path, @"Geometry change must flush the shared paths");
+    
+    for (NSUInteger i = 0; i < 20; i++) {
+        [tv addTabWithLabel:@"Same" tag:nil];
+    }
+    tv.tabImageCacheEnabled = YES;
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.tabImageCacheMisses, (NSUInteger)1, @"All tabs have the same width, label and state");
+    XCTAssertEqual(tv.tabImageCacheHits, (NSUInteger)19);
+    
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.tabImageCacheMisses, (NSUInteger)1);
+    
+    tv.borderColor = [NSColor redColor];
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.tabImageCacheMisses, (NSUInteger)2, @"Color change must flush the cached images");
+}
+
+- (void)testStatisticsAreOptInAndReportBudgetOverruns {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    BSTCountingDelegate *delegate = [[BSTCountingDelegate alloc] init];
+    tv.delegate = delegate;
+    for (NSUInteger i = 0; i < 20; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i] tag:nil];
+    }
+    
+    BSTRenderOffscreen(tv);
+    BSTTabViewStatistics *stats = [tv statisticsSnapshot];
+    XCTAssertEqual(stats.layoutPasses, (NSUInteger)0, @"Nothing is timed while disabled");
+    XCTAssertEqual(stats.drawCalls, (NSUInteger)0);
+    
+    tv.statisticsEnabled = YES;
+    tv.timeBudget = 1e-9;
+    [tv resetStatistics];
+    [tv setFrameSize:NSMakeSize(300, 22)];
+    BSTRenderOffscreen(tv);
+    stats = [tv statisticsSnapshot];
+    XCTAssertEqual(stats.layoutPasses, (NSUInteger)1);
+    XCTAssertEqual(stats.compressedLayoutPasses, (NSUInteger)1);
+    XCTAssertEqual(stats.drawCalls, (NSUInteger)1);
+    XCTAssertEqual(stats.tabsLaidOut, (NSUInteger)20);
+    XCTAssertEqual(stats.labelMeasurements, (NSUInteger)0, @"Widths were measured before the reset");
+    XCTAssertTrue(stats.layoutTime > 0.0);
+    XCTAssertEqual(delegate.budgetExceededCount, (NSUInteger)2, @"Both layout and draw exceed a 1 ns budget");
+    XCTAssertEqual(stats.delegateCallbacks, (NSUInteger)4, @"The two overruns and the tabs no longer fitting at 300");
+    
+    [tv resetStatistics];
+    XCTAssertEqual([tv statisticsSnapshot].layoutPasses, (NSUInteger)0);
+}
+
+- (void)testEqualLabelsAndTagsShareOneString {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    NSMutableString *label = [NSMutableString stringWithString:@"A label long enough not to be a tagged pointer"];
+    [tv addTabWithLabel:label tag:[label mutableCopy]];
+    [tv addTabWithLabel:[label mutableCopy] tag:[label mutableCopy]];
+    [tv addTabsWithLabels:@[[label mutableCopy]] tags:nil atIndex:0];
+    
+    [label appendString:@" changed"];
+    XCTAssertEqualObjects([tv labelForTabAtIndex:1], @"A label long enough not to be a tagged pointer", @"Labels are still copied");
+    XCTAssertEqual([tv labelForTabAtIndex:0], [tv labelForTabAtIndex:1]);
+    XCTAssertEqual([tv labelForTabAtIndex:1], [tv labelForTabAtIndex:2]);
+    XCTAssertEqual([tv tagForTabAtIndex:1], [tv tagForTabAtIndex:2]);
+    XCTAssertEqual([tv indexForTabWithLabel:[tv labelForTabAtIndex:2]], (NSInteger)0);
+    
+    [tv setLabel:@"Other" forTabAtIndex:0];
+    [tv removeTabAtIndex:1];
+    XCTAssertEqual([tv indexForTabWithLabel:@"A label long enough not to be a tagged pointer"], (NSInteger)1);
+    XCTAssertEqual([tv indexForTabWithTag:@"A label long enough not to be a tagged pointer"], (NSInteger)1);
+    [tv removeTabAtIndex:1];
+    XCTAssertEqual([tv indexForTabWithLabel:@"A label long enough not to be a tagged pointer"], (NSInteger)-1);
+    XCTAssertEqual([tv indexForTabWithLabel:@"Other"], (NSInteger)0);
+}
+
+- (void)testTabStateRoundTripRestoresInOnePass {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    for (NSUInteger i = 0; i < 300; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab \u00e5 %lu", (unsigned long)i] tag:((i % 3) ? [NSString stringWithFormat:@"T%lu", (unsigned long)i] : nil)];
+    }
+    tv.selectedTab = 7;
+    BSTRenderOffscreen(tv);
+    NSData *data = [tv tabStateData];
+    
+    BSTTabView *restored = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    BSTCountingDelegate *delegate = [[BSTCountingDelegate alloc] init];
+    restored.delegate = delegate;
+    [restored addTabWithLabel:@"Replaced" tag:@"Old"];
+    XCTAssertTrue([restored restoreTabStateFromData:data]);
+    XCTAssertEqual(delegate.restoreCount, (NSUInteger)1);
+    XCTAssertEqual(delegate.indexChangeCount, (NSUInteger)0, @"The restore is the only notification");
+    XCTAssertEqual(restored.count, (NSUInteger)300);
+    XCTAssertEqual(restored.selectedTab, (NSInteger)7);
+    XCTAssertEqual([restored indexForTabWithTag:@"Old"], (NSInteger)-1);
+    for (NSUInteger i = 0; i < 300; i++) {
+        XCTAssertEqualObjects([restored labelForTabAtIndex:i], [tv labelForTabAtIndex:i]);
+        XCTAssertEqualObjects([restored tagForTabAtIndex:i], [tv tagForTabAtIndex:i]);
+    }
+    XCTAssertEqual([restored indexForTabWithTag:@"T299"], (NSInteger)299);
+    
+    restored.labelWidthCacheMisses = 0;
+    BSTRenderOffscreen(restored);
+    XCTAssertEqual(restored.labelWidthCacheMisses, (NSUInteger)0, @"Saved widths are reused in the same font");
+    XCTAssertEqualObjects(BSTHitTestSignature(restored, 600.0), BSTHitTestSignature(tv, 600.0));
+    
+    // Truncated and newer data is rejected without touching the tabs
+    XCTAssertFalse([restored restoreTabStateFromData:[data subdataWithRange:NSMakeRange(0, data.length - 1)]]);
+    NSMutableData *newer = [data mutableCopy];
+    ((uint8_t *)newer.mutableBytes)[4] = 3;
+    XCTAssertFalse([restored restoreTabStateFromData:newer]);
+    XCTAssertEqual(restored.count, (NSUInteger)300);
+    XCTAssertEqual(delegate.restoreCount, (NSUInteger)1);
+    
+    // A tab without a label is saved and restored without one
+    [tv addTabWithLabel:nil tag:@"Unlabeled"];
+    XCTAssertTrue([restored restoreTabStateFromData:[tv tabStateData]]);
+    XCTAssertEqual(restored.count, (NSUInteger)301);
+    XCTAssertNil([restored labelForTabAtIndex:300]);
+    XCTAssertEqual([restored indexForTabWithTag:@"Unlabeled"], (NSInteger)300);
+}
+
+- (void)testAsynchronousMeasurementEstimatesThenAppliesOnce {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    tv.theme = [[BSTTabViewTheme alloc] init];  // A label width cache of its own
+    tv.asynchronousLabelMeasurementEnabled = YES;
+    for (NSUInteger i = 0; i < 50; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i] tag:nil];
+    }
+    tv.labelWidthCacheMisses = 0;
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.labelWidthCacheMisses, (NSUInteger)0, @"Nothing is measured on the main thread");
+    
+    NSDate *timeout = [NSDate dateWithTimeIntervalSinceNow:5.0];
+    while ((tv.labelWidthCacheMisses < 50) && ([timeout timeIntervalSinceNow] > 0.0)) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+    }
+    XCTAssertEqual(tv.labelWidthCacheMisses, (NSUInteger)50);
+    XCTAssertTrue(tv.LayoutIsInvalid, @"The measured widths need a relayout");
+    BSTRenderOffscreen(tv);
+    XCTAssertFalse(tv.LayoutIsInvalid);
+    XCTAssertEqual(tv.labelWidthCacheMisses, (NSUInteger)50, @"The measured widths reached the tabs");
+    
+    // Results for labels that are gone or from an old font are dropped
+    [tv applyMeasuredWidths:@[@100.0] forLabels:@[@"Renamed meanwhile"] generation:tv.labelWidthGeneration];
+    XCTAssertFalse(tv.LayoutIsInvalid);
+    [tv applyMeasuredWidths:@[@100.0] forLabels:@[@"Tab 1"] generation:(tv.labelWidthGeneration + 1)];
+    XCTAssertFalse(tv.LayoutIsInvalid);
+}
+
+- (void)testAsynchronousMeasurementSkipsTabsWithoutLabel {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    tv.theme = [[BSTTabViewTheme alloc] init];
+    tv.asynchronousLabelMeasurementEnabled = YES;
+    [tv addTabWithLabel:nil tag:nil];
+    [tv addTabWithLabel:@"Labeled" tag:nil];
+    tv.selectedTab = 0;
+    tv.labelWidthCacheMisses = 0;
+    XCTAssertNoThrow(BSTRenderOffscreen(tv));
+    
+    NSDate *timeout = [NSDate dateWithTimeIntervalSinceNow:5.0];
+    while ((tv.labelWidthCacheMisses < 1) && ([timeout timeIntervalSinceNow] > 0.0)) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+    }
+    XCTAssertEqual(tv.labelWidthCacheMisses, (NSUInteger)1, @"Only the labeled tab is measured");
+    XCTAssertNoThrow(BSTRenderOffscreen(tv));
+    XCTAssertNil([tv labelForTabAtIndex:0]);
+}
+
+- (void)testPaintOnlyChangesDoNotRelayout {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    for (NSUInteger i = 0; i < 50; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i] tag:nil];
+    }
+    BSTRenderOffscreen(tv);
+    NSUInteger laidOut = tv.tabsLaidOutCount;
+    
+    tv.borderColor = [NSColor redColor];
+    tv.selectedTextColor = [NSColor blueColor];
+    tv.tabCornerRadius = 3.0;
+    [tv updateRolloverForPoint:NSMakePoint(30.0, 5.0) event:nil];
+    XCTAssertFalse(tv.LayoutIsInvalid);
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.tabsLaidOutCount, laidOut, @"Colors, rollover and tab shape keep the layout");
+    
+    tv.spacerWidth = 4.0;
+    tv.spacerWidth = 6.0;
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.tabsLaidOutCount, laidOut + 50, @"Two width changes share one layout pass");
+}
+
+- (void)testInsufficientWidthIsNotifiedOnChangeWithHiddenCount {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 300, 22)];
+    BSTCountingDelegate *delegate = [[BSTCountingDelegate alloc] init];
+    tv.delegate = delegate;
+    for (NSUInteger i = 0; i < 100; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i] tag:nil];
+    }
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(delegate.insufficientWidthCount, (NSUInteger)1);
+    XCTAssertEqual(delegate.insufficientChangeCount, (NSUInteger)1);
+    XCTAssertEqual(delegate.lastHiddenCount, tv.hiddenTabCount);
+    XCTAssertTrue(tv.hiddenTabCount > 0);
+    XCTAssertTrue(tv.hiddenTabCount < 100);
+    
+    tv.spacerWidth = 4.0;  // Relayout, still the same tabs hidden
+    BSTRenderOffscreen(tv);
+    tv.spacerWidth = 5.0;
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(delegate.insufficientWidthCount, (NSUInteger)1, @"Not sent again while the tabs still do not fit");
+    
+    [tv setFrameSize:NSMakeSize(100000, 22)];
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.hiddenTabCount, (NSUInteger)0);
+    XCTAssertEqual(delegate.lastHiddenCount, (NSUInteger)0);
+    XCTAssertEqual(delegate.insufficientWidthCount, (NSUInteger)1);
+}
+
+- (void)testTypesetLabelsAreReusedUntilLabelWidthOrTextChange {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    for (NSUInteger i = 0; i < 20; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i] tag:nil];
+    }
+    tv.typesetLabelCacheEnabled = YES;
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.typesetLineMisses, (NSUInteger)20);
+    
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.typesetLineMisses, (NSUInteger)20, @"Unchanged tabs draw their cached lines");
+    XCTAssertEqual(tv.typesetLineHits, (NSUInteger)20);
+    
+    [tv updateRolloverForPoint:NSMakePoint(10.0, 5.0) event:nil];
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.typesetLineMisses, (NSUInteger)21, @"The rollover state has a line of its own");
+    
+    [tv setLabel:@"A much longer label" forTabAtIndex:5];
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.typesetLineMisses, (NSUInteger)22, @"Only the renamed tab is typeset again");
+    
+    tv.textColor = [NSColor redColor];
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.typesetLineMisses, (NSUInteger)42, @"Text option change must invalidate all lines");
+}
+
+- (void)testOffscreenRenderingRestoresTheViewState {
+    
+    BSTTabView *tv = BSTGoldenTabView();
+    BSTCountingDelegate *delegate = [[BSTCountingDelegate alloc] init];
+    tv.delegate = delegate;
+    tv.selectedTab = 1;
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.hiddenTabCount, (NSUInteger)0);
+    
+    NSBitmapImageRep *rep = [tv bitmapImageRepWithSize:NSMakeSize(150, 22) scale:2.0 selectedTab:2 rolloverTab:3 dragInsertPoint:-1];
+    XCTAssertNotNil(rep);
+    XCTAssertEqual(rep.pixelsWide, (NSInteger)300);
+    XCTAssertEqual(rep.pixelsHigh, (NSInteger)44);
+    XCTAssertTrue(NSEqualSizes(rep.size, NSMakeSize(150, 22)));
+    
+    XCTAssertTrue(NSEqualSizes(tv.frame.size, NSMakeSize(600, 22)));
+    XCTAssertEqual(tv.selectedTab, (NSInteger)1);
+    XCTAssertEqual([tv indexForRolloverTab], (NSInteger)-1);
+    XCTAssertEqual(tv.hiddenTabCount, (NSUInteger)0, @"The narrow rendering is not the on screen state");
+    XCTAssertEqual(delegate.insufficientChangeCount, (NSUInteger)0);
+    XCTAssertEqual(delegate.indexChangeCount, (NSUInteger)0);
+    
+    XCTAssertNil([tv bitmapImageRepWithSize:NSMakeSize(0, 22) scale:1.0 selectedTab:-1 rolloverTab:-1 dragInsertPoint:NSNotFound]);
+    XCTAssertNil([tv bitmapImageRepWithSize:NSMakeSize(600, 22) scale:1.0 selectedTab:10 rolloverTab:-1 dragInsertPoint:NSNotFound]);
+    XCTAssertNil([tv bitmapImageRepWithSize:NSMakeSize(600, 22) scale:1.0 selectedTab:-1 rolloverTab:-1 dragInsertPoint:10]);
+}
+
+- (void)testRenderingMatchesGoldenImages {
+    
+    BSTTabView *tv = BSTGoldenTabView();
+    NSMutableDictionary *all = [[NSMutableDictionary alloc] init];
+    [all setObject:[tv bitmapImageRepWithSize:NSMakeSize(600, 22) scale:1.0 selectedTab:2 rolloverTab:4 dragInsertPoint:NSNotFound] forKey:@"strip-1x"];
+    [all setObject:[tv bitmapImageRepWithSize:NSMakeSize(600, 22) scale:2.0 selectedTab:2 rolloverTab:4 dragInsertPoint:NSNotFound] forKey:@"strip-2x"];
+    [all setObject:[tv bitmapImageRepWithSize:NSMakeSize(300, 22) scale:2.0 selectedTab:6 rolloverTab:-1 dragInsertPoint:NSNotFound] forKey:@"strip-compressed-2x"];
+    [all setObject:[tv bitmapImageRepWithSize:NSMakeSize(600, 22) scale:1.0 selectedTab:-1 rolloverTab:-1 dragInsertPoint:3] forKey:@"strip-insert-point-1x"];
+    [all setObject:[tv bitmapImageRepWithSize:NSMakeSize(600, 9) scale:1.0 selectedTab:0 rolloverTab:-1 dragInsertPoint:-1] forKey:@"strip-small-1x"];
+    tv.topEdgeAligned = NO;
+    [all setObject:[tv bitmapImageRepWithSize:NSMakeSize(600, 22) scale:2.0 selectedTab:2 rolloverTab:4 dragInsertPoint:5] forKey:@"strip-bottom-aligned-2x"];
+    
+    NSString *dir = BSTGoldenImageDirectory();
+    BOOL record = ([[[NSProcessInfo processInfo] environment] objectForKey:@"BST_RECORD_GOLDEN_IMAGES"] != nil);
+    BOOL isDirectory = NO;
+    if (record) {
+        [[NSFileManager defaultManager] createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:NULL];
+    } else if (![[NSFileManager defaultManager] fileExistsAtPath:dir isDirectory:&isDirectory] || !isDirectory) {  // No images recorded, nothing to compare with
+        return;
+    }
+    
+    for (NSString *name in all) {
+        NSBitmapImageRep *rep = [all objectForKey:name];
+        NSString *path = [[dir stringByAppendingPathComponent:name] stringByAppendingPathExtension:@"png"];
+        if (record) {
+            XCTAssertTrue([[rep representationUsingType:NSPNGFileType properties:@{}] writeToFile:path atomically:YES], @"Could not record %@", path);
+            continue;
+        }
+        NSBitmapImageRep *golden = [NSBitmapImageRep imageRepWithContentsOfFile:path];
+        if (!golden) {  // Never recorded on the fly, a missing image would otherwise pass on every clean checkout
+            XCTFail(@"No golden image %@, run the test with BST_RECORD_GOLDEN_IMAGES set to record it", path);
+            continue;
+        }
+        NSUInteger differing = BSTDifferingPixels(rep, golden, (2.0 / 255.0));  // Room for anti-aliasing rounding
+        if (differing != 0) {
+            NSString *actual = [NSTemporaryDirectory() stringByAppendingPathComponent:[name stringByAppendingString:@"-actual.png"]];
+            [[rep representationUsingType:NSPNGFileType properties:@{}] writeToFile:actual atomically:YES];
+            XCTFail(@"%@ differs from its golden image in %lu pixels, see %@", name, (unsigned long)differing, actual);
+        }
+    }
+}
+
+- (void)testViewsShareOneThemeAndItsMeasurements {
+    
+    BSTTabView *a = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 2000, 22)];
+    BSTTabView *b = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 2000, 22)];
+    XCTAssertEqual(a.theme, [BSTTabViewTheme defaultTheme]);
+    XCTAssertEqual(b.theme, a.theme);
+    
+    BSTMutableTabViewTheme *editable = [[BSTTabViewTheme defaultTheme] mutableCopy];
+    editable.backgroundColor = [NSColor redColor];
+    editable.font = [NSFont systemFontOfSize:14.0];
+    editable.tabCornerRadius = 20.0;
+    BSTTabViewTheme *theme = [editable copy];
+    XCTAssertEqual([theme copy], theme, @"An immutable theme is shared, not copied");
+    XCTAssertEqual(theme.tabCornerRadius, theme.spacerWidth, @"The corner radius is limited to the spacer width");
+    
+    a.theme = theme;
+    b.theme = theme;
+    XCTAssertEqual(b.theme, a.theme);
+    XCTAssertEqualObjects(a.theme.backgroundColor, [NSColor redColor]);
+    
+    for (NSUInteger i = 0; i < 20; i++) {
+        [a addTabWithLabel:[NSString stringWithFormat:@"Themed %lu", (unsigned long)i] tag:nil];
+        [b addTabWithLabel:[NSString stringWithFormat:@"Themed %lu", (unsigned long)i] tag:nil];
+    }
+    BSTRenderOffscreen(a);
+    BSTRenderOffscreen(b);
+    XCTAssertEqual(a.labelWidthCacheMisses, (NSUInteger)20);
+    XCTAssertEqual(b.labelWidthCacheMisses, (NSUInteger)0, @"Widths measured for one view serve all views with the theme");
+    
+    NSUInteger laidOut = b.tabsLaidOutCount;
+    editable.borderColor = [NSColor blueColor];
+    b.theme = editable;
+    XCTAssertFalse(b.LayoutIsInvalid, @"A new color is a repaint only");
+    BSTRenderOffscreen(b);
+    XCTAssertEqual(b.tabsLaidOutCount, laidOut);
+    
+    a.textColor = [NSColor greenColor];
+    XCTAssertNotEqual(a.theme, theme, @"A view setter gives the view its own theme");
+    XCTAssertEqualObjects(theme.textColor, [[BSTTabViewTheme defaultTheme] textColor], @"The shared theme is unchanged");
+}
+
+- (void)testQueuedLabelsAreCoalescedAndAppliedInOneBatch {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 800, 22)];
+    for (NSUInteger i = 0; i < 10; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"%lu", (unsigned long)i] tag:[NSString stringWithFormat:@"T%lu", (unsigned long)i]];
+    }
+    BSTCountingDelegate *delegate = [[BSTCountingDelegate alloc] init];
+    tv.delegate = delegate;
+    BSTRenderOffscreen(tv);
+    
+    dispatch_apply(1000, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        [tv enqueueLabel:[NSString stringWithFormat:@"Tick %zu", i] forTabWithTag:[NSString stringWithFormat:@"T%zu", i % 10]];
+    });
+    for (NSUInteger i = 0; i < 10; i++) {
+        [tv enqueueLabel:[NSString stringWithFormat:@"Final %lu", (unsigned long)i] forTabWithTag:[NSString stringWithFormat:@"T%lu", (unsigned long)i]];
+    }
+    [tv enqueueLabel:@"Nobody" forTabWithTag:@"Unknown"];
+    XCTAssertEqual(delegate.labelBatchCount, (NSUInteger)0, @"Nothing is applied on the producer threads");
+    
+    [tv applyQueuedLabels];
+    for (NSUInteger i = 0; i < 10; i++) {
+        XCTAssertEqualObjects([tv labelForTabAtIndex:i], ([NSString stringWithFormat:@"Final %lu", (unsigned long)i]), @"The latest label per tag wins");
+    }
+    XCTAssertEqual(delegate.labelBatchCount, (NSUInteger)1);
+    XCTAssertEqualObjects(delegate.lastChangedIndexes, [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, 10)]);
+    XCTAssertEqual([tv indexForTabWithLabel:@"Final 3"], (NSInteger)3, @"The label map follows the new labels");
+    XCTAssertTrue(tv.LayoutIsInvalid, @"Longer labels move the tabs after them");
+    
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    XCTAssertEqual(delegate.labelBatchCount, (NSUInteger)1, @"The scheduled apply finds an empty queue");
+}
+
+- (void)testQueuedLabelsAskTheDelegate {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 800, 22)];
+    [tv addTabWithLabel:@"A" tag:@"T0"];
+    [tv addTabWithLabel:@"B" tag:@"T1"];
+    BSTCountingDelegate *delegate = [[BSTCountingDelegate alloc] init];
+    delegate.deniedLabel = @"Denied";
+    tv.delegate = delegate;
+    
+    [tv enqueueLabel:@"Denied" forTabWithTag:@"T0"];
+    [tv enqueueLabel:@"Allowed" forTabWithTag:@"T1"];
+    [tv applyQueuedLabels];
+    XCTAssertEqualObjects([tv labelForTabAtIndex:0], @"A", @"The delegate veto holds for queued labels");
+    XCTAssertEqualObjects([tv labelForTabAtIndex:1], @"Allowed");
+    XCTAssertEqualObjects(delegate.lastChangedIndexes, [NSIndexSet indexSetWithIndex:1], @"Only the accepted label is reported");
+    
+    [tv enqueueLabel:@"Denied" forTabWithTag:@"T0"];
+    [tv applyQueuedLabels];
+    XCTAssertEqual(delegate.labelBatchCount, (NSUInteger)1, @"A batch with every label denied is not reported");
+}
+
+- (void)testWidthStableRelabelRepaintsOnlyTheTab {
+    
+    BSTRecordingTabView *tv = [[BSTRecordingTabView alloc] initWithFrame:NSMakeRect(0, 0, 2000, 22)];
+    tv.theme = BSTMonospacedDigitTheme();
+    for (NSUInteger i = 0; i < 20; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Price %lu.00", (unsigned long)(10 + i)] tag:nil];
+    }
+    BSTRenderOffscreen(tv);
+    NSUInteger laidOut = tv.tabsLaidOutCount;
+    BOOL estimated = NO;
+    XCTAssertEqual([tv measuredWidthForLabel:@"Price 98.76" estimated:&estimated], [tv measuredWidthForLabel:@"Price 15.00" estimated:&estimated], @"The theme font has digits of equal width");
+    
+    tv.invalidRect = NSZeroRect;
+    tv.fullInvalidation = NO;
+    [tv setLabel:@"Price 10.00" forTabAtIndex:0];
+    XCTAssertTrue(NSIsEmptyRect(tv.invalidRect) && !tv.fullInvalidation, @"An unchanged label is not drawn again");
+    
+    [tv setLabel:@"Price 98.76" forTabAtIndex:5];  // Digits of equal width
+    XCTAssertFalse(tv.LayoutIsInvalid);
+    XCTAssertFalse(tv.fullInvalidation);
+    XCTAssertFalse(NSIsEmptyRect(tv.invalidRect));
+    XCTAssertTrue(NSWidth(tv.invalidRect) < 200.0, @"Only the relabeled tab is repainted");
+    BSTRenderOffscreen(tv);
+    XCTAssertEqual(tv.tabsLaidOutCount, laidOut);
+    XCTAssertEqualObjects([tv labelForTabAtIndex:5], @"Price 98.76");
+    
+    [tv setLabel:@"Price 1234.00" forTabAtIndex:5];
+    XCTAssertTrue(tv.LayoutIsInvalid, @"A wider label moves the tabs after it");
+    BSTRenderOffscreen(tv);
+    
+    // Compressed, a capped tab stays capped while the longest label is another tab's
+    BSTTabView *compressed = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    for (NSUInteger i = 0; i < 40; i++) {
+        [compressed addTabWithLabel:[NSString stringWithFormat:@"Quarterly report %lu", (unsigned long)i] tag:nil];
+    }
+    [compressed addTabWithLabel:@"The longest label of all the quarterly reports" tag:nil];
+    compressed.selectedTab = 0;
+    BSTRenderOffscreen(compressed);
+    laidOut = compressed.tabsLaidOutCount;
+    
+    [compressed setLabel:@"Quarterly report draft 20" forTabAtIndex:20];
+    XCTAssertFalse(compressed.LayoutIsInvalid);
+    [compressed setLabel:@"The longest label of all the quarterly reports, and longer" forTabAtIndex:21];
+    XCTAssertTrue(compressed.LayoutIsInvalid, @"A new longest label changes the cap");
+    BSTRenderOffscreen(compressed);
+    XCTAssertEqual(compressed.tabsLaidOutCount, laidOut + 41);
+    
+    [compressed setLabel:@"Quarterly report 3" forTabAtIndex:0];
+    XCTAssertTrue(compressed.LayoutIsInvalid, @"The selected tab is not capped");
+}
+
+- (void)testRecordedTraceReplaysToTheSameState {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    tv.userTabDraggingEnabled = BSTTabViewDragGlobal;
+    tv.singleTrackingAreaEnabled = YES;  // Mouse moves are handled by the view itself
+    [tv addTabsWithLabels:@[@"Inbox", @"Drafts", @"Sent"] tags:@[@"I", @"D", @"S"] atIndex:0];
+    tv.traceRecordingEnabled = YES;
+    
+    [tv addTabWithLabel:@"Notes" tag:@"N" atIndex:1];
+    [tv setLabel:@"Drafts 2" forTabAtIndex:2];
+    [tv mouseMoved:BSTMouseEvent(tv, NSMouseMoved, NSMakePoint(10, 10))];
+    [tv mouseDown:BSTMouseEvent(tv, NSLeftMouseDown, NSMakePoint(10, 10))];
+    [tv mouseUp:BSTMouseEvent(tv, NSLeftMouseUp, NSMakePoint(10, 10))];
+    [tv setFrameSize:NSMakeSize(400, 22)];
+    [tv beginUpdates];
+    [tv moveTabsAtIndexes:[NSIndexSet indexSetWithIndex:3] toIndex:0];
+    [tv removeTabAtIndex:2];
+    [tv endUpdates];
+    
+    BSTTabViewDragPayload *payload = [[BSTTabViewDragPayload alloc] initWithLabels:@[@"Dropped"] tags:@[@"X"] sourceIndexes:[NSIndexSet indexSetWithIndex:0]];
+    BSTExternalDraggingInfo *drag = [[BSTExternalDraggingInfo alloc] init];
+    drag.view = tv;
+    drag.location = NSMakePoint(2, 10);
+    drag.draggingPasteboard = [NSPasteboard pasteboardWithUniqueName];
+    [drag.draggingPasteboard declareTypes:@[@"bst.tabview.tabs"] owner:nil];
+    [drag.draggingPasteboard setData:[payload data] forType:@"bst.tabview.tabs"];
+    id<NSDraggingInfo> sender = (id<NSDraggingInfo>)drag;
+    XCTAssertEqual([tv draggingEntered:sender], NSDragOperationMove);
+    [tv draggingUpdated:sender];
+    XCTAssertTrue([tv prepareForDragOperation:sender]);
+    XCTAssertTrue([tv performDragOperation:sender]);
+    [tv concludeDragOperation:sender];
+    [drag.draggingPasteboard releaseGlobally];
+    tv.traceRecordingEnabled = NO;
+    [tv addTabWithLabel:@"Not recorded" tag:nil];
+    [tv removeTabAtIndex:tv.count - 1];
+    
+    NSData *trace = [tv recordedTrace];
+    XCTAssertNotNil(trace);
+    BSTTabView *replayed = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 100, 100)];
+    NSArray *events = [replayed replayTrace:trace];
+    XCTAssertEqual(events.count, (NSUInteger)14, @"The calls the control made to itself are not recorded");
+    XCTAssertEqualObjects([[events objectAtIndex:0] name], @"addTabWithLabel:tag:atIndex:");
+    XCTAssertEqualObjects([[events lastObject] name], @"performDragOperation:");
+    
+    XCTAssertEqual(replayed.count, tv.count);
+    for (NSUInteger i = 0; i < tv.count; i++) {
+        XCTAssertEqualObjects([replayed labelForTabAtIndex:i], [tv labelForTabAtIndex:i]);
+        XCTAssertEqualObjects([replayed tagForTabAtIndex:i], [tv tagForTabAtIndex:i]);
+    }
+    XCTAssertEqual(replayed.selectedTab, tv.selectedTab);
+    XCTAssertTrue(NSEqualSizes(replayed.frame.size, tv.frame.size));
+    XCTAssertEqual(replayed.userTabDraggingEnabled, BSTTabViewDragGlobal);
+    
+    XCTAssertNil([replayed replayTrace:[trace subdataWithRange:NSMakeRange(0, trace.length - 1)]], @"A truncated trace is rejected");
+    XCTAssertNil([replayed replayTrace:[@"Not a trace" dataUsingEncoding:NSUTF8StringEncoding]]);
+}
+
+- (void)testTraceReplayStartsFromUnlabeledTabsAndGroups {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+    [tv addTabsWithLabels:@[@"Inbox", [NSNull null], @"Sent", @"Archive"] tags:nil atIndex:0];
+    XCTAssertTrue([tv groupTabsInRange:NSMakeRange(2, 2) withLabel:@"Old"]);
+    XCTAssertTrue([tv collapseGroupOfTabAtIndex:2]);
+    tv.traceRecordingEnabled = YES;
+    [tv addTabWithLabel:@"Joined" tag:nil atIndex:3];
+    tv.traceRecordingEnabled = NO;
+    
+    BSTTabView *replayed = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 100, 100)];
+    XCTAssertNotNil([replayed replayTrace:[tv recordedTrace]]);
+    XCTAssertEqual(replayed.count, (NSUInteger)5);
+    XCTAssertNil([replayed labelForTabAtIndex:1]);
+    XCTAssertTrue(NSEqualRanges([replayed groupRangeForTabAtIndex:3], NSMakeRange(2, 3)), @"The insert joins the group the recording started with");
+    XCTAssertTrue([replayed isGroupCollapsedForTabAtIndex:2]);
+    XCTAssertEqualObjects([replayed groupLabelForTabAtIndex:4], @"Old");
+}
+
+- (void)testChangeSetsMirrorTheTabs {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 800, 22)];
+    for (NSUInteger i = 0; i < 10; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i] tag:[NSString stringWithFormat:@"T%lu", (unsigned long)i]];
+    }
+    tv.selectedTab = 2;
+    BSTMirroringDelegate *mirror = [[BSTMirroringDelegate alloc] initWithTabView:tv];
+    tv.delegate = mirror;
+    
+    [tv beginUpdates];
+    [tv removeTabAtIndex:0];
+    [tv addTabWithLabel:@"New" tag:@"N" atIndex:3];
+    [tv moveTabsAtIndexes:[NSIndexSet indexSetWithIndex:8] toIndex:0];
+    [tv setLabel:@"Renamed" forTabAtIndex:5];
+    [tv setTag:@"R" ForTabAtIndex:6];
+    [tv addTabWithLabel:@"Gone again" tag:nil atIndex:0];
+    [tv removeTabAtIndex:0];
+    XCTAssertEqual(mirror.changeSetCount, (NSUInteger)0, @"Held back in a transaction");
+    [tv endUpdates];
+    XCTAssertEqual(mirror.changeSetCount, (NSUInteger)1);
+    XCTAssertEqualObjects(mirror.lastChanges.removedIndexes, [NSIndexSet indexSetWithIndex:0]);
+    XCTAssertEqual(mirror.lastChanges.insertedIndexes.count, (NSUInteger)1, @"A tab added and removed again is not reported");
+    XCTAssertEqualObjects(mirror.lastChanges.movedFromIndexes, [NSIndexSet indexSetWithIndex:8]);
+    XCTAssertEqual([mirror.lastChanges indexAfterMoveOfTabAtIndex:8], (NSInteger)0);
+    XCTAssertEqual(mirror.lastChanges.selectedTabBefore, (NSInteger)2);
+    XCTAssertEqual(mirror.lastChanges.selectedTabAfter, tv.selectedTab);
+    
+    // Outside a transaction the changes of one run loop turn are sent together
+    [tv addTabWithLabel:@"A" tag:nil];
+    [tv addTabsWithLabels:@[@"B", @"C"] tags:nil atIndex:1];
+    [tv moveTabAtIndex:0 oneStepRight:YES];
+    tv.selectedTab = 4;
+    XCTAssertEqual(mirror.changeSetCount, (NSUInteger)1);
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    XCTAssertEqual(mirror.changeSetCount, (NSUInteger)2);
+    
+    // Random changes, checked against the mirror after every change set
+    srandom(7);
+    for (NSUInteger round = 0; round < 200; round++) {
+        [tv beginUpdates];
+        for (NSUInteger op = 0; op < 5; op++) {
+            NSUInteger count = tv.count;
+            switch (random() % 6) {
+                case 0:
+                    [tv addTabWithLabel:[NSString stringWithFormat:@"R%lu.%lu", (unsigned long)round, (unsigned long)op] tag:nil atIndex:(random() % (count + 1))];
+                    break;
+                case 1:
+                    if (count > 1) {
+                        [tv removeTabAtIndex:(random() % count)];
+                    }
+                    break;
+                case 2:
+                    [tv moveTabsAtIndexes:[NSIndexSet indexSetWithIndex:(random() % count)] toIndex:(random() % count)];
+                    break;
+                case 3:
+                    [tv setLabel:[NSString stringWithFormat:@"L%lu.%lu", (unsigned long)round, (unsigned long)op] forTabAtIndex:(random() % count)];
+                    break;
+                case 4:
+                    [tv setTag:[NSString stringWithFormat:@"G%lu", (unsigned long)(random() % 4)] ForTabAtIndex:(random() % count)];
+                    break;
+                default:
+                    tv.selectedTab = (NSInteger)(random() % count);
+                    break;
+            }
+        }
+        [tv endUpdates];
+        
+        XCTAssertEqual(mirror.labels.count, tv.count);
+        for (NSUInteger i = 0; i < tv.count; i++) {
+            XCTAssertEqualObjects([mirror.labels objectAtIndex:i], [tv labelForTabAtIndex:i]);
+            XCTAssertEqualObjects([mirror.tags objectAtIndex:i], ([tv tagForTabAtIndex:i] ? [tv tagForTabAtIndex:i] : [NSNull null]));
+        }
+        XCTAssertEqual(mirror.selectedTab, tv.selectedTab);
+    }
+    
+    NSUInteger sent = mirror.changeSetCount;
+    [tv setLabel:[tv labelForTabAtIndex:0] forTabAtIndex:0];
+    [tv sendPendingChanges];
+    XCTAssertEqual(mirror.changeSetCount, sent, @"Nothing changed, nothing sent");
+}
+
+- (void)testRemovedTabsAreRecycled {
+    
+    BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 2000, 22)];
+    tv.statisticsEnabled = YES;
+    tv.tabPoolLimit = 4;
+    for (NSUInteger i = 0; i < 20; i++) {
+        [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i] tag:[NSString stringWithFormat:@"T%lu", (unsigned long)i]];
+    }
+    BSTRenderOffscreen(tv);
+    
+    for (NSUInteger round = 0; round < 100; round++) {  // A preview tab replacing itself
+        [tv removeTabAtIndex:10];
+        [tv addTabWithLabel:@"Preview" tag:@"P" atIndex:10];
+        BSTRenderOffscreen(tv);
+    }
+    BSTTabViewStatistics *stats = [tv statisticsSnapshot];
+    XCTAssertEqual(stats.tabsAllocated, (NSUInteger)20, @"Only the first tabs are allocated");
+    XCTAssertEqual(stats.tabsReused, (NSUInteger)100);
+    XCTAssertEqual(stats.trackingAreasReused, (NSUInteger)99, @"The tracking area is reused once the preview is laid out in the same place");
+    XCTAssertEqualObjects([tv labelForTabAtIndex:10], @"Preview");
+    XCTAssertEqualObjects([tv tagForTabAtIndex:10], @"P");
+    XCTAssertEqual([tv indexForTabWithTag:@"T10"], (NSInteger)-1);
+    XCTAssertEqual([tv indexForTabWithTag:@"P"], (NSInteger)10);
+    
+    [tv removeTabsAtIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, 10)]];
+    XCTAssertEqual([tv statisticsSnapshot].pooledTabs, (NSUInteger)4, @"The pool stops at the high-water mark");
+    tv.tabPoolLimit = 1;
+    XCTAssertEqual([tv statisticsSnapshot].pooledTabs, (NSUInteger)1);
+    [tv addTabsWithLabels:@[@"A", @"B", @"C"] tags:nil atIndex:0];
+    stats = [tv statisticsSnapshot];
+    XCTAssertEqual(stats.tabsReused, (NSUInteger)101);
+    XCTAssertEqual(stats.tabsAllocated, (NSUInteger)22);
+    XCTAssertNil([tv tagForTabAtIndex:0], @"A reused tab has no tag left");
+    
+    // Tabs removed while changes are collected are pooled once the change set is made
+    BSTMirroringDelegate *mirror = [[BSTMirroringDelegate alloc] initWithTabView:tv];
+    tv.delegate = mirror;
+    [tv removeTabAtIndex:0];
+    [tv addTabWithLabel:@"D" tag:nil atIndex:0];
+    XCTAssertEqual([tv statisticsSnapshot].tabsAllocated, (NSUInteger)23);
+    [tv sendPendingChanges];
+    XCTAssertEqual([tv statisticsSnapshot].pooledTabs, (NSUInteger)1);
+    XCTAssertEqualObjects(mirror.lastChanges.removedIndexes, [NSIndexSet indexSetWithIndex:0]);
+    XCTAssertEqualObjects(mirror.lastChanges.insertedIndexes, [NSIndexSet indexSetWithIndex:0]);
+    XCTAssertEqualObjects([mirror.labels objectAtIndex:0], @"D");
+}
+
+- (void)testCollapsedGroupsLayOutAsOneTab {
+    
+    BSTTabView *tv = BSTUncompressedTabView(20);
+    BSTCountingDelegate *delegate = [[BSTCountingDelegate alloc] init];
+    tv.delegate = delegate;
+    [tv setTag:@"T12" ForTabAtIndex:12];
+    XCTAssertFalse([tv groupTabsInRange:NSMakeRange(15, 10) withLabel:@"Beyond"]);
+    XCTAssertTrue([tv groupTabsInRange:NSMakeRange(5, 10) withLabel:@"Reports"]);
+    XCTAssertFalse(tv.LayoutIsInvalid, @"An expanded group is drawn as its tabs");
+    XCTAssertTrue(NSEqualRanges([tv groupRangeForTabAtIndex:9], NSMakeRange(5, 10)));
+    XCTAssertEqual([tv groupRangeForTabAtIndex:4].location, (NSUInteger)NSNotFound);
+    XCTAssertEqualObjects([tv groupLabelForTabAtIndex:14], @"Reports");
+    NSArray *expanded = BSTHitTestSignature(tv, 3000.0);
+    
+    XCTAssertTrue([tv collapseGroupOfTabAtIndex:9]);
+    XCTAssertTrue([tv isGroupCollapsedForTabAtIndex:5]);
+    XCTAssertEqual(delegate.groupChangeCount, (NSUInteger)1);
+    XCTAssertTrue(NSEqualRanges(delegate.lastGroupRange, NSMakeRange(5, 10)));
+    NSUInteger laidOut = tv.tabsLaidOutCount;
+    [tv reassignTabPositionAndTrackingArea];
+    XCTAssertEqual(tv.tabsLaidOutCount - laidOut, (NSUInteger)11, @"The collapsed group is laid out as one tab");
+    
+    // The summary is hit as the first tab of the group, the other tabs are never hit
+    NSArray *collapsed = BSTHitTestSignature(tv, 3000.0);
+    NSUInteger first = [collapsed indexOfObject:@5];
+    NSUInteger last = first;
+    while ((last + 1 < collapsed.count) && [[collapsed objectAtIndex:(last + 1)] isEqual:@5]) {
+        last++;
+    }
+    for (NSUInteger i = 6; i < 15; i++) {
+        XCTAssertFalse([collapsed containsObject:@(i)]);
+    }
+    XCTAssertTrue([collapsed containsObject:@15] && [collapsed containsObject:@19]);
+    XCTAssertEqualObjects([collapsed subarrayWithRange:NSMakeRange(0, first)], [expanded subarrayWithRange:NSMakeRange(0, first)]);
+    XCTAssertEqual([tv insertPointForXLocation:(first + 1)], (NSInteger)4);
+    XCTAssertEqual([tv insertPointForXLocation:last], (NSInteger)14, @"Never inserted inside a collapsed group");
+    XCTAssertEqualObjects([tv labelForTabAtIndex:12], @"Tab 12");
+    XCTAssertEqual([tv indexForTabWithTag:@"T12"], (NSInteger)12);
+    
+    // A tab inserted between two tabs of the group joins it, the layout is redone from the summary
+    [tv addTabWithLabel:@"Joined" tag:nil atIndex:10];
+    XCTAssertTrue(NSEqualRanges([tv groupRangeForTabAtIndex:10], NSMakeRange(5, 11)));
+    laidOut = tv.tabsLaidOutCount;
+    [tv reassignTabPositionAndTrackingArea];
+    XCTAssertEqual(tv.tabsLaidOutCount - laidOut, (NSUInteger)6);
+    [tv removeTabAtIndex:10];
+    
+    delegate.denyGroupChanges = YES;
+    XCTAssertFalse([tv expandGroupOfTabAtIndex:5]);
+    XCTAssertTrue([tv isGroupCollapsedForTabAtIndex:5]);
+    delegate.denyGroupChanges = NO;
+    XCTAssertTrue([tv expandGroupOfTabAtIndex:5]);
+    [tv reassignTabPositionAndTrackingArea];
+    XCTAssertEqualObjects(BSTHitTestSignature(tv, 3000.0), expanded);
+    
+    // Moving a tab away leaves the group, the ungrouped tabs are laid out as before
+    [tv moveTabsAtIndexes:[NSIndexSet indexSetWithIndex:14] toIndex:19];
+    XCTAssertEqual([tv groupRangeForTabAtIndex:19].location, (NSUInteger)NSNotFound);
+    XCTAssertTrue(NSEqualRanges([tv groupRangeForTabAtIndex:5], NSMakeRange(5, 9)));
+    XCTAssertTrue([tv ungroupTabsOfGroupAtIndex:8]);
+    XCTAssertFalse([tv ungroupTabsOfGroupAtIndex:8]);
+    XCTAssertNil([tv groupLabelForTabAtIndex:5]);
+}
+
+- (void)testGroupsAreSavedAndFoundAgainFromTheChange {
+    
+    BSTTabView *tv = BSTUncompressedTabView(100);
+    XCTAssertTrue([tv groupTabsInRange:NSMakeRange(10, 5) withLabel:@"Before"]);
+    XCTAssertTrue([tv groupTabsInRange:NSMakeRange(50, 10) withLabel:nil]);
+    XCTAssertTrue([tv collapseGroupOfTabAtIndex:50]);
+    [tv reassignTabPositionAndTrackingArea];
+    
+    // A change after a group leaves it alone, one before a group moves it
+    NSUInteger laidOut = tv.tabsLaidOutCount;
+    [tv addTabWithLabel:@"Appended" tag:nil];
+    [tv reassignTabPositionAndTrackingArea];
+    XCTAssertEqual(tv.tabsLaidOutCount - laidOut, (NSUInteger)1, @"Groups do not undo the incremental layout");
+    [tv removeTabAtIndex:20];
+    XCTAssertTrue(NSEqualRanges([tv groupRangeForTabAtIndex:10], NSMakeRange(10, 5)));
+    XCTAssertTrue(NSEqualRanges([tv groupRangeForTabAtIndex:49], NSMakeRange(49, 10)));
+    XCTAssertTrue([tv isGroupCollapsedForTabAtIndex:58]);
+    
+    BSTTabView *restored = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 1000000, 22)];
+    XCTAssertTrue([restored restoreTabStateFromData:[tv tabStateData]]);
+    XCTAssertTrue(NSEqualRanges([restored groupRangeForTabAtIndex:12], NSMakeRange(10, 5)));
+    XCTAssertEqualObjects([restored groupLabelForTabAtIndex:12], @"Before");
+    XCTAssertFalse([restored isGroupCollapsedForTabAtIndex:12]);
+    XCTAssertTrue(NSEqualRanges([restored groupRangeForTabAtIndex:49], NSMakeRange(49, 10)));
+    XCTAssertNil([restored groupLabelForTabAtIndex:49]);
+    XCTAssertTrue([restored isGroupCollapsedForTabAtIndex:49], @"A collapsed group comes back collapsed");
+    [tv reassignTabPositionAndTrackingArea];
+    [restored reassignTabPositionAndTrackingArea];
+    XCTAssertEqualObjects(BSTHitTestSignature(restored, 8000.0), BSTHitTestSignature(tv, 8000.0));
+}
+
+- (void)testViewDeallocatedWithOpenChangeSet {
+    
+    __weak BSTTabView *gone = nil;
+    BSTMirroringDelegate *mirror = nil;
+    @autoreleasepool {
+        BSTTabView *tv = [[BSTTabView alloc] initWithFrame:NSMakeRect(0, 0, 600, 22)];
+        tv.tabPoolLimit = 4;
+        for (NSUInteger i = 0; i < 20; i++) {
+            [tv addTabWithLabel:[NSString stringWithFormat:@"Tab %lu", (unsigned long)i] tag:[NSString stringWithFormat:@"T%lu", (unsigned long)i]];
+        }
+        BSTRenderOffscreen(tv);
+        mirror = [[BSTMirroringDelegate alloc] initWithTabView:tv];
+        tv.delegate = mirror;
+        [tv beginUpdates];
+        [tv removeTabsAtIndexes:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, 10)]];  // Held by the change set only
+        [tv addTabWithLabel:@"New" tag:nil atIndex:0];
+        [tv setLabel:@"Renamed" forTabAtIndex:5];
+        gone = tv;
+    }
+    XCTAssertNil(gone, @"The removed tabs go after the view without reaching it");
+    XCTAssertEqual(mirror.changeSetCount, (NSUInteger)0, @"The open change set is never sent");
+}
+
 - (void)testPerformanceExample {
     // This is an example of a performance test case.
     [self measureBlock:^{